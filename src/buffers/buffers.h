@@ -28,7 +28,8 @@ extern struct SaveBuffer gSaveBuffer;
 
 extern u8 gGfxSPTaskStack[];
 
-#ifdef TARGET_N64
+// The render thread reads one pool while the game fills the other
+#if defined(TARGET_N64) || defined(USE_RENDER_THREAD)
 #define GFX_NUM_POOLS 2
 #else
 #define GFX_NUM_POOLS 1
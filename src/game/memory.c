@@ -24,6 +24,11 @@
 #define ALIGN8(val) (((val) + 0x7) & ~0x7)
 #define ALIGN16(val) (((val) + 0xF) & ~0xF)
 
+#ifdef USE_RENDER_THREAD
+// Blocks until the render thread is done with every queued frame
+extern void render_thread_sync(void);
+#endif
+
 struct MainPoolState {
 #ifndef USE_SYSTEM_MALLOC
     u32 freeSpace;
@@ -198,6 +203,10 @@ void *main_pool_alloc(u32 size, void (*releaseHandler)(void *addr)) {
 u32 main_pool_free(void *addr) {
     struct MainPoolBlock *block = ((struct MainPoolBlock *) addr) - 1;
     void *toFree;
+#ifdef USE_RENDER_THREAD
+    // Queued display lists may still point at the level data being freed
+    render_thread_sync();
+#endif
     do {
         if (sPoolListHeadL == NULL) {
             abort();
@@ -273,6 +282,10 @@ u32 main_pool_free(void *addr) {
     struct MainPoolBlock *block = (struct MainPoolBlock *) ((u8 *) addr - 16);
     struct MainPoolBlock *oldListHead = (struct MainPoolBlock *) ((u8 *) addr - 16);
 
+#ifdef USE_RENDER_THREAD
+    render_thread_sync();
+#endif
+
     if (oldListHead < sPoolListHeadL) {
         while (oldListHead->next != NULL) {
             oldListHead = oldListHead->next;
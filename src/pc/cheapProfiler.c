@@ -4,6 +4,9 @@
 #include <time.h>
 #include <error.h>
 #include <errno.h>
+#if defined(USE_RENDER_THREAD) || defined(USE_GL_THREAD)
+#include <pthread.h>
+#endif
 
 #include "cheapProfiler.h"
 
@@ -17,6 +20,7 @@
 
 typedef struct EventSlot {
     int needs_sampling;
+    int is_counter;
     double total;
     struct timespec start;
     char label[MAX_LABEL_SIZE];
@@ -27,6 +31,16 @@ static int events_allocated = 0;
 static EventSlot event_slots[MAX_PROFILER_SLOTS] = {};
 static FILE *f = NULL;
 
+#if defined(USE_RENDER_THREAD) || defined(USE_GL_THREAD)
+// Events come from more than one thread, guard slot creation
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_SLOTS() pthread_mutex_lock(&slots_mutex)
+#define UNLOCK_SLOTS() pthread_mutex_unlock(&slots_mutex)
+#else
+#define LOCK_SLOTS()
+#define UNLOCK_SLOTS()
+#endif
+
 
 // Returns difference between two timespec structures in nanoseconds
 double diff_timespec(struct timespec *t1, struct timespec *t2) 
@@ -64,15 +78,19 @@ void ProfEmitEventStart(char *label)
     EventSlot *ev;
 
     int slot;
+    LOCK_SLOTS();
     if ((slot = getProfilerSlot(label)) == -1) {
         // Create new event if we don't have one
-        ev = &event_slots[events_allocated++];
+        ev = &event_slots[events_allocated];
         strncpy(ev->label, label, MAX_LABEL_SIZE);
         ev->total = 0;
         ev->needs_sampling = 0;
+        ev->is_counter = 0;
+        events_allocated++;
     } else {
         ev = &event_slots[slot];
     }
+    UNLOCK_SLOTS();
 
     if (ev->needs_sampling == 1)
         printf("Warning: Event %s has been started without being ended.\n", label);
@@ -101,6 +119,27 @@ void ProfEmitEventEnd(char *label)
     ev->needs_sampling = 0;
 }
 
+// Counters are sampled every frame as-is, regardless of their value.
+void ProfEmitCounter(char *label, double value)
+{
+    EventSlot *ev;
+
+    int slot;
+    LOCK_SLOTS();
+    if ((slot = getProfilerSlot(label)) == -1) {
+        ev = &event_slots[events_allocated];
+        strncpy(ev->label, label, MAX_LABEL_SIZE);
+        ev->needs_sampling = 0;
+        ev->is_counter = 1;
+        events_allocated++;
+    } else {
+        ev = &event_slots[slot];
+    }
+    UNLOCK_SLOTS();
+
+    ev->total = value;
+}
+
 void ProfSampleFrame()
 {
     if (!f) {
@@ -117,6 +156,12 @@ void ProfSampleFrame()
         if (ev->needs_sampling)
             fprintf(stderr, "Frame ended with event %s end still pending.\n", ev->label);
 
+        if (ev->is_counter) {
+            fprintf(f, "%c \"%s\": %g", next, ev->label, ev->total);
+            next = ',';
+            continue;
+        }
+
         // Only emit samples for events with significant time spent in a frame.
         if (ev->total > 0.1) {
             fprintf(f, "%c \"%s\": %.1f", next, ev->label, ev->total);
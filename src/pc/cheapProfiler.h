@@ -4,10 +4,12 @@
 #ifdef USE_PROFILER
 extern void ProfEmitEventStart(char *label);
 extern void ProfEmitEventEnd(char *label);
+extern void ProfEmitCounter(char *label, double value);
 extern void ProfSampleFrame();
 #else
 #define ProfEmitEventStart(...) ;
 #define ProfEmitEventEnd(...) ;
+#define ProfEmitCounter(...) ;
 #define ProfSampleFrame(...) ;
 #endif
 
@@ -63,6 +63,42 @@ unsigned int configKeyStickLeft  = 0x0200;
 unsigned int configKeyStickRight = 0x0200;
 #endif
 
+// Maximum number of textures kept decoded and uploaded at once
+unsigned int configTextureCacheSize = 512;
+// Share a single upload between textures with identical contents
+bool         configTextureDedup     = false;
+// Megabytes of decoded textures kept on disk between runs, 0 to disable
+unsigned int configTextureDiskCacheSize = 0;
+// Store textures in 16 bit or smaller formats, lossy for the texture atlas page
+bool         configTexture16Bit     = false;
+// Threads the software renderer rasterizes with, 0 for one per CPU core
+unsigned int configSoftThreads      = 0;
+// Write every Nth software rendered frame to soft_<frame>.png, 0 to disable
+unsigned int configSoftDumpInterval = 0;
+// First frame written to gfx_trace.bin in builds with USE_DL_TRACE
+unsigned int configTraceStart       = 0;
+// Frames written to gfx_trace.bin, 0 to disable capturing
+unsigned int configTraceFrames      = 0;
+// Wait out the rest of each frame's time slot, the trace replay turns this off
+bool         configFrameLimit       = true;
+// Print frame time percentiles every 300 frames
+bool         configFrameStats       = false;
+// Log texture atlas allocations to atlas_trace.txt for tools/atlas_bench
+bool         configAtlasTrace       = false;
+// Texture atlas pages, from 1 to 4, and their width and height in pixels
+unsigned int configAtlasPages       = 1;
+unsigned int configAtlasPageSize    = 2048;
+// Megabytes of video memory the atlas pages may take, 0 for no limit
+unsigned int configAtlasVramBudget  = 0;
+// Bounds of the render scale, in percent of the window size, 100 for both disables dynamic resolution
+#ifdef TARGET_OD
+unsigned int configDynaresMinScale  = 100; // the 320x240 screen is cheap to fill already
+#else
+unsigned int configDynaresMinScale  = 50;
+#endif
+unsigned int configDynaresMaxScale  = 100;
+// Microseconds a frame may take before the render scale drops, 0 keeps the maximum scale
+unsigned int configDynaresBudget    = 33333;
 
 static const struct ConfigOption options[] = {
     {.name = "fullscreen",     .type = CONFIG_TYPE_BOOL, .boolValue = &configFullscreen},
@@ -79,6 +115,23 @@ static const struct ConfigOption options[] = {
     {.name = "key_stickdown",  .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStickDown},
     {.name = "key_stickleft",  .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStickLeft},
     {.name = "key_stickright", .type = CONFIG_TYPE_UINT, .uintValue = &configKeyStickRight},
+    {.name = "texture_cache_size", .type = CONFIG_TYPE_UINT, .uintValue = &configTextureCacheSize},
+    {.name = "texture_dedup",      .type = CONFIG_TYPE_BOOL, .boolValue = &configTextureDedup},
+    {.name = "texture_disk_cache_size", .type = CONFIG_TYPE_UINT, .uintValue = &configTextureDiskCacheSize},
+    {.name = "texture_16bit",      .type = CONFIG_TYPE_BOOL, .boolValue = &configTexture16Bit},
+    {.name = "soft_threads",       .type = CONFIG_TYPE_UINT, .uintValue = &configSoftThreads},
+    {.name = "soft_dump_interval", .type = CONFIG_TYPE_UINT, .uintValue = &configSoftDumpInterval},
+    {.name = "trace_start",        .type = CONFIG_TYPE_UINT, .uintValue = &configTraceStart},
+    {.name = "trace_frames",       .type = CONFIG_TYPE_UINT, .uintValue = &configTraceFrames},
+    {.name = "frame_limit",        .type = CONFIG_TYPE_BOOL, .boolValue = &configFrameLimit},
+    {.name = "frame_stats",        .type = CONFIG_TYPE_BOOL, .boolValue = &configFrameStats},
+    {.name = "atlas_trace",        .type = CONFIG_TYPE_BOOL, .boolValue = &configAtlasTrace},
+    {.name = "atlas_pages",        .type = CONFIG_TYPE_UINT, .uintValue = &configAtlasPages},
+    {.name = "atlas_page_size",    .type = CONFIG_TYPE_UINT, .uintValue = &configAtlasPageSize},
+    {.name = "atlas_vram_budget",  .type = CONFIG_TYPE_UINT, .uintValue = &configAtlasVramBudget},
+    {.name = "dynares_min_scale",  .type = CONFIG_TYPE_UINT, .uintValue = &configDynaresMinScale},
+    {.name = "dynares_max_scale",  .type = CONFIG_TYPE_UINT, .uintValue = &configDynaresMaxScale},
+    {.name = "dynares_budget",     .type = CONFIG_TYPE_UINT, .uintValue = &configDynaresBudget},
 };
 
 // Reads an entire line from a file (excluding the newline character) and returns an allocated string
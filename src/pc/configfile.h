@@ -15,6 +15,23 @@ extern unsigned int configKeyStickUp;
 extern unsigned int configKeyStickDown;
 extern unsigned int configKeyStickLeft;
 extern unsigned int configKeyStickRight;
+extern unsigned int configTextureCacheSize;
+extern bool         configTextureDedup;
+extern unsigned int configTextureDiskCacheSize;
+extern bool         configTexture16Bit;
+extern unsigned int configSoftThreads;
+extern unsigned int configSoftDumpInterval;
+extern unsigned int configTraceStart;
+extern unsigned int configTraceFrames;
+extern bool         configFrameLimit;
+extern bool         configFrameStats;
+extern bool         configAtlasTrace;
+extern unsigned int configAtlasPages;
+extern unsigned int configAtlasPageSize;
+extern unsigned int configAtlasVramBudget;
+extern unsigned int configDynaresMinScale;
+extern unsigned int configDynaresMaxScale;
+extern unsigned int configDynaresBudget;
 
 void configfile_load(const char *filename);
 void configfile_save(const char *filename);
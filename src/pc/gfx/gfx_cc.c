@@ -1,6 +1,20 @@
+#include <string.h>
+
 #include "gfx_cc.h"
 
 void gfx_cc_get_features(uint32_t shader_id, struct CCFeatures *cc_features) {
+    if (shader_id & SHADER_UBER) {
+        // Takes everything a combiner could read, with alpha and fog
+        memset(cc_features, 0, sizeof(*cc_features));
+        cc_features->opt_uber = true;
+        cc_features->opt_alpha = true;
+        cc_features->opt_fog = true;
+        cc_features->used_textures[0] = true;
+        cc_features->used_textures[1] = true;
+        cc_features->num_inputs = SHADER_UBER_INPUTS;
+        return;
+    }
+
     for (int i = 0; i < 4; i++) {
         cc_features->c[0][i] = (shader_id >> (i * 3)) & 7;
         cc_features->c[1][i] = (shader_id >> (12 + i * 3)) & 7;
@@ -10,6 +24,8 @@ void gfx_cc_get_features(uint32_t shader_id, struct CCFeatures *cc_features) {
     cc_features->opt_fog = (shader_id & SHADER_OPT_FOG) != 0;
     cc_features->opt_texture_edge = (shader_id & SHADER_OPT_TEXTURE_EDGE) != 0;
     cc_features->opt_noise = (shader_id & SHADER_OPT_NOISE) != 0;
+    cc_features->opt_uber = false;
+    cc_features->lit_input = (shader_id >> SHADER_LIT_INPUT_SHIFT) & 7;
 
     cc_features->used_textures[0] = false;
     cc_features->used_textures[1] = false;
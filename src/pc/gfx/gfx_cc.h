@@ -26,17 +26,36 @@ enum {
     SHADER_TEXEL1
 };
 
+// With USE_COLOR_UNIFORMS every combiner source gets the same input, so the
+// backends know that the primitive and environment colours are uniforms.
+#define SHADER_INPUT_PRIM SHADER_INPUT_1
+#define SHADER_INPUT_ENV SHADER_INPUT_2
+#define SHADER_INPUT_SHADE SHADER_INPUT_3
+#define SHADER_INPUT_LOD SHADER_INPUT_4
+
 #define SHADER_OPT_ALPHA (1 << 24)
 #define SHADER_OPT_FOG (1 << 25)
 #define SHADER_OPT_TEXTURE_EDGE (1 << 26)
 #define SHADER_OPT_NOISE (1 << 27)
 
+// Combiner ids only: shade color gets computed from the vertex normals on the GPU.
+#define SHADER_OPT_LIGHTING (1 << 28)
+// Shader ids only: 3 bits holding the number of the input that is lit (0 = none).
+#define SHADER_LIT_INPUT_SHIFT 28
+// Shader ids only: the one program that runs every unlit combiner, the
+// selectors and options come with each vertex instead (see USE_UBER_SHADER).
+#define SHADER_UBER (1U << 31)
+// Inputs the uber program always takes, enough for any combiner.
+#define SHADER_UBER_INPUTS 4
+
 struct CCFeatures {
     uint8_t c[2][4];
     bool opt_alpha;
     bool opt_fog;
     bool opt_texture_edge;
     bool opt_noise;
+    bool opt_uber;
+    uint8_t lit_input;
     bool used_textures[2];
     int num_inputs;
     bool do_single[2];
@@ -0,0 +1,773 @@
+#ifdef USE_GL_THREAD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __MINGW32__
+#include "SDL.h"
+#else
+#include <SDL2/SDL.h>
+#endif
+
+#include "macros.h"
+#include "../cheapProfiler.h"
+#include "gfx_cmdqueue.h"
+
+// Ring buffer size, a power of two. A single command may take up to half of it.
+#define CMDQUEUE_SIZE (1 << 21)
+#define CMDQUEUE_ALIGN(size) (((size) + 7) & ~7)
+// The biggest command: a full indexed draw, every vertex at the largest layout
+#define CMDQUEUE_MAX_DRAW (CMDQUEUE_ALIGN(sizeof(struct Command)) + \
+    CMDQUEUE_ALIGN(GFX_MAX_BUFFERED_TRIS * 3 * GFX_MAX_FLOATS_PER_VERTEX * sizeof(float)) + \
+    CMDQUEUE_ALIGN(GFX_MAX_BUFFERED_TRIS * 3 * sizeof(uint16_t)))
+// Programs whose info is remembered on the recording side, every one a backend
+// can hold so looking one up never has to wait for the GL thread
+#define CMDQUEUE_MAX_SHADERS GFX_MAX_SHADER_PROGRAMS
+
+enum CommandOp {
+    CMD_WRAP, // the rest of the ring is unused, continue from the start
+    CMD_Z_IS_FROM_0_TO_1,
+    CMD_UNLOAD_SHADER,
+    CMD_LOAD_SHADER,
+    CMD_CREATE_AND_LOAD_NEW_SHADER,
+    CMD_LOOKUP_SHADER,
+    CMD_SHADER_GET_INFO,
+    CMD_NEW_TEXTURE,
+    CMD_SELECT_TEXTURE,
+    CMD_UPLOAD_TEXTURE,
+    CMD_SET_SAMPLER_PARAMETERS,
+    CMD_SET_DEPTH_TEST,
+    CMD_SET_DEPTH_MASK,
+    CMD_SET_ZMODE_DECAL,
+    CMD_SET_VIEWPORT,
+    CMD_SET_SCISSOR,
+    CMD_SET_USE_ALPHA,
+    CMD_DRAW_TRIANGLES,
+    CMD_INIT,
+    CMD_ON_RESIZE,
+    CMD_START_FRAME,
+    CMD_END_FRAME,
+    CMD_FINISH_RENDER,
+    CMD_BIND_VIRTUAL_TEXTURE_PAGE,
+    CMD_CREATE_VIRTUAL_TEXTURE_PAGE,
+    CMD_UPLOAD_VIRTUAL_TEXTURE,
+    CMD_MOVE_VIRTUAL_TEXTURES,
+    CMD_SIGNAL_START,
+    CMD_SET_TNL_STATE,
+    CMD_UPLOAD_TEXTURE_FORMAT,
+    CMD_DRAW_INDEXED_TRIANGLES,
+    CMD_SET_COMBINER_COLORS,
+    CMD_SWAP_BUFFERS_BEGIN,
+    CMD_SWAP_BUFFERS_END
+};
+
+/**
+ * A recorded call. Vertices, texels and structs passed by pointer are copied
+ * right after it, calls with a result point at where the GL thread stores it.
+ * @property size: Bytes taken in the ring including that data, multiple of 8.
+ **/
+struct Command {
+    uint16_t op;
+    uint32_t size;
+    union {
+        bool enable;
+        bool *z_result;
+        struct ShaderProgram *prg;
+        struct {
+            uint32_t shader_id;
+            struct ShaderProgram **result;
+            uint8_t *num_inputs;
+            bool *used_textures;
+        } shader;
+        struct { struct ShaderProgram *prg; uint8_t *num_inputs; bool *used_textures; } info;
+        uint32_t *texture_result;
+        struct { int tile; uint32_t texture_id; } select;
+        struct { int format, width, height; } upload;
+        struct { int sampler; bool linear_filter; uint32_t cms, cmt; } sampler;
+        struct { int x, y, width, height; } rect;
+        struct { size_t buf_vbo_len, num_tris; } draw;
+        struct { int tile, page; } bind;
+        struct { int page; uint16_t dimensions; int format; bool *result; } page;
+        struct { int page, x, y, width, height; } vtex;
+        struct { int page, count; } move;
+        struct { uint32_t width, height; } signal;
+    } args;
+};
+
+#define COMMAND_DATA(cmd) ((uint8_t *)(cmd) + CMDQUEUE_ALIGN(sizeof(struct Command)))
+
+STATIC_ASSERT(CMDQUEUE_MAX_DRAW <= CMDQUEUE_SIZE / 2, "the command queue must hold a full buf_vbo flush");
+STATIC_ASSERT(CMDQUEUE_MAX_SHADERS >= GFX_MAX_SHADER_PROGRAMS, "the command queue must remember every shader program");
+
+/**
+ * Positions are running byte counts, the ring offset is the count modulo
+ * CMDQUEUE_SIZE. written, read and frames_done are shared with the GL thread
+ * and protected by mutex, as is idle_us in profiler builds.
+ * @property pending: Bytes reserved by the command being recorded.
+ **/
+static struct {
+    struct GfxWindowManagerAPI *wapi;
+    struct GfxRenderingAPI *rapi;
+    SDL_Thread *thread;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    uint8_t *ring;
+    uint32_t written, read, pending;
+    uint32_t frames_submitted, frames_done;
+    int z_is_from_0_to_1; // -1 until asked for the first time
+
+    // Draw state updates want the shader info all the time, don't wait for it every time
+    struct {
+        uint32_t shader_id;
+        struct ShaderProgram *prg;
+        uint8_t num_inputs;
+        bool used_textures[2];
+    } shaders[CMDQUEUE_MAX_SHADERS];
+    int num_shaders;
+
+    // This frame's statistics
+    uint32_t commands, bytes, max_depth, stalls, syncs;
+    unsigned long stall_us, sync_us, frame_wait_us;
+#ifdef USE_PROFILER
+    unsigned long idle_us;
+#endif
+} cq;
+
+static struct GfxWindowManagerAPI cq_wapi;
+static struct GfxRenderingAPI cq_rapi;
+
+static unsigned long cq_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void cq_execute(struct Command *cmd) {
+    struct GfxRenderingAPI *rapi = cq.rapi;
+    uint8_t *data = COMMAND_DATA(cmd);
+
+    switch (cmd->op) {
+        case CMD_Z_IS_FROM_0_TO_1:
+            *cmd->args.z_result = rapi->z_is_from_0_to_1();
+            break;
+        case CMD_UNLOAD_SHADER:
+            rapi->unload_shader(cmd->args.prg);
+            break;
+        case CMD_LOAD_SHADER:
+            rapi->load_shader(cmd->args.prg);
+            break;
+        case CMD_CREATE_AND_LOAD_NEW_SHADER:
+        case CMD_LOOKUP_SHADER: {
+            struct ShaderProgram *prg = cmd->op == CMD_LOOKUP_SHADER ? rapi->lookup_shader(cmd->args.shader.shader_id)
+                                                                    : rapi->create_and_load_new_shader(cmd->args.shader.shader_id);
+            if (prg != NULL) {
+                rapi->shader_get_info(prg, cmd->args.shader.num_inputs, cmd->args.shader.used_textures);
+            }
+            *cmd->args.shader.result = prg;
+            break;
+        }
+        case CMD_SHADER_GET_INFO:
+            rapi->shader_get_info(cmd->args.info.prg, cmd->args.info.num_inputs, cmd->args.info.used_textures);
+            break;
+        case CMD_NEW_TEXTURE:
+            *cmd->args.texture_result = rapi->new_texture();
+            break;
+        case CMD_SELECT_TEXTURE:
+            rapi->select_texture(cmd->args.select.tile, cmd->args.select.texture_id);
+            break;
+        case CMD_UPLOAD_TEXTURE:
+            rapi->upload_texture(data, cmd->args.upload.width, cmd->args.upload.height);
+            break;
+        case CMD_SET_SAMPLER_PARAMETERS:
+            rapi->set_sampler_parameters(cmd->args.sampler.sampler, cmd->args.sampler.linear_filter,
+                                         cmd->args.sampler.cms, cmd->args.sampler.cmt);
+            break;
+        case CMD_SET_DEPTH_TEST:
+            rapi->set_depth_test(cmd->args.enable);
+            break;
+        case CMD_SET_DEPTH_MASK:
+            rapi->set_depth_mask(cmd->args.enable);
+            break;
+        case CMD_SET_ZMODE_DECAL:
+            rapi->set_zmode_decal(cmd->args.enable);
+            break;
+        case CMD_SET_VIEWPORT:
+            rapi->set_viewport(cmd->args.rect.x, cmd->args.rect.y, cmd->args.rect.width, cmd->args.rect.height);
+            break;
+        case CMD_SET_SCISSOR:
+            rapi->set_scissor(cmd->args.rect.x, cmd->args.rect.y, cmd->args.rect.width, cmd->args.rect.height);
+            break;
+        case CMD_SET_USE_ALPHA:
+            rapi->set_use_alpha(cmd->args.enable);
+            break;
+        case CMD_DRAW_TRIANGLES:
+            rapi->draw_triangles((float *)data, cmd->args.draw.buf_vbo_len, cmd->args.draw.num_tris);
+            break;
+        case CMD_INIT:
+            rapi->init();
+            break;
+        case CMD_ON_RESIZE:
+            rapi->on_resize();
+            break;
+        case CMD_START_FRAME:
+            rapi->start_frame();
+            break;
+        case CMD_END_FRAME:
+            rapi->end_frame();
+            break;
+        case CMD_FINISH_RENDER:
+            rapi->finish_render();
+            break;
+#ifdef USE_TEXTURE_ATLAS
+        case CMD_BIND_VIRTUAL_TEXTURE_PAGE:
+            rapi->bind_virtual_texture_page(cmd->args.bind.tile, cmd->args.bind.page);
+            break;
+        case CMD_CREATE_VIRTUAL_TEXTURE_PAGE:
+            *cmd->args.page.result = rapi->create_virtual_texture_page(cmd->args.page.page, cmd->args.page.dimensions,
+                                                                       cmd->args.page.format);
+            break;
+        case CMD_UPLOAD_VIRTUAL_TEXTURE:
+            rapi->upload_virtual_texture(cmd->args.vtex.page, data, cmd->args.vtex.x, cmd->args.vtex.y, cmd->args.vtex.width,
+                                         cmd->args.vtex.height);
+            break;
+        case CMD_MOVE_VIRTUAL_TEXTURES:
+            rapi->move_virtual_textures(cmd->args.move.page, (const struct GfxTextureMove *)data, cmd->args.move.count);
+            break;
+#endif
+        case CMD_SIGNAL_START:
+            rapi->signal_start(cmd->args.signal.width, cmd->args.signal.height);
+            break;
+#ifdef USE_HW_TNL
+        case CMD_SET_TNL_STATE:
+            rapi->set_tnl_state((const struct GfxTnlState *)data);
+            break;
+#endif
+        case CMD_UPLOAD_TEXTURE_FORMAT:
+            rapi->upload_texture_format(data, cmd->args.upload.format, cmd->args.upload.width, cmd->args.upload.height);
+            break;
+#ifdef USE_INDEXED_DRAWING
+        case CMD_DRAW_INDEXED_TRIANGLES: {
+            size_t vbo_bytes = CMDQUEUE_ALIGN(cmd->args.draw.buf_vbo_len * sizeof(float));
+            rapi->draw_indexed_triangles((float *)data, cmd->args.draw.buf_vbo_len,
+                                         (const uint16_t *)(data + vbo_bytes), cmd->args.draw.num_tris);
+            break;
+        }
+#endif
+#ifdef USE_COLOR_UNIFORMS
+        case CMD_SET_COMBINER_COLORS:
+            rapi->set_combiner_colors((const struct GfxCombinerColors *)data);
+            break;
+#endif
+        case CMD_SWAP_BUFFERS_BEGIN:
+            cq.wapi->swap_buffers_begin();
+            break;
+        case CMD_SWAP_BUFFERS_END:
+            cq.wapi->swap_buffers_end();
+            break;
+    }
+}
+
+static int cq_thread_fn(void *arg) {
+    cq.wapi->make_context_current(true);
+
+    while (true) {
+        SDL_LockMutex(cq.mutex);
+        if (cq.read == cq.written) {
+#ifdef USE_PROFILER
+            unsigned long t0 = cq_get_time();
+#endif
+            while (cq.read == cq.written) {
+                SDL_CondWait(cq.cond, cq.mutex);
+            }
+#ifdef USE_PROFILER
+            cq.idle_us += cq_get_time() - t0;
+#endif
+        }
+        uint32_t end = cq.written;
+        SDL_UnlockMutex(cq.mutex);
+
+        // Only this thread moves read, no need to lock for reading it
+        uint32_t read = cq.read;
+        while (read != end) {
+            struct Command *cmd = (struct Command *)(cq.ring + read % CMDQUEUE_SIZE);
+            uint16_t op = cmd->op;
+            if (op != CMD_WRAP) {
+                cq_execute(cmd);
+            }
+            read += cmd->size;
+
+            // Hand the space back right away, the recording side may be waiting for it
+            SDL_LockMutex(cq.mutex);
+            cq.read = read;
+            if (op == CMD_SWAP_BUFFERS_END) {
+                cq.frames_done++;
+            }
+            SDL_CondBroadcast(cq.cond);
+            SDL_UnlockMutex(cq.mutex);
+        }
+    }
+
+    return 0;
+}
+
+// Expects the mutex to be held
+static void cq_wait_for_space(uint32_t size) {
+    if (CMDQUEUE_SIZE - (cq.written - cq.read) >= size) {
+        return;
+    }
+
+    unsigned long t0 = cq_get_time();
+    while (CMDQUEUE_SIZE - (cq.written - cq.read) < size) {
+        SDL_CondWait(cq.cond, cq.mutex);
+    }
+    cq.stalls++;
+    cq.stall_us += cq_get_time() - t0;
+}
+
+// Reserves room for a command and data_size bytes after it, blocks while the ring is full.
+static struct Command *cq_record(enum CommandOp op, size_t data_size) {
+    uint32_t size = CMDQUEUE_ALIGN(sizeof(struct Command)) + CMDQUEUE_ALIGN(data_size);
+    if (size > CMDQUEUE_SIZE / 2) {
+        fprintf(stderr, "GL thread command of %u bytes doesn't fit the queue\n", size);
+        abort();
+    }
+
+    uint32_t pos = cq.written % CMDQUEUE_SIZE;
+    uint32_t skip = pos + size > CMDQUEUE_SIZE ? CMDQUEUE_SIZE - pos : 0;
+
+    SDL_LockMutex(cq.mutex);
+    cq_wait_for_space(skip + size);
+    SDL_UnlockMutex(cq.mutex);
+
+    if (skip != 0) {
+        // Commands are multiples of 8 bytes, so op and size always fit in what's left
+        struct Command *wrap = (struct Command *)(cq.ring + pos);
+        wrap->op = CMD_WRAP;
+        wrap->size = skip;
+        pos = 0;
+    }
+
+    struct Command *cmd = (struct Command *)(cq.ring + pos);
+    cmd->op = op;
+    cmd->size = size;
+    cq.pending = skip + size;
+    return cmd;
+}
+
+static void cq_submit(void) {
+    SDL_LockMutex(cq.mutex);
+    cq.written += cq.pending;
+    uint32_t depth = cq.written - cq.read;
+    SDL_CondBroadcast(cq.cond);
+    SDL_UnlockMutex(cq.mutex);
+
+    if (depth > cq.max_depth) {
+        cq.max_depth = depth;
+    }
+    cq.commands++;
+    cq.bytes += cq.pending;
+}
+
+// For calls with a result, waits until the GL thread has run the command.
+static void cq_submit_and_wait(void) {
+    cq_submit();
+
+    unsigned long t0 = cq_get_time();
+    SDL_LockMutex(cq.mutex);
+    while (cq.read != cq.written) {
+        SDL_CondWait(cq.cond, cq.mutex);
+    }
+    SDL_UnlockMutex(cq.mutex);
+    cq.syncs++;
+    cq.sync_us += cq_get_time() - t0;
+}
+
+static void cq_record_simple(enum CommandOp op) {
+    cq_record(op, 0);
+    cq_submit();
+}
+
+static void cq_record_enable(enum CommandOp op, bool enable) {
+    struct Command *cmd = cq_record(op, 0);
+    cmd->args.enable = enable;
+    cq_submit();
+}
+
+static bool cq_z_is_from_0_to_1(void) {
+    // Asked for every draw state, but the answer never changes
+    if (cq.z_is_from_0_to_1 < 0) {
+        bool result;
+        struct Command *cmd = cq_record(CMD_Z_IS_FROM_0_TO_1, 0);
+        cmd->args.z_result = &result;
+        cq_submit_and_wait();
+        cq.z_is_from_0_to_1 = result;
+    }
+    return cq.z_is_from_0_to_1;
+}
+
+static void cq_unload_shader(struct ShaderProgram *old_prg) {
+    struct Command *cmd = cq_record(CMD_UNLOAD_SHADER, 0);
+    cmd->args.prg = old_prg;
+    cq_submit();
+}
+
+static void cq_load_shader(struct ShaderProgram *new_prg) {
+    struct Command *cmd = cq_record(CMD_LOAD_SHADER, 0);
+    cmd->args.prg = new_prg;
+    cq_submit();
+}
+
+// Creates or looks a program up, and remembers its info when there's room.
+static struct ShaderProgram *cq_shader_call(enum CommandOp op, uint32_t shader_id) {
+    struct ShaderProgram *result;
+    uint8_t num_inputs;
+    bool used_textures[2];
+    struct Command *cmd = cq_record(op, 0);
+    cmd->args.shader.shader_id = shader_id;
+    cmd->args.shader.result = &result;
+    cmd->args.shader.num_inputs = &num_inputs;
+    cmd->args.shader.used_textures = used_textures;
+    cq_submit_and_wait();
+
+    if (result != NULL && cq.num_shaders < CMDQUEUE_MAX_SHADERS) {
+        int i = cq.num_shaders++;
+        cq.shaders[i].shader_id = shader_id;
+        cq.shaders[i].prg = result;
+        cq.shaders[i].num_inputs = num_inputs;
+        cq.shaders[i].used_textures[0] = used_textures[0];
+        cq.shaders[i].used_textures[1] = used_textures[1];
+    }
+    return result;
+}
+
+static struct ShaderProgram *cq_create_and_load_new_shader(uint32_t shader_id) {
+    return cq_shader_call(CMD_CREATE_AND_LOAD_NEW_SHADER, shader_id);
+}
+
+static struct ShaderProgram *cq_lookup_shader(uint32_t shader_id) {
+    for (int i = 0; i < cq.num_shaders; i++) {
+        if (cq.shaders[i].shader_id == shader_id) {
+            return cq.shaders[i].prg;
+        }
+    }
+    return cq_shader_call(CMD_LOOKUP_SHADER, shader_id);
+}
+
+static void cq_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    for (int i = 0; i < cq.num_shaders; i++) {
+        if (cq.shaders[i].prg == prg) {
+            *num_inputs = cq.shaders[i].num_inputs;
+            used_textures[0] = cq.shaders[i].used_textures[0];
+            used_textures[1] = cq.shaders[i].used_textures[1];
+            return;
+        }
+    }
+
+    struct Command *cmd = cq_record(CMD_SHADER_GET_INFO, 0);
+    cmd->args.info.prg = prg;
+    cmd->args.info.num_inputs = num_inputs;
+    cmd->args.info.used_textures = used_textures;
+    cq_submit_and_wait();
+}
+
+static uint32_t cq_new_texture(void) {
+    uint32_t result;
+    struct Command *cmd = cq_record(CMD_NEW_TEXTURE, 0);
+    cmd->args.texture_result = &result;
+    cq_submit_and_wait();
+    return result;
+}
+
+static void cq_select_texture(int tile, uint32_t texture_id) {
+    struct Command *cmd = cq_record(CMD_SELECT_TEXTURE, 0);
+    cmd->args.select.tile = tile;
+    cmd->args.select.texture_id = texture_id;
+    cq_submit();
+}
+
+static void cq_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
+    struct Command *cmd = cq_record(CMD_UPLOAD_TEXTURE, width * height * 4);
+    cmd->args.upload.width = width;
+    cmd->args.upload.height = height;
+    memcpy(COMMAND_DATA(cmd), rgba32_buf, width * height * 4);
+    cq_submit();
+}
+
+static void cq_set_sampler_parameters(int sampler, bool linear_filter, uint32_t cms, uint32_t cmt) {
+    struct Command *cmd = cq_record(CMD_SET_SAMPLER_PARAMETERS, 0);
+    cmd->args.sampler.sampler = sampler;
+    cmd->args.sampler.linear_filter = linear_filter;
+    cmd->args.sampler.cms = cms;
+    cmd->args.sampler.cmt = cmt;
+    cq_submit();
+}
+
+static void cq_set_depth_test(bool depth_test) {
+    cq_record_enable(CMD_SET_DEPTH_TEST, depth_test);
+}
+
+static void cq_set_depth_mask(bool z_upd) {
+    cq_record_enable(CMD_SET_DEPTH_MASK, z_upd);
+}
+
+static void cq_set_zmode_decal(bool zmode_decal) {
+    cq_record_enable(CMD_SET_ZMODE_DECAL, zmode_decal);
+}
+
+static void cq_record_rect(enum CommandOp op, int x, int y, int width, int height) {
+    struct Command *cmd = cq_record(op, 0);
+    cmd->args.rect.x = x;
+    cmd->args.rect.y = y;
+    cmd->args.rect.width = width;
+    cmd->args.rect.height = height;
+    cq_submit();
+}
+
+static void cq_set_viewport(int x, int y, int width, int height) {
+    cq_record_rect(CMD_SET_VIEWPORT, x, y, width, height);
+}
+
+static void cq_set_scissor(int x, int y, int width, int height) {
+    cq_record_rect(CMD_SET_SCISSOR, x, y, width, height);
+}
+
+static void cq_set_use_alpha(bool use_alpha) {
+    cq_record_enable(CMD_SET_USE_ALPHA, use_alpha);
+}
+
+static void cq_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
+    struct Command *cmd = cq_record(CMD_DRAW_TRIANGLES, buf_vbo_len * sizeof(float));
+    cmd->args.draw.buf_vbo_len = buf_vbo_len;
+    cmd->args.draw.num_tris = buf_vbo_num_tris;
+    memcpy(COMMAND_DATA(cmd), buf_vbo, buf_vbo_len * sizeof(float));
+    cq_submit();
+}
+
+static void cq_init(void) {
+    cq_record_simple(CMD_INIT);
+}
+
+static void cq_on_resize(void) {
+    cq_record_simple(CMD_ON_RESIZE);
+}
+
+static void cq_start_frame(void) {
+    cq_record_simple(CMD_START_FRAME);
+}
+
+static void cq_end_frame(void) {
+    cq_record_simple(CMD_END_FRAME);
+}
+
+static void cq_finish_render(void) {
+    cq_record_simple(CMD_FINISH_RENDER);
+}
+
+#ifdef USE_TEXTURE_ATLAS
+static void cq_bind_virtual_texture_page(int tile, int page) {
+    struct Command *cmd = cq_record(CMD_BIND_VIRTUAL_TEXTURE_PAGE, 0);
+    cmd->args.bind.tile = tile;
+    cmd->args.bind.page = page;
+    cq_submit();
+}
+
+static bool cq_create_virtual_texture_page(int page, uint16_t dimensions, enum GfxTextureFormat format) {
+    bool result;
+    struct Command *cmd = cq_record(CMD_CREATE_VIRTUAL_TEXTURE_PAGE, 0);
+    cmd->args.page.page = page;
+    cmd->args.page.dimensions = dimensions;
+    cmd->args.page.format = format;
+    cmd->args.page.result = &result;
+    cq_submit_and_wait();
+    return result;
+}
+
+static void cq_upload_virtual_texture(int page, const uint8_t *rgba32_buf, int x, int y, int width, int height) {
+    struct Command *cmd = cq_record(CMD_UPLOAD_VIRTUAL_TEXTURE, width * height * 4);
+    cmd->args.vtex.page = page;
+    cmd->args.vtex.x = x;
+    cmd->args.vtex.y = y;
+    cmd->args.vtex.width = width;
+    cmd->args.vtex.height = height;
+    memcpy(COMMAND_DATA(cmd), rgba32_buf, width * height * 4);
+    cq_submit();
+}
+
+static void cq_move_virtual_textures(int page, const struct GfxTextureMove *moves, int count) {
+    struct Command *cmd = cq_record(CMD_MOVE_VIRTUAL_TEXTURES, count * sizeof(*moves));
+    cmd->args.move.page = page;
+    cmd->args.move.count = count;
+    memcpy(COMMAND_DATA(cmd), moves, count * sizeof(*moves));
+    cq_submit();
+}
+#endif
+
+static void cq_signal_start(uint32_t width, uint32_t height) {
+    struct Command *cmd = cq_record(CMD_SIGNAL_START, 0);
+    cmd->args.signal.width = width;
+    cmd->args.signal.height = height;
+    cq_submit();
+}
+
+#ifdef USE_HW_TNL
+static void cq_set_tnl_state(const struct GfxTnlState *state) {
+    struct Command *cmd = cq_record(CMD_SET_TNL_STATE, sizeof(*state));
+    memcpy(COMMAND_DATA(cmd), state, sizeof(*state));
+    cq_submit();
+}
+#endif
+
+static void cq_upload_texture_format(const uint8_t *rgba32_buf, enum GfxTextureFormat format, int width, int height) {
+    struct Command *cmd = cq_record(CMD_UPLOAD_TEXTURE_FORMAT, width * height * 4);
+    cmd->args.upload.format = format;
+    cmd->args.upload.width = width;
+    cmd->args.upload.height = height;
+    memcpy(COMMAND_DATA(cmd), rgba32_buf, width * height * 4);
+    cq_submit();
+}
+
+#ifdef USE_INDEXED_DRAWING
+static void cq_draw_indexed_triangles(float buf_vbo[], size_t buf_vbo_len, const uint16_t indices[], size_t buf_vbo_num_tris) {
+    size_t vbo_bytes = CMDQUEUE_ALIGN(buf_vbo_len * sizeof(float));
+    struct Command *cmd = cq_record(CMD_DRAW_INDEXED_TRIANGLES, vbo_bytes + buf_vbo_num_tris * 3 * sizeof(uint16_t));
+    cmd->args.draw.buf_vbo_len = buf_vbo_len;
+    cmd->args.draw.num_tris = buf_vbo_num_tris;
+    memcpy(COMMAND_DATA(cmd), buf_vbo, buf_vbo_len * sizeof(float));
+    memcpy(COMMAND_DATA(cmd) + vbo_bytes, indices, buf_vbo_num_tris * 3 * sizeof(uint16_t));
+    cq_submit();
+}
+#endif
+
+#ifdef USE_COLOR_UNIFORMS
+static void cq_set_combiner_colors(const struct GfxCombinerColors *colors) {
+    struct Command *cmd = cq_record(CMD_SET_COMBINER_COLORS, sizeof(*colors));
+    memcpy(COMMAND_DATA(cmd), colors, sizeof(*colors));
+    cq_submit();
+}
+#endif
+
+static void cq_wm_init(const char *game_name, bool start_in_fullscreen) {
+    cq.wapi->init(game_name, start_in_fullscreen);
+
+    // From here on only the GL thread talks to the driver
+    cq.wapi->make_context_current(false);
+    cq.ring = malloc(CMDQUEUE_SIZE);
+    cq.mutex = SDL_CreateMutex();
+    cq.cond = SDL_CreateCond();
+    cq.thread = SDL_CreateThread(cq_thread_fn, "th_gl", NULL);
+    if (cq.ring == NULL || cq.thread == NULL) {
+        fprintf(stderr, "Unable to start the GL thread\n");
+        abort();
+    }
+}
+
+static void cq_swap_buffers_begin(void) {
+    cq_record_simple(CMD_SWAP_BUFFERS_BEGIN);
+}
+
+static void cq_swap_buffers_end(void) {
+    cq_record_simple(CMD_SWAP_BUFFERS_END);
+    cq.frames_submitted++;
+
+    // Let the decoder run at most one frame ahead of the GL thread
+    unsigned long t0 = cq_get_time();
+    SDL_LockMutex(cq.mutex);
+    while (cq.frames_submitted - cq.frames_done > 1) {
+        SDL_CondWait(cq.cond, cq.mutex);
+    }
+#ifdef USE_PROFILER
+    unsigned long idle_us = cq.idle_us;
+    cq.idle_us = 0;
+#endif
+    SDL_UnlockMutex(cq.mutex);
+    cq.frame_wait_us += cq_get_time() - t0;
+
+    ProfEmitCounter("cmdqueue_commands", cq.commands);
+    ProfEmitCounter("cmdqueue_bytes", cq.bytes);
+    ProfEmitCounter("cmdqueue_max_depth", cq.max_depth);
+    ProfEmitCounter("cmdqueue_stalls", cq.stalls);
+    ProfEmitCounter("cmdqueue_stall_us", cq.stall_us);
+    ProfEmitCounter("cmdqueue_syncs", cq.syncs);
+    ProfEmitCounter("cmdqueue_sync_us", cq.sync_us);
+    ProfEmitCounter("cmdqueue_frame_wait_us", cq.frame_wait_us);
+#ifdef USE_PROFILER
+    ProfEmitCounter("cmdqueue_gl_idle_us", idle_us);
+#endif
+    cq.commands = cq.bytes = cq.max_depth = cq.stalls = cq.syncs = 0;
+    cq.stall_us = cq.sync_us = cq.frame_wait_us = 0;
+}
+
+bool gfx_cmdqueue_wrap(struct GfxWindowManagerAPI **wapi, struct GfxRenderingAPI **rapi) {
+    if ((*wapi)->make_context_current == NULL) {
+        return false;
+    }
+
+    cq.wapi = *wapi;
+    cq.rapi = *rapi;
+    cq.z_is_from_0_to_1 = -1;
+
+    // Everything else about the window stays on the calling thread
+    cq_wapi = **wapi;
+    cq_wapi.init = cq_wm_init;
+    cq_wapi.swap_buffers_begin = cq_swap_buffers_begin;
+    cq_wapi.swap_buffers_end = cq_swap_buffers_end;
+
+    cq_rapi = (struct GfxRenderingAPI) {
+        cq_z_is_from_0_to_1,
+        cq_unload_shader,
+        cq_load_shader,
+        cq_create_and_load_new_shader,
+        cq_lookup_shader,
+        cq_shader_get_info,
+        cq_new_texture,
+        cq_select_texture,
+        cq_upload_texture,
+        cq_set_sampler_parameters,
+        cq_set_depth_test,
+        cq_set_depth_mask,
+        cq_set_zmode_decal,
+        cq_set_viewport,
+        cq_set_scissor,
+        cq_set_use_alpha,
+        cq_draw_triangles,
+        cq_init,
+        cq_on_resize,
+        cq_start_frame,
+        cq_end_frame,
+        cq_finish_render,
+#ifdef USE_TEXTURE_ATLAS
+        cq_bind_virtual_texture_page,
+        cq_create_virtual_texture_page,
+        cq_upload_virtual_texture,
+        cq_move_virtual_textures,
+#endif
+        cq_signal_start,
+    };
+    // Optional hooks stay NULL when the backend doesn't have them
+#ifdef USE_HW_TNL
+    if (cq.rapi->set_tnl_state != NULL) {
+        cq_rapi.set_tnl_state = cq_set_tnl_state;
+    }
+#endif
+    if (cq.rapi->upload_texture_format != NULL) {
+        cq_rapi.upload_texture_format = cq_upload_texture_format;
+    }
+#ifdef USE_INDEXED_DRAWING
+    if (cq.rapi->draw_indexed_triangles != NULL) {
+        cq_rapi.draw_indexed_triangles = cq_draw_indexed_triangles;
+    }
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    if (cq.rapi->set_combiner_colors != NULL) {
+        cq_rapi.set_combiner_colors = cq_set_combiner_colors;
+    }
+#endif
+
+    *wapi = &cq_wapi;
+    *rapi = &cq_rapi;
+    return true;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef GFX_CMDQUEUE_H
+#define GFX_CMDQUEUE_H
+
+#include <stdbool.h>
+
+#include "gfx_window_manager_api.h"
+#include "gfx_rendering_api.h"
+
+/**
+ * Records the rendering API calls into a command buffer that a dedicated GL
+ * thread replays against the real backend, so decoding display lists never
+ * stalls on the driver. Buffer swaps go through the queue too, and calls that
+ * return something wait for the GL thread to catch up.
+ * @arg wapi, rapi: Replaced by the queued versions.
+ * @returns false, leaving both untouched, when the window manager can't hand
+ * its context over to another thread.
+ **/
+extern bool gfx_cmdqueue_wrap(struct GfxWindowManagerAPI **wapi, struct GfxRenderingAPI **rapi);
+
+#endif
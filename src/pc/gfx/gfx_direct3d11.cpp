@@ -1,6 +1,7 @@
 #ifdef ENABLE_DX11
 
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <cmath>
 
@@ -99,7 +100,7 @@ static struct {
     PerFrameCB per_frame_cb_data;
     PerDrawCB per_draw_cb_data;
 
-    struct ShaderProgramD3D11 shader_program_pool[64];
+    struct ShaderProgramD3D11 shader_program_pool[GFX_MAX_SHADER_PROGRAMS];
     uint8_t shader_program_pool_size;
 
     std::vector<struct TextureData> textures;
@@ -349,6 +350,10 @@ static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shade
         throw hr;
     }
 
+    if (d3d.shader_program_pool_size >= GFX_MAX_SHADER_PROGRAMS) {
+        fprintf(stderr, "Out of shader programs, %08x is one too many\n", shader_id);
+        abort();
+    }
     struct ShaderProgramD3D11 *prg = &d3d.shader_program_pool[d3d.shader_program_pool_size++];
 
     ThrowIfFailed(d3d.device->CreateVertexShader(vs->GetBufferPointer(), vs->GetBufferSize(), nullptr, prg->vertex_shader.GetAddressOf()));
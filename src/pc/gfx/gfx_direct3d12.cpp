@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
@@ -103,7 +105,7 @@ static struct {
     HMODULE d3dcompiler_module;
     pD3DCompile D3DCompile;
     
-    struct ShaderProgramD3D12 shader_program_pool[64];
+    struct ShaderProgramD3D12 shader_program_pool[GFX_MAX_SHADER_PROGRAMS];
     uint8_t shader_program_pool_size;
     
     uint32_t current_width, current_height;
@@ -238,6 +240,10 @@ static struct ShaderProgram *gfx_direct3d12_create_and_load_new_shader(uint32_t
     fprintf(fp, "0x%08x\n", shader_id);
     fflush(fp);*/
     
+    if (d3d.shader_program_pool_size >= GFX_MAX_SHADER_PROGRAMS) {
+        fprintf(stderr, "Out of shader programs, %08x is one too many\n", shader_id);
+        abort();
+    }
     struct ShaderProgramD3D12 *prg = &d3d.shader_program_pool[d3d.shader_program_pool_size++];
     
     CCFeatures cc_features;
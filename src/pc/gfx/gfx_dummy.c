@@ -4,6 +4,7 @@
 
 #include "gfx_window_manager_api.h"
 #include "gfx_rendering_api.h"
+#include "../configfile.h"
 
 static void gfx_dummy_wm_init(const char *game_name, bool start_in_fullscreen) {
 }
@@ -61,6 +62,9 @@ static struct timespec gfx_dummy_wm_timeadd(struct timespec t1, struct timespec
 static void gfx_dummy_wm_swap_buffers_end(void) {
     static struct timespec prev;
     struct timespec t;
+    if (!configFrameLimit) {
+        return;
+    }
     clock_gettime(CLOCK_MONOTONIC, &t);
     struct timespec diff = gfx_dummy_wm_timediff(t, prev);
     if (diff.tv_sec == 0 && diff.tv_nsec < 1000000000 / 30) {
@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
+#include <time.h>
 
 #ifndef _LANGUAGE_C
 #define _LANGUAGE_C
@@ -28,31 +30,81 @@
 static int has_vao_support = 0;
 static PFNGLBINDVERTEXARRAYOESPROC glBindVertexArrayOES;
 static PFNGLGENVERTEXARRAYSOESPROC glGenVertexArraysOES;
+static PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+static PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+
+#ifndef GL_MAP_WRITE_BIT_EXT
+#define GL_MAP_WRITE_BIT_EXT 0x0002
+#define GL_MAP_INVALIDATE_RANGE_BIT_EXT 0x0004
+#define GL_MAP_UNSYNCHRONIZED_BIT_EXT 0x0020
+#endif
+static void *(*glMapBufferRangeEXT)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+static GLboolean (*glUnmapBufferOES)(GLenum target);
+
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT_EXT
+#define GL_QUERY_RESULT_EXT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE_EXT 0x8867
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+// Not named after the extension, GLEW already defines some of those as macros
+static struct {
+    void (*gen_queries)(GLsizei n, GLuint *ids);
+    void (*begin_query)(GLenum target, GLuint id);
+    void (*end_query)(GLenum target);
+    void (*get_query_uiv)(GLuint id, GLenum pname, GLuint *params);
+    void (*get_query_ui64v)(GLuint id, GLenum pname, uint64_t *params);
+} timer_query;
 
 #include "gfx_cc.h"
 #include "gfx_rendering_api.h"
 #include "gfx_opengl_dynares.h"
 #include "../cheapProfiler.h"
+#include "../configfile.h"
+#include "../fsutils.h"
 
 struct ShaderProgram {
     uint32_t shader_id;
     GLuint opengl_program_id;
     uint8_t num_inputs;
     bool used_textures[2];
-    uint8_t num_floats;
+    uint8_t num_floats; // 32-bit words per vertex
     GLint attrib_locations[12];
     uint8_t attrib_sizes[12];
+    GLenum attrib_types[12];
+    bool attrib_normalized[12];
+    uint8_t attrib_words[12];
     uint8_t num_attribs;
     bool used_noise;
     GLint frame_count_location;
     GLint window_height_location;
+#ifdef USE_HW_TNL
+    uint8_t lit_input;
+    GLint mvp_location;
+    GLint fog_location;
+    GLint light_dir_location;
+    GLint light_color_location;
+    uint32_t tnl_generation;
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    GLint prim_color_location;
+    GLint env_color_location;
+    GLint fog_color_location;
+    bool colors_have_alpha;
+    uint32_t color_generation;
+#endif
     GLuint vao;
+    GLuint vao_buffer; // vertex buffer the VAO's attributes point into
     bool init;
 };
 
 struct FBOBlitter {
     GLuint program;
-    GLuint vao;
+    GLuint vao, vbo;
     GLuint fbo, fbo_tex, fbo_depth;
     GLfloat h_scale, v_scale;
     GLuint width, height;
@@ -60,16 +112,84 @@ struct FBOBlitter {
     GLint uScale;
     GLint uFBOTex;
     int status;
+    bool active; // rendering below full scale this frame
+};
+
+// Timer queries are read back this many frames late so they never stall
+#define DYNARES_QUERIES 4
+// Render scales are picked in steps of this many percent
+#define DYNARES_STEP 5
+// Consecutive frames over budget before the scale drops
+#define DYNARES_DOWN_FRAMES 3
+// Consecutive frames with headroom for the next step before the scale rises
+#define DYNARES_UP_FRAMES 30
+
+// Picks the largest render scale whose frames still fit in the frame budget.
+// The scale drops quickly when the GPU falls behind, and only rises again
+// once the estimated cost of the larger scale has fit for a while, so the
+// two thresholds don't make it oscillate.
+struct DynaresController {
+    uint32_t scale; // percent of the window's width and height
+    uint32_t min_scale, max_scale;
+    uint32_t budget_us;
+    uint64_t cpu_start; // signal_start timestamp
+    uint32_t cpu_us, gpu_us; // last measured frame
+    float gpu_avg_us; // smoothed, 0 until measured at the current scale
+    uint32_t over_frames, under_frames;
+    uint32_t settle_frames; // samples still rendered at the previous scale
+    GLuint queries[DYNARES_QUERIES];
+    uint32_t query_frame;
 };
 
-static struct ShaderProgram shader_program_pool[64];
+static struct ShaderProgram shader_program_pool[GFX_MAX_SHADER_PROGRAMS];
 static uint8_t shader_program_pool_size;
-static GLuint opengl_vbo;
+
+// Vertices (and indices) are streamed into a ring buffer: flushes append
+// after each other with glBufferSubData, or through an unsynchronized mapping
+// when available, and the storage is only orphaned when the ring wraps
+// around. A few buffers are rotated per frame so the driver doesn't need to
+// wait on the previous frame's draws either.
+#define RING_COUNT 3
+#define VBO_RING_SIZE (1024 * 1024)
+#define IBO_RING_SIZE (256 * 1024)
+
+struct RingBuffer {
+    GLuint id;
+    uint32_t size;
+    uint32_t offset;
+};
+
+struct StreamRing {
+    GLenum target;
+    struct RingBuffer buffers[RING_COUNT];
+    struct RingBuffer *current;
+    uint32_t bytes_streamed; // this frame
+    uint32_t wraps; // this frame
+};
+
+static struct StreamRing vbo_ring;
+#ifdef USE_INDEXED_DRAWING
+static struct StreamRing ibo_ring;
+#endif
 
 static uint32_t frame_count;
+static uint32_t draw_calls, program_switches; // per frame
 static uint32_t current_height;
 
 static struct FBOBlitter dynares = {};
+static struct DynaresController dynares_ctl;
+
+static struct ShaderProgram *current_program;
+
+#ifdef USE_HW_TNL
+static struct GfxTnlState tnl_state;
+static uint32_t tnl_generation = 1;
+#endif
+
+#ifdef USE_COLOR_UNIFORMS
+static struct GfxCombinerColors combiner_colors;
+static uint32_t color_generation = 1;
+#endif
 
 static GLuint gfx_compile_shaders(const GLchar *sources[2], const const GLint lengths[2])
 {
@@ -115,8 +235,152 @@ static GLuint gfx_compile_shaders(const GLchar *sources[2], const const GLint le
     return shader_program;
 }
 
+// Linked programs are kept on disk through GL_OES_get_program_binary, so
+// shaders from earlier runs skip the compiler altogether. Entries are tied
+// to the generated source and to the driver that produced them.
+#define PROGRAM_CACHE_FILE "shader_cache.bin"
+#define PROGRAM_CACHE_MAGIC 0x50483436 // "64HP"
+#define PROGRAM_CACHE_VERSION 1
+
+struct ProgramCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t driver_hash;
+};
+
+struct ProgramCacheRecord {
+    uint32_t shader_id;
+    uint32_t source_hash;
+    uint32_t format;
+    uint32_t length; // bytes of binary that follow
+};
+
+static struct {
+    uint8_t *data; // file contents read at startup
+    size_t size;
+    uint32_t driver_hash;
+    bool valid; // the file on disk belongs to this driver, and it took every binary so far
+    uint32_t loads; // this frame
+} program_cache;
+
+static uint32_t gfx_opengl_hash(const void *data, size_t size, uint32_t hash) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619;
+    }
+    return hash;
+}
+
+static uint32_t gfx_opengl_hash_string(GLenum name, uint32_t hash) {
+    const char *str = (const char *)glGetString(name);
+    return str != NULL ? gfx_opengl_hash(str, strlen(str), hash) : hash;
+}
+
+static void gfx_opengl_program_cache_open(void) {
+    uint32_t hash = gfx_opengl_hash_string(GL_VENDOR, 2166136261U);
+    hash = gfx_opengl_hash_string(GL_RENDERER, hash);
+    program_cache.driver_hash = gfx_opengl_hash_string(GL_VERSION, hash);
+
+    FILE *file = fopen_home(PROGRAM_CACHE_FILE, "rb");
+    if (file == NULL) {
+        return;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size >= (long)sizeof(struct ProgramCacheHeader)) {
+        program_cache.data = malloc(size);
+        if (program_cache.data != NULL && fread(program_cache.data, 1, size, file) == (size_t)size) {
+            program_cache.size = size;
+        }
+    }
+    fclose(file);
+
+    struct ProgramCacheHeader header;
+    if (program_cache.size != 0) {
+        memcpy(&header, program_cache.data, sizeof(header));
+        program_cache.valid = header.magic == PROGRAM_CACHE_MAGIC &&
+                              header.version == PROGRAM_CACHE_VERSION &&
+                              header.driver_hash == program_cache.driver_hash;
+    }
+}
+
+// Returns the cached program, or 0 if there's none or the driver rejects it.
+static GLuint gfx_opengl_program_cache_load(uint32_t shader_id, uint32_t source_hash) {
+    if (glProgramBinaryOES == NULL || !program_cache.valid) {
+        return 0;
+    }
+
+    size_t pos = sizeof(struct ProgramCacheHeader);
+    while (pos + sizeof(struct ProgramCacheRecord) <= program_cache.size) {
+        struct ProgramCacheRecord record;
+        memcpy(&record, program_cache.data + pos, sizeof(record));
+        pos += sizeof(record);
+        if (record.length > program_cache.size - pos) {
+            break; // truncated
+        }
+        if (record.shader_id == shader_id && record.source_hash == source_hash) {
+            GLint success;
+            GLuint program = glCreateProgram();
+            glProgramBinaryOES(program, record.format, program_cache.data + pos, record.length);
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            if (!success) {
+                // Most likely a driver update the version string didn't show. Start
+                // the file over with the next store, appending would leave this
+                // record in front of its replacement for good.
+                glDeleteProgram(program);
+                program_cache.valid = false;
+                return 0;
+            }
+            program_cache.loads++;
+            return program;
+        }
+        pos += record.length;
+    }
+    return 0;
+}
+
+static void gfx_opengl_program_cache_store(GLuint program, uint32_t shader_id, uint32_t source_hash) {
+    if (glGetProgramBinaryOES == NULL) {
+        return;
+    }
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+    if (length <= 0) {
+        return;
+    }
+    void *binary = malloc(length);
+    if (binary == NULL) {
+        return;
+    }
+    GLenum format;
+    glGetProgramBinaryOES(program, length, &length, &format, binary);
+
+    // Start the file over if it was written by another driver or version
+    FILE *file = fopen_home(PROGRAM_CACHE_FILE, program_cache.valid ? "ab" : "wb");
+    if (file != NULL) {
+        if (!program_cache.valid) {
+            struct ProgramCacheHeader header = { PROGRAM_CACHE_MAGIC, PROGRAM_CACHE_VERSION, program_cache.driver_hash };
+            fwrite(&header, sizeof(header), 1, file);
+            program_cache.valid = true;
+            program_cache.size = 0; // what was read is gone now
+        }
+        struct ProgramCacheRecord record = { shader_id, source_hash, format, length };
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(binary, 1, length, file);
+        fclose(file);
+    }
+    free(binary);
+}
+
 #ifdef USE_TEXTURE_ATLAS
-GLuint vt_page;
+static GLuint vt_pages[GFX_MAX_VIRTUAL_TEXTURE_PAGES];
+static bool vt_page_movable[GFX_MAX_VIRTUAL_TEXTURE_PAGES]; // can be attached to vt_page_fbo
+static int vt_page_bound[2]; // page each texture unit samples
+static enum GfxTextureFormat vt_page_format;
+static uint16_t vt_page_dimensions;
+static GLuint vt_page_fbo; // reads a page back when moving texels
 #endif
 
 static bool gfx_opengl_z_is_from_0_to_1(void) {
@@ -129,8 +393,9 @@ static void gfx_opengl_vertex_array_set_attribs(struct ShaderProgram *prg) {
 
     for (int i = 0; i < prg->num_attribs; i++) {
         glEnableVertexAttribArray(prg->attrib_locations[i]);
-        glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], GL_FLOAT, GL_FALSE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
-        pos += prg->attrib_sizes[i];
+        glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], prg->attrib_types[i],
+            prg->attrib_normalized[i] ? GL_TRUE : GL_FALSE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
+        pos += prg->attrib_words[i];
     }
 }
 
@@ -139,6 +404,32 @@ static void gfx_opengl_set_uniforms(struct ShaderProgram *prg) {
         glUniform1i(prg->frame_count_location, frame_count);
         glUniform1i(prg->window_height_location, current_height);
     }
+#ifdef USE_HW_TNL
+    if (prg->tnl_generation != tnl_generation) {
+        glUniformMatrix4fv(prg->mvp_location, 1, GL_FALSE, &tnl_state.mp_matrix[0][0]);
+        if (prg->fog_location >= 0) {
+            glUniform3f(prg->fog_location, tnl_state.fog_mul, tnl_state.fog_offset, tnl_state.fog ? 1.0f : 0.0f);
+        }
+        if (prg->lit_input) {
+            glUniform3fv(prg->light_dir_location, GFX_TNL_MAX_LIGHTS, &tnl_state.light_dirs[0][0]);
+            glUniform3fv(prg->light_color_location, GFX_TNL_MAX_LIGHTS + 1, &tnl_state.light_colors[0][0]);
+        }
+        prg->tnl_generation = tnl_generation;
+    }
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    if (prg->color_generation != color_generation) {
+        if (prg->colors_have_alpha) {
+            glUniform4fv(prg->prim_color_location, 1, combiner_colors.prim);
+            glUniform4fv(prg->env_color_location, 1, combiner_colors.env);
+        } else {
+            glUniform3fv(prg->prim_color_location, 1, combiner_colors.prim);
+            glUniform3fv(prg->env_color_location, 1, combiner_colors.env);
+        }
+        glUniform3fv(prg->fog_color_location, 1, combiner_colors.fog);
+        prg->color_generation = color_generation;
+    }
+#endif
 }
 
 static void gfx_opengl_unload_shader(struct ShaderProgram *old_prg) {
@@ -154,15 +445,23 @@ static void gfx_opengl_unload_shader(struct ShaderProgram *old_prg) {
 
 static void gfx_opengl_load_shader(struct ShaderProgram *new_prg) {
     glUseProgram(new_prg->opengl_program_id);
+    current_program = new_prg;
+    program_switches++;
     if (has_vao_support) {
         if (!new_prg->init) {
             new_prg->init = 1;
             glGenVertexArraysOES(1, &new_prg->vao);
             glBindVertexArrayOES(new_prg->vao);
             gfx_opengl_vertex_array_set_attribs(new_prg);
+            new_prg->vao_buffer = vbo_ring.current->id;
         }
         else {
             glBindVertexArrayOES(new_prg->vao);
+            // The ring buffers rotate each frame
+            if (new_prg->vao_buffer != vbo_ring.current->id) {
+                gfx_opengl_vertex_array_set_attribs(new_prg);
+                new_prg->vao_buffer = vbo_ring.current->id;
+            }
         }
     } else {
         gfx_opengl_vertex_array_set_attribs(new_prg);
@@ -250,6 +549,70 @@ static void append_formula(char *buf, size_t *len, uint8_t c[2][4], bool do_sing
     }
 }
 
+// Evaluates the combiner whose selectors and options came with the vertex.
+static void append_uber_combiner(char *buf, size_t *len) {
+    // a | b << 3 | c << 6 | d << 9, rounded since they went through the interpolators
+    append_line(buf, len, "vec3 combiner = floor(vCombiner + 0.5);");
+    append_line(buf, len, "vec4 rgb = mod(floor(combiner.x / vec4(1.0, 8.0, 64.0, 512.0)), 8.0);");
+    append_line(buf, len, "vec4 alpha = mod(floor(combiner.y / vec4(1.0, 8.0, 64.0, 512.0)), 8.0);");
+    append_line(buf, len, "vec4 a = vec4(ccItem(rgb.x, texVal0, texVal1).rgb, ccItem(alpha.x, texVal0, texVal1).a);");
+    append_line(buf, len, "vec4 b = vec4(ccItem(rgb.y, texVal0, texVal1).rgb, ccItem(alpha.y, texVal0, texVal1).a);");
+    append_line(buf, len, "vec4 c = vec4(ccItem(rgb.z, texVal0, texVal1).rgb, ccItem(alpha.z, texVal0, texVal1).a);");
+    append_line(buf, len, "vec4 d = vec4(ccItem(rgb.w, texVal0, texVal1).rgb, ccItem(alpha.w, texVal0, texVal1).a);");
+    append_line(buf, len, "vec4 texel = (a - b) * c + d;");
+    // alpha | texture edge << 1 | fog << 2, fog is left to the caller since
+    // its factor is 0 for the combiners without it
+    append_line(buf, len, "vec3 options = mod(floor(combiner.z / vec3(1.0, 2.0, 4.0)), 2.0);");
+    append_line(buf, len, "if (options.y > 0.5) { if (texel.a > 0.3) texel.a = 1.0; else discard; }");
+    append_line(buf, len, "if (options.x < 0.5) texel.a = 1.0;");
+}
+
+// Whether a combiner input is a uniform rather than a vertex attribute.
+static bool gfx_opengl_input_is_uniform(int input) {
+#ifdef USE_COLOR_UNIFORMS
+    return input == SHADER_INPUT_PRIM || input == SHADER_INPUT_ENV;
+#else
+    return false;
+#endif
+}
+
+#ifdef USE_PACKED_VERTICES
+#define TEXCOORD_FORMAT GL_SHORT, false
+#define COLOR_FORMAT GL_UNSIGNED_BYTE, true
+#define TEXCOORD_WORDS 1
+#define COLOR_WORDS(n) 1
+#define COMBINER_FORMAT GL_UNSIGNED_SHORT, false
+#define COMBINER_WORDS 2
+#else
+#define TEXCOORD_FORMAT GL_FLOAT, false
+#define COLOR_FORMAT GL_FLOAT, false
+#define TEXCOORD_WORDS 2
+#define COLOR_WORDS(n) (n)
+#define COMBINER_FORMAT GL_FLOAT, false
+#define COMBINER_WORDS 4
+#endif
+
+static void gfx_opengl_add_attrib(struct ShaderProgram *prg, size_t *cnt, GLuint program, const char *name, uint8_t size, GLenum type, bool normalized) {
+    prg->attrib_locations[*cnt] = glGetAttribLocation(program, name);
+    prg->attrib_sizes[*cnt] = size;
+    prg->attrib_types[*cnt] = type;
+    prg->attrib_normalized[*cnt] = normalized;
+    // Every attribute starts on a 32-bit word
+    switch (type) {
+        case GL_UNSIGNED_BYTE:
+            prg->attrib_words[*cnt] = (size + 3) / 4;
+            break;
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT:
+            prg->attrib_words[*cnt] = (size * 2 + 3) / 4;
+            break;
+        default:
+            prg->attrib_words[*cnt] = size;
+            break;
+    }
+    ++*cnt;
+}
+
 static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shader_id) {
     struct CCFeatures cc_features;
     gfx_cc_get_features(shader_id, &cc_features);
@@ -260,12 +623,16 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     size_t fs_len = 0;
     size_t num_floats = 4;
 
+#ifdef USE_TEXTURE_ATLAS
     int num_samplers = cc_features.used_textures[0] + cc_features.used_textures[1];
+#ifndef USE_PACKED_VERTICES
     char *aTexParams_type[] = {
         "",
         "vec2",
         "vec4"
     };
+#endif
+#endif
 
     // Vertex shader
 #ifndef USE_GLES2
@@ -275,15 +642,33 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
 #endif
     append_line(vs_buf, &vs_len, "precision highp float;");
     append_line(vs_buf, &vs_len, "attribute vec4 aVtxPos;");
+#ifdef USE_HW_TNL
+    append_line(vs_buf, &vs_len, "uniform mat4 uMVP;");
+    if (cc_features.lit_input) {
+        append_line(vs_buf, &vs_len, "attribute vec3 aNormal;");
+        vs_len += sprintf(vs_buf + vs_len, "uniform vec3 uLightDir[%d];\n", GFX_TNL_MAX_LIGHTS);
+        vs_len += sprintf(vs_buf + vs_len, "uniform vec3 uLightColor[%d];\n", GFX_TNL_MAX_LIGHTS + 1);
+        num_floats += 3;
+    }
+    if (cc_features.opt_fog) {
+        // fog multiplier, fog offset, enabled
+        append_line(vs_buf, &vs_len, "uniform vec3 uFog;");
+    }
+#endif
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(vs_buf, &vs_len, "attribute vec2 aTexCoord;");
 #ifndef USE_TEXTURE_ATLAS
         append_line(vs_buf, &vs_len, "varying vec2 vTexCoord;");
 #else
+#ifndef USE_PACKED_VERTICES
         vs_len += sprintf(vs_buf + vs_len, "#define bundle_t %s\n", aTexParams_type[num_samplers]);
         vs_len += sprintf(vs_buf + vs_len, "attribute bundle_t aTexParams;\n");
+#endif
         for (int i = 0, samplers = 1; i < 2; i++) {
             if (cc_features.used_textures[i]) {
+#ifdef USE_PACKED_VERTICES
+                vs_len += sprintf(vs_buf + vs_len, "attribute vec4 aTexParams%d;\n", samplers);
+#endif
                 vs_len += sprintf(vs_buf + vs_len, "varying vec4 vTexDimensions%d;\n", samplers);
                 vs_len += sprintf(vs_buf + vs_len, "varying vec4 vTexSampler%d;\n", samplers);
                 vs_len += sprintf(vs_buf + vs_len, "varying vec2 vTexCoord%d;\n", samplers);
@@ -292,22 +677,38 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
             }
         }
 #endif
-        num_floats += 2;
+        num_floats += TEXCOORD_WORDS;
     }
     if (cc_features.opt_fog) {
+#ifdef USE_COLOR_UNIFORMS
+        // Just the factor, the colour is a uniform
+        append_line(vs_buf, &vs_len, "attribute float aFog;");
+        append_line(vs_buf, &vs_len, "varying float vFogFactor;");
+        num_floats += COLOR_WORDS(1);
+#else
         append_line(vs_buf, &vs_len, "attribute vec4 aFog;");
         append_line(vs_buf, &vs_len, "varying vec4 vFog;");
-        num_floats += 4;
+        num_floats += COLOR_WORDS(4);
+#endif
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
+        if (gfx_opengl_input_is_uniform(i + 1)) {
+            continue;
+        }
         vs_len += sprintf(vs_buf + vs_len, "attribute vec%d aInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
         vs_len += sprintf(vs_buf + vs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
-        num_floats += cc_features.opt_alpha ? 4 : 3;
+        num_floats += COLOR_WORDS(cc_features.opt_alpha ? 4 : 3);
+    }
+    if (cc_features.opt_uber) {
+        // color selectors, alpha selectors, options
+        append_line(vs_buf, &vs_len, "attribute vec4 aCombiner;");
+        append_line(vs_buf, &vs_len, "varying vec3 vCombiner;");
+        num_floats += COMBINER_WORDS;
     }
 
 #ifdef USE_TEXTURE_ATLAS
     // Returns two texture param activator tuples.
-    // e.g.: (is_mirror0, is_clamp0, is_mirror1, is_clamp1)
+    // e.g.: (is_clamp0, is_mirror0, is_clamp1, is_mirror1)
     // Normal Repeat operation is implied is_repeat = 1-(is_mirror0+is_clamp0) 
     append_line(vs_buf, &vs_len,
         "vec4 cms_cmt(vec2 cmst) {"
@@ -318,18 +719,71 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
 #endif
     
     append_line(vs_buf, &vs_len, "void main() {");
-#ifndef USE_TEXTURE_ATLAS
+#ifdef USE_HW_TNL
+    append_line(vs_buf, &vs_len, "gl_Position = uMVP * aVtxPos;");
+#endif
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        append_line(vs_buf, &vs_len, "vTexCoord = aTexCoord;");
-    }
+#ifdef USE_PACKED_VERTICES
+        vs_len += sprintf(vs_buf + vs_len, "vec2 texCoord = aTexCoord * (1.0 / %d.0);\n", GFX_PACKED_UV_SCALE);
+#else
+        append_line(vs_buf, &vs_len, "vec2 texCoord = aTexCoord;");
 #endif
+#ifndef USE_TEXTURE_ATLAS
+        append_line(vs_buf, &vs_len, "vTexCoord = texCoord;");
+#endif
+    }
     if (cc_features.opt_fog) {
+#ifdef USE_COLOR_UNIFORMS
+        append_line(vs_buf, &vs_len, "vFogFactor = aFog;");
+#else
         append_line(vs_buf, &vs_len, "vFog = aFog;");
+#endif
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
+        if (gfx_opengl_input_is_uniform(i + 1)) {
+            continue;
+        }
         vs_len += sprintf(vs_buf + vs_len, "vInput%d = aInput%d;\n", i + 1, i + 1);
     }
+    if (cc_features.opt_uber) {
+        append_line(vs_buf, &vs_len, "vCombiner = aCombiner.xyz;");
+    }
+#ifdef USE_HW_TNL
+    if (cc_features.opt_fog) {
+        // Same as gfx_fog_factor, the result gets stored in the fog alpha
+        if (cc_features.opt_uber) {
+            // Only for the combiners that fog
+            append_line(vs_buf, &vs_len, "if (uFog.z > 0.5 && aCombiner.z >= 4.0) {");
+        } else {
+            append_line(vs_buf, &vs_len, "if (uFog.z > 0.5) {");
+        }
+        append_line(vs_buf, &vs_len, "    float winv = abs(gl_Position.w) < 0.001 ? 1000.0 : 1.0 / gl_Position.w;");
+        append_line(vs_buf, &vs_len, "    if (winv < 0.0) winv = 32767.0;");
+#ifdef USE_COLOR_UNIFORMS
+        append_line(vs_buf, &vs_len, "    vFogFactor = floor(clamp(gl_Position.z * winv * uFog.x + uFog.y, 0.0, 255.0)) / 255.0;");
+#else
+        append_line(vs_buf, &vs_len, "    vFog.a = floor(clamp(gl_Position.z * winv * uFog.x + uFog.y, 0.0, 255.0)) / 255.0;");
+#endif
+        append_line(vs_buf, &vs_len, "}");
+    }
+    if (cc_features.lit_input) {
+        vs_len += sprintf(vs_buf + vs_len, "vec3 lit = uLightColor[%d];\n", GFX_TNL_MAX_LIGHTS);
+        for (int i = 0; i < GFX_TNL_MAX_LIGHTS; i++) {
+            vs_len += sprintf(vs_buf + vs_len, "lit += max(dot(aNormal, uLightDir[%d]), 0.0) * uLightColor[%d];\n", i, i);
+        }
+        vs_len += sprintf(vs_buf + vs_len, "vInput%d.rgb = min(lit, 1.0);\n", cc_features.lit_input);
+    }
+#endif
 
+#ifdef USE_TEXTURE_ATLAS
+#ifdef USE_PACKED_VERTICES
+    // x, y, width | cms << 12, height | cmt << 12
+    for (int i = 1; i <= num_samplers; i++) {
+        vs_len += sprintf(vs_buf + vs_len, "vTexDimensions%d = vec4(aTexParams%d.xy, mod(aTexParams%d.zw, 4096.0)) / %d.0;\n", i, i, i, vt_page_dimensions);
+        vs_len += sprintf(vs_buf + vs_len, "vTexSampler%d = cms_cmt(floor(aTexParams%d.zw / 4096.0));\n", i, i);
+        vs_len += sprintf(vs_buf + vs_len, "vTexCoord%d = texCoord;\n", i);
+    }
+#else
     // Extract the bundled encFloat_t in parallel
     if (num_samplers > 0) {
         // exponent = floor(log2(value))
@@ -338,8 +792,8 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
         // MAXIMUM_MANTISSA_VALUE = (1<<23)-1 = 8388607.0
         // mantissa = MAXIMUM_MANTISSA_VALUE * (value / 2.0**exponent)) - 1)
         append_line(vs_buf, &vs_len, "bundle_t mant = 8388607.0 * ((aTexParams / p) - bundle_t(1.0));");
-        // cmst = ((e+BIAS) >> 1)
-        append_line(vs_buf, &vs_len, "bundle_t dec_cmst = floor((e + 127.0) / 2.0);");
+        // cmst = ((e+BIAS) >> 1) & 3, the page index sits above it
+        append_line(vs_buf, &vs_len, "bundle_t dec_cmst = mod(floor((e + 127.0) / 2.0), 4.0);");
         // width or height = mant >> 11
         append_line(vs_buf, &vs_len, "bundle_t dec_zw = floor(mant / 2048.0);");
         // x or y = mant & 0xFFF
@@ -347,31 +801,28 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
 
         // Swizzle all the necessary things into their correct places
         if (num_samplers > 0) {
-            // Dimensions are in the [0-2048] range, but OpenGL expects [0-1]. Scale it down.
+            // Dimensions are in the [0-page size] range, but OpenGL expects [0-1]. Scale it down.
             // Johnny: I don't see any point in using an uniform for the texture range
             // since we only have 11 bits of precision on the encoded numbers. 
             // There's an extra 2 unused on the exponential, but first let's attempt not to use them.
             append_line(vs_buf, &vs_len, "vTexDimensions1 = vec4(dec_xy.xy, dec_zw.xy);");
-            append_line(vs_buf, &vs_len, "vTexDimensions1 = vTexDimensions1 / 2048.0;");
+            vs_len += sprintf(vs_buf + vs_len, "vTexDimensions1 = vTexDimensions1 / %d.0;\n", vt_page_dimensions);
             append_line(vs_buf, &vs_len, "vTexSampler1 = cms_cmt(dec_cmst.xy);");
-
-            // In case we have a mirrored tile, we'll used the pre-uploaded mirrors
-            // For that, we'll fix the dimensions here by pre-multiplying them
-            append_line(vs_buf, &vs_len, "vTexDimensions1.zw *= vTexSampler1.yw + 1.0;"); // Use mirrored images
-            append_line(vs_buf, &vs_len, "vTexCoord1 = aTexCoord / (vTexSampler1.yw + 1.0);"); // Use mirrored images
+            append_line(vs_buf, &vs_len, "vTexCoord1 = texCoord;");
             if (num_samplers == 2) {
                 append_line(vs_buf, &vs_len, "vTexDimensions2 = vec4(dec_xy.zw, dec_zw.zw);");
-                append_line(vs_buf, &vs_len, "vTexDimensions2 = vTexDimensions2 / 2048.0;");
+                vs_len += sprintf(vs_buf + vs_len, "vTexDimensions2 = vTexDimensions2 / %d.0;\n", vt_page_dimensions);
                 append_line(vs_buf, &vs_len, "vTexSampler2 = cms_cmt(dec_cmst.zw);");
-
-                // Same here
-                append_line(vs_buf, &vs_len, "vTexDimensions2.zw *= vTexSampler2.yw + 1.0;"); // Use mirrored images
-                append_line(vs_buf, &vs_len, "vTexCoord2 = aTexCoord / (vTexSampler2.yw + 1.0);"); // Use mirrored images
+                append_line(vs_buf, &vs_len, "vTexCoord2 = texCoord;");
             }
         }
     }    
+#endif
+#endif
 
+#ifndef USE_HW_TNL
     append_line(vs_buf, &vs_len, "gl_Position = aVtxPos;");
+#endif
     append_line(vs_buf, &vs_len, "}");
 
     // Fragment shader
@@ -398,11 +849,36 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     }
 
     if (cc_features.opt_fog) {
+#ifdef USE_COLOR_UNIFORMS
+        append_line(fs_buf, &fs_len, "uniform vec3 uFogColor;");
+        append_line(fs_buf, &fs_len, "varying float vFogFactor;");
+        append_line(fs_buf, &fs_len, "#define vFog vec4(uFogColor, vFogFactor)");
+#else
         append_line(fs_buf, &fs_len, "varying vec4 vFog;");
+#endif
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
+#ifdef USE_COLOR_UNIFORMS
+        if (gfx_opengl_input_is_uniform(i + 1)) {
+            const char *name = i + 1 == SHADER_INPUT_PRIM ? "uPrimColor" : "uEnvColor";
+            fs_len += sprintf(fs_buf + fs_len, "uniform vec%d %s;\n", cc_features.opt_alpha ? 4 : 3, name);
+            fs_len += sprintf(fs_buf + fs_len, "#define vInput%d %s\n", i + 1, name);
+            continue;
+        }
+#endif
         fs_len += sprintf(fs_buf + fs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
     }
+    if (cc_features.opt_uber) {
+        append_line(fs_buf, &fs_len, "varying vec3 vCombiner;");
+        // Picks one of the SHADER_* items, there's no dynamic indexing of
+        // varyings in GLSL ES 1.00 so everything gets weighted instead.
+        append_line(fs_buf, &fs_len, "vec4 ccItem(float item, vec4 texVal0, vec4 texVal1) {");
+        append_line(fs_buf, &fs_len, "    vec4 inputs = vec4(equal(vec4(item), vec4(1.0, 2.0, 3.0, 4.0)));");
+        append_line(fs_buf, &fs_len, "    vec3 texels = vec3(equal(vec3(item), vec3(5.0, 6.0, 7.0)));");
+        append_line(fs_buf, &fs_len, "    return inputs.x * vInput1 + inputs.y * vInput2 + inputs.z * vInput3 + inputs.w * vInput4 +");
+        append_line(fs_buf, &fs_len, "           texels.x * texVal0 + texels.y * texVal0.aaaa + texels.z * texVal1;");
+        append_line(fs_buf, &fs_len, "}");
+    }
     if (cc_features.used_textures[0]) {
         append_line(fs_buf, &fs_len, "uniform sampler2D uTex0;");
     }
@@ -438,28 +914,34 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
         // See the definition of cms_cmt() to understand this.
         // We use precomputed sampler activators here to avoid calculating them 
         // on the fragment shaders, and to allow us to simd the coordinate params.
+        // Mirrored tiles fold every other repetition back onto the texture.
         for (int i = 1; i <= num_samplers; i++) {
             if (cc_features.used_textures[i-1]) {
                 fs_len += sprintf(fs_buf + fs_len, "texCoords = vTexDimensions%d.xy;", i);
                 fs_len += sprintf(fs_buf + fs_len, "texCoords +=      vTexSampler%d.xz  * vTexDimensions%d.zw * clamp(vTexCoord%d, 0.0, 1.0);", i, i, i);
-                fs_len += sprintf(fs_buf + fs_len, "texCoords += (1.0-vTexSampler%d.xz) * vTexDimensions%d.zw * fract(vTexCoord%d);", i, i, i);
+                fs_len += sprintf(fs_buf + fs_len, "texCoords +=      vTexSampler%d.yw  * vTexDimensions%d.zw * (1.0 - abs(1.0 - mod(vTexCoord%d, 2.0)));", i, i, i);
+                fs_len += sprintf(fs_buf + fs_len, "texCoords += (1.0-vTexSampler%d.xz-vTexSampler%d.yw) * vTexDimensions%d.zw * fract(vTexCoord%d);", i, i, i, i);
                 fs_len += sprintf(fs_buf + fs_len, "vec4 texVal%d = texture2D(uTex%d, texCoords);", i-1, i-1);
             }
         }
     }
 #endif
 
-    append_str(fs_buf, &fs_len, cc_features.opt_alpha ? "vec4 texel = " : "vec3 texel = ");
-    if (!cc_features.color_alpha_same && cc_features.opt_alpha) {
-        append_str(fs_buf, &fs_len, "vec4(");
-        append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], false, false, true);
-        append_str(fs_buf, &fs_len, ", ");
-        append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[1], cc_features.do_multiply[1], cc_features.do_mix[1], true, true, true);
-        append_str(fs_buf, &fs_len, ")");
+    if (cc_features.opt_uber) {
+        append_uber_combiner(fs_buf, &fs_len);
     } else {
-        append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], cc_features.opt_alpha, false, cc_features.opt_alpha);
+        append_str(fs_buf, &fs_len, cc_features.opt_alpha ? "vec4 texel = " : "vec3 texel = ");
+        if (!cc_features.color_alpha_same && cc_features.opt_alpha) {
+            append_str(fs_buf, &fs_len, "vec4(");
+            append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], false, false, true);
+            append_str(fs_buf, &fs_len, ", ");
+            append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[1], cc_features.do_multiply[1], cc_features.do_mix[1], true, true, true);
+            append_str(fs_buf, &fs_len, ")");
+        } else {
+            append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], cc_features.opt_alpha, false, cc_features.opt_alpha);
+        }
+        append_line(fs_buf, &fs_len, ";");
     }
-    append_line(fs_buf, &fs_len, ";");
 
 
     if (cc_features.opt_texture_edge && cc_features.opt_alpha) {
@@ -493,40 +975,64 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
 
     const GLchar *sources[2] = { vs_buf, fs_buf };
     const GLint lengths[2] = { vs_len, fs_len };
-    GLuint shader_program = gfx_compile_shaders(sources, lengths);
+    uint32_t source_hash = gfx_opengl_hash(fs_buf, fs_len, gfx_opengl_hash(vs_buf, vs_len, 2166136261U));
+    GLuint shader_program = gfx_opengl_program_cache_load(shader_id, source_hash);
+    if (shader_program == 0) {
+        shader_program = gfx_compile_shaders(sources, lengths);
+        gfx_opengl_program_cache_store(shader_program, shader_id, source_hash);
+    }
 
     size_t cnt = 0;
 
+    if (shader_program_pool_size >= GFX_MAX_SHADER_PROGRAMS) {
+        fprintf(stderr, "Out of shader programs, %08x is one too many\n", shader_id);
+        abort();
+    }
     struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
-    prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aVtxPos");
-    prg->attrib_sizes[cnt] = 4;
-    ++cnt;
+    gfx_opengl_add_attrib(prg, &cnt, shader_program, "aVtxPos", 4, GL_FLOAT, false);
+
+#ifdef USE_HW_TNL
+    if (cc_features.lit_input) {
+        gfx_opengl_add_attrib(prg, &cnt, shader_program, "aNormal", 3, GL_FLOAT, false);
+    }
+#endif
 
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
-        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTexCoord");
-        prg->attrib_sizes[cnt] = 2;
-        ++cnt;
+        gfx_opengl_add_attrib(prg, &cnt, shader_program, "aTexCoord", 2, TEXCOORD_FORMAT);
 #ifdef USE_TEXTURE_ATLAS
+#ifdef USE_PACKED_VERTICES
+        for (int i = 1; i <= num_samplers; i++) {
+            char name[16];
+            sprintf(name, "aTexParams%d", i);
+            gfx_opengl_add_attrib(prg, &cnt, shader_program, name, 4, GL_UNSIGNED_SHORT, false);
+        }
+#else
         if (num_samplers > 0) {
-            prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTexParams");
-            prg->attrib_sizes[cnt] = num_samplers * 2; /* vec2 or vec4 */
-            ++cnt;
+            gfx_opengl_add_attrib(prg, &cnt, shader_program, "aTexParams", num_samplers * 2, GL_FLOAT, false); /* vec2 or vec4 */
         }
+#endif
 #endif
     }
 
     if (cc_features.opt_fog) {
-        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aFog");
-        prg->attrib_sizes[cnt] = 4;
-        ++cnt;
+#ifdef USE_COLOR_UNIFORMS
+        gfx_opengl_add_attrib(prg, &cnt, shader_program, "aFog", 1, COLOR_FORMAT);
+#else
+        gfx_opengl_add_attrib(prg, &cnt, shader_program, "aFog", 4, COLOR_FORMAT);
+#endif
     }
 
     for (int i = 0; i < cc_features.num_inputs; i++) {
-        char name[16];
-        sprintf(name, "aInput%d", i + 1);
-        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, name);
-        prg->attrib_sizes[cnt] = cc_features.opt_alpha ? 4 : 3;
-        ++cnt;
+        if (gfx_opengl_input_is_uniform(i + 1)) {
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "aInput%d", i + 1);
+        gfx_opengl_add_attrib(prg, &cnt, shader_program, name, cc_features.opt_alpha ? 4 : 3, COLOR_FORMAT);
+    }
+
+    if (cc_features.opt_uber) {
+        gfx_opengl_add_attrib(prg, &cnt, shader_program, "aCombiner", 4, COMBINER_FORMAT);
     }
 
     prg->shader_id = shader_id;
@@ -537,6 +1043,21 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     prg->num_floats = num_floats;
     prg->num_attribs = cnt;
     prg->init = 0;
+#ifdef USE_HW_TNL
+    prg->lit_input = cc_features.lit_input;
+    prg->mvp_location = glGetUniformLocation(shader_program, "uMVP");
+    prg->fog_location = glGetUniformLocation(shader_program, "uFog");
+    prg->light_dir_location = glGetUniformLocation(shader_program, "uLightDir");
+    prg->light_color_location = glGetUniformLocation(shader_program, "uLightColor");
+    prg->tnl_generation = 0;
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    prg->prim_color_location = glGetUniformLocation(shader_program, "uPrimColor");
+    prg->env_color_location = glGetUniformLocation(shader_program, "uEnvColor");
+    prg->fog_color_location = glGetUniformLocation(shader_program, "uFogColor");
+    prg->colors_have_alpha = cc_features.opt_alpha;
+    prg->color_generation = 0;
+#endif
 
     gfx_opengl_load_shader(prg);
 
@@ -594,6 +1115,65 @@ static void gfx_opengl_upload_texture(const uint8_t *rgba32_buf, int width, int
     ProfEmitEventEnd("glTexImage2D");
 }
 
+// Large enough for the biggest virtual texture, borders included.
+static uint16_t pack_buf[4096 * 4 + ((63-1) * 4)];
+
+// Packs count RGBA32 texels into format, rounding to nearest so texels that
+// were expanded from 4 or 5 bits come back out exactly. Returns the data to
+// hand to GL along with its format and type.
+static const void *gfx_opengl_pack_texture(const uint8_t *rgba32_buf, enum GfxTextureFormat format, int count, GLenum *gl_format, GLenum *gl_type)
+{
+    uint8_t *pack_buf8 = (uint8_t *)pack_buf;
+    const uint8_t *src = rgba32_buf;
+
+    switch (format) {
+        case GFX_TEXFMT_RGBA5551:
+            for (int i = 0; i < count; i++, src += 4) {
+                pack_buf[i] = ((src[0] * 31 + 127) / 255) << 11 | ((src[1] * 31 + 127) / 255) << 6 |
+                              ((src[2] * 31 + 127) / 255) << 1 | (src[3] >> 7);
+            }
+            *gl_format = GL_RGBA;
+            *gl_type = GL_UNSIGNED_SHORT_5_5_5_1;
+            return pack_buf;
+        case GFX_TEXFMT_RGBA4444:
+            for (int i = 0; i < count; i++, src += 4) {
+                pack_buf[i] = ((src[0] * 15 + 127) / 255) << 12 | ((src[1] * 15 + 127) / 255) << 8 |
+                              ((src[2] * 15 + 127) / 255) << 4 | ((src[3] * 15 + 127) / 255);
+            }
+            *gl_format = GL_RGBA;
+            *gl_type = GL_UNSIGNED_SHORT_4_4_4_4;
+            return pack_buf;
+        case GFX_TEXFMT_LA88:
+            for (int i = 0; i < count; i++, src += 4) {
+                pack_buf8[2*i + 0] = src[0];
+                pack_buf8[2*i + 1] = src[3];
+            }
+            *gl_format = GL_LUMINANCE_ALPHA;
+            *gl_type = GL_UNSIGNED_BYTE;
+            return pack_buf;
+        case GFX_TEXFMT_L8:
+            for (int i = 0; i < count; i++, src += 4) {
+                pack_buf8[i] = src[0];
+            }
+            *gl_format = GL_LUMINANCE;
+            *gl_type = GL_UNSIGNED_BYTE;
+            return pack_buf;
+        default:
+            *gl_format = GL_RGBA;
+            *gl_type = GL_UNSIGNED_BYTE;
+            return rgba32_buf;
+    }
+}
+
+static void gfx_opengl_upload_texture_format(const uint8_t *rgba32_buf, enum GfxTextureFormat format, int width, int height) {
+    GLenum gl_format, gl_type;
+    const void *buf = gfx_opengl_pack_texture(rgba32_buf, format, width * height, &gl_format, &gl_type);
+
+    ProfEmitEventStart("glTexImage2D");
+    glTexImage2D(GL_TEXTURE_2D, 0, gl_format, width, height, 0, gl_format, gl_type, buf);
+    ProfEmitEventEnd("glTexImage2D");
+}
+
 static uint32_t gfx_cm_to_opengl(uint32_t val) {
     if (val & G_TX_CLAMP) {
         return GL_CLAMP_TO_EDGE;
@@ -666,22 +1246,171 @@ static void gfx_opengl_set_use_alpha(bool use_alpha) {
     }
 }
 
+/**
+ * Appends data to the current buffer of a ring, which must be bound.
+ * @arg align: The data is placed on a multiple of it.
+ * @arg limit: Offset the data must end before, on top of the buffer size.
+ * @returns the offset the data was written at.
+ **/
+static uint32_t gfx_opengl_stream(struct StreamRing *ring, const void *data, uint32_t size, uint32_t align, uint32_t limit) {
+    struct RingBuffer *buf = ring->current;
+    uint32_t offset = (buf->offset + align - 1) / align * align;
+
+    if (size > buf->size) {
+        // Bigger than the whole ring, grow it
+        buf->size = size;
+        glBufferData(ring->target, buf->size, NULL, GL_STREAM_DRAW);
+        offset = 0;
+        ring->wraps++;
+    } else if (offset + size > buf->size || offset + size > limit) {
+        // Orphan the storage, the driver keeps the old one alive for pending draws
+        glBufferData(ring->target, buf->size, NULL, GL_STREAM_DRAW);
+        offset = 0;
+        ring->wraps++;
+    }
+
+    // Nothing before the write offset gets overwritten until the next
+    // orphan, so there's no need for the driver to synchronize.
+    void *ptr = NULL;
+    if (glMapBufferRangeEXT != NULL) {
+        ptr = glMapBufferRangeEXT(ring->target, offset, size,
+            GL_MAP_WRITE_BIT_EXT | GL_MAP_INVALIDATE_RANGE_BIT_EXT | GL_MAP_UNSYNCHRONIZED_BIT_EXT);
+    }
+    if (ptr != NULL) {
+        memcpy(ptr, data, size);
+        glUnmapBufferOES(ring->target);
+    } else {
+        glBufferSubData(ring->target, offset, size, data);
+    }
+
+    buf->offset = offset + size;
+    ring->bytes_streamed += size;
+    return offset;
+}
+
+static void gfx_opengl_init_ring(struct StreamRing *ring, GLenum target, uint32_t size) {
+    ring->target = target;
+    for (int i = 0; i < RING_COUNT; i++) {
+        struct RingBuffer *buf = &ring->buffers[i];
+        glGenBuffers(1, &buf->id);
+        glBindBuffer(target, buf->id);
+        buf->size = size;
+        glBufferData(target, buf->size, NULL, GL_STREAM_DRAW);
+    }
+    ring->current = &ring->buffers[0];
+}
+
+static void gfx_opengl_rotate_ring(struct StreamRing *ring) {
+    size_t next = (ring->current - ring->buffers + 1) % RING_COUNT;
+    ring->current = &ring->buffers[next];
+    glBindBuffer(ring->target, ring->current->id);
+}
+
 static void gfx_opengl_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
     //printf("flushing %d tris\n", buf_vbo_num_tris);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * buf_vbo_len, buf_vbo, GL_STREAM_DRAW);
-    glDrawArrays(GL_TRIANGLES, 0, 3 * buf_vbo_num_tris);
+    // Starting on a multiple of the stride lets the attribute pointers stay put
+    uint32_t stride = current_program->num_floats * sizeof(float);
+    uint32_t offset = gfx_opengl_stream(&vbo_ring, buf_vbo, sizeof(float) * buf_vbo_len, stride, UINT32_MAX);
+    glDrawArrays(GL_TRIANGLES, offset / stride, 3 * buf_vbo_num_tris);
+    draw_calls++;
+}
+
+#ifdef USE_INDEXED_DRAWING
+static void gfx_opengl_draw_indexed_triangles(float buf_vbo[], size_t buf_vbo_len, const uint16_t indices[], size_t buf_vbo_num_tris) {
+    static uint16_t *rebased;
+    static size_t rebased_size;
+
+    uint32_t stride = current_program->num_floats * sizeof(float);
+    uint32_t size = sizeof(float) * buf_vbo_len;
+    size_t num_indices = 3 * buf_vbo_num_tris;
+
+    // Indices are relative to the first vertex and have to stay within 16 bits
+    uint32_t offset = gfx_opengl_stream(&vbo_ring, buf_vbo, size, stride, 65536 * stride);
+    uint16_t first = offset / stride;
+    if (first != 0) {
+        if (rebased_size < num_indices) {
+            rebased_size = num_indices;
+            rebased = realloc(rebased, rebased_size * sizeof(uint16_t));
+            if (rebased == NULL)
+                abort();
+        }
+        for (size_t i = 0; i < num_indices; i++) {
+            rebased[i] = indices[i] + first;
+        }
+        indices = rebased;
+    }
+
+    // The element buffer binding belongs to the VAO
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_ring.current->id);
+    uint32_t index_offset = gfx_opengl_stream(&ibo_ring, indices, num_indices * sizeof(uint16_t), sizeof(uint16_t), UINT32_MAX);
+    glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_SHORT, (void *)(uintptr_t)index_offset);
+    draw_calls++;
+}
+#endif
+
+#ifdef USE_HW_TNL
+static void gfx_opengl_set_tnl_state(const struct GfxTnlState *state) {
+    if (state != NULL) {
+        tnl_state = *state;
+    } else {
+        // Pre-transformed vertices, pass them through
+        memset(&tnl_state, 0, sizeof(tnl_state));
+        for (int i = 0; i < 4; i++) {
+            tnl_state.mp_matrix[i][i] = 1.0f;
+        }
+    }
+    tnl_generation++;
+
+    switch (tnl_state.cull_mode) {
+        case GFX_CULL_NONE:
+            glDisable(GL_CULL_FACE);
+            break;
+        case GFX_CULL_FRONT:
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_FRONT);
+            break;
+        case GFX_CULL_BACK:
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_BACK);
+            break;
+        case GFX_CULL_BOTH:
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_FRONT_AND_BACK);
+            break;
+    }
+
+    if (current_program != NULL) {
+        gfx_opengl_set_uniforms(current_program);
+    }
+}
+#endif
+
+#ifdef USE_COLOR_UNIFORMS
+static void gfx_opengl_set_combiner_colors(const struct GfxCombinerColors *colors) {
+    combiner_colors = *colors;
+    color_generation++;
+    if (current_program != NULL) {
+        gfx_opengl_set_uniforms(current_program);
+    }
 }
+#endif
 
 static void gfx_opengl_init(void) {
 #if FOR_WINDOWS
     glewInit();
 #endif
+    // Drivers may hand out entry points for extensions they don't support,
+    // only look them up once the extension string lists them
 #ifdef USE_GLES2
-    glGenVertexArraysOES = SDL_GL_GetProcAddress("glGenVertexArraysOES");
-    glBindVertexArrayOES = SDL_GL_GetProcAddress("glBindVertexArrayOES");
+    if (SDL_GL_ExtensionSupported("GL_OES_vertex_array_object")) {
+        glGenVertexArraysOES = SDL_GL_GetProcAddress("glGenVertexArraysOES");
+        glBindVertexArrayOES = SDL_GL_GetProcAddress("glBindVertexArrayOES");
+    }
 #else
-    glGenVertexArraysOES = SDL_GL_GetProcAddress("glGenVertexArrays");
-    glBindVertexArrayOES = SDL_GL_GetProcAddress("glBindVertexArray");
+    if (SDL_GL_ExtensionSupported("GL_ARB_vertex_array_object")) {
+        glGenVertexArraysOES = SDL_GL_GetProcAddress("glGenVertexArrays");
+        glBindVertexArrayOES = SDL_GL_GetProcAddress("glBindVertexArray");
+    }
 #endif
     if (!glGenVertexArraysOES || !glBindVertexArrayOES) {
         printf("Missing GL_OES_vertex_array_object, falling back.\n");
@@ -689,21 +1418,87 @@ static void gfx_opengl_init(void) {
         has_vao_support = 1;
     }
 
-    glGenBuffers(1, &opengl_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
+#ifdef USE_GLES2
+    if (SDL_GL_ExtensionSupported("GL_EXT_map_buffer_range")) {
+        glMapBufferRangeEXT = SDL_GL_GetProcAddress("glMapBufferRangeEXT");
+        glUnmapBufferOES = SDL_GL_GetProcAddress("glUnmapBufferOES");
+    }
+    if (SDL_GL_ExtensionSupported("GL_OES_get_program_binary")) {
+        glGetProgramBinaryOES = SDL_GL_GetProcAddress("glGetProgramBinaryOES");
+        glProgramBinaryOES = SDL_GL_GetProcAddress("glProgramBinaryOES");
+    }
+    if (SDL_GL_ExtensionSupported("GL_EXT_disjoint_timer_query")) {
+        timer_query.gen_queries = SDL_GL_GetProcAddress("glGenQueriesEXT");
+        timer_query.begin_query = SDL_GL_GetProcAddress("glBeginQueryEXT");
+        timer_query.end_query = SDL_GL_GetProcAddress("glEndQueryEXT");
+        timer_query.get_query_uiv = SDL_GL_GetProcAddress("glGetQueryObjectuivEXT");
+        timer_query.get_query_ui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64vEXT");
+    }
+#else
+    if (SDL_GL_ExtensionSupported("GL_ARB_map_buffer_range")) {
+        glMapBufferRangeEXT = SDL_GL_GetProcAddress("glMapBufferRange");
+        glUnmapBufferOES = SDL_GL_GetProcAddress("glUnmapBuffer");
+    }
+    if (SDL_GL_ExtensionSupported("GL_ARB_get_program_binary")) {
+        glGetProgramBinaryOES = SDL_GL_GetProcAddress("glGetProgramBinary");
+        glProgramBinaryOES = SDL_GL_GetProcAddress("glProgramBinary");
+    }
+    if (SDL_GL_ExtensionSupported("GL_ARB_timer_query")) {
+        timer_query.gen_queries = SDL_GL_GetProcAddress("glGenQueries");
+        timer_query.begin_query = SDL_GL_GetProcAddress("glBeginQuery");
+        timer_query.end_query = SDL_GL_GetProcAddress("glEndQuery");
+        timer_query.get_query_uiv = SDL_GL_GetProcAddress("glGetQueryObjectuiv");
+        timer_query.get_query_ui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+    }
+#endif
+    if (!glMapBufferRangeEXT || !glUnmapBufferOES) {
+        printf("Missing GL_EXT_map_buffer_range, streaming vertices with glBufferSubData.\n");
+        glMapBufferRangeEXT = NULL;
+    }
+    if (!glGetProgramBinaryOES || !glProgramBinaryOES) {
+        printf("Missing GL_OES_get_program_binary, shaders won't be cached.\n");
+        glGetProgramBinaryOES = NULL;
+        glProgramBinaryOES = NULL;
+    } else {
+        gfx_opengl_program_cache_open();
+    }
+    if (!timer_query.gen_queries || !timer_query.begin_query || !timer_query.end_query ||
+        !timer_query.get_query_uiv || !timer_query.get_query_ui64v) {
+        printf("Missing GL_EXT_disjoint_timer_query, dynamic resolution stays at its maximum scale.\n");
+        timer_query.gen_queries = NULL;
+    }
+
+#ifdef USE_INDEXED_DRAWING
+    gfx_opengl_init_ring(&ibo_ring, GL_ELEMENT_ARRAY_BUFFER, IBO_RING_SIZE);
+#endif
+    gfx_opengl_init_ring(&vbo_ring, GL_ARRAY_BUFFER, VBO_RING_SIZE);
+    gfx_opengl_init_dynares_controller();
     
     glDepthFunc(GL_LEQUAL);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    // Packed luminance rows aren't necessarily 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+#ifdef USE_HW_TNL
+    gfx_opengl_set_tnl_state(NULL);
+#endif
 }
 
 static void gfx_opengl_on_resize(void) {
 }
 
 static void gfx_opengl_start_frame() {
-    dynares.h_scale = 0.5f;
-    dynares.v_scale = 0.5f;
+    gfx_opengl_rotate_ring(&vbo_ring);
+#ifdef USE_INDEXED_DRAWING
+    gfx_opengl_rotate_ring(&ibo_ring);
+#endif
+
+    dynares.h_scale = dynares_ctl.scale / 100.0f;
+    dynares.v_scale = dynares_ctl.scale / 100.0f;
+    dynares.active = dynares.status > 0 && dynares_ctl.scale < 100;
 
     gfx_opengl_bind_dynares(dynares.width, dynares.height);
+    gfx_opengl_begin_dynares_timing();
     glDisable(GL_SCISSOR_TEST);
     glDepthMask(GL_TRUE); // Must be set to clear Z-buffer
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -713,101 +1508,88 @@ static void gfx_opengl_start_frame() {
 
 static void gfx_opengl_end_frame(void) {
     ProfEmitEventStart("gfx_opengl_swap_dynares");
-    if (dynares.status > 0) {
+    if (dynares.active) {
         gfx_opengl_swap_dynares();
     }
 
     ProfEmitEventEnd("gfx_opengl_swap_dynares");
+
+    gfx_opengl_update_dynares();
+
+    ProfEmitCounter("vbo_stream_bytes", vbo_ring.bytes_streamed);
+    ProfEmitCounter("vbo_wraps", vbo_ring.wraps);
+    vbo_ring.bytes_streamed = vbo_ring.wraps = 0;
+#ifdef USE_INDEXED_DRAWING
+    ProfEmitCounter("ibo_stream_bytes", ibo_ring.bytes_streamed);
+    ProfEmitCounter("ibo_wraps", ibo_ring.wraps);
+    ibo_ring.bytes_streamed = ibo_ring.wraps = 0;
+#endif
+    ProfEmitCounter("shader_binary_loads", program_cache.loads);
+    program_cache.loads = 0;
+    ProfEmitCounter("draw_calls", draw_calls);
+    ProfEmitCounter("program_switches", program_switches);
+    draw_calls = program_switches = 0;
 }
 
 static void gfx_opengl_finish_render(void) {
 }
 
 #ifdef USE_TEXTURE_ATLAS
-static void gfx_opengl_bind_virtual_texture_page(void)
+static void gfx_opengl_bind_virtual_texture_page(int tile, int page)
+{
+    glActiveTexture(GL_TEXTURE0 + tile);
+    glBindTexture(GL_TEXTURE_2D, vt_pages[page]);
+    vt_page_bound[tile] = page;
+}
+
+// Uploads and moves go through the first texture unit, put its page back afterwards
+static void gfx_opengl_restore_virtual_texture_page(void)
 {
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, vt_page);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, vt_page);
+    glBindTexture(GL_TEXTURE_2D, vt_pages[vt_page_bound[0]]);
 }
 
-static void gfx_opengl_create_virtual_texture_page(uint16_t dimensions)
+static bool gfx_opengl_create_virtual_texture_page(int page, uint16_t dimensions, enum GfxTextureFormat format)
 {
-    glGenTextures(1, &vt_page);
+    GLenum gl_format, gl_type;
+    vt_page_format = format;
+    vt_page_dimensions = dimensions;
+    gfx_opengl_pack_texture(NULL, format, 0, &gl_format, &gl_type);
+
+    glGenTextures(1, &vt_pages[page]);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, vt_page);
+    glBindTexture(GL_TEXTURE_2D, vt_pages[page]);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, dimensions, dimensions, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-}
-
-static void mirror_horizontal(uint32_t *mirror_buf, uint32_t *rgba32_buf, int width, int height)
-{
-    uint32_t *src = &rgba32_buf[0];
-    uint32_t *dst_orig = &mirror_buf[0];
-    uint32_t *dst_mror = &mirror_buf[width*2 + 2];
-
-    for (int i = 0; i < height; i++) {
-        /* Fetch for left/right borders */
-        uint32_t fetch = *src;
-        
-        *dst_orig++ = fetch;
-        *dst_mror-- = fetch;
-
-        for (int j = 0; j < width; j++) {
-            // Fill inner buffers
-            fetch = *src++;
-            *dst_orig++ = fetch;
-            *dst_mror-- = fetch;
-        }
-        dst_orig +=  width + 1;      /* line pitch + border   */
-        dst_mror += (width + 1) * 3; /* same as above, but 3x */
-    }
-}
-
-static void mirror_vertical(uint32_t *mirror_buf, uint32_t *rgba32_buf, int width, int height)
-{
-    // Virtual Stride - or "stride with added borders"
-    uint32_t v_stride = width + 2;
-    uint32_t *src = &rgba32_buf[0];
-    uint32_t *dst = &mirror_buf[v_stride * (height * 2)];
+    glTexImage2D(GL_TEXTURE_2D, 0, gl_format, dimensions, dimensions, 0, gl_format, gl_type, NULL);
 
-    for (int i = 0; i < height; i++) {
-        uint32_t fetch;
-        *dst-- = *src;
-        for (int j = 0; j < width; j++) {
-            fetch = *src++;
-            *dst-- = fetch;
-        }
-        *dst-- = fetch;
+    // Texels can only be copied around if the page can be attached to a framebuffer
+    GLint prev_fbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+    if (vt_page_fbo == 0) {
+        glGenFramebuffers(1, &vt_page_fbo);
     }
-}
-
-static void mirror_both(uint32_t *mirror_buf, uint32_t *rgba32_buf, int width, int height)
-{
-    // Usual horizontal mirroring
-    mirror_horizontal(mirror_buf, rgba32_buf, width, height);
-
-    // Virtual Stride - or "stride with added borders"
-    uint32_t v_stride = width*2 + 2;
-    uint32_t *src = &mirror_buf[0];
-    uint32_t *dst = &mirror_buf[v_stride * (height * 2)];
+    glBindFramebuffer(GL_FRAMEBUFFER, vt_page_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, vt_pages[page], 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+    gfx_opengl_restore_virtual_texture_page();
 
-    // Border-less vertical mirroring
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < v_stride; j++) {
-            *dst-- = *src++;
-        }
+    vt_page_movable[page] = status == GL_FRAMEBUFFER_COMPLETE;
+    if (!vt_page_movable[page]) {
+        printf("Texture page %d can't be a framebuffer (0x%04x), it won't be compacted\n", page, status);
     }
+    return vt_page_movable[page];
 }
 
-static void only_borders(uint32_t *mirror_buf, uint32_t *rgba32_buf, int width, int height)
+// Copies the texels with a one texel border around them, repeating the edges,
+// so filtering right at the edge of a virtual texture stays inside it.
+static void add_borders(uint32_t *border_buf, const uint32_t *rgba32_buf, int width, int height)
 {
-    uint32_t *src = &rgba32_buf[0];
-    uint32_t *dst = &mirror_buf[0];
+    const uint32_t *src = &rgba32_buf[0];
+    uint32_t *dst = &border_buf[width + 2];
 
     for (int i = 0; i < height; i++) {
         *dst++ = *src;
@@ -816,42 +1598,81 @@ static void only_borders(uint32_t *mirror_buf, uint32_t *rgba32_buf, int width,
         }
         *dst++ = *(src-1);
     }
+
+    // Create the top and bottom borders, respectively.
+    memcpy(border_buf, border_buf + width + 2, (width + 2) * sizeof(uint32_t));
+    memcpy(dst, dst - (width + 2), (width + 2) * sizeof(uint32_t));
 }
 
-static void gfx_opengl_upload_virtual_texture(const uint8_t *rgba32_buf, int x, 
-    int y, int width, int height, int h_mirror, int v_mirror)
+static void gfx_opengl_upload_virtual_texture(int page, const uint8_t *rgba32_buf, int x, int y, int width, int height)
 {
     ProfEmitEventStart("gfx_opengl_upload_virtual_texture");
-    int has_mirrors = h_mirror || v_mirror;
-
-    // Full size for mirror + 3x borders
-    uint32_t mirror_buf[4096 * 4 + ((63-1) * 4)];
-
-    int v_stride = 2 + ((!h_mirror) ? width  : width  * 2);
-    int v_height = 2 + ((!v_mirror) ? height : height * 2);
-    uint32_t *mirror_buf_head = mirror_buf + v_height * v_stride; 
 
-    if (h_mirror && v_mirror) mirror_both(&mirror_buf[v_stride], rgba32_buf, width, height);
-    else if (h_mirror)  mirror_horizontal(&mirror_buf[v_stride], rgba32_buf, width, height);
-    else if (v_mirror)    mirror_vertical(&mirror_buf[v_stride], rgba32_buf, width, height);
-    else                     only_borders(&mirror_buf[v_stride], rgba32_buf, width, height);
+    // Mirroring is done by the fragment shader, only the borders are added here
+    uint32_t border_buf[4096 * 4 + ((63-1) * 4)]; // any texture TMEM holds, borders included
+    int v_stride = width + 2;
+    int v_height = height + 2;
+    add_borders(border_buf, (const uint32_t *)rgba32_buf, width, height);
 
-    // Create the top and bottom mirrors, respectively.
-    memcpy(mirror_buf, mirror_buf + v_stride, v_stride * sizeof(uint32_t));
-    memcpy(mirror_buf_head - v_stride, mirror_buf_head - v_stride*2, v_stride * sizeof(uint32_t));
+    GLenum gl_format, gl_type;
+    const void *buf = gfx_opengl_pack_texture((const uint8_t *)border_buf, vt_page_format, v_stride * v_height, &gl_format, &gl_type);
 
     // Upload texture page
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, vt_page);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, x - 1, y - 1, v_stride, v_height, GL_RGBA, GL_UNSIGNED_BYTE, mirror_buf);
+    glBindTexture(GL_TEXTURE_2D, vt_pages[page]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x - 1, y - 1, v_stride, v_height, gl_format, gl_type, buf);
+    if (vt_page_bound[0] != page) {
+        gfx_opengl_restore_virtual_texture_page();
+    }
 
     ProfEmitEventEnd("gfx_opengl_upload_virtual_texture");
 }
+
+static void gfx_opengl_move_virtual_textures(int page, const struct GfxTextureMove *moves, int count)
+{
+    if (!vt_page_movable[page])
+        return;
+
+    ProfEmitEventStart("gfx_opengl_move_virtual_textures");
+    GLint prev_fbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+
+    // Copy the whole page aside first, a texture's new spot can overlap
+    // another one's old spot
+    GLenum gl_format, gl_type;
+    gfx_opengl_pack_texture(NULL, vt_page_format, 0, &gl_format, &gl_type);
+
+    GLuint snapshot;
+    glGenTextures(1, &snapshot);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, snapshot);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, gl_format, vt_page_dimensions, vt_page_dimensions, 0, gl_format, gl_type, NULL);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, vt_page_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, vt_pages[page], 0);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, vt_page_dimensions, vt_page_dimensions);
+
+    // Then read from the copy into the page
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, snapshot, 0);
+    glBindTexture(GL_TEXTURE_2D, vt_pages[page]);
+    for (int i = 0; i < count; i++) {
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, moves[i].dst_x, moves[i].dst_y,
+                            moves[i].src_x, moves[i].src_y, moves[i].width, moves[i].height);
+    }
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, vt_pages[page], 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+    glDeleteTextures(1, &snapshot);
+    gfx_opengl_restore_virtual_texture_page();
+    ProfEmitEventEnd("gfx_opengl_move_virtual_textures");
+}
 #endif
 
 void gfx_opengl_bind_dynares(uint32_t width, uint32_t height)
 {
-    if (dynares.status <= 0)
+    if (!dynares.active)
         return;
 
     glBindFramebuffer(GL_FRAMEBUFFER, dynares.fbo);
@@ -860,7 +1681,7 @@ void gfx_opengl_bind_dynares(uint32_t width, uint32_t height)
 
 void gfx_opengl_swap_dynares()
 {
-    if (dynares.status <= 0)
+    if (!dynares.active)
         return;
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -872,6 +1693,7 @@ void gfx_opengl_swap_dynares()
     if (has_vao_support) {
         glBindVertexArrayOES(dynares.vao);
     } else {
+        glBindBuffer(GL_ARRAY_BUFFER, dynares.vbo);
         glEnableVertexAttribArray(dynares.aCoord);
         glVertexAttribPointer(dynares.aCoord, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
     }
@@ -887,13 +1709,6 @@ void gfx_opengl_swap_dynares()
     glUniform1i(dynares.uFBOTex, 0);
 
     // Dispatch drawcall
-    GLfloat vert[] = {
-        -1.0f, -1.0f,
-        -1.0f,  1.0f,
-         1.0f, -1.0f,
-         1.0f,  1.0f
-    };
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vert), vert, GL_STREAM_DRAW);    
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
     // Undo VA
@@ -901,6 +1716,7 @@ void gfx_opengl_swap_dynares()
         glBindVertexArrayOES(0);
     } else {
         glDisableVertexAttribArray(dynares.aCoord);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_ring.current->id);
     }
 }
 
@@ -915,6 +1731,17 @@ int gfx_opengl_init_dynares_program(void)
     dynares.uScale = glGetUniformLocation(dynares.program, "uScale");
     dynares.uFBOTex = glGetUniformLocation(dynares.program, "uFBOTex");
 
+    // The quad never changes, keep it out of the streaming buffers
+    GLfloat vert[] = {
+        -1.0f, -1.0f,
+        -1.0f,  1.0f,
+         1.0f, -1.0f,
+         1.0f,  1.0f
+    };
+    glGenBuffers(1, &dynares.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, dynares.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vert), vert, GL_STATIC_DRAW);
+
     // Prepare the vertex array object
     if (has_vao_support) {
         glGenVertexArraysOES(1, &dynares.vao);
@@ -923,13 +1750,13 @@ int gfx_opengl_init_dynares_program(void)
         glVertexAttribPointer(dynares.aCoord, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
         glBindVertexArrayOES(0);
     }
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_ring.current->id);
 }
 
 void gfx_opengl_init_dynares(uint32_t width, uint32_t height)
 {
-    // TODO:: REMOVE THIS
-    // DYNAMIC RES IS A HACK UNTIL FURTHER DISCUSSION AND TESTS
-    if (width <= 320)
+    // Always rendering at full scale, don't pay for the extra blit
+    if ((dynares_ctl.budget_us != 0 ? dynares_ctl.min_scale : dynares_ctl.max_scale) >= 100)
         return;
 
     // Failed for some reason, don't retry
@@ -946,6 +1773,9 @@ void gfx_opengl_init_dynares(uint32_t width, uint32_t height)
         glGenFramebuffers(1, &dynares.fbo);
         glGenTextures(1, &dynares.fbo_tex);
         glGenRenderbuffers(1, &dynares.fbo_depth);
+        if (timer_query.gen_queries != NULL) {
+            timer_query.gen_queries(DYNARES_QUERIES, dynares_ctl.queries);
+        }
 
         dynares.h_scale = 1.0;
         dynares.v_scale = 1.0;
@@ -985,8 +1815,143 @@ void gfx_opengl_init_dynares(uint32_t width, uint32_t height)
     dynares.status = 1;
 }
 
+static uint64_t gfx_opengl_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+void gfx_opengl_init_dynares_controller(void)
+{
+    dynares_ctl.max_scale = configDynaresMaxScale;
+    if (dynares_ctl.max_scale > 100)
+        dynares_ctl.max_scale = 100;
+    if (dynares_ctl.max_scale < DYNARES_STEP)
+        dynares_ctl.max_scale = DYNARES_STEP;
+
+    dynares_ctl.min_scale = configDynaresMinScale;
+    if (dynares_ctl.min_scale > dynares_ctl.max_scale)
+        dynares_ctl.min_scale = dynares_ctl.max_scale;
+    if (dynares_ctl.min_scale < DYNARES_STEP)
+        dynares_ctl.min_scale = DYNARES_STEP;
+
+    // Timing the GPU without timer queries means a glFinish every frame, which costs more than it saves
+    dynares_ctl.budget_us = timer_query.gen_queries != NULL ? configDynaresBudget : 0;
+    dynares_ctl.scale = dynares_ctl.max_scale;
+}
+
+void gfx_opengl_begin_dynares_timing(void)
+{
+    if (dynares.status <= 0 || dynares_ctl.budget_us == 0)
+        return;
+
+    GLuint query = dynares_ctl.queries[dynares_ctl.query_frame % DYNARES_QUERIES];
+    timer_query.begin_query(GL_TIME_ELAPSED_EXT, query);
+}
+
+// Measures the frame that was just submitted, returns false if there's no GPU time for it yet
+static bool gfx_opengl_measure_dynares(void)
+{
+    uint64_t now = gfx_opengl_time_us();
+    dynares_ctl.cpu_us = now - dynares_ctl.cpu_start;
+
+    timer_query.end_query(GL_TIME_ELAPSED_EXT);
+    dynares_ctl.query_frame++;
+    if (dynares_ctl.query_frame < DYNARES_QUERIES)
+        return false;
+
+    // The oldest query, issued DYNARES_QUERIES - 1 frames ago
+    GLuint query = dynares_ctl.queries[dynares_ctl.query_frame % DYNARES_QUERIES];
+    GLuint available = 0;
+    timer_query.get_query_uiv(query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+    if (!available)
+        return false;
+
+    uint64_t elapsed_ns = 0;
+    timer_query.get_query_ui64v(query, GL_QUERY_RESULT_EXT, &elapsed_ns);
+#ifdef USE_GLES2
+    // The GPU changed clocks or was preempted, the result is meaningless
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    if (disjoint)
+        return false;
+#endif
+    dynares_ctl.gpu_us = elapsed_ns / 1000;
+    return true;
+}
+
+static void gfx_opengl_set_dynares_scale(uint32_t scale)
+{
+    if (scale < dynares_ctl.min_scale)
+        scale = dynares_ctl.min_scale;
+    if (scale > dynares_ctl.max_scale)
+        scale = dynares_ctl.max_scale;
+    if (scale == dynares_ctl.scale)
+        return;
+
+    dynares_ctl.scale = scale;
+    dynares_ctl.gpu_avg_us = 0.0f;
+    dynares_ctl.over_frames = dynares_ctl.under_frames = 0;
+    // Queries still in flight were rendered at the old scale
+    dynares_ctl.settle_frames = DYNARES_QUERIES - 1;
+}
+
+void gfx_opengl_update_dynares(void)
+{
+    if (dynares.status <= 0 || dynares_ctl.budget_us == 0 || !gfx_opengl_measure_dynares())
+        return;
+
+    ProfEmitCounter("dynares_scale", dynares_ctl.scale);
+    ProfEmitCounter("dynares_gpu_us", dynares_ctl.gpu_us);
+    ProfEmitCounter("dynares_cpu_us", dynares_ctl.cpu_us);
+
+    if (dynares_ctl.settle_frames > 0) {
+        dynares_ctl.settle_frames--;
+        return;
+    }
+
+    if (dynares_ctl.gpu_avg_us == 0.0f) {
+        dynares_ctl.gpu_avg_us = dynares_ctl.gpu_us;
+    } else {
+        dynares_ctl.gpu_avg_us += (dynares_ctl.gpu_us - dynares_ctl.gpu_avg_us) * 0.125f;
+    }
+
+    // Rendering fewer pixels doesn't help when the game logic is what's late
+    bool cpu_bound = dynares_ctl.cpu_us > dynares_ctl.budget_us && dynares_ctl.cpu_us >= dynares_ctl.gpu_us;
+
+    if (dynares_ctl.gpu_us > dynares_ctl.budget_us && !cpu_bound) {
+        dynares_ctl.under_frames = 0;
+        if (++dynares_ctl.over_frames >= DYNARES_DOWN_FRAMES) {
+            // The cost is roughly proportional to the pixel count, aim a tenth below the budget
+            float fit = sqrtf(dynares_ctl.budget_us * 0.9f / dynares_ctl.gpu_avg_us);
+            uint32_t scale = (uint32_t)(dynares_ctl.scale * fit) / DYNARES_STEP * DYNARES_STEP;
+            if (scale > dynares_ctl.scale - DYNARES_STEP)
+                scale = dynares_ctl.scale - DYNARES_STEP;
+            gfx_opengl_set_dynares_scale(scale);
+        }
+        return;
+    }
+
+    dynares_ctl.over_frames = 0;
+    if (dynares_ctl.scale >= dynares_ctl.max_scale)
+        return;
+
+    // Only step up once the larger scale would leave some headroom too
+    float next = (float)(dynares_ctl.scale + DYNARES_STEP) / dynares_ctl.scale;
+    if (dynares_ctl.gpu_avg_us * next * next < dynares_ctl.budget_us * 0.85f &&
+        dynares_ctl.cpu_us < dynares_ctl.budget_us) {
+        if (++dynares_ctl.under_frames >= DYNARES_UP_FRAMES) {
+            gfx_opengl_set_dynares_scale(dynares_ctl.scale + DYNARES_STEP);
+        }
+    } else {
+        dynares_ctl.under_frames = 0;
+    }
+}
+
 static void gfx_opengl_signal_start(uint32_t width, uint32_t height)
 {
+    dynares_ctl.cpu_start = gfx_opengl_time_us();
     gfx_opengl_init_dynares(width, height);
 }
 
@@ -1017,8 +1982,19 @@ struct GfxRenderingAPI gfx_opengl_api = {
     gfx_opengl_bind_virtual_texture_page,
     gfx_opengl_create_virtual_texture_page,
     gfx_opengl_upload_virtual_texture,
+    gfx_opengl_move_virtual_textures,
 #endif
     gfx_opengl_signal_start,
+#ifdef USE_HW_TNL
+    gfx_opengl_set_tnl_state,
+#endif
+    gfx_opengl_upload_texture_format,
+#ifdef USE_INDEXED_DRAWING
+    gfx_opengl_draw_indexed_triangles,
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    gfx_opengl_set_combiner_colors,
+#endif
 };
 
 #endif
@@ -23,5 +23,8 @@ static char *gfx_dynares_fshader =
 void gfx_opengl_bind_dynares(uint32_t width, uint32_t height);
 void gfx_opengl_swap_dynares();
 void gfx_opengl_init_dynares(uint32_t width, uint32_t height);
+void gfx_opengl_init_dynares_controller(void);
+void gfx_opengl_begin_dynares_timing(void);
+void gfx_opengl_update_dynares(void);
 
 #endif /* __GFX_OPENGL_DYNARES_H__ */
\ No newline at end of file
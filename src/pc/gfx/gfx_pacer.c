@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "gfx_pacer.h"
+#include "../cheapProfiler.h"
+#include "../configfile.h"
+
+#define NS_IN_S 1000000000ll
+#define NS_IN_US 1000ll
+
+// Swaps to fill the driver's queue before timing them, then the timed ones
+#define PACER_WARMUP_SWAPS 4
+#define PACER_CALIBRATION_SWAPS 16
+// How much earlier than the deadline to stop sleeping and start spinning
+#define PACER_MIN_SLACK (100 * NS_IN_US)
+#define PACER_MAX_SLACK (2000 * NS_IN_US)
+#define PACER_INITIAL_SLACK (1000 * NS_IN_US)
+#ifdef TARGET_OD
+// One core, spinning would only take time away from the game thread
+#define PACER_SPIN 0
+#else
+#define PACER_SPIN 1
+#endif
+// Frame intervals kept for the percentiles, ten seconds at 30 fps
+#define PACER_SAMPLES 300
+
+static struct {
+    int64_t refresh; // one refresh of the display
+    int64_t period; // one game frame, a whole number of refreshes when possible
+    bool vsync; // swaps block until vblank
+    int swap_interval; // refreshes every swap waits for, the timer isn't needed when set
+    int64_t deadline; // when the next frame should be presented
+    int64_t last_present;
+    int64_t slack; // how late clock_nanosleep tends to wake up, plus some margin
+
+    uint32_t samples[PACER_SAMPLES]; // microseconds between presents
+    uint32_t num_samples;
+} pacer;
+
+static int64_t gfx_pacer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_IN_S + ts.tv_nsec;
+}
+
+static int gfx_pacer_compare(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int gfx_pacer_compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times a few swaps after filling the driver's queue, sorted shortest first.
+static void gfx_pacer_time_swaps(void (*swap)(void), int64_t *intervals) {
+    for (int i = 0; i < PACER_WARMUP_SWAPS; i++) {
+        swap();
+    }
+    int64_t prev = gfx_pacer_now();
+    for (int i = 0; i < PACER_CALIBRATION_SWAPS; i++) {
+        swap();
+        int64_t now = gfx_pacer_now();
+        intervals[i] = now - prev;
+        prev = now;
+    }
+    qsort(intervals, PACER_CALIBRATION_SWAPS, sizeof(intervals[0]), gfx_pacer_compare);
+}
+
+void gfx_pacer_init(void (*swap)(void), int (*set_swap_interval)(int), int refresh_rate, int frame_rate) {
+    int64_t target = NS_IN_S / frame_rate;
+    int64_t intervals[PACER_CALIBRATION_SWAPS];
+
+    pacer.refresh = refresh_rate > 0 ? NS_IN_S / refresh_rate : NS_IN_S / 60;
+    pacer.slack = PACER_INITIAL_SLACK;
+    pacer.vsync = false;
+    pacer.swap_interval = 0;
+
+    if (swap != NULL) {
+        gfx_pacer_time_swaps(swap, intervals);
+
+        // Swaps that wait for vblank take about a refresh, anything from 20 to 250 Hz
+        // when the display didn't say, or within a tenth of what it said
+        int64_t median = intervals[PACER_CALIBRATION_SWAPS / 2];
+        bool plausible = median > NS_IN_S / 250 && median < NS_IN_S / 20;
+        if (plausible && (refresh_rate <= 0 || llabs(median - pacer.refresh) < pacer.refresh / 10)) {
+            // Average the middle half, the reported rate is rounded (59.94 Hz shows up as 60)
+            int64_t sum = 0;
+            for (int i = PACER_CALIBRATION_SWAPS / 4; i < PACER_CALIBRATION_SWAPS * 3 / 4; i++) {
+                sum += intervals[i];
+            }
+            pacer.refresh = sum / (PACER_CALIBRATION_SWAPS / 2);
+            pacer.vsync = true;
+        }
+    }
+
+    int64_t refreshes = (target + pacer.refresh / 2) / pacer.refresh;
+    if (refreshes < 1) {
+        refreshes = 1;
+    }
+    if (llabs(refreshes * pacer.refresh - target) <= target / 20) {
+        pacer.period = refreshes * pacer.refresh;
+    } else {
+        // Not a multiple of the game's frame rate, some judder can't be avoided
+        pacer.period = target;
+        pacer.vsync = false;
+        refreshes = 0;
+    }
+
+    // Have the driver hold every frame for its refreshes, counted from the vblank
+    // the previous one was shown on. Only if the swaps then really take that long.
+    if (pacer.vsync && set_swap_interval != NULL) {
+        if (refreshes == 1 || set_swap_interval(refreshes) == 0) {
+            if (refreshes > 1) {
+                gfx_pacer_time_swaps(swap, intervals);
+            }
+            if (refreshes == 1 || llabs(intervals[PACER_CALIBRATION_SWAPS / 2] - pacer.period) < pacer.refresh / 4) {
+                pacer.swap_interval = refreshes;
+            } else {
+                set_swap_interval(1);
+            }
+        }
+    }
+
+    printf("Frame pacer: %.2f Hz display, %s, %.2f ms frames", (double)NS_IN_S / pacer.refresh,
+           pacer.swap_interval != 0 ? "swap interval" : pacer.vsync ? "vsync and timer" : "timer only", pacer.period / 1e6);
+    if (refreshes > 0) {
+        printf(" (%d refreshes each)", (int)refreshes);
+    }
+    printf("\n");
+
+    pacer.deadline = 0;
+    pacer.last_present = 0;
+    pacer.num_samples = 0;
+}
+
+void gfx_pacer_wait(void) {
+    if (pacer.swap_interval != 0) {
+        return;
+    }
+    int64_t now = gfx_pacer_now();
+    if (pacer.deadline == 0 || now >= pacer.deadline) {
+        // Too far behind to catch up without a burst of short frames, start over from now
+        if (now - pacer.deadline > pacer.period) {
+            pacer.deadline = now;
+        }
+        return;
+    }
+
+    // The kernel may wake us up late, sleep until a bit before the deadline and spin for the rest
+    int64_t wake = PACER_SPIN ? pacer.deadline - pacer.slack : pacer.deadline;
+    if (wake > now) {
+        struct timespec ts = { wake / NS_IN_S, wake % NS_IN_S };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+        if (!PACER_SPIN) {
+            return;
+        }
+        now = gfx_pacer_now();
+
+        // Follow the wake up latency quickly when it grows and slowly when it shrinks
+        int64_t slack = now - wake + PACER_MIN_SLACK;
+        if (slack > pacer.slack) {
+            pacer.slack = slack;
+        } else {
+            pacer.slack += (slack - pacer.slack) / 16;
+        }
+        if (pacer.slack < PACER_MIN_SLACK) {
+            pacer.slack = PACER_MIN_SLACK;
+        } else if (pacer.slack > PACER_MAX_SLACK) {
+            pacer.slack = PACER_MAX_SLACK;
+        }
+    }
+
+    while (now < pacer.deadline) {
+        now = gfx_pacer_now();
+    }
+}
+
+static void gfx_pacer_print_stats(void) {
+    uint32_t sorted[PACER_SAMPLES];
+    uint32_t late = 0;
+    for (uint32_t i = 0; i < PACER_SAMPLES; i++) {
+        sorted[i] = pacer.samples[i];
+        // Shown for at least one refresh longer than it should have been
+        if (sorted[i] * NS_IN_US >= pacer.period + pacer.refresh / 2) {
+            late++;
+        }
+    }
+    qsort(sorted, PACER_SAMPLES, sizeof(sorted[0]), gfx_pacer_compare_samples);
+
+    printf("Frame times: 50%% %.2f ms, 90%% %.2f ms, 99%% %.2f ms, worst %.2f ms, %u of %u late\n",
+           sorted[PACER_SAMPLES / 2] / 1000.0, sorted[PACER_SAMPLES * 90 / 100] / 1000.0,
+           sorted[PACER_SAMPLES * 99 / 100] / 1000.0, sorted[PACER_SAMPLES - 1] / 1000.0, late, PACER_SAMPLES);
+}
+
+void gfx_pacer_presented(void) {
+    int64_t now = gfx_pacer_now();
+
+    if (pacer.last_present != 0) {
+        uint32_t interval = (now - pacer.last_present) / NS_IN_US;
+        ProfEmitCounter("frame_interval_us", interval);
+        pacer.samples[pacer.num_samples++] = interval;
+        if (pacer.num_samples == PACER_SAMPLES) {
+            if (configFrameStats) {
+                gfx_pacer_print_stats();
+            }
+            pacer.num_samples = 0;
+        }
+    }
+    pacer.last_present = now;
+
+    if (pacer.deadline == 0) {
+        // With vsync the swap returned at vblank, aim half a refresh before the one
+        // the next frame is due on so a little lateness doesn't cost a whole refresh
+        pacer.deadline = now + pacer.period - (pacer.vsync ? pacer.refresh / 2 : 0);
+    } else {
+        // Absolute schedule, so neither rounding errors nor drivers that return
+        // from swaps early accumulate into drift
+        pacer.deadline += pacer.period;
+    }
+}
+
+bool gfx_pacer_has_vsync(void) {
+    return pacer.vsync;
+}
@@ -0,0 +1,39 @@
+#ifndef __GFX_PACER_H__
+#define __GFX_PACER_H__
+
+#include <stdbool.h>
+
+/**
+ * Finds out how long a refresh of the display takes, and whether buffer swaps
+ * wait for vblank, by timing a few swaps. Frames are then paced to a whole
+ * number of refreshes, so 30 fps on a 60 Hz panel shows every frame for
+ * exactly two refreshes. With vsync that's left to the swap interval, a timer
+ * only paces frames when the driver doesn't honour it.
+ * @arg swap: Presents a frame, called about twenty times, forty when the swap
+ * interval is checked. NULL skips the calibration and assumes swaps don't wait.
+ * @arg set_swap_interval: Makes swaps wait for that many refreshes, returns 0
+ * on success. Expected to be 1 on entry, NULL leaves pacing to the timer.
+ * @arg refresh_rate: Refresh rate the display reports, 0 if unknown.
+ * @arg frame_rate: Frames per second the game runs at.
+ **/
+extern void gfx_pacer_init(void (*swap)(void), int (*set_swap_interval)(int), int refresh_rate, int frame_rate);
+
+/**
+ * Sleeps, then spins for the last stretch, until the next frame should be
+ * presented. Returns right away when the frame is already late, or when the
+ * swap interval does the waiting.
+ **/
+extern void gfx_pacer_wait(void);
+
+/**
+ * Call right after presenting a frame. Schedules the next one and records
+ * the time since the previous one, printed as percentiles with frame_stats.
+ **/
+extern void gfx_pacer_presented(void);
+
+/**
+ * @returns whether swaps were found to wait for vblank.
+ **/
+extern bool gfx_pacer_has_vsync(void);
+
+#endif /* __GFX_PACER_H__ */
@@ -5,6 +5,14 @@
 #include <stdbool.h>
 #include <assert.h>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #ifndef _LANGUAGE_C
 #define _LANGUAGE_C
 #endif
@@ -17,15 +25,28 @@
 #include "gfx_screen_config.h"
 
 #include "../cheapProfiler.h"
+#include "../configfile.h"
+#include "texture_disk_cache.h"
+#include "gfx_cmdqueue.h"
+#include "gfx_trace.h"
+#include "../fsutils.h"
 #ifdef USE_TEXTURE_ATLAS
 #include "texture_atlas.h"
 Atlas *atlas = NULL;
 
+// Written in builds with USE_TEXTURE_ATLAS when atlas_trace is set, replayed by tools/atlas_bench
+#define ATLAS_TRACE_FILE "atlas_trace.txt"
+
+// Range of atlas_page_size, coordinates past 2047 don't fit in encFloat_t
+#define ATLAS_MIN_PAGE_SIZE 256
+#define ATLAS_MAX_PAGE_SIZE 2048
+
 //  A single float is encoded as:
 //   * S.EEEEEEEE.XMMMMMMMMMMMMMMMMMMMMMM
 //   * S: 1, Sign bit, usable, but left unused.
 //   * E: 8, Exponent bits, only 6 bits are actually usable to encode data
-//           255 and 0 gives NaNs and INFs, not good.
+//           255 and 0 gives NaNs and INFs, not good. Two of them hold the
+//           wrap mode and two more the atlas page.
 //   * M: 23, Mantissa bits, using the last mantissa bit causes a discontinuity
 //            when (1<<22) is set, so left unused for now.
 //            Otherwise, all other 22 bits are usable.
@@ -47,7 +68,8 @@ typedef union {
         unsigned int padding0: 1;
         unsigned int always_one: 1;
         unsigned int cms: 2;
-        unsigned int padding1: 6;
+        unsigned int page: 2;
+        unsigned int padding1: 4;
     } sampler_0;
     struct {
         unsigned int v: 11;
@@ -55,7 +77,8 @@ typedef union {
         unsigned int padding0: 1;
         unsigned int always_one: 1;
         unsigned int cmt: 2;
-        unsigned int padding1: 6;
+        unsigned int page: 2;
+        unsigned int padding1: 4;
     } sampler_1;
 } encFloat_t;
 #endif
@@ -78,8 +101,25 @@ typedef union {
 #define RATIO_X (gfx_current_dimensions.width / (2.0f * HALF_SCREEN_WIDTH))
 #define RATIO_Y (gfx_current_dimensions.height / (2.0f * HALF_SCREEN_HEIGHT))
 
-#define MAX_BUFFERED 2048
+#define MAX_BUFFERED GFX_MAX_BUFFERED_TRIS
 #define MAX_LIGHTS 2
+
+#define TEXTURE_CACHE_HASH_SIZE 1024
+#define TEXTURE_CACHE_MIN_SIZE 16
+
+// Combiners whose shaders were first compiled during play are written here
+// and built up front on the next run, on top of the fixed list in gfx_init.
+#define SHADER_WARMUP_FILE "shader_warmup.txt"
+
+#ifdef USE_HW_TNL
+#define TNL_SNAPSHOTS 8
+#define TNL_NONE 0
+
+#ifdef USE_DL_CACHE
+// The vertex shaders already do the work the cache saves
+#undef USE_DL_CACHE
+#endif
+#endif
 #define MAX_VERTICES 64
 
 struct RGBA {
@@ -95,10 +135,16 @@ struct LoadedVertex {
     float u, v;
     struct RGBA color;
     uint8_t clip_rej;
+#ifdef USE_HW_TNL
+    uint8_t tnl; // snapshot the raw data below belongs to, TNL_NONE once transformed
+    float ob[3];
+    float n[3];
+#endif
 };
 
 struct TextureHashmapNode {
     struct TextureHashmapNode *next;
+    struct TextureHashmapNode *lru_prev, *lru_next;
     
     const uint8_t *texture_addr;
     uint8_t fmt, siz;
@@ -111,17 +157,45 @@ struct TextureHashmapNode {
     encFloat_t enc_sampler_params[2];
 #endif
     bool linear_filter;
+    
+    // Content deduplication, see gfx_texture_cache_dedup
+    struct TextureHashmapNode *content_next;
+    struct TextureHashmapNode *shared; // node whose texture this one uses, NULL if it has its own
+    uint32_t spare_texture_id; // own texture, unused while shared
+    uint16_t share_count; // number of nodes using this one's texture
+    bool hashed;
+    uint32_t content_hash[2];
+    uint32_t content_check; // second hash of the same bytes, see gfx_texture_check_hash
+    uint32_t size_bytes, line_size_bytes;
 };
 static struct {
-    struct TextureHashmapNode *hashmap[1024];
-    struct TextureHashmapNode pool[512];
-    uint32_t pool_pos;
+    struct TextureHashmapNode *hashmap[TEXTURE_CACHE_HASH_SIZE];
+    struct TextureHashmapNode *pool;
+    uint32_t pool_pos, pool_size;
+    struct TextureHashmapNode *free_list;
+    struct TextureHashmapNode *lru_head, *lru_tail; // most and least recently used
+    struct TextureHashmapNode *content_hashmap[TEXTURE_CACHE_HASH_SIZE];
+    uint32_t hits, misses, evictions, dedups, disk_hits, compactions;
+#ifdef USE_TEXTURE_ATLAS
+    uint32_t page_binds;
+    bool movable; // the backend can move texels around the atlas pages
+#endif
+    bool disk_cache; // texture_disk_cache opened successfully
+    bool disk_store; // import_texture_finish should write the decoded texels back
 } gfx_texture_cache;
 
 struct ColorCombiner {
     uint32_t cc_id;
     struct ShaderProgram *prg;
     uint8_t shader_input_mapping[2][4];
+#ifdef USE_HW_TNL
+    uint8_t lit_input;
+#endif
+#ifdef USE_UBER_SHADER
+    bool uber; // prg is the uber program, uber_params go with every vertex
+    bool used_textures[2];
+    uint16_t uber_params[3]; // color selectors, alpha selectors, options
+#endif
 };
 
 static struct ColorCombiner color_combiner_pool[64];
@@ -195,25 +269,109 @@ static struct RenderingState {
     struct XYWidthHeight viewport, scissor;
     struct ShaderProgram *shader_program;
     struct TextureHashmapNode *textures[2];
+#ifdef USE_TEXTURE_ATLAS
+    int8_t atlas_pages[2]; // page bound to each texture unit
+#endif
+#ifdef USE_HW_TNL
+    uint32_t tnl_id;
+    uint8_t cull_mode;
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    struct RGBA prim_color, env_color, fog_color; // last ones set_combiner_colors got
+#endif
 } rendering_state;
 
+#ifdef USE_COLOR_UNIFORMS
+// Primitive, environment and fog colours go to the backend as uniforms, so
+// only shade colours and fog factors are left in the vertices.
+static struct {
+    bool supported;
+    uint32_t updates; // per frame
+} gfx_colors;
+#endif
+
+// What the current combiner and render mode need from every emitted vertex.
+struct DrawState {
+    struct ColorCombiner *comb;
+    uint8_t num_inputs;
+    bool used_textures[2];
+    bool use_texture;
+    bool use_alpha;
+    bool use_fog;
+    bool linear_filter;
+    bool z_is_from_0_to_1;
+    uint32_t tex_width, tex_height;
+#ifdef USE_HW_TNL
+    bool hw_tnl;
+    uint8_t lit_input;
+#endif
+#ifdef USE_UBER_SHADER
+    bool uber;
+#endif
+};
+
 struct GfxDimensions gfx_current_dimensions;
 
 static bool dropped_frame;
 
-#ifndef USE_TEXTURE_ATLAS
-static float buf_vbo[MAX_BUFFERED * (26 * 3)]; // 3 vertices in a triangle and 26 floats per vtx
-#else
-//  We're also going to pack some virtual texture parameters here [see encFloat_t] 
-// so we need four extra floats.
-static float buf_vbo[MAX_BUFFERED * ((26 + 4) * 3)];
-#endif
+static float buf_vbo[MAX_BUFFERED * (GFX_MAX_FLOATS_PER_VERTEX * 3)]; // 3 vertices in a triangle
 static size_t buf_vbo_len;
 static size_t buf_vbo_num_tris;
 
+#ifdef USE_INDEXED_DRAWING
+static uint16_t buf_ibo[MAX_BUFFERED * 3];
+static uint16_t buf_vbo_num_verts;
+
+// Everything other than the vertex itself that ends up in its attributes.
+struct VertexShareKey {
+    const struct ColorCombiner *comb;
+    uint32_t tex_width, tex_height;
+    uint16_t uls, ult;
+    uint8_t cms, cmt;
+    bool linear_filter;
+    bool hw_tnl;
+    struct RGBA env_color, prim_color, fog_color;
+#ifdef USE_TEXTURE_ATLAS
+    uint32_t sampler_params[2][2];
+#endif
+};
+
+// Triangles made from the same G_VTX load share most of their vertices, so
+// each loaded vertex is written to buf_vbo once and the triangles only add
+// indices. A slot's copy can be reused while its generation is the current
+// one, which changes whenever buf_vbo is flushed or the state baked into the
+// attributes does.
+static struct {
+    bool supported;
+    uint32_t generation;
+    uint32_t slot_generation[MAX_VERTICES + 4];
+    uint16_t slot_index[MAX_VERTICES + 4];
+    struct VertexShareKey key;
+    struct LoadedVertex origin; // packed texture coordinates are relative to it
+    uint32_t origin_generation;
+    uint32_t shared; // this frame
+} gfx_index;
+
+static inline void gfx_index_invalidate(size_t slot, size_t n) {
+    for (size_t i = slot; i < slot + n; i++) {
+        gfx_index.slot_generation[i] = 0;
+    }
+}
+#endif
+
 static struct GfxWindowManagerAPI *gfx_wapi;
 static struct GfxRenderingAPI *gfx_rapi;
 
+// Counted during gfx_run, last holds the previous frame's for gfx_get_stats
+static struct GfxStats gfx_stats, gfx_stats_last;
+
+#ifdef USE_DL_TRACE
+#define DL_TRACE_FILE "gfx_trace.bin"
+
+// Frames drawn so far, the trace covers trace_start up to trace_start + trace_frames
+static uint32_t gfx_trace_frame_count;
+#endif
+
 #include <time.h>
 static unsigned long get_time(void) {
     struct timespec ts;
@@ -221,29 +379,423 @@ static unsigned long get_time(void) {
     return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void gfx_flush(void) {
+#ifdef USE_COLOR_UNIFORMS
+static void gfx_send_combiner_colors(const struct RGBA *prim, const struct RGBA *env, const struct RGBA *fog) {
+    struct GfxCombinerColors colors = {
+        {prim->r / 255.0f, prim->g / 255.0f, prim->b / 255.0f, prim->a / 255.0f},
+        {env->r / 255.0f, env->g / 255.0f, env->b / 255.0f, env->a / 255.0f},
+        {fog->r / 255.0f, fog->g / 255.0f, fog->b / 255.0f}
+    };
+    gfx_rapi->set_combiner_colors(&colors);
+    rendering_state.prim_color = *prim;
+    rendering_state.env_color = *env;
+    rendering_state.fog_color = *fog;
+    gfx_colors.updates++;
+}
+#endif
+
+static void gfx_flush(enum GfxFlushCause cause) {
     ProfEmitEventStart("gfx_flush");
     if (buf_vbo_len > 0) {
-        int num = buf_vbo_num_tris;
-        unsigned long t0 = get_time();
+        gfx_stats.flushes[cause]++;
+        gfx_stats.draw_calls++;
+        gfx_stats.tris_drawn += buf_vbo_num_tris;
+#ifdef USE_INDEXED_DRAWING
+        if (gfx_index.supported) {
+            gfx_rapi->draw_indexed_triangles(buf_vbo, buf_vbo_len, buf_ibo, buf_vbo_num_tris);
+        } else {
+            gfx_rapi->draw_triangles(buf_vbo, buf_vbo_len, buf_vbo_num_tris);
+        }
+        buf_vbo_num_verts = 0;
+        gfx_index.generation++;
+#else
         gfx_rapi->draw_triangles(buf_vbo, buf_vbo_len, buf_vbo_num_tris);
+#endif
         buf_vbo_len = 0;
         buf_vbo_num_tris = 0;
-        unsigned long t1 = get_time();
-        /*if (t1 - t0 > 1000) {
-            printf("f: %d %d\n", num, (int)(t1 - t0));
-        }*/
     }
     ProfEmitEventEnd("gfx_flush");
 }
 
+#ifdef USE_INDEXED_DRAWING
+// Indexes triangles whose vertices were written to buf_vbo one after another.
+static void gfx_index_sequential(size_t num_tris) {
+    uint16_t *dst = &buf_ibo[buf_vbo_num_tris * 3];
+    for (size_t i = 0; i < num_tris * 3; i++) {
+        dst[i] = buf_vbo_num_verts++;
+    }
+}
+#endif
+
+#ifdef USE_STATE_SORTING
+// Opaque triangles that test and write depth come out the same whatever order
+// they're drawn in, so rather than drawing them as they come they're sorted
+// into buckets by render state. The buckets are drawn, one draw call each, as
+// soon as something order dependent (blending, no depth writes, the end of
+// the frame or a texture eviction) comes along.
+#define BATCH_MAX_BUCKETS 128
+#define BATCH_MAX_SPANS 4096
+#define BATCH_POOL_SIZE (256 * 1024) // floats
+#define BATCH_MAX_TRI_LEN (GFX_MAX_FLOATS_PER_VERTEX * 3)
+
+// Everything gfx_update_draw_state can change that affects a draw call.
+struct BatchKey {
+    struct ShaderProgram *shader_program;
+    bool depth_test, depth_mask, decal_mode, alpha_blend;
+    struct XYWidthHeight viewport, scissor;
+    uint32_t texture_ids[2];
+    struct TextureHashmapNode *textures[2]; // node owning the sampler state
+    bool linear_filter[2];
+    uint8_t cms[2], cmt[2];
+#ifdef USE_TEXTURE_ATLAS
+    int8_t atlas_pages[2]; // -1 for unused textures
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    struct RGBA prim_color, env_color, fog_color;
+#endif
+};
+
+// Run of consecutive triangles in the pool belonging to the same bucket.
+struct BatchSpan {
+    uint32_t offset, len;
+    uint32_t num_tris;
+    int32_t next;
+};
+
+struct BatchBucket {
+    struct BatchKey key;
+    int32_t head, tail; // spans
+};
+
+static struct {
+    struct BatchBucket buckets[BATCH_MAX_BUCKETS];
+    uint32_t num_buckets;
+    struct BatchSpan spans[BATCH_MAX_SPANS];
+    uint32_t num_spans;
+    float pool[BATCH_POOL_SIZE];
+    uint32_t pool_len;
+    struct BatchBucket *current; // where gfx_end_tri puts triangles, NULL to draw them directly
+    uint32_t draws, flushes; // per frame
+} gfx_batch;
+
+static void gfx_batch_capture(struct BatchKey *key, const bool used_textures[2]) {
+    memset(key, 0, sizeof(*key));
+    key->shader_program = rendering_state.shader_program;
+    key->depth_test = rendering_state.depth_test;
+    key->depth_mask = rendering_state.depth_mask;
+    key->decal_mode = rendering_state.decal_mode;
+    key->alpha_blend = rendering_state.alpha_blend;
+    key->viewport = rendering_state.viewport;
+    key->scissor = rendering_state.scissor;
+#ifdef USE_COLOR_UNIFORMS
+    key->prim_color = rendering_state.prim_color;
+    key->env_color = rendering_state.env_color;
+    key->fog_color = rendering_state.fog_color;
+#endif
+#ifdef USE_TEXTURE_ATLAS
+    key->atlas_pages[0] = key->atlas_pages[1] = -1;
+#endif
+    
+    for (int i = 0; i < 2; i++) {
+        if (!used_textures[i]) {
+            continue;
+        }
+#ifndef USE_TEXTURE_ATLAS
+        struct TextureHashmapNode *tex = rendering_state.textures[i];
+        if (tex == NULL) {
+            continue;
+        }
+        key->texture_ids[i] = tex->texture_id;
+        if (tex->shared != NULL) {
+            tex = tex->shared;
+        }
+        key->textures[i] = tex;
+        key->linear_filter[i] = tex->linear_filter;
+        key->cms[i] = tex->cms;
+        key->cmt[i] = tex->cmt;
+#else
+        key->linear_filter[i] = rendering_state.linear_filter[i];
+        key->atlas_pages[i] = rendering_state.atlas_pages[i];
+#endif
+    }
+}
+
+static void gfx_batch_apply(const struct BatchKey *key) {
+    if (key->depth_test != rendering_state.depth_test) {
+        gfx_rapi->set_depth_test(key->depth_test);
+        rendering_state.depth_test = key->depth_test;
+    }
+    if (key->depth_mask != rendering_state.depth_mask) {
+        gfx_rapi->set_depth_mask(key->depth_mask);
+        rendering_state.depth_mask = key->depth_mask;
+    }
+    if (key->decal_mode != rendering_state.decal_mode) {
+        gfx_rapi->set_zmode_decal(key->decal_mode);
+        rendering_state.decal_mode = key->decal_mode;
+    }
+    if (memcmp(&key->viewport, &rendering_state.viewport, sizeof(key->viewport)) != 0) {
+        gfx_rapi->set_viewport(key->viewport.x, key->viewport.y, key->viewport.width, key->viewport.height);
+        rendering_state.viewport = key->viewport;
+    }
+    if (memcmp(&key->scissor, &rendering_state.scissor, sizeof(key->scissor)) != 0) {
+        gfx_rapi->set_scissor(key->scissor.x, key->scissor.y, key->scissor.width, key->scissor.height);
+        rendering_state.scissor = key->scissor;
+    }
+    if (key->shader_program != rendering_state.shader_program) {
+        gfx_rapi->unload_shader(rendering_state.shader_program);
+        gfx_rapi->load_shader(key->shader_program);
+        rendering_state.shader_program = key->shader_program;
+        gfx_stats.shader_switches++;
+    }
+    if (key->alpha_blend != rendering_state.alpha_blend) {
+        gfx_rapi->set_use_alpha(key->alpha_blend);
+        rendering_state.alpha_blend = key->alpha_blend;
+    }
+#ifdef USE_COLOR_UNIFORMS
+    if (memcmp(&key->prim_color, &rendering_state.prim_color, sizeof(key->prim_color)) != 0 ||
+        memcmp(&key->env_color, &rendering_state.env_color, sizeof(key->env_color)) != 0 ||
+        memcmp(&key->fog_color, &rendering_state.fog_color, sizeof(key->fog_color)) != 0) {
+        gfx_send_combiner_colors(&key->prim_color, &key->env_color, &key->fog_color);
+    }
+#endif
+    
+    for (int i = 0; i < 2; i++) {
+#ifndef USE_TEXTURE_ATLAS
+        struct TextureHashmapNode *tex = key->textures[i];
+        if (tex == NULL) {
+            continue;
+        }
+        gfx_rapi->select_texture(i, key->texture_ids[i]);
+        if (tex->linear_filter != key->linear_filter[i] || tex->cms != key->cms[i] || tex->cmt != key->cmt[i]) {
+            gfx_rapi->set_sampler_parameters(i, key->linear_filter[i], key->cms[i], key->cmt[i]);
+            tex->linear_filter = key->linear_filter[i];
+            tex->cms = key->cms[i];
+            tex->cmt = key->cmt[i];
+        }
+#else
+        if (key->linear_filter[i] != rendering_state.linear_filter[i]) {
+            gfx_rapi->set_sampler_parameters(i, key->linear_filter[i], 0, 0);
+            rendering_state.linear_filter[i] = key->linear_filter[i];
+        }
+        if (key->atlas_pages[i] >= 0 && key->atlas_pages[i] != rendering_state.atlas_pages[i]) {
+            gfx_rapi->bind_virtual_texture_page(i, key->atlas_pages[i]);
+            rendering_state.atlas_pages[i] = key->atlas_pages[i];
+            gfx_texture_cache.page_binds++;
+        }
+#endif
+    }
+}
+
+// Decals have to land on top of what's already there, so they go last.
+static int gfx_batch_compare(const struct BatchKey *a, const struct BatchKey *b) {
+    if (a->decal_mode != b->decal_mode) {
+        return a->decal_mode ? 1 : -1;
+    }
+    if (a->shader_program != b->shader_program) {
+        return (uintptr_t)a->shader_program < (uintptr_t)b->shader_program ? -1 : 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (a->texture_ids[i] != b->texture_ids[i]) {
+            return a->texture_ids[i] < b->texture_ids[i] ? -1 : 1;
+        }
+#ifdef USE_TEXTURE_ATLAS
+        // Buckets on the same pages go one after the other, binding them once
+        if (a->atlas_pages[i] != b->atlas_pages[i]) {
+            return a->atlas_pages[i] < b->atlas_pages[i] ? -1 : 1;
+        }
+#endif
+    }
+    return 0;
+}
+
+// Draws every bucket, then puts the render state back the way it was.
+static void gfx_batch_flush(void) {
+    if (gfx_batch.num_buckets == 0) {
+        gfx_batch.current = NULL;
+        return;
+    }
+    
+    ProfEmitEventStart("gfx_batch_flush");
+    static const bool all_textures[2] = {true, true};
+    struct BatchKey live;
+    gfx_batch_capture(&live, all_textures);
+    gfx_flush(GFX_FLUSH_BATCH);
+    
+    struct BatchBucket *order[BATCH_MAX_BUCKETS];
+    for (uint32_t i = 0; i < gfx_batch.num_buckets; i++) {
+        struct BatchBucket *b = &gfx_batch.buckets[i];
+        uint32_t j = i;
+        for (; j > 0 && gfx_batch_compare(&order[j - 1]->key, &b->key) > 0; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = b;
+    }
+    
+    for (uint32_t i = 0; i < gfx_batch.num_buckets; i++) {
+        gfx_batch_apply(&order[i]->key);
+        for (int32_t s = order[i]->head; s >= 0; s = gfx_batch.spans[s].next) {
+            const struct BatchSpan *span = &gfx_batch.spans[s];
+            uint32_t tri_len = span->len / span->num_tris;
+            uint32_t done = 0;
+            while (done < span->num_tris) {
+                uint32_t n = span->num_tris - done;
+                if (n > MAX_BUFFERED - buf_vbo_num_tris) {
+                    n = MAX_BUFFERED - buf_vbo_num_tris;
+                }
+                memcpy(&buf_vbo[buf_vbo_len], &gfx_batch.pool[span->offset + done * tri_len], n * tri_len * sizeof(float));
+                buf_vbo_len += n * tri_len;
+#ifdef USE_INDEXED_DRAWING
+                gfx_index_sequential(n);
+#endif
+                buf_vbo_num_tris += n;
+                done += n;
+                if (buf_vbo_num_tris == MAX_BUFFERED) {
+                    gfx_flush(GFX_FLUSH_BATCH);
+                    gfx_batch.draws++;
+                }
+            }
+        }
+        if (buf_vbo_num_tris > 0) {
+            gfx_flush(GFX_FLUSH_BATCH);
+            gfx_batch.draws++;
+        }
+    }
+    
+    gfx_batch.num_buckets = 0;
+    gfx_batch.num_spans = 0;
+    gfx_batch.pool_len = 0;
+    gfx_batch.current = NULL;
+    gfx_batch.flushes++;
+    
+    gfx_batch_apply(&live);
+    ProfEmitEventEnd("gfx_batch_flush");
+}
+
+static struct BatchBucket *gfx_batch_bucket(const struct BatchKey *key) {
+    for (uint32_t i = 0; i < gfx_batch.num_buckets; i++) {
+        if (memcmp(&gfx_batch.buckets[i].key, key, sizeof(*key)) == 0) {
+            return &gfx_batch.buckets[i];
+        }
+    }
+    if (gfx_batch.num_buckets == BATCH_MAX_BUCKETS) {
+        gfx_batch_flush();
+    }
+    struct BatchBucket *b = &gfx_batch.buckets[gfx_batch.num_buckets++];
+    b->key = *key;
+    b->head = b->tail = -1;
+    return b;
+}
+
+// Called once the draw state for the next triangles is set up. Picks the
+// bucket they go to, or draws the pending buckets if they can't be deferred.
+static void gfx_batch_select(const struct DrawState *ds) {
+    bool deferrable = rendering_state.depth_test && rendering_state.depth_mask && !rendering_state.alpha_blend;
+#ifdef USE_HW_TNL
+    // Vertex shader state isn't part of the key
+    deferrable = deferrable && !ds->hw_tnl;
+#endif
+    if (!deferrable) {
+        gfx_batch_flush();
+        return;
+    }
+    
+    struct BatchKey key;
+    gfx_batch_capture(&key, ds->used_textures);
+    if (gfx_batch.current != NULL && memcmp(&gfx_batch.current->key, &key, sizeof(key)) == 0) {
+        return;
+    }
+    if (gfx_batch.current == NULL) {
+        // Whatever was drawn directly comes first
+        gfx_flush(GFX_FLUSH_BATCH);
+    }
+    gfx_batch.current = gfx_batch_bucket(&key);
+}
+
+// Moves the triangle just written to buf_vbo into the current bucket.
+static void gfx_batch_append(void) {
+    struct BatchBucket *b = gfx_batch.current;
+    
+    if (gfx_batch.pool_len + buf_vbo_len > BATCH_POOL_SIZE || gfx_batch.num_spans == BATCH_MAX_SPANS) {
+        // Out of room, draw what we have and start over
+        struct BatchKey key = b->key;
+        float tri[BATCH_MAX_TRI_LEN];
+        size_t tri_len = buf_vbo_len;
+        memcpy(tri, buf_vbo, tri_len * sizeof(float));
+        buf_vbo_len = 0;
+        buf_vbo_num_tris = 0;
+        gfx_batch_flush();
+        memcpy(buf_vbo, tri, tri_len * sizeof(float));
+        buf_vbo_len = tri_len;
+        b = gfx_batch.current = gfx_batch_bucket(&key);
+    }
+    
+    struct BatchSpan *span = b->tail >= 0 ? &gfx_batch.spans[b->tail] : NULL;
+    if (span == NULL || span->offset + span->len != gfx_batch.pool_len) {
+        int32_t s = gfx_batch.num_spans++;
+        span = &gfx_batch.spans[s];
+        span->offset = gfx_batch.pool_len;
+        span->len = 0;
+        span->num_tris = 0;
+        span->next = -1;
+        if (b->tail >= 0) {
+            gfx_batch.spans[b->tail].next = s;
+        } else {
+            b->head = s;
+        }
+        b->tail = s;
+    }
+    
+    memcpy(&gfx_batch.pool[gfx_batch.pool_len], buf_vbo, buf_vbo_len * sizeof(float));
+    gfx_batch.pool_len += buf_vbo_len;
+    span->len += buf_vbo_len;
+    span->num_tris++;
+    buf_vbo_len = 0;
+    buf_vbo_num_tris = 0;
+}
+#endif
+
+static struct {
+    bool recording; // set once the warm-up is done
+    uint32_t programs; // created since startup
+    uint32_t compiles; // this frame
+    unsigned long compile_time; // this frame, microseconds
+} gfx_shader_warmup;
+
+static void gfx_shader_warmup_record(uint32_t cc_id) {
+    FILE *file = fopen_home(SHADER_WARMUP_FILE, "a");
+    if (file != NULL) {
+        fprintf(file, "%08x\n", cc_id);
+        fclose(file);
+    }
+}
+
+// Whether cc_id could have come from gfx_update_draw_state in this build.
+static bool gfx_shader_warmup_is_valid(uint32_t cc_id) {
+    uint32_t opts = SHADER_OPT_ALPHA | SHADER_OPT_FOG | SHADER_OPT_TEXTURE_EDGE | SHADER_OPT_NOISE;
+#ifdef USE_HW_TNL
+    opts |= SHADER_OPT_LIGHTING;
+#endif
+    if ((cc_id & ~(opts | 0xffffff)) != 0) {
+        return false;
+    }
+    if ((cc_id & SHADER_OPT_TEXTURE_EDGE) && !(cc_id & SHADER_OPT_ALPHA)) {
+        return false;
+    }
+    // Without alpha the alpha combiner is cleared
+    return (cc_id & SHADER_OPT_ALPHA) || (cc_id & 0xfff000) == 0;
+}
+
 static struct ShaderProgram *gfx_lookup_or_create_shader_program(uint32_t shader_id) {
     ProfEmitEventStart("gfx_shader_program");
     struct ShaderProgram *prg = gfx_rapi->lookup_shader(shader_id);
     if (prg == NULL) {
+        unsigned long t0 = get_time();
         gfx_rapi->unload_shader(rendering_state.shader_program);
         prg = gfx_rapi->create_and_load_new_shader(shader_id);
         rendering_state.shader_program = prg;
+        gfx_shader_warmup.compile_time += get_time() - t0;
+        gfx_shader_warmup.compiles++;
+        gfx_shader_warmup.programs++;
     }
     ProfEmitEventEnd("gfx_shader_program");
     return prg;
@@ -251,7 +803,7 @@ static struct ShaderProgram *gfx_lookup_or_create_shader_program(uint32_t shader
 
 static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
     uint8_t c[2][4];
-    uint32_t shader_id = (cc_id >> 24) << 24;
+    uint32_t shader_id = ((cc_id >> 24) & 0xf) << 24;
     uint8_t shader_input_mapping[2][4] = {{0}};
     for (int i = 0; i < 4; i++) {
         c[0][i] = (cc_id >> (i * 3)) & 7;
@@ -262,7 +814,9 @@ static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
             c[i][0] = c[i][1] = c[i][2] = 0;
         }
         uint8_t input_number[8] = {0};
+#ifndef USE_COLOR_UNIFORMS
         int next_input_number = SHADER_INPUT_1;
+#endif
         for (int j = 0; j < 4; j++) {
             int val = 0;
             switch (c[i][j]) {
@@ -282,8 +836,20 @@ static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
                 case CC_ENV:
                 case CC_LOD:
                     if (input_number[c[i][j]] == 0) {
+#ifdef USE_COLOR_UNIFORMS
+                        // Every source has its own input, see SHADER_INPUT_PRIM
+                        static const uint8_t fixed_inputs[8] = {
+                            [CC_PRIM] = SHADER_INPUT_PRIM,
+                            [CC_ENV] = SHADER_INPUT_ENV,
+                            [CC_SHADE] = SHADER_INPUT_SHADE,
+                            [CC_LOD] = SHADER_INPUT_LOD
+                        };
+                        input_number[c[i][j]] = fixed_inputs[c[i][j]];
+                        shader_input_mapping[i][input_number[c[i][j]] - 1] = c[i][j];
+#else
                         shader_input_mapping[i][next_input_number - 1] = c[i][j];
                         input_number[c[i][j]] = next_input_number++;
+#endif
                     }
                     val = input_number[c[i][j]];
                     break;
@@ -291,8 +857,37 @@ static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
             shader_id |= val << (i * 12 + j * 3);
         }
     }
+#ifdef USE_HW_TNL
+    comb->lit_input = 0;
+    if (cc_id & SHADER_OPT_LIGHTING) {
+        for (int j = 0; j < 4; j++) {
+            if (shader_input_mapping[0][j] == CC_SHADE) {
+                comb->lit_input = j + 1;
+            }
+        }
+        shader_id |= comb->lit_input << SHADER_LIT_INPUT_SHIFT;
+    }
+#endif
+#ifdef USE_UBER_SHADER
+    // The uber program has no normals or noise, lit and noisy combiners keep their own
+    comb->uber = !(cc_id & (SHADER_OPT_LIGHTING | SHADER_OPT_NOISE));
+    if (comb->uber) {
+        struct CCFeatures features;
+        gfx_cc_get_features(shader_id, &features);
+        comb->used_textures[0] = features.used_textures[0];
+        comb->used_textures[1] = features.used_textures[1];
+        comb->uber_params[0] = shader_id & 0xfff;
+        comb->uber_params[1] = (shader_id >> 12) & 0xfff;
+        comb->uber_params[2] = features.opt_alpha | (features.opt_texture_edge && features.opt_alpha) << 1 | features.opt_fog << 2;
+        shader_id = SHADER_UBER;
+    }
+#endif
     comb->cc_id = cc_id;
+    uint32_t programs = gfx_shader_warmup.programs;
     comb->prg = gfx_lookup_or_create_shader_program(shader_id);
+    if (gfx_shader_warmup.recording && gfx_shader_warmup.programs != programs) {
+        gfx_shader_warmup_record(cc_id);
+    }
     memcpy(comb->shader_input_mapping, shader_input_mapping, sizeof(shader_input_mapping));
 }
 
@@ -307,49 +902,226 @@ static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint32_t cc_id)
             return prev_combiner = &color_combiner_pool[i];
         }
     }
-    gfx_flush();
+    gfx_flush(GFX_FLUSH_SHADER);
     struct ColorCombiner *comb = &color_combiner_pool[color_combiner_pool_size++];
     gfx_generate_cc(comb, cc_id);
     return prev_combiner = comb;
 }
 
+static inline size_t gfx_texture_cache_hash(const uint8_t *orig_addr) {
+    return ((uintptr_t)orig_addr >> 5) & (TEXTURE_CACHE_HASH_SIZE - 1);
+}
+
+static void gfx_texture_cache_lru_unlink(struct TextureHashmapNode *node) {
+    if (node->lru_prev != NULL) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        gfx_texture_cache.lru_head = node->lru_next;
+    }
+    if (node->lru_next != NULL) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        gfx_texture_cache.lru_tail = node->lru_prev;
+    }
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void gfx_texture_cache_lru_push(struct TextureHashmapNode *node) {
+    node->lru_prev = NULL;
+    node->lru_next = gfx_texture_cache.lru_head;
+    if (gfx_texture_cache.lru_head != NULL) {
+        gfx_texture_cache.lru_head->lru_prev = node;
+    } else {
+        gfx_texture_cache.lru_tail = node;
+    }
+    gfx_texture_cache.lru_head = node;
+}
+
+// Drops the least recently used texture that isn't bound right now, and
+// returns its node. Returns NULL if there's nothing to evict.
+static struct TextureHashmapNode *gfx_texture_cache_evict(void) {
+    struct TextureHashmapNode *victim = gfx_texture_cache.lru_tail;
+    while (victim != NULL && (victim == rendering_state.textures[0] || victim == rendering_state.textures[1])) {
+        victim = victim->lru_prev;
+    }
+    if (victim == NULL) {
+        return NULL;
+    }
+    
+    // Buffered triangles might still sample from it
+#ifdef USE_STATE_SORTING
+    gfx_batch_flush();
+#endif
+    gfx_flush(GFX_FLUSH_TEXTURE);
+    
+    struct TextureHashmapNode **node = &gfx_texture_cache.hashmap[gfx_texture_cache_hash(victim->texture_addr)];
+    while (*node != victim) {
+        node = &(*node)->next;
+    }
+    *node = victim->next;
+    gfx_texture_cache_lru_unlink(victim);
+    
+    if (victim->hashed) {
+        struct TextureHashmapNode **content = &gfx_texture_cache.content_hashmap[victim->content_hash[0] & (TEXTURE_CACHE_HASH_SIZE - 1)];
+        while (*content != victim) {
+            content = &(*content)->content_next;
+        }
+        *content = victim->content_next;
+        victim->content_next = NULL;
+        victim->hashed = false;
+    }
+    
+    if (victim->shared != NULL) {
+        // Only the texture's owner goes away, take back our own texture
+        victim->shared->share_count--;
+        victim->shared = NULL;
+        victim->texture_id = victim->spare_texture_id;
+    } else if (victim->share_count > 0) {
+        // Hand the texture over to one of the nodes sharing it, which gives us its unused one
+        struct TextureHashmapNode *heir = NULL;
+        for (struct TextureHashmapNode *n = gfx_texture_cache.content_hashmap[victim->content_hash[0] & (TEXTURE_CACHE_HASH_SIZE - 1)]; n != NULL; n = n->content_next) {
+            if (n->shared != victim) {
+                continue;
+            }
+            if (heir == NULL) {
+                heir = n;
+                heir->shared = NULL;
+                heir->share_count = victim->share_count - 1;
+                victim->texture_id = heir->spare_texture_id;
+            } else {
+                n->shared = heir;
+            }
+        }
+        victim->share_count = 0;
+    } else {
+#ifdef USE_TEXTURE_ATLAS
+        // Give the space back to the atlas, the node gets a fresh virtual texture
+        atlas_destroy_vtex(atlas, victim->texture_id);
+        uint32_t virtual_id;
+        if (!atlas_gen_texture(atlas, &virtual_id))
+            abort();
+        victim->texture_id = virtual_id;
+#endif
+    }
+    
+    victim->next = NULL;
+    victim->texture_addr = NULL;
+    gfx_texture_cache.evictions++;
+    return victim;
+}
+
+#ifdef USE_TEXTURE_ATLAS
+// Packs an atlas page again so its free space is in one piece. The texels are
+// moved by the backend, and every texture using them gets its new spot.
+static bool gfx_texture_atlas_compact(int page) {
+    if (!gfx_texture_cache.movable) {
+        return false;
+    }
+    
+    // Buffered triangles still sample from the old spots
+#ifdef USE_STATE_SORTING
+    gfx_batch_flush();
+#endif
+    gfx_flush(GFX_FLUSH_TEXTURE);
+    
+    const AtlasMove *moves;
+    int move_count;
+    if (!atlas_compact(atlas, page, &moves, &move_count)) {
+        return false;
+    }
+    
+    static struct GfxTextureMove *gpu_moves;
+    static int gpu_moves_size;
+    if (move_count > gpu_moves_size) {
+        struct GfxTextureMove *grown = realloc(gpu_moves, move_count * sizeof(*grown));
+        if (grown == NULL) {
+            abort();
+        }
+        gpu_moves = grown;
+        gpu_moves_size = move_count;
+    }
+    for (int i = 0; i < move_count; i++) {
+        gpu_moves[i].src_x = moves[i].src_x;
+        gpu_moves[i].src_y = moves[i].src_y;
+        gpu_moves[i].dst_x = moves[i].dst_x;
+        gpu_moves[i].dst_y = moves[i].dst_y;
+        gpu_moves[i].width = moves[i].width;
+        gpu_moves[i].height = moves[i].height;
+    }
+    gfx_rapi->move_virtual_textures(page, gpu_moves, move_count);
+    
+    // Nodes sharing a texture carry its id and a copy of its position
+    for (uint32_t i = 0; i < gfx_texture_cache.pool_pos; i++) {
+        struct TextureHashmapNode *node = &gfx_texture_cache.pool[i];
+        uint16_t xywh[4];
+        if (node->texture_addr == NULL || node->enc_sampler_params[0].sampler_0.page != page ||
+            !atlas_get_vtex_xywh_coords(atlas, node->texture_id, 0, xywh)) {
+            continue;
+        }
+        node->x = xywh[0];
+        node->y = xywh[1];
+        node->enc_sampler_params[0].sampler_0.u = node->x;
+        node->enc_sampler_params[1].sampler_1.v = node->y;
+    }
+    
+    gfx_texture_cache.compactions++;
+    return true;
+}
+#endif
+
 static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, const uint8_t *orig_addr, uint32_t fmt, uint32_t siz) {
-    size_t hash = (uintptr_t)orig_addr;
-    hash = (hash >> 5) & 0x3ff;
+    size_t hash = gfx_texture_cache_hash(orig_addr);
     struct TextureHashmapNode **node = &gfx_texture_cache.hashmap[hash];
-    while (*node != NULL && *node - gfx_texture_cache.pool < (int)gfx_texture_cache.pool_pos) {
+    while (*node != NULL) {
         if ((*node)->texture_addr == orig_addr && (*node)->fmt == fmt && (*node)->siz == siz) {
 #ifndef USE_TEXTURE_ATLAS
             gfx_rapi->select_texture(tile, (*node)->texture_id);
 #endif
+            if (gfx_texture_cache.lru_head != *node) {
+                gfx_texture_cache_lru_unlink(*node);
+                gfx_texture_cache_lru_push(*node);
+            }
+            gfx_texture_cache.hits++;
             *n = *node;
             return true;
         }
         node = &(*node)->next;
     }
-    if (gfx_texture_cache.pool_pos == sizeof(gfx_texture_cache.pool) / sizeof(struct TextureHashmapNode)) {
-        // Pool is full. We just invalidate everything and start over.
-        gfx_texture_cache.pool_pos = 0;
-        node = &gfx_texture_cache.hashmap[hash];
-        //puts("Clearing texture cache");
-    }
-    *node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
+    
+    gfx_texture_cache.misses++;
+    
+    struct TextureHashmapNode *new_node;
+    if (gfx_texture_cache.free_list != NULL) {
+        new_node = gfx_texture_cache.free_list;
+        gfx_texture_cache.free_list = new_node->next;
+    } else if (gfx_texture_cache.pool_pos < gfx_texture_cache.pool_size) {
+        new_node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
 #ifndef USE_TEXTURE_ATLAS
-    if ((*node)->texture_addr == NULL) {
-        (*node)->texture_id = gfx_rapi->new_texture();
-    }
-    gfx_rapi->select_texture(tile, (*node)->texture_id);
-    gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
+        new_node->texture_id = gfx_rapi->new_texture();
 #else
-    if ((*node)->texture_addr == NULL) {
         uint32_t virtual_id;
         if (!atlas_gen_texture(atlas, &virtual_id))
             abort();
         
-        (*node)->texture_id = virtual_id;
-    }
+        new_node->texture_id = virtual_id;
 #endif
-    (*node)->cms = 0;
+    } else {
+        new_node = gfx_texture_cache_evict();
+        if (new_node == NULL)
+            abort();
+        // The eviction may have unlinked the node we were going to append to
+        node = &gfx_texture_cache.hashmap[hash];
+        while (*node != NULL) {
+            node = &(*node)->next;
+        }
+    }
+    *node = new_node;
+    gfx_texture_cache_lru_push(new_node);
+#ifndef USE_TEXTURE_ATLAS
+    gfx_rapi->select_texture(tile, (*node)->texture_id);
+    gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
+#endif
+    (*node)->cms = 0;
     (*node)->cmt = 0;
     (*node)->linear_filter = false;
     (*node)->next = NULL;
@@ -360,29 +1132,112 @@ static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, co
     return false;
 }
 
-static void import_texture_finish(uint8_t *buf, int tile, uint16_t width, uint16_t height)
+// A differently built hash of the same bytes, MurmurHash3's block mix. Both
+// have to match before two textures share an upload or a disk cache entry.
+static uint32_t gfx_texture_check_hash(uint32_t hash, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t k;
+        memcpy(&k, data + i, sizeof(k));
+        k *= 0xcc9e2d51U;
+        k = (k << 15 | k >> 17) * 0x1b873593U;
+        hash ^= k;
+        hash = (hash << 13 | hash >> 19) * 5 + 0xe6546b64U;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x1b873593U;
+    }
+    return hash;
+}
+
+static void gfx_texture_disk_cache_key(int tile, struct TextureDiskCacheKey *key) {
+    struct TextureHashmapNode *node = rendering_state.textures[tile];
+    
+    memset(key, 0, sizeof(*key));
+    key->hash[0] = node->content_hash[0];
+    key->hash[1] = node->content_hash[1];
+    key->size_bytes = node->size_bytes;
+    key->line_size_bytes = node->line_size_bytes;
+    key->fmt = node->fmt;
+    key->siz = node->siz;
+    key->check = node->content_check;
+}
+
+#ifndef USE_TEXTURE_ATLAS
+// Smallest upload format that holds every texel of the source format exactly
+static enum GfxTextureFormat gfx_texture_upload_format(uint8_t fmt, uint8_t siz) {
+    switch (fmt) {
+        case G_IM_FMT_RGBA:
+            return siz == G_IM_SIZ_16b ? GFX_TEXFMT_RGBA5551 : GFX_TEXFMT_RGBA8888;
+        case G_IM_FMT_CI:
+            return GFX_TEXFMT_RGBA5551;
+        case G_IM_FMT_IA:
+            return siz == G_IM_SIZ_8b ? GFX_TEXFMT_RGBA4444 : GFX_TEXFMT_LA88;
+        case G_IM_FMT_I:
+            return GFX_TEXFMT_L8;
+        default:
+            return GFX_TEXFMT_RGBA8888;
+    }
+}
+#endif
+
+static void import_texture_finish(const uint8_t *buf, int tile, uint16_t width, uint16_t height)
 {
     ProfEmitEventEnd("import_texture_xxx");
+    if (gfx_texture_cache.disk_store) {
+        struct TextureDiskCacheKey key;
+        gfx_texture_disk_cache_key(tile, &key);
+        texture_disk_cache_store(&key, buf, width, height);
+    }
 #ifndef USE_TEXTURE_ATLAS
-    gfx_rapi->upload_texture(buf, width, height);
+    if (configTexture16Bit && gfx_rapi->upload_texture_format != NULL) {
+        struct TextureHashmapNode *node = rendering_state.textures[tile];
+        enum GfxTextureFormat format = gfx_texture_upload_format(node->fmt, node->siz);
+        gfx_rapi->upload_texture_format(buf, format, width, height);
+        gfx_stats.texture_upload_bytes += width * height * (format == GFX_TEXFMT_RGBA8888 ? 4 : format == GFX_TEXFMT_L8 ? 1 : 2);
+    } else {
+        gfx_rapi->upload_texture(buf, width, height);
+        gfx_stats.texture_upload_bytes += width * height * 4;
+    }
 #else
-    // Deal with failure gracefully - maybe invalidate a few textures for more space
     uint32_t v_id = rendering_state.textures[tile]->texture_id;
 
-    int h_mirror = rdp.texture_tile.cms == G_TX_MIRROR;
-    int v_mirror = rdp.texture_tile.cmt == G_TX_MIRROR;
-
-    // Allocate enough memory for the mirrored set. This allows us to simplify
-    // the fragment shader texture fetches a little.
-    if (!atlas_allocate_vtex_space(atlas, v_id, 
-        !h_mirror ? width : width*2, !v_mirror ? height : height * 2))
-        abort();
+    // Mirrored textures take their natural size, the fragment shader flips the coordinates
+    bool compacted = false, allocated = false;
+    int page;
+    while (!atlas_allocate_vtex_space(atlas, v_id, width, height)) {
+        // Plenty of room, just in pieces too small for this texture
+        if (!compacted && atlas_wants_compaction(atlas, width, height, &page)) {
+            compacted = true;
+            if (gfx_texture_atlas_compact(page)) {
+                continue;
+            }
+        }
+        
+        // Atlas is full, make room by dropping the least recently used textures
+        struct TextureHashmapNode *evicted = gfx_texture_cache_evict();
+        if (evicted == NULL) {
+            // Only the bound textures are left, packing them together is the last resort
+            for (page = 0; page < atlas_get_page_count(atlas) && !allocated; page++) {
+                allocated = gfx_texture_atlas_compact(page) && atlas_allocate_vtex_space(atlas, v_id, width, height);
+            }
+            if (allocated) {
+                break;
+            }
+            fprintf(stderr, "No room in the texture atlas for a %ux%u texture\n", width, height);
+            abort();
+        }
+        evicted->next = gfx_texture_cache.free_list;
+        gfx_texture_cache.free_list = evicted;
+    }
 
     uint16_t xyzw[4];
-    if (!atlas_get_vtex_xywh_coords(atlas, v_id, 0, &xyzw))
+    page = atlas_get_vtex_page(atlas, v_id);
+    if (page < 0 || !atlas_get_vtex_xywh_coords(atlas, v_id, 0, &xyzw))
         abort();
 
-    gfx_rapi->upload_virtual_texture(buf, xyzw[0], xyzw[1], width, height, h_mirror, v_mirror);
+    gfx_rapi->upload_virtual_texture(page, buf, xyzw[0], xyzw[1], width, height);
+    gfx_stats.texture_upload_bytes += width * height * (configTexture16Bit ? 2 : 4);
     rendering_state.textures[tile]->x = xyzw[0];
     rendering_state.textures[tile]->y = xyzw[1];
     rendering_state.textures[tile]->width = width;
@@ -393,11 +1248,13 @@ static void import_texture_finish(uint8_t *buf, int tile, uint16_t width, uint16
     sampler_params[0].sampler_0.s = rendering_state.textures[tile]->width;
     sampler_params[0].sampler_0.always_one = 1; // DON'T REMOVE ME
     sampler_params[0].sampler_0.cms = rdp.texture_tile.cms;
+    sampler_params[0].sampler_0.page = page;
 
     sampler_params[1].sampler_1.v = rendering_state.textures[tile]->y;
     sampler_params[1].sampler_1.t = rendering_state.textures[tile]->height;
     sampler_params[1].sampler_1.always_one = 1; // DON'T REMOVE ME
     sampler_params[1].sampler_1.cmt = rdp.texture_tile.cmt;
+    sampler_params[1].sampler_1.page = page;
 #endif
 }
 
@@ -582,6 +1439,106 @@ static void import_texture_ci8(int tile) {
     import_texture_finish(rgba32_buf, tile, width, height);
 }
 
+static void gfx_texture_hash(uint32_t hash[2], const uint8_t *data, size_t len) {
+    // Two independent 32-bit lanes so it stays cheap on 32-bit CPUs
+    uint32_t h0 = hash[0], h1 = hash[1];
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t k;
+        memcpy(&k, data + i, sizeof(k));
+        h0 = (h0 ^ k) * 0x01000193;
+        h1 = ((h1 << 5) | (h1 >> 27)) + (k * 0x9e3779b1);
+    }
+    for (; i < len; i++) {
+        h0 = (h0 ^ data[i]) * 0x01000193;
+        h1 = ((h1 << 5) | (h1 >> 27)) + (data[i] * 0x9e3779b1);
+    }
+    hash[0] = h0;
+    hash[1] = h1;
+}
+
+// Fills in the content key used by both gfx_texture_cache_dedup and the disk cache
+static void gfx_texture_cache_hash_contents(int tile) {
+    struct TextureHashmapNode *node = rendering_state.textures[tile];
+    
+    node->content_hash[0] = 0x811c9dc5;
+    node->content_hash[1] = 0;
+    gfx_texture_hash(node->content_hash, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes);
+    node->content_check = gfx_texture_check_hash(0, rdp.loaded_texture[tile].addr, rdp.loaded_texture[tile].size_bytes);
+    if (node->fmt == G_IM_FMT_CI) {
+        gfx_texture_hash(node->content_hash, rdp.palette, node->siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2);
+        node->content_check = gfx_texture_check_hash(node->content_check, rdp.palette, node->siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2);
+    }
+    node->size_bytes = rdp.loaded_texture[tile].size_bytes;
+    node->line_size_bytes = rdp.texture_tile.line_size_bytes;
+}
+
+// Second level lookup, keyed on the texel data and palette. Lets textures that
+// live at different addresses but have the same contents share a single
+// texture or atlas slot. Returns true if the texture didn't need importing.
+static bool gfx_texture_cache_dedup(int tile) {
+    struct TextureHashmapNode *node = rendering_state.textures[tile];
+    
+    struct TextureHashmapNode **content = &gfx_texture_cache.content_hashmap[node->content_hash[0] & (TEXTURE_CACHE_HASH_SIZE - 1)];
+    struct TextureHashmapNode *owner = NULL;
+    for (struct TextureHashmapNode *n = *content; n != NULL; n = n->content_next) {
+        if (n->content_hash[0] == node->content_hash[0] && n->content_hash[1] == node->content_hash[1] &&
+            n->content_check == node->content_check &&
+            n->fmt == node->fmt && n->siz == node->siz &&
+            n->size_bytes == node->size_bytes && n->line_size_bytes == node->line_size_bytes
+            ) {
+            owner = n->shared != NULL ? n->shared : n;
+            break;
+        }
+    }
+    
+    node->hashed = true;
+    node->content_next = *content;
+    *content = node;
+    
+    if (owner == NULL) {
+        return false;
+    }
+    
+    node->shared = owner;
+    owner->share_count++;
+    node->spare_texture_id = node->texture_id;
+    node->texture_id = owner->texture_id;
+#ifndef USE_TEXTURE_ATLAS
+    gfx_rapi->select_texture(tile, node->texture_id);
+#else
+    node->x = owner->x;
+    node->y = owner->y;
+    node->width = owner->width;
+    node->height = owner->height;
+    // Same texels whatever the wrap modes, only the encoded ones differ
+    node->enc_sampler_params[0] = owner->enc_sampler_params[0];
+    node->enc_sampler_params[1] = owner->enc_sampler_params[1];
+    node->enc_sampler_params[0].sampler_0.cms = rdp.texture_tile.cms;
+    node->enc_sampler_params[1].sampler_1.cmt = rdp.texture_tile.cmt;
+#endif
+    gfx_texture_cache.dedups++;
+    return true;
+}
+
+// Third level lookup, texels decoded by a previous run. On a hit the upload
+// reads straight from the mapped file and no decoding happens.
+static bool gfx_texture_disk_cache_load(int tile) {
+    struct TextureDiskCacheKey key;
+    uint16_t width, height;
+    
+    gfx_texture_disk_cache_key(tile, &key);
+    const uint8_t *rgba32_buf = texture_disk_cache_lookup(&key, &width, &height);
+    if (rgba32_buf == NULL) {
+        return false;
+    }
+    
+    ProfEmitEventStart("import_texture_xxx");
+    import_texture_finish(rgba32_buf, tile, width, height);
+    gfx_texture_cache.disk_hits++;
+    return true;
+}
+
 static void import_texture(int tile) {
     uint8_t fmt = rdp.texture_tile.fmt;
     uint8_t siz = rdp.texture_tile.siz;
@@ -590,6 +1547,21 @@ static void import_texture(int tile) {
         return;
     }
     
+    // RGBA32 is uploaded as is, nothing to gain from caching it on disk
+    bool disk_cache = gfx_texture_cache.disk_cache && !(fmt == G_IM_FMT_RGBA && siz == G_IM_SIZ_32b);
+    if (configTextureDedup || disk_cache) {
+        gfx_texture_cache_hash_contents(tile);
+    }
+    
+    if (configTextureDedup && gfx_texture_cache_dedup(tile)) {
+        return;
+    }
+    
+    if (disk_cache && gfx_texture_disk_cache_load(tile)) {
+        return;
+    }
+    
+    gfx_texture_cache.disk_store = disk_cache;
     ProfEmitEventStart("import_texture_xxx");
     int t0 = get_time();
     if (fmt == G_IM_FMT_RGBA) {
@@ -629,6 +1601,7 @@ static void import_texture(int tile) {
     } else {
         abort();
     }
+    gfx_texture_cache.disk_store = false;
     int t1 = get_time();
     //printf("Time diff: %d\n", t1 - t0);
 }
@@ -722,34 +1695,504 @@ static float gfx_adjust_x_for_aspect_ratio(float x) {
     return x * (4.0f / 3.0f) / ((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height);
 }
 
-static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
+// Transforms a model space position into clip space and sets the trivial
+// clip rejection flags.
+static void gfx_transform_vertex(struct LoadedVertex *d, float ob0, float ob1, float ob2) {
+    float x = ob0 * rsp.MP_matrix[0][0] + ob1 * rsp.MP_matrix[1][0] + ob2 * rsp.MP_matrix[2][0] + rsp.MP_matrix[3][0];
+    float y = ob0 * rsp.MP_matrix[0][1] + ob1 * rsp.MP_matrix[1][1] + ob2 * rsp.MP_matrix[2][1] + rsp.MP_matrix[3][1];
+    float z = ob0 * rsp.MP_matrix[0][2] + ob1 * rsp.MP_matrix[1][2] + ob2 * rsp.MP_matrix[2][2] + rsp.MP_matrix[3][2];
+    float w = ob0 * rsp.MP_matrix[0][3] + ob1 * rsp.MP_matrix[1][3] + ob2 * rsp.MP_matrix[2][3] + rsp.MP_matrix[3][3];
+    
+    x = gfx_adjust_x_for_aspect_ratio(x);
+    
+    // trivial clip rejection
+    d->clip_rej = 0;
+    if (x < -w) d->clip_rej |= 1;
+    if (x > w) d->clip_rej |= 2;
+    if (y < -w) d->clip_rej |= 4;
+    if (y > w) d->clip_rej |= 8;
+    if (z < -w) d->clip_rej |= 16;
+    if (z > w) d->clip_rej |= 32;
+    
+    d->x = x;
+    d->y = y;
+    d->z = z;
+    d->w = w;
+}
+
+static uint8_t gfx_fog_factor(float z, float w, float fog_mul, float fog_offset) {
+    if (fabsf(w) < 0.001f) {
+        // To avoid division by zero
+        w = 0.001f;
+    }
+    
+    float winv = 1.0f / w;
+    if (winv < 0.0f) {
+        winv = 32767.0f;
+    }
+    
+    float fog_z = z * winv * fog_mul + fog_offset;
+    if (fog_z < 0) fog_z = 0;
+    if (fog_z > 255) fog_z = 255;
+    return fog_z;
+}
+
+// Batched G_VTX transform.
+// Positions, clip rejection flags and fog factors are computed for several
+// vertices at once. Every path performs the exact same sequence of IEEE single
+// precision operations as gfx_transform_vertex/gfx_fog_factor (no FMA, true
+// division), so all of them produce bit-identical LoadedVertex data as long as
+// the scalar code isn't contracted into FMAs by the compiler (-ffp-contract=off).
+
+// Clip rejection bits as one mask per plane, bit N belonging to vertex N.
+enum {
+    CLIP_X_NEG, CLIP_X_POS, CLIP_Y_NEG, CLIP_Y_POS, CLIP_Z_NEG, CLIP_Z_POS, CLIP_PLANES
+};
+
+static void gfx_store_transformed(struct LoadedVertex *d, size_t n, const float *x, const float *y, const float *z, const float *w,
+                                  const int *clip_masks, const int32_t *fog) {
+    for (size_t i = 0; i < n; i++) {
+        d[i].x = x[i];
+        d[i].y = y[i];
+        d[i].z = z[i];
+        d[i].w = w[i];
+        d[i].clip_rej = 0;
+        for (int p = 0; p < CLIP_PLANES; p++) {
+            d[i].clip_rej |= ((clip_masks[p] >> i) & 1) << p;
+        }
+        if (fog != NULL) {
+            d[i].color.a = fog[i];
+        }
+    }
+}
+
+#if defined(__AVX__)
+static void gfx_transform_vertices_avx(struct LoadedVertex *d, const Vtx *vertices, bool fog) {
+    float x[8], y[8], z[8], w[8];
+    int32_t fog_factor[8];
+    int clip_masks[CLIP_PLANES];
+    __m256 ob[3], out[4];
+    
+    for (int j = 0; j < 3; j++) {
+        ob[j] = _mm256_set_ps(vertices[7].v.ob[j], vertices[6].v.ob[j], vertices[5].v.ob[j], vertices[4].v.ob[j],
+                              vertices[3].v.ob[j], vertices[2].v.ob[j], vertices[1].v.ob[j], vertices[0].v.ob[j]);
+    }
+    for (int c = 0; c < 4; c++) {
+        out[c] = _mm256_mul_ps(ob[0], _mm256_set1_ps(rsp.MP_matrix[0][c]));
+        out[c] = _mm256_add_ps(out[c], _mm256_mul_ps(ob[1], _mm256_set1_ps(rsp.MP_matrix[1][c])));
+        out[c] = _mm256_add_ps(out[c], _mm256_mul_ps(ob[2], _mm256_set1_ps(rsp.MP_matrix[2][c])));
+        out[c] = _mm256_add_ps(out[c], _mm256_set1_ps(rsp.MP_matrix[3][c]));
+    }
+    out[0] = _mm256_mul_ps(out[0], _mm256_set1_ps(4.0f / 3.0f));
+    out[0] = _mm256_div_ps(out[0], _mm256_set1_ps((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height));
+    
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 neg_w = _mm256_xor_ps(out[3], sign);
+    for (int c = 0; c < 3; c++) {
+        clip_masks[c * 2 + 0] = _mm256_movemask_ps(_mm256_cmp_ps(out[c], neg_w, _CMP_LT_OQ));
+        clip_masks[c * 2 + 1] = _mm256_movemask_ps(_mm256_cmp_ps(out[c], out[3], _CMP_GT_OQ));
+    }
+    
+    if (fog) {
+        __m256 zero = _mm256_setzero_ps();
+        __m256 fw = _mm256_blendv_ps(out[3], _mm256_set1_ps(0.001f),
+                                     _mm256_cmp_ps(_mm256_andnot_ps(sign, out[3]), _mm256_set1_ps(0.001f), _CMP_LT_OQ));
+        __m256 winv = _mm256_div_ps(_mm256_set1_ps(1.0f), fw);
+        winv = _mm256_blendv_ps(winv, _mm256_set1_ps(32767.0f), _mm256_cmp_ps(winv, zero, _CMP_LT_OQ));
+        __m256 fog_z = _mm256_mul_ps(_mm256_mul_ps(out[2], winv), _mm256_set1_ps(rsp.fog_mul));
+        fog_z = _mm256_add_ps(fog_z, _mm256_set1_ps(rsp.fog_offset));
+        fog_z = _mm256_min_ps(_mm256_max_ps(fog_z, zero), _mm256_set1_ps(255.0f));
+        _mm256_storeu_si256((__m256i *)fog_factor, _mm256_cvttps_epi32(fog_z));
+    }
+    
+    _mm256_storeu_ps(x, out[0]);
+    _mm256_storeu_ps(y, out[1]);
+    _mm256_storeu_ps(z, out[2]);
+    _mm256_storeu_ps(w, out[3]);
+    gfx_store_transformed(d, 8, x, y, z, w, clip_masks, fog ? fog_factor : NULL);
+}
+#endif
+
+#if defined(__SSE2__)
+static void gfx_transform_vertices_sse2(struct LoadedVertex *d, const Vtx *vertices, bool fog) {
+    float x[4], y[4], z[4], w[4];
+    int32_t fog_factor[4];
+    int clip_masks[CLIP_PLANES];
+    __m128 ob[3], out[4];
+    
+    for (int j = 0; j < 3; j++) {
+        ob[j] = _mm_set_ps(vertices[3].v.ob[j], vertices[2].v.ob[j], vertices[1].v.ob[j], vertices[0].v.ob[j]);
+    }
+    for (int c = 0; c < 4; c++) {
+        out[c] = _mm_mul_ps(ob[0], _mm_set1_ps(rsp.MP_matrix[0][c]));
+        out[c] = _mm_add_ps(out[c], _mm_mul_ps(ob[1], _mm_set1_ps(rsp.MP_matrix[1][c])));
+        out[c] = _mm_add_ps(out[c], _mm_mul_ps(ob[2], _mm_set1_ps(rsp.MP_matrix[2][c])));
+        out[c] = _mm_add_ps(out[c], _mm_set1_ps(rsp.MP_matrix[3][c]));
+    }
+    out[0] = _mm_mul_ps(out[0], _mm_set1_ps(4.0f / 3.0f));
+    out[0] = _mm_div_ps(out[0], _mm_set1_ps((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height));
+    
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 neg_w = _mm_xor_ps(out[3], sign);
+    for (int c = 0; c < 3; c++) {
+        clip_masks[c * 2 + 0] = _mm_movemask_ps(_mm_cmplt_ps(out[c], neg_w));
+        clip_masks[c * 2 + 1] = _mm_movemask_ps(_mm_cmpgt_ps(out[c], out[3]));
+    }
+    
+    if (fog) {
+        __m128 zero = _mm_setzero_ps();
+        __m128 small = _mm_cmplt_ps(_mm_andnot_ps(sign, out[3]), _mm_set1_ps(0.001f));
+        __m128 fw = _mm_or_ps(_mm_and_ps(small, _mm_set1_ps(0.001f)), _mm_andnot_ps(small, out[3]));
+        __m128 winv = _mm_div_ps(_mm_set1_ps(1.0f), fw);
+        __m128 behind = _mm_cmplt_ps(winv, zero);
+        winv = _mm_or_ps(_mm_and_ps(behind, _mm_set1_ps(32767.0f)), _mm_andnot_ps(behind, winv));
+        __m128 fog_z = _mm_mul_ps(_mm_mul_ps(out[2], winv), _mm_set1_ps(rsp.fog_mul));
+        fog_z = _mm_add_ps(fog_z, _mm_set1_ps(rsp.fog_offset));
+        fog_z = _mm_min_ps(_mm_max_ps(fog_z, zero), _mm_set1_ps(255.0f));
+        _mm_storeu_si128((__m128i *)fog_factor, _mm_cvttps_epi32(fog_z));
+    }
+    
+    _mm_storeu_ps(x, out[0]);
+    _mm_storeu_ps(y, out[1]);
+    _mm_storeu_ps(z, out[2]);
+    _mm_storeu_ps(w, out[3]);
+    gfx_store_transformed(d, 4, x, y, z, w, clip_masks, fog ? fog_factor : NULL);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static int gfx_neon_movemask(uint32x4_t mask) {
+    static const uint32_t bits[4] = {1, 2, 4, 8};
+    return vaddvq_u32(vandq_u32(mask, vld1q_u32(bits)));
+}
+
+static void gfx_transform_vertices_neon(struct LoadedVertex *d, const Vtx *vertices, bool fog) {
+    float x[4], y[4], z[4], w[4];
+    int32_t fog_factor[4];
+    int clip_masks[CLIP_PLANES];
+    float32x4_t ob[3], out[4];
+    
+    for (int j = 0; j < 3; j++) {
+        float tmp[4] = {vertices[0].v.ob[j], vertices[1].v.ob[j], vertices[2].v.ob[j], vertices[3].v.ob[j]};
+        ob[j] = vld1q_f32(tmp);
+    }
+    for (int c = 0; c < 4; c++) {
+        // Separate multiplies and adds, vmlaq/vfmaq would change the rounding
+        out[c] = vmulq_f32(ob[0], vdupq_n_f32(rsp.MP_matrix[0][c]));
+        out[c] = vaddq_f32(out[c], vmulq_f32(ob[1], vdupq_n_f32(rsp.MP_matrix[1][c])));
+        out[c] = vaddq_f32(out[c], vmulq_f32(ob[2], vdupq_n_f32(rsp.MP_matrix[2][c])));
+        out[c] = vaddq_f32(out[c], vdupq_n_f32(rsp.MP_matrix[3][c]));
+    }
+    out[0] = vmulq_f32(out[0], vdupq_n_f32(4.0f / 3.0f));
+    out[0] = vdivq_f32(out[0], vdupq_n_f32((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height));
+    
+    float32x4_t neg_w = vnegq_f32(out[3]);
+    for (int c = 0; c < 3; c++) {
+        clip_masks[c * 2 + 0] = gfx_neon_movemask(vcltq_f32(out[c], neg_w));
+        clip_masks[c * 2 + 1] = gfx_neon_movemask(vcgtq_f32(out[c], out[3]));
+    }
+    
+    if (fog) {
+        float32x4_t zero = vdupq_n_f32(0.0f);
+        float32x4_t fw = vbslq_f32(vcltq_f32(vabsq_f32(out[3]), vdupq_n_f32(0.001f)), vdupq_n_f32(0.001f), out[3]);
+        float32x4_t winv = vdivq_f32(vdupq_n_f32(1.0f), fw);
+        winv = vbslq_f32(vcltq_f32(winv, zero), vdupq_n_f32(32767.0f), winv);
+        float32x4_t fog_z = vmulq_f32(vmulq_f32(out[2], winv), vdupq_n_f32(rsp.fog_mul));
+        fog_z = vaddq_f32(fog_z, vdupq_n_f32(rsp.fog_offset));
+        fog_z = vminq_f32(vmaxq_f32(fog_z, zero), vdupq_n_f32(255.0f));
+        vst1q_s32(fog_factor, vcvtq_s32_f32(fog_z));
+    }
+    
+    vst1q_f32(x, out[0]);
+    vst1q_f32(y, out[1]);
+    vst1q_f32(z, out[2]);
+    vst1q_f32(w, out[3]);
+    gfx_store_transformed(d, 4, x, y, z, w, clip_masks, fog ? fog_factor : NULL);
+}
+#endif
+
+// Transforms a whole G_VTX load. With fog enabled the fog factor is written to
+// color.a, otherwise color is left untouched.
+static void gfx_transform_vertices(struct LoadedVertex *d, const Vtx *vertices, size_t n_vertices, bool fog) {
+    size_t i = 0;
+    gfx_stats.vertices_transformed += n_vertices;
+    
+#if defined(__AVX__)
+    for (; i + 8 <= n_vertices; i += 8) {
+        gfx_transform_vertices_avx(&d[i], &vertices[i], fog);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 4 <= n_vertices; i += 4) {
+        gfx_transform_vertices_sse2(&d[i], &vertices[i], fog);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n_vertices; i += 4) {
+        gfx_transform_vertices_neon(&d[i], &vertices[i], fog);
+    }
+#endif
+    
+    for (; i < n_vertices; i++) {
+        gfx_transform_vertex(&d[i], vertices[i].v.ob[0], vertices[i].v.ob[1], vertices[i].v.ob[2]);
+        if (fog) {
+            d[i].color.a = gfx_fog_factor(d[i].z, d[i].w, rsp.fog_mul, rsp.fog_offset); // Use alpha variable to store fog factor
+        }
+    }
+}
+
+static void gfx_update_lights(void) {
+    if (rsp.lights_changed) {
+        for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+            calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
+        }
+        static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
+        static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
+        calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
+        calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
+        rsp.lights_changed = false;
+    }
+}
+
+#ifdef USE_HW_TNL
+// Hardware T&L.
+// G_VTX only stores the raw vertex data along with a reference to a snapshot
+// of the matrix, lights and fog it was loaded with. Triangles whose vertices
+// share a snapshot are drawn in model space and the vertex shader does the
+// rest, including clipping and culling. Anything else (vertices loaded under
+// different matrices, texgen, LOD fractions, fog used as shade alpha) gets
+// transformed on the CPU as usual and drawn with an identity transform.
+static struct {
+    bool supported;
+    uint8_t current;
+    uint32_t next_id;
+    struct {
+        struct GfxTnlState state;
+        bool lit;
+        uint32_t id;
+    } snapshots[TNL_SNAPSHOTS + 1]; // TNL_NONE is never used
+} gfx_tnl;
+
+// Transforms, lights and fogs a vertex on the CPU using the snapshot it was loaded with.
+static void gfx_tnl_materialize(struct LoadedVertex *d) {
+#ifdef USE_INDEXED_DRAWING
+    gfx_index_invalidate(d - rsp.loaded_vertices, 1);
+#endif
+    const struct GfxTnlState *s = &gfx_tnl.snapshots[d->tnl].state;
+    float m[4];
+    gfx_stats.vertices_transformed++;
+    
+    for (int c = 0; c < 4; c++) {
+        m[c] = d->ob[0] * s->mp_matrix[0][c] + d->ob[1] * s->mp_matrix[1][c] + d->ob[2] * s->mp_matrix[2][c] + s->mp_matrix[3][c];
+    }
+    
+    d->clip_rej = 0;
+    if (m[0] < -m[3]) d->clip_rej |= 1;
+    if (m[0] > m[3]) d->clip_rej |= 2;
+    if (m[1] < -m[3]) d->clip_rej |= 4;
+    if (m[1] > m[3]) d->clip_rej |= 8;
+    if (m[2] < -m[3]) d->clip_rej |= 16;
+    if (m[2] > m[3]) d->clip_rej |= 32;
+    
+    d->x = m[0];
+    d->y = m[1];
+    d->z = m[2];
+    d->w = m[3];
+    
+    if (gfx_tnl.snapshots[d->tnl].lit) {
+        float r = s->light_colors[GFX_TNL_MAX_LIGHTS][0];
+        float g = s->light_colors[GFX_TNL_MAX_LIGHTS][1];
+        float b = s->light_colors[GFX_TNL_MAX_LIGHTS][2];
+        for (int i = 0; i < GFX_TNL_MAX_LIGHTS; i++) {
+            float intensity = d->n[0] * s->light_dirs[i][0] + d->n[1] * s->light_dirs[i][1] + d->n[2] * s->light_dirs[i][2];
+            if (intensity > 0.0f) {
+                r += intensity * s->light_colors[i][0];
+                g += intensity * s->light_colors[i][1];
+                b += intensity * s->light_colors[i][2];
+            }
+        }
+        d->color.r = r > 1.0f ? 255 : r * 255.0f;
+        d->color.g = g > 1.0f ? 255 : g * 255.0f;
+        d->color.b = b > 1.0f ? 255 : b * 255.0f;
+    }
+    
+    if (s->fog) {
+        d->color.a = gfx_fog_factor(d->z, d->w, s->fog_mul, s->fog_offset);
+    }
+    
+    d->tnl = TNL_NONE;
+}
+
+static void gfx_tnl_snapshot(void) {
+    bool lit = (rsp.geometry_mode & G_LIGHTING) != 0;
+    struct GfxTnlState s;
+    memset(&s, 0, sizeof(s));
+    
+    for (int i = 0; i < 4; i++) {
+        s.mp_matrix[i][0] = gfx_adjust_x_for_aspect_ratio(rsp.MP_matrix[i][0]);
+        s.mp_matrix[i][1] = rsp.MP_matrix[i][1];
+        s.mp_matrix[i][2] = rsp.MP_matrix[i][2];
+        s.mp_matrix[i][3] = rsp.MP_matrix[i][3];
+    }
+    
+    if (lit) {
+        gfx_update_lights();
+        const Light_t *ambient = &rsp.current_lights[rsp.current_num_lights - 1];
+        for (int i = 0; i < rsp.current_num_lights - 1 && i < GFX_TNL_MAX_LIGHTS; i++) {
+            for (int j = 0; j < 3; j++) {
+                s.light_dirs[i][j] = rsp.current_lights_coeffs[i][j] / 127.0f;
+                s.light_colors[i][j] = rsp.current_lights[i].col[j] / 255.0f;
+            }
+        }
+        for (int j = 0; j < 3; j++) {
+            s.light_colors[GFX_TNL_MAX_LIGHTS][j] = ambient->col[j] / 255.0f;
+        }
+    }
+    
+    if (rsp.geometry_mode & G_FOG) {
+        s.fog = true;
+        s.fog_mul = rsp.fog_mul;
+        s.fog_offset = rsp.fog_offset;
+    }
+    
+    if (gfx_tnl.current != TNL_NONE && gfx_tnl.snapshots[gfx_tnl.current].lit == lit &&
+        memcmp(&gfx_tnl.snapshots[gfx_tnl.current].state, &s, sizeof(s)) == 0) {
+        return;
+    }
+    
+    uint8_t next = gfx_tnl.current % TNL_SNAPSHOTS + 1;
+    for (int i = 0; i < MAX_VERTICES; i++) {
+        // Vertices still referring to the snapshot that's about to be replaced
+        if (rsp.loaded_vertices[i].tnl == next) {
+            gfx_tnl_materialize(&rsp.loaded_vertices[i]);
+        }
+    }
+    
+    gfx_tnl.current = next;
+    gfx_tnl.snapshots[next].state = s;
+    gfx_tnl.snapshots[next].lit = lit;
+    gfx_tnl.snapshots[next].id = ++gfx_tnl.next_id;
+}
+
+static void gfx_tnl_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
+    gfx_tnl_snapshot();
+    bool lit = gfx_tnl.snapshots[gfx_tnl.current].lit;
+    
     for (size_t i = 0; i < n_vertices; i++, dest_index++) {
         const Vtx_t *v = &vertices[i].v;
         const Vtx_tn *vn = &vertices[i].n;
         struct LoadedVertex *d = &rsp.loaded_vertices[dest_index];
         
-        float x = v->ob[0] * rsp.MP_matrix[0][0] + v->ob[1] * rsp.MP_matrix[1][0] + v->ob[2] * rsp.MP_matrix[2][0] + rsp.MP_matrix[3][0];
-        float y = v->ob[0] * rsp.MP_matrix[0][1] + v->ob[1] * rsp.MP_matrix[1][1] + v->ob[2] * rsp.MP_matrix[2][1] + rsp.MP_matrix[3][1];
-        float z = v->ob[0] * rsp.MP_matrix[0][2] + v->ob[1] * rsp.MP_matrix[1][2] + v->ob[2] * rsp.MP_matrix[2][2] + rsp.MP_matrix[3][2];
-        float w = v->ob[0] * rsp.MP_matrix[0][3] + v->ob[1] * rsp.MP_matrix[1][3] + v->ob[2] * rsp.MP_matrix[2][3] + rsp.MP_matrix[3][3];
-        
-        x = gfx_adjust_x_for_aspect_ratio(x);
+        d->ob[0] = v->ob[0];
+        d->ob[1] = v->ob[1];
+        d->ob[2] = v->ob[2];
+        if (lit) {
+            d->n[0] = vn->n[0];
+            d->n[1] = vn->n[1];
+            d->n[2] = vn->n[2];
+        } else {
+            d->color.r = v->cn[0];
+            d->color.g = v->cn[1];
+            d->color.b = v->cn[2];
+        }
+        d->color.a = v->cn[3]; // replaced by the fog factor when materialized
+        d->u = (short)(v->tc[0] * rsp.texture_scaling_factor.s >> 16);
+        d->v = (short)(v->tc[1] * rsp.texture_scaling_factor.t >> 16);
+        d->tnl = gfx_tnl.current;
+    }
+}
+
+// Checks whether the current combiner can be fed from the vertex shader.
+// Reads the RDP state directly, so it can be asked before gfx_update_draw_state
+// loads a program for either path.
+static bool gfx_tnl_can_draw(uint8_t tnl) {
+    bool use_fog = (rdp.other_mode_l >> 30) == G_BL_CLR_FOG;
+    if (gfx_tnl.snapshots[tnl].state.fog && !use_fog) {
+        // Fog factor used as shade alpha
+        return false;
+    }
+    
+    // Same selectors gfx_generate_cc ends up using: the alpha half only when
+    // blending, and neither half when it reduces to a constant
+    bool use_alpha = (rdp.other_mode_l & (G_BL_A_MEM << 18)) == 0 || (rdp.other_mode_l & CVG_X_ALPHA) == CVG_X_ALPHA;
+    for (int i = 0; i < (use_alpha ? 2 : 1); i++) {
+        uint8_t c[4];
+        for (int j = 0; j < 4; j++) {
+            c[j] = (rdp.combine_mode >> (i * 12 + j * 3)) & 7;
+        }
+        if (c[0] == c[1] || c[2] == CC_0) {
+            continue;
+        }
+        for (int j = 0; j < 4; j++) {
+            if (c[j] == CC_LOD) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void gfx_tnl_select(uint8_t tnl) {
+    uint32_t id = 0;
+    uint8_t cull_mode = GFX_CULL_NONE;
+    
+    if (tnl != TNL_NONE) {
+        id = gfx_tnl.snapshots[tnl].id;
+        switch (rsp.geometry_mode & G_CULL_BOTH) {
+            case G_CULL_FRONT:
+                cull_mode = GFX_CULL_FRONT;
+                break;
+            case G_CULL_BACK:
+                cull_mode = GFX_CULL_BACK;
+                break;
+            case G_CULL_BOTH:
+                cull_mode = GFX_CULL_BOTH;
+                break;
+        }
+    }
+    
+    if (id != rendering_state.tnl_id || cull_mode != rendering_state.cull_mode) {
+        gfx_flush(GFX_FLUSH_TNL);
+        if (tnl != TNL_NONE) {
+            struct GfxTnlState s = gfx_tnl.snapshots[tnl].state;
+            s.cull_mode = cull_mode;
+            gfx_rapi->set_tnl_state(&s);
+        } else {
+            gfx_rapi->set_tnl_state(NULL);
+        }
+        rendering_state.tnl_id = id;
+        rendering_state.cull_mode = cull_mode;
+    }
+}
+#endif
+
+static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
+#ifdef USE_INDEXED_DRAWING
+    gfx_index_invalidate(dest_index, n_vertices);
+#endif
+#ifdef USE_HW_TNL
+    if (gfx_tnl.supported && !(rsp.geometry_mode & G_TEXTURE_GEN)) {
+        gfx_tnl_sp_vertex(n_vertices, dest_index, vertices);
+        return;
+    }
+#endif
+    
+    bool fog = (rsp.geometry_mode & G_FOG) != 0;
+    gfx_transform_vertices(&rsp.loaded_vertices[dest_index], vertices, n_vertices, fog);
+    
+    if (rsp.geometry_mode & G_LIGHTING) {
+        gfx_update_lights();
+    }
+    
+    for (size_t i = 0; i < n_vertices; i++, dest_index++) {
+        const Vtx_t *v = &vertices[i].v;
+        const Vtx_tn *vn = &vertices[i].n;
+        struct LoadedVertex *d = &rsp.loaded_vertices[dest_index];
+#ifdef USE_HW_TNL
+        d->tnl = TNL_NONE;
+#endif
         
         short U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
         short V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
         
         if (rsp.geometry_mode & G_LIGHTING) {
-            if (rsp.lights_changed) {
-                for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                    calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
-                }
-                static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
-                static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
-                calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
-                calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
-                rsp.lights_changed = false;
-            }
-            
             int r = rsp.current_lights[rsp.current_num_lights - 1].col[0];
             int g = rsp.current_lights[rsp.current_num_lights - 1].col[1];
             int b = rsp.current_lights[rsp.current_num_lights - 1].col[2];
@@ -792,52 +2235,16 @@ static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *verti
         d->u = U;
         d->v = V;
         
-        // trivial clip rejection
-        d->clip_rej = 0;
-        if (x < -w) d->clip_rej |= 1;
-        if (x > w) d->clip_rej |= 2;
-        if (y < -w) d->clip_rej |= 4;
-        if (y > w) d->clip_rej |= 8;
-        if (z < -w) d->clip_rej |= 16;
-        if (z > w) d->clip_rej |= 32;
-        
-        d->x = x;
-        d->y = y;
-        d->z = z;
-        d->w = w;
-        
-        if (rsp.geometry_mode & G_FOG) {
-            if (fabsf(w) < 0.001f) {
-                // To avoid division by zero
-                w = 0.001f;
-            }
-            
-            float winv = 1.0f / w;
-            if (winv < 0.0f) {
-                winv = 32767.0f;
-            }
-            
-            float fog_z = z * winv * rsp.fog_mul + rsp.fog_offset;
-            if (fog_z < 0) fog_z = 0;
-            if (fog_z > 255) fog_z = 255;
-            d->color.a = fog_z; // Use alpha variable to store fog factor
-        } else {
+        if (!fog) {
             d->color.a = v->cn[3];
         }
     }
 }
 
-static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
-    struct LoadedVertex *v1 = &rsp.loaded_vertices[vtx1_idx];
-    struct LoadedVertex *v2 = &rsp.loaded_vertices[vtx2_idx];
-    struct LoadedVertex *v3 = &rsp.loaded_vertices[vtx3_idx];
-    struct LoadedVertex *v_arr[3] = {v1, v2, v3};
-    
-    //if (rand()%2) return;
-    
+static bool gfx_tri_is_rejected(const struct LoadedVertex *v1, const struct LoadedVertex *v2, const struct LoadedVertex *v3) {
     if (v1->clip_rej & v2->clip_rej & v3->clip_rej) {
         // The whole triangle lies outside the visible area
-        return;
+        return true;
     }
     
     if ((rsp.geometry_mode & G_CULL_BOTH) != 0) {
@@ -855,46 +2262,52 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
         
         switch (rsp.geometry_mode & G_CULL_BOTH) {
             case G_CULL_FRONT:
-                if (cross <= 0) return;
+                if (cross <= 0) return true;
                 break;
             case G_CULL_BACK:
-                if (cross >= 0) return;
+                if (cross >= 0) return true;
                 break;
             case G_CULL_BOTH:
                 // Why is this even an option?
-                return;
+                return true;
         }
     }
     
+    return false;
+}
+
+// Brings the backend up to date with the RSP/RDP state and returns what the
+// current combiner needs from every vertex.
+static void gfx_update_draw_state(struct DrawState *ds, bool hw_lighting) {
     bool depth_test = (rsp.geometry_mode & G_ZBUFFER) == G_ZBUFFER;
     if (depth_test != rendering_state.depth_test) {
-        gfx_flush();
+        gfx_flush(GFX_FLUSH_DEPTH);
         gfx_rapi->set_depth_test(depth_test);
         rendering_state.depth_test = depth_test;
     }
     
     bool z_upd = (rdp.other_mode_l & Z_UPD) == Z_UPD;
     if (z_upd != rendering_state.depth_mask) {
-        gfx_flush();
+        gfx_flush(GFX_FLUSH_DEPTH);
         gfx_rapi->set_depth_mask(z_upd);
         rendering_state.depth_mask = z_upd;
     }
     
     bool zmode_decal = (rdp.other_mode_l & ZMODE_DEC) == ZMODE_DEC;
     if (zmode_decal != rendering_state.decal_mode) {
-        gfx_flush();
+        gfx_flush(GFX_FLUSH_DEPTH);
         gfx_rapi->set_zmode_decal(zmode_decal);
         rendering_state.decal_mode = zmode_decal;
     }
     
     if (rdp.viewport_or_scissor_changed) {
         if (memcmp(&rdp.viewport, &rendering_state.viewport, sizeof(rdp.viewport)) != 0) {
-            gfx_flush();
+            gfx_flush(GFX_FLUSH_VIEWPORT);
             gfx_rapi->set_viewport(rdp.viewport.x, rdp.viewport.y, rdp.viewport.width, rdp.viewport.height);
             rendering_state.viewport = rdp.viewport;
         }
         if (memcmp(&rdp.scissor, &rendering_state.scissor, sizeof(rdp.scissor)) != 0) {
-            gfx_flush();
+            gfx_flush(GFX_FLUSH_SCISSOR);
             gfx_rapi->set_scissor(rdp.scissor.x, rdp.scissor.y, rdp.scissor.width, rdp.scissor.height);
             rendering_state.scissor = rdp.scissor;
         }
@@ -916,6 +2329,9 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     if (use_fog) cc_id |= SHADER_OPT_FOG;
     if (texture_edge) cc_id |= SHADER_OPT_TEXTURE_EDGE;
     if (use_noise) cc_id |= SHADER_OPT_NOISE;
+#ifdef USE_HW_TNL
+    if (hw_lighting) cc_id |= SHADER_OPT_LIGHTING;
+#endif
     
     if (!use_alpha) {
         cc_id &= ~0xfff000;
@@ -924,147 +2340,688 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     struct ColorCombiner *comb = gfx_lookup_or_create_color_combiner(cc_id);
     struct ShaderProgram *prg = comb->prg;
     if (prg != rendering_state.shader_program) {
-        gfx_flush();
+        gfx_flush(GFX_FLUSH_SHADER);
         gfx_rapi->unload_shader(rendering_state.shader_program);
         gfx_rapi->load_shader(prg);
         rendering_state.shader_program = prg;
+        gfx_stats.shader_switches++;
     }
     if (use_alpha != rendering_state.alpha_blend) {
-        gfx_flush();
+        gfx_flush(GFX_FLUSH_ALPHA);
         gfx_rapi->set_use_alpha(use_alpha);
         rendering_state.alpha_blend = use_alpha;
     }
+#ifdef USE_COLOR_UNIFORMS
+    if (gfx_colors.supported) {
+        // Only the colours this combiner reads have to be up to date
+        const uint8_t (*mapping)[4] = comb->shader_input_mapping;
+        bool prim = mapping[0][SHADER_INPUT_PRIM - 1] == CC_PRIM || mapping[1][SHADER_INPUT_PRIM - 1] == CC_PRIM;
+        bool env = mapping[0][SHADER_INPUT_ENV - 1] == CC_ENV || mapping[1][SHADER_INPUT_ENV - 1] == CC_ENV;
+        if ((prim && memcmp(&rdp.prim_color, &rendering_state.prim_color, sizeof(rdp.prim_color)) != 0) ||
+            (env && memcmp(&rdp.env_color, &rendering_state.env_color, sizeof(rdp.env_color)) != 0) ||
+            (use_fog && memcmp(&rdp.fog_color, &rendering_state.fog_color, 3) != 0)) {
+            gfx_flush(GFX_FLUSH_COLORS);
+            gfx_send_combiner_colors(&rdp.prim_color, &rdp.env_color, &rdp.fog_color);
+        }
+    }
+#endif
     uint8_t num_inputs;
     bool used_textures[2];
     gfx_rapi->shader_get_info(prg, &num_inputs, used_textures);
+#ifdef USE_UBER_SHADER
+    if (comb->uber) {
+        // The program samples both, but only what the combiner reads gets imported
+        used_textures[0] = comb->used_textures[0];
+        used_textures[1] = comb->used_textures[1];
+    }
+#endif
+    
+    bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
     
     for (int i = 0; i < 2; i++) {
         if (used_textures[i]) {
             if (rdp.textures_changed[i]) {
 #ifndef USE_TEXTURE_ATLAS
-                gfx_flush();
+                gfx_flush(GFX_FLUSH_TEXTURE);
 #endif
                 import_texture(i);
                 rdp.textures_changed[i] = false;
             }
-            bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
 
 #ifdef USE_TEXTURE_ATLAS
             if (rendering_state.linear_filter[i] != linear_filter) {
-                gfx_flush();
+                gfx_flush(GFX_FLUSH_TEXTURE);
                 gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
                 rendering_state.linear_filter[i] = linear_filter;
             }
+            
+            // A draw call samples one page per texture unit
+            int page = rendering_state.textures[i]->enc_sampler_params[0].sampler_0.page;
+            if (rendering_state.atlas_pages[i] != page) {
+                gfx_flush(GFX_FLUSH_TEXTURE);
+                gfx_rapi->bind_virtual_texture_page(i, page);
+                rendering_state.atlas_pages[i] = page;
+                gfx_texture_cache.page_binds++;
+            }
+            
+            // Wrap modes are applied when sampling, so they can change without another upload
+            encFloat_t *params = rendering_state.textures[i]->enc_sampler_params;
+            params[0].sampler_0.cms = rdp.texture_tile.cms;
+            params[1].sampler_1.cmt = rdp.texture_tile.cmt;
 #endif
 
-            if (linear_filter != rendering_state.textures[i]->linear_filter || rdp.texture_tile.cms != rendering_state.textures[i]->cms || rdp.texture_tile.cmt != rendering_state.textures[i]->cmt) {
+            // Sampler state belongs to the texture, which might be shared
+            struct TextureHashmapNode *tex = rendering_state.textures[i];
+            if (tex->shared != NULL) {
+                tex = tex->shared;
+            }
+            if (linear_filter != tex->linear_filter || rdp.texture_tile.cms != tex->cms || rdp.texture_tile.cmt != tex->cmt) {
 #ifndef USE_TEXTURE_ATLAS
-                gfx_flush();
+                gfx_flush(GFX_FLUSH_TEXTURE);
                 gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
 #endif
-                rendering_state.textures[i]->linear_filter = linear_filter;
-                rendering_state.textures[i]->cms = rdp.texture_tile.cms;
-                rendering_state.textures[i]->cmt = rdp.texture_tile.cmt;
+                tex->linear_filter = linear_filter;
+                tex->cms = rdp.texture_tile.cms;
+                tex->cmt = rdp.texture_tile.cmt;
+            }
+        }
+    }
+    
+    ds->comb = comb;
+    ds->num_inputs = num_inputs;
+    ds->used_textures[0] = used_textures[0];
+    ds->used_textures[1] = used_textures[1];
+    ds->use_texture = used_textures[0] || used_textures[1];
+    ds->use_alpha = use_alpha;
+    ds->use_fog = use_fog;
+    ds->linear_filter = linear_filter;
+    ds->tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
+    ds->tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
+    ds->z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
+#ifdef USE_HW_TNL
+    ds->hw_tnl = false;
+    ds->lit_input = comb->lit_input;
+#endif
+#ifdef USE_UBER_SHADER
+    ds->uber = comb->uber;
+#endif
+}
+
+static void gfx_texcoord(const struct LoadedVertex *v, const struct DrawState *ds, float uv[2]) {
+    float u = (v->u - rdp.texture_tile.uls * 8) / 32.0f;
+    float t = (v->v - rdp.texture_tile.ult * 8) / 32.0f;
+    if (ds->linear_filter) {
+        // Linear filter adds 0.5f to the coordinates
+        u += 0.5f;
+        t += 0.5f;
+    }
+    uv[0] = u / ds->tex_width;
+    uv[1] = t / ds->tex_height;
+}
+
+#ifdef USE_PACKED_VERTICES
+static inline void gfx_pack_bytes(float *dst, uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    uint8_t bytes[4] = {a, b, c, d};
+    memcpy(dst, bytes, sizeof(bytes));
+}
+
+static inline int16_t gfx_pack_texcoord(float coord, float origin, uint32_t cm) {
+    // Repeating and mirroring look the same two texture widths further, so
+    // the triangle gets moved next to the origin to keep it within 16 bits.
+    if (!(cm & G_TX_CLAMP)) {
+        coord -= 2.0f * floorf(origin / 2.0f);
+    }
+    float packed = roundf(coord * GFX_PACKED_UV_SCALE);
+    if (packed > INT16_MAX) packed = INT16_MAX;
+    if (packed < INT16_MIN) packed = INT16_MIN;
+    return (int16_t)packed;
+}
+#endif
+
+// Stores the fog factor in the word(s) gfx_emit_vertex_attribs wrote for fog.
+static inline void gfx_store_fog_factor(float *fog, uint8_t factor) {
+    int i = 3;
+#ifdef USE_COLOR_UNIFORMS
+    if (gfx_colors.supported) {
+        i = 0; // there's no colour before it
+    }
+#endif
+#ifdef USE_PACKED_VERTICES
+    ((uint8_t *)fog)[i] = factor;
+#else
+    fog[i] = factor / 255.0f;
+#endif
+}
+
+// Writes everything but the position of a vertex. v1 is the first vertex of
+// the triangle, which is what the LOD fraction is derived from.
+static size_t gfx_emit_vertex_attribs(float *dst, const struct LoadedVertex *v, const struct LoadedVertex *v1, const struct DrawState *ds) {
+    size_t len = 0;
+#ifdef USE_UBER_SHADER
+    // The uber program takes every attribute whatever the combiner reads
+    bool uber = ds->uber;
+#else
+    bool uber = false;
+#endif
+    
+    if (ds->use_texture || uber) {
+        float uv[2] = {0.0f, 0.0f};
+        if (ds->use_texture) {
+            gfx_texcoord(v, ds, uv);
+        }
+#ifdef USE_PACKED_VERTICES
+        float origin[2] = {0.0f, 0.0f};
+        if (ds->use_texture) {
+            gfx_texcoord(v1, ds, origin);
+        }
+        int16_t st[2] = {
+            gfx_pack_texcoord(uv[0], origin[0], rdp.texture_tile.cms),
+            gfx_pack_texcoord(uv[1], origin[1], rdp.texture_tile.cmt)
+        };
+        memcpy(&dst[len++], st, sizeof(st));
+#else
+        dst[len++] = uv[0];
+        dst[len++] = uv[1];
+#endif
+#ifdef USE_TEXTURE_ATLAS
+        for (int j = 0; j < 2; j++) {
+            if (ds->used_textures[j]) {
+                const struct TextureHashmapNode *tex = rendering_state.textures[j];
+#ifdef USE_PACKED_VERTICES
+                uint16_t params[4] = {
+                    tex->x,
+                    tex->y,
+                    tex->width | tex->enc_sampler_params[0].sampler_0.cms << 12,
+                    tex->height | tex->enc_sampler_params[1].sampler_1.cmt << 12
+                };
+                memcpy(&dst[len], params, sizeof(params));
+                len += 2;
+#else
+                dst[len++] = tex->enc_sampler_params[0].value;
+                dst[len++] = tex->enc_sampler_params[1].value;
+#endif
+            } else if (uber) {
+#ifdef USE_PACKED_VERTICES
+                memset(&dst[len], 0, 2 * sizeof(float));
+                len += 2;
+#else
+                // Decodes to an empty texture at the origin
+                dst[len++] = 1.0f;
+                dst[len++] = 1.0f;
+#endif
+            }
+        }
+#endif
+    }
+    
+    if (ds->use_fog || uber) {
+        float *fog = &dst[len];
+#ifdef USE_COLOR_UNIFORMS
+        if (gfx_colors.supported) {
+            dst[len++] = 0.0f; // just the factor, the colour is a uniform
+        } else
+#endif
+        {
+#ifdef USE_PACKED_VERTICES
+            gfx_pack_bytes(fog, rdp.fog_color.r, rdp.fog_color.g, rdp.fog_color.b, 0);
+            len += 1;
+#else
+            fog[0] = rdp.fog_color.r / 255.0f;
+            fog[1] = rdp.fog_color.g / 255.0f;
+            fog[2] = rdp.fog_color.b / 255.0f;
+            len += 4;
+#endif
+        }
+        gfx_store_fog_factor(fog, ds->use_fog ? v->color.a : 0); // fog factor (not alpha)
+    }
+    
+    for (int j = 0; j < ds->num_inputs; j++) {
+        const struct RGBA *color;
+        struct RGBA tmp;
+#ifdef USE_PACKED_VERTICES
+        uint8_t packed[4] = {0, 0, 0, 0};
+#endif
+#ifdef USE_COLOR_UNIFORMS
+        if (gfx_colors.supported && (j + 1 == SHADER_INPUT_PRIM || j + 1 == SHADER_INPUT_ENV)) {
+            continue;
+        }
+#endif
+        for (int k = 0; k < 1 + (ds->use_alpha || uber ? 1 : 0); k++) {
+            switch (ds->comb->shader_input_mapping[k][j]) {
+                case CC_PRIM:
+                    color = &rdp.prim_color;
+                    break;
+                case CC_SHADE:
+                    color = &v->color;
+                    break;
+                case CC_ENV:
+                    color = &rdp.env_color;
+                    break;
+                case CC_LOD:
+                {
+                    float distance_frac = (v1->w - 3000.0f) / 3000.0f;
+                    if (distance_frac < 0.0f) distance_frac = 0.0f;
+                    if (distance_frac > 1.0f) distance_frac = 1.0f;
+                    tmp.r = tmp.g = tmp.b = tmp.a = distance_frac * 255.0f;
+                    color = &tmp;
+                    break;
+                }
+                default:
+                    memset(&tmp, 0, sizeof(tmp));
+                    color = &tmp;
+                    break;
+            }
+#ifdef USE_PACKED_VERTICES
+            if (k == 0) {
+                packed[0] = color->r;
+                packed[1] = color->g;
+                packed[2] = color->b;
+            } else {
+                // Shade alpha is 100% for fog
+                packed[3] = ds->use_fog && color == &v->color ? 255 : color->a;
+            }
+#else
+            if (k == 0) {
+                dst[len++] = color->r / 255.0f;
+                dst[len++] = color->g / 255.0f;
+                dst[len++] = color->b / 255.0f;
+            } else {
+                if (ds->use_fog && color == &v->color) {
+                    // Shade alpha is 100% for fog
+                    dst[len++] = 1.0f;
+                } else {
+                    dst[len++] = color->a / 255.0f;
+                }
+            }
+#endif
+        }
+#ifdef USE_PACKED_VERTICES
+        gfx_pack_bytes(&dst[len++], packed[0], packed[1], packed[2], packed[3]);
+#endif
+    }
+    
+#ifdef USE_UBER_SHADER
+    if (uber) {
+        const uint16_t *params = ds->comb->uber_params;
+#ifdef USE_PACKED_VERTICES
+        uint16_t words[4] = {params[0], params[1], params[2], 0};
+        memcpy(&dst[len], words, sizeof(words));
+        len += 2;
+#else
+        dst[len++] = params[0];
+        dst[len++] = params[1];
+        dst[len++] = params[2];
+        dst[len++] = 0.0f;
+#endif
+    }
+#endif
+    
+    return len;
+}
+
+static void gfx_emit_vertex_position(const struct LoadedVertex *v, const struct DrawState *ds) {
+#ifdef USE_HW_TNL
+    if (ds->hw_tnl) {
+        buf_vbo[buf_vbo_len++] = v->ob[0];
+        buf_vbo[buf_vbo_len++] = v->ob[1];
+        buf_vbo[buf_vbo_len++] = v->ob[2];
+        buf_vbo[buf_vbo_len++] = 1.0f;
+        if (ds->lit_input) {
+            buf_vbo[buf_vbo_len++] = v->n[0];
+            buf_vbo[buf_vbo_len++] = v->n[1];
+            buf_vbo[buf_vbo_len++] = v->n[2];
+        }
+        return;
+    }
+#endif
+    float z = v->z, w = v->w;
+    if (ds->z_is_from_0_to_1) {
+        z = (z + w) / 2.0f;
+    }
+    buf_vbo[buf_vbo_len++] = v->x;
+    buf_vbo[buf_vbo_len++] = v->y;
+    buf_vbo[buf_vbo_len++] = z;
+    buf_vbo[buf_vbo_len++] = w;
+}
+
+// Counts a triangle whose indices are already in place.
+static void gfx_count_tri(void) {
+    if (++buf_vbo_num_tris == MAX_BUFFERED) {
+        gfx_flush(GFX_FLUSH_BUFFER_FULL);
+    }
+}
+
+// Finishes a triangle whose three vertices were just written to buf_vbo.
+static void gfx_end_tri(void) {
+#ifdef USE_STATE_SORTING
+    if (gfx_batch.current != NULL) {
+        gfx_batch_append();
+        return;
+    }
+#endif
+#ifdef USE_INDEXED_DRAWING
+    gfx_index_sequential(1);
+#endif
+    gfx_count_tri();
+}
+
+#ifdef USE_INDEXED_DRAWING
+#ifdef USE_PACKED_VERTICES
+// Whether the texture coordinates still fit after being moved next to origin.
+static bool gfx_texcoord_fits(const struct LoadedVertex *v, const struct LoadedVertex *origin, const struct DrawState *ds) {
+    const uint32_t cm[2] = {rdp.texture_tile.cms, rdp.texture_tile.cmt};
+    float uv[2], o[2];
+    gfx_texcoord(v, ds, uv);
+    gfx_texcoord(origin, ds, o);
+    for (int i = 0; i < 2; i++) {
+        if (cm[i] & G_TX_CLAMP) {
+            continue; // saturates the same either way
+        }
+        float packed = (uv[i] - 2.0f * floorf(o[i] / 2.0f)) * GFX_PACKED_UV_SCALE;
+        if (packed > INT16_MAX || packed < INT16_MIN) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// Starts a new generation if the attribute state changed since the last one,
+// returns whether triangles drawn with ds may share vertices at all.
+static bool gfx_index_begin(const struct DrawState *ds) {
+    if (!gfx_index.supported) {
+        return false;
+    }
+#ifdef USE_STATE_SORTING
+    if (gfx_batch.current != NULL) {
+        return false; // buckets hold whole triangles
+    }
+#endif
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < ds->num_inputs; j++) {
+            if (ds->comb->shader_input_mapping[i][j] == CC_LOD) {
+                return false; // taken from the first vertex of each triangle
             }
         }
     }
     
-    bool use_texture = used_textures[0] || used_textures[1];
-    uint32_t tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
-    uint32_t tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
+    struct VertexShareKey key;
+    memset(&key, 0, sizeof(key));
+    key.comb = ds->comb;
+    key.tex_width = ds->tex_width;
+    key.tex_height = ds->tex_height;
+    key.uls = rdp.texture_tile.uls;
+    key.ult = rdp.texture_tile.ult;
+    key.cms = rdp.texture_tile.cms;
+    key.cmt = rdp.texture_tile.cmt;
+    key.linear_filter = ds->linear_filter;
+#ifdef USE_HW_TNL
+    key.hw_tnl = ds->hw_tnl;
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    if (!gfx_colors.supported)
+#endif
+    {
+        key.env_color = rdp.env_color;
+        key.prim_color = rdp.prim_color;
+        key.fog_color = rdp.fog_color;
+    }
+#ifdef USE_TEXTURE_ATLAS
+    for (int i = 0; i < 2; i++) {
+        if (ds->used_textures[i]) {
+            memcpy(key.sampler_params[i], rendering_state.textures[i]->enc_sampler_params, sizeof(key.sampler_params[i]));
+        }
+    }
+#endif
+    if (memcmp(&key, &gfx_index.key, sizeof(key)) != 0) {
+        gfx_index.key = key;
+        gfx_index.generation++;
+    }
+    return true;
+}
+
+// Whether the triangle can reuse vertices already in buf_vbo.
+static bool gfx_index_fits(struct LoadedVertex *v_arr[3], const struct DrawState *ds) {
+    if (gfx_index.origin_generation != gfx_index.generation) {
+        gfx_index.origin = *v_arr[0];
+        gfx_index.origin_generation = gfx_index.generation;
+    }
+#ifdef USE_PACKED_VERTICES
+    if (ds->use_texture) {
+        for (int i = 0; i < 3; i++) {
+            if (!gfx_texcoord_fits(v_arr[i], &gfx_index.origin, ds)) {
+                return false;
+            }
+        }
+    }
+#endif
+    return true;
+}
+
+static bool gfx_index_can_share(struct LoadedVertex *v_arr[3], const struct DrawState *ds) {
+    return gfx_index_begin(ds) && gfx_index_fits(v_arr, ds);
+}
+
+// Returns where the vertex in the given slot is in buf_vbo, writing it first
+// if the current generation doesn't have it yet.
+static uint16_t gfx_index_vertex(uint8_t slot, const struct LoadedVertex *v, const struct DrawState *ds) {
+    if (gfx_index.slot_generation[slot] == gfx_index.generation) {
+        gfx_index.shared++;
+        return gfx_index.slot_index[slot];
+    }
+    gfx_emit_vertex_position(v, ds);
+    buf_vbo_len += gfx_emit_vertex_attribs(&buf_vbo[buf_vbo_len], v, &gfx_index.origin, ds);
+    gfx_index.slot_generation[slot] = gfx_index.generation;
+    gfx_index.slot_index[slot] = buf_vbo_num_verts;
+    return buf_vbo_num_verts++;
+}
+#endif
+
+#ifdef USE_TRI_BATCHING
+#define TRI_BATCH_MAX 64
+
+// Projected positions of the vertices used by the current triangle run,
+// valid for the slots whose stamp matches run.
+static struct {
+    float sx[MAX_VERTICES + 4], sy[MAX_VERTICES + 4];
+    uint32_t stamp[MAX_VERTICES + 4];
+    uint32_t run;
+    uint32_t tris, culled; // this frame
+} gfx_tri_batch;
+#endif
+
+static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
+    struct LoadedVertex *v1 = &rsp.loaded_vertices[vtx1_idx];
+    struct LoadedVertex *v2 = &rsp.loaded_vertices[vtx2_idx];
+    struct LoadedVertex *v3 = &rsp.loaded_vertices[vtx3_idx];
+    struct LoadedVertex *v_arr[3] = {v1, v2, v3};
+    
+    //if (rand()%2) return;
     
-    bool z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
+    gfx_stats.tris_submitted++;
+    struct DrawState ds;
+#ifdef USE_HW_TNL
+    uint8_t tnl = v1->tnl;
+    bool hw_tnl = tnl != TNL_NONE && v2->tnl == tnl && v3->tnl == tnl && gfx_tnl_can_draw(tnl);
+    if (hw_tnl) {
+        gfx_update_draw_state(&ds, gfx_tnl.snapshots[tnl].lit);
+    } else {
+        for (int i = 0; i < 3; i++) {
+            if (v_arr[i]->tnl != TNL_NONE) {
+                gfx_tnl_materialize(v_arr[i]);
+            }
+        }
+        if (gfx_tri_is_rejected(v1, v2, v3)) {
+            gfx_stats.tris_culled++;
+            return;
+        }
+        gfx_update_draw_state(&ds, false);
+    }
+    ds.hw_tnl = hw_tnl;
+#ifdef USE_STATE_SORTING
+    gfx_batch_select(&ds);
+#endif
+    if (gfx_tnl.supported) {
+        gfx_tnl_select(hw_tnl ? tnl : TNL_NONE);
+    }
+#else
+    if (gfx_tri_is_rejected(v1, v2, v3)) {
+        gfx_stats.tris_culled++;
+        return;
+    }
+    
+    gfx_update_draw_state(&ds, false);
+#ifdef USE_STATE_SORTING
+    gfx_batch_select(&ds);
+#endif
+#endif
+    
+#ifdef USE_INDEXED_DRAWING
+    if (gfx_index_can_share(v_arr, &ds)) {
+        uint8_t slots[3] = {vtx1_idx, vtx2_idx, vtx3_idx};
+        for (int i = 0; i < 3; i++) {
+            buf_ibo[buf_vbo_num_tris * 3 + i] = gfx_index_vertex(slots[i], v_arr[i], &ds);
+        }
+        gfx_count_tri();
+        return;
+    }
+#endif
     
     for (int i = 0; i < 3; i++) {
-        float z = v_arr[i]->z, w = v_arr[i]->w;
-        if (z_is_from_0_to_1) {
-            z = (z + w) / 2.0f;
-        }
-        buf_vbo[buf_vbo_len++] = v_arr[i]->x;
-        buf_vbo[buf_vbo_len++] = v_arr[i]->y;
-        buf_vbo[buf_vbo_len++] = z;
-        buf_vbo[buf_vbo_len++] = w;
+        gfx_emit_vertex_position(v_arr[i], &ds);
+        buf_vbo_len += gfx_emit_vertex_attribs(&buf_vbo[buf_vbo_len], v_arr[i], v1, &ds);
+    }
+    gfx_end_tri();
+}
+
+#ifdef USE_TRI_BATCHING
+// Draws a run of triangles that share all RSP/RDP state. Clip rejection and
+// culling are done for the whole run first, with x/w and y/w computed once per
+// vertex instead of for every triangle corner, then the draw state is brought up to
+// date once and only the survivors get packed.
+static void gfx_sp_tris(const uint8_t (*idx)[3], size_t n) {
+#ifdef USE_HW_TNL
+    if (gfx_tnl.supported) {
+        // Runs with vertices left to the GPU go one by one, those aren't
+        // transformed on the CPU and get culled by the GPU instead
+        bool gpu = false;
+        for (size_t t = 0; t < n; t++) {
+            gpu |= (rsp.loaded_vertices[idx[t][0]].tnl | rsp.loaded_vertices[idx[t][1]].tnl |
+                    rsp.loaded_vertices[idx[t][2]].tnl) != TNL_NONE;
+        }
+        if (gpu) {
+            for (size_t t = 0; t < n; t++) {
+                gfx_sp_tri1(idx[t][0], idx[t][1], idx[t][2]);
+            }
+            return;
+        }
+    }
+#endif
+    uint32_t cull = rsp.geometry_mode & G_CULL_BOTH;
+    gfx_tri_batch.tris += n;
+    gfx_stats.tris_submitted += n;
+    if (cull == G_CULL_BOTH) {
+        gfx_tri_batch.culled += n;
+        gfx_stats.tris_culled += n;
+        return;
+    }
+    
+    if (++gfx_tri_batch.run == 0) {
+        memset(gfx_tri_batch.stamp, 0, sizeof(gfx_tri_batch.stamp));
+        gfx_tri_batch.run = 1;
+    }
+    
+    float dx1[TRI_BATCH_MAX], dy1[TRI_BATCH_MAX], dx2[TRI_BATCH_MAX], dy2[TRI_BATCH_MAX];
+    float sign[TRI_BATCH_MAX];
+    bool keep[TRI_BATCH_MAX];
+    for (size_t t = 0; t < n; t++) {
+        const struct LoadedVertex *v1 = &rsp.loaded_vertices[idx[t][0]];
+        const struct LoadedVertex *v2 = &rsp.loaded_vertices[idx[t][1]];
+        const struct LoadedVertex *v3 = &rsp.loaded_vertices[idx[t][2]];
+        keep[t] = (v1->clip_rej & v2->clip_rej & v3->clip_rej) == 0;
+        if (cull == 0) {
+            continue;
+        }
         
-        if (use_texture) {
-            float u = (v_arr[i]->u - rdp.texture_tile.uls * 8) / 32.0f;
-            float v = (v_arr[i]->v - rdp.texture_tile.ult * 8) / 32.0f;
-            if ((rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT) {
-                // Linear filter adds 0.5f to the coordinates
-                u += 0.5f;
-                v += 0.5f;
+        float sx[3], sy[3];
+        for (int i = 0; i < 3; i++) {
+            uint8_t slot = idx[t][i];
+            if (gfx_tri_batch.stamp[slot] != gfx_tri_batch.run) {
+                const struct LoadedVertex *v = &rsp.loaded_vertices[slot];
+                // Divided like gfx_tri_is_rejected does, so both cull the same triangles
+                gfx_tri_batch.sx[slot] = v->x / v->w;
+                gfx_tri_batch.sy[slot] = v->y / v->w;
+                gfx_tri_batch.stamp[slot] = gfx_tri_batch.run;
             }
-            buf_vbo[buf_vbo_len++] = u / tex_width;
-            buf_vbo[buf_vbo_len++] = v / tex_height;
-#ifdef USE_TEXTURE_ATLAS
-            for (int j = 0; j < 2; j++) {
-                if (used_textures[j]) {
-                    buf_vbo[buf_vbo_len++] = rendering_state.textures[j]->enc_sampler_params[0].value;
-                    buf_vbo[buf_vbo_len++] = rendering_state.textures[j]->enc_sampler_params[1].value;
-                }
+            sx[i] = gfx_tri_batch.sx[slot];
+            sy[i] = gfx_tri_batch.sy[slot];
+        }
+        dx1[t] = sx[0] - sx[1];
+        dy1[t] = sy[0] - sy[1];
+        dx2[t] = sx[2] - sx[1];
+        dy2[t] = sy[2] - sy[1];
+        // With one vertex behind the eye the winding flips, see gfx_tri_is_rejected
+        sign[t] = ((v1->w < 0) ^ (v2->w < 0) ^ (v3->w < 0)) ? -1.0f : 1.0f;
+    }
+    if (cull != 0) {
+        // Culling front faces keeps positive cross products, back faces negative
+        // ones. Written so that a NaN keeps the triangle, like the scalar test.
+        float facing = cull == G_CULL_FRONT ? 1.0f : -1.0f;
+        for (size_t t = 0; t < n; t++) {
+            float cross = (dx1[t] * dy2[t] - dy1[t] * dx2[t]) * sign[t];
+            keep[t] = keep[t] && !(cross * facing <= 0.0f);
+        }
+    }
+    
+    struct DrawState ds;
+#ifdef USE_INDEXED_DRAWING
+    bool share = false;
+#endif
+    size_t drawn = 0;
+    for (size_t t = 0; t < n; t++) {
+        if (!keep[t]) {
+            continue;
+        }
+        if (drawn++ == 0) {
+            gfx_update_draw_state(&ds, false);
+#ifdef USE_HW_TNL
+            ds.hw_tnl = false;
+#endif
+#ifdef USE_STATE_SORTING
+            gfx_batch_select(&ds);
+#endif
+#ifdef USE_HW_TNL
+            if (gfx_tnl.supported) {
+                gfx_tnl_select(TNL_NONE);
             }
+#endif
+#ifdef USE_INDEXED_DRAWING
+            share = gfx_index_begin(&ds);
 #endif
         }
         
-        if (use_fog) {
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.r / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.g / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.b / 255.0f;
-            buf_vbo[buf_vbo_len++] = v_arr[i]->color.a / 255.0f; // fog factor (not alpha)
-        }
-        
-        for (int j = 0; j < num_inputs; j++) {
-            struct RGBA *color;
-            struct RGBA tmp;
-            for (int k = 0; k < 1 + (use_alpha ? 1 : 0); k++) {
-                switch (comb->shader_input_mapping[k][j]) {
-                    case CC_PRIM:
-                        color = &rdp.prim_color;
-                        break;
-                    case CC_SHADE:
-                        color = &v_arr[i]->color;
-                        break;
-                    case CC_ENV:
-                        color = &rdp.env_color;
-                        break;
-                    case CC_LOD:
-                    {
-                        float distance_frac = (v1->w - 3000.0f) / 3000.0f;
-                        if (distance_frac < 0.0f) distance_frac = 0.0f;
-                        if (distance_frac > 1.0f) distance_frac = 1.0f;
-                        tmp.r = tmp.g = tmp.b = tmp.a = distance_frac * 255.0f;
-                        color = &tmp;
-                        break;
-                    }
-                    default:
-                        memset(&tmp, 0, sizeof(tmp));
-                        color = &tmp;
-                        break;
-                }
-                if (k == 0) {
-                    buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->b / 255.0f;
-                } else {
-                    if (use_fog && color == &v_arr[i]->color) {
-                        // Shade alpha is 100% for fog
-                        buf_vbo[buf_vbo_len++] = 1.0f;
-                    } else {
-                        buf_vbo[buf_vbo_len++] = color->a / 255.0f;
-                    }
-                }
+        struct LoadedVertex *v_arr[3] = {
+            &rsp.loaded_vertices[idx[t][0]], &rsp.loaded_vertices[idx[t][1]], &rsp.loaded_vertices[idx[t][2]]
+        };
+#ifdef USE_INDEXED_DRAWING
+        if (share && gfx_index_fits(v_arr, &ds)) {
+            for (int i = 0; i < 3; i++) {
+                buf_ibo[buf_vbo_num_tris * 3 + i] = gfx_index_vertex(idx[t][i], v_arr[i], &ds);
             }
+            gfx_count_tri();
+            continue;
         }
-        /*struct RGBA *color = &v_arr[i]->color;
-        buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->b / 255.0f;
-        buf_vbo[buf_vbo_len++] = color->a / 255.0f;*/
-    }
-    if (++buf_vbo_num_tris == MAX_BUFFERED) {
-        printf("Vertex buffer overflow!\n");
-        gfx_flush();
+#endif
+        for (int i = 0; i < 3; i++) {
+            gfx_emit_vertex_position(v_arr[i], &ds);
+            buf_vbo_len += gfx_emit_vertex_attribs(&buf_vbo[buf_vbo_len], v_arr[i], v_arr[0], &ds);
+        }
+        gfx_end_tri();
     }
+    gfx_tri_batch.culled += n - drawn;
+    gfx_stats.tris_culled += n - drawn;
 }
+#endif
 
 static void gfx_sp_geometry_mode(uint32_t clear, uint32_t set) {
     rsp.geometry_mode &= ~clear;
@@ -1357,6 +3314,9 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     struct LoadedVertex* ll = &rsp.loaded_vertices[MAX_VERTICES + 1];
     struct LoadedVertex* lr = &rsp.loaded_vertices[MAX_VERTICES + 2];
     struct LoadedVertex* ur = &rsp.loaded_vertices[MAX_VERTICES + 3];
+#ifdef USE_INDEXED_DRAWING
+    gfx_index_invalidate(MAX_VERTICES, 4);
+#endif
     
     ul->x = ulxf;
     ul->y = ulyf;
@@ -1498,6 +3458,500 @@ static inline void *seg_addr(uintptr_t w1) {
 #define C0(pos, width) ((cmd->words.w0 >> (pos)) & ((1U << width) - 1))
 #define C1(pos, width) ((cmd->words.w1 >> (pos)) & ((1U << width) - 1))
 
+static inline void gfx_decode_tri1(const Gfx *cmd, uint8_t idx[3]) {
+#ifdef F3DEX_GBI_2
+    idx[0] = C0(16, 8) / 2;
+    idx[1] = C0(8, 8) / 2;
+    idx[2] = C0(0, 8) / 2;
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    idx[0] = C1(16, 8) / 2;
+    idx[1] = C1(8, 8) / 2;
+    idx[2] = C1(0, 8) / 2;
+#else
+    idx[0] = C1(16, 8) / 10;
+    idx[1] = C1(8, 8) / 10;
+    idx[2] = C1(0, 8) / 10;
+#endif
+}
+
+#ifdef USE_TRI_BATCHING
+static inline bool gfx_is_tri_opcode(uint32_t opcode) {
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    return opcode == (uint8_t)G_TRI1 || opcode == (uint8_t)G_TRI2;
+#else
+    return opcode == (uint8_t)G_TRI1;
+#endif
+}
+
+// Decodes the run of triangle commands starting at cmd and draws it in one go.
+// Returns the last command that was part of the run.
+static Gfx *gfx_run_tris(Gfx *cmd) {
+    uint8_t idx[TRI_BATCH_MAX][3];
+    size_t n = 0;
+    
+    for (;;) {
+        if ((cmd->words.w0 >> 24) == (uint8_t)G_TRI1) {
+            gfx_decode_tri1(cmd, idx[n++]);
+        }
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+        else {
+            idx[n][0] = C0(16, 8) / 2;
+            idx[n][1] = C0(8, 8) / 2;
+            idx[n++][2] = C0(0, 8) / 2;
+            idx[n][0] = C1(16, 8) / 2;
+            idx[n][1] = C1(8, 8) / 2;
+            idx[n++][2] = C1(0, 8) / 2;
+        }
+#endif
+        // The rest becomes the next run once a G_TRI2 might not fit anymore
+        if (n > TRI_BATCH_MAX - 2 || !gfx_is_tri_opcode(cmd[1].words.w0 >> 24)) {
+            break;
+        }
+        cmd++;
+    }
+    
+    gfx_sp_tris(idx, n);
+    return cmd;
+}
+#endif
+
+#ifdef USE_DL_CACHE
+// Static geometry cache.
+// Level geometry and model parts are split into one display list per texture,
+// made of nothing but vertex loads and triangles. The first time such a list
+// is called with a given render state it gets translated into its model space
+// vertices, an index list and the already packed vertex attributes, so later
+// calls only transform the positions and copy the rest into buf_vbo.
+
+#define DL_CACHE_HASH_SIZE 1024
+#define DL_CACHE_MAX_ENTRIES 1024
+#define DL_CACHE_MAX_VERTICES 512
+#define DL_CACHE_MAX_TRIS 1024
+#define DL_CACHE_MAX_COMMANDS 2048
+
+// Everything that ends up baked into the translated vertex attributes.
+struct DisplayListCacheKey {
+    uint32_t geometry_mode;
+    uint32_t other_mode_l, other_mode_h;
+    uint32_t combine_mode;
+    uint16_t sc, tc;
+    uint16_t uls, ult, lrs, lrt;
+    struct RGBA env_color, prim_color, fog_color;
+    const struct TextureHashmapNode *textures[2];
+#ifdef USE_TEXTURE_ATLAS
+    uint32_t sampler_params[2][2];
+#endif
+};
+
+struct DisplayListCacheVertex {
+    float ob[3];
+    float u, v;
+    struct RGBA color;
+    uint8_t slot; // Where G_VTX put it in rsp.loaded_vertices
+};
+
+struct DisplayListCacheEntry {
+    struct DisplayListCacheEntry *next;
+    const Gfx *addr;
+    uint32_t content_hash;
+    uint32_t checked_frame; // when content_hash was last compared
+    struct DisplayListCacheKey key;
+    uint16_t num_vertices;
+    uint16_t num_tris;
+    uint8_t attribs_len; // floats per vertex, position excluded
+    int8_t fog_offset; // index of the fog attribute, -1 if the factor is static
+    struct DisplayListCacheVertex *vertices;
+    uint16_t *indices;
+    float *attribs;
+};
+
+static struct {
+    struct DisplayListCacheEntry *hashmap[DL_CACHE_HASH_SIZE];
+    struct DisplayListCacheEntry pool[DL_CACHE_MAX_ENTRIES];
+    uint32_t pool_pos;
+    uint32_t frame;
+} gfx_dl_cache;
+
+static inline void gfx_decode_vtx(const Gfx *cmd, size_t *n_vertices, size_t *dest_index, const Vtx **vertices) {
+#ifdef F3DEX_GBI_2
+    *n_vertices = C0(12, 8);
+    *dest_index = C0(1, 7) - C0(12, 8);
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    *n_vertices = C0(10, 6);
+    *dest_index = C0(16, 8) / 2;
+#else
+    *n_vertices = (C0(0, 16)) / sizeof(Vtx);
+    *dest_index = C0(16, 4);
+#endif
+    *vertices = (const Vtx *) seg_addr(cmd->words.w1);
+}
+
+static inline uint32_t gfx_dl_cache_hash(uint32_t hash, const void *data, size_t len) {
+    // MurmurHash3's block mix, a word at a time. Commands and vertices are
+    // always a whole number of words.
+    const uint32_t *p = (const uint32_t *) data;
+    for (size_t i = 0; i < len / 4; i++) {
+        uint32_t k = p[i] * 0xcc9e2d51U;
+        k = (k << 15 | k >> 17) * 0x1b873593U;
+        hash ^= k;
+        hash = (hash << 13 | hash >> 19) * 5 + 0xe6546b64U;
+    }
+    return hash;
+}
+
+// Checks whether a display list only contains geometry and hashes its contents,
+// including the vertices it loads, so lists that get rewritten in place (gfx
+// pool reuse, Goddard, paintings) are caught. Done once per list and frame.
+static bool gfx_dl_cache_scan(const Gfx *cmd, uint32_t *hash, uint16_t *num_vertices, uint16_t *num_tris) {
+    uint32_t h = 2166136261U;
+    size_t vertices = 0, tris = 0;
+    
+    for (int i = 0; i < DL_CACHE_MAX_COMMANDS; i++, cmd++) {
+        uint32_t opcode = cmd->words.w0 >> 24;
+        h = gfx_dl_cache_hash(h, &cmd->words, sizeof(cmd->words));
+        
+        switch (opcode) {
+            case G_VTX: {
+                size_t n, dest;
+                const Vtx *v;
+                gfx_decode_vtx(cmd, &n, &dest, &v);
+                if (dest + n > MAX_VERTICES) {
+                    return false;
+                }
+                h = gfx_dl_cache_hash(h, v, n * sizeof(Vtx));
+                vertices += n;
+                break;
+            }
+            case (uint8_t)G_TRI1:
+                tris++;
+                break;
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+            case (uint8_t)G_TRI2:
+                tris += 2;
+                break;
+#endif
+            case G_NOOP:
+                break;
+            case (uint8_t)G_ENDDL:
+                if (tris == 0 || vertices > DL_CACHE_MAX_VERTICES || tris > DL_CACHE_MAX_TRIS) {
+                    return false;
+                }
+                *hash = h;
+                *num_vertices = vertices;
+                *num_tris = tris;
+                return true;
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+static void gfx_dl_cache_make_key(struct DisplayListCacheKey *key, const struct DrawState *ds) {
+    memset(key, 0, sizeof(*key));
+    key->geometry_mode = rsp.geometry_mode;
+    key->other_mode_l = rdp.other_mode_l;
+    key->other_mode_h = rdp.other_mode_h;
+    key->combine_mode = rdp.combine_mode;
+    key->sc = rsp.texture_scaling_factor.s;
+    key->tc = rsp.texture_scaling_factor.t;
+    key->uls = rdp.texture_tile.uls;
+    key->ult = rdp.texture_tile.ult;
+    key->lrs = rdp.texture_tile.lrs;
+    key->lrt = rdp.texture_tile.lrt;
+#ifdef USE_COLOR_UNIFORMS
+    if (!gfx_colors.supported)
+#endif
+    {
+        key->env_color = rdp.env_color;
+        key->prim_color = rdp.prim_color;
+        key->fog_color = rdp.fog_color;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (ds->used_textures[i]) {
+            key->textures[i] = rendering_state.textures[i];
+#ifdef USE_TEXTURE_ATLAS
+            memcpy(key->sampler_params[i], rendering_state.textures[i]->enc_sampler_params, sizeof(key->sampler_params[i]));
+#endif
+        }
+    }
+}
+
+// Vertex attributes can only be baked if they don't depend on the transform.
+static bool gfx_dl_cache_state_is_static(const struct DrawState *ds) {
+    if (rsp.geometry_mode & G_LIGHTING) {
+        return false;
+    }
+    if ((rsp.geometry_mode & G_FOG) && !ds->use_fog) {
+        // Fog factor ends up as shade alpha
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < ds->num_inputs; j++) {
+            if (ds->comb->shader_input_mapping[i][j] == CC_LOD) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void gfx_dl_cache_free_entry(struct DisplayListCacheEntry *entry) {
+    // vertices, indices and attributes share a single allocation
+    free(entry->vertices);
+    entry->vertices = NULL;
+    entry->indices = NULL;
+    entry->attribs = NULL;
+}
+
+static struct DisplayListCacheEntry *gfx_dl_cache_find(const Gfx *addr) {
+    size_t hash = ((uintptr_t)addr >> 3) & (DL_CACHE_HASH_SIZE - 1);
+    for (struct DisplayListCacheEntry *node = gfx_dl_cache.hashmap[hash]; node != NULL; node = node->next) {
+        if (node->addr == addr) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static struct DisplayListCacheEntry *gfx_dl_cache_insert(const Gfx *addr) {
+    size_t hash = ((uintptr_t)addr >> 3) & (DL_CACHE_HASH_SIZE - 1);
+    struct DisplayListCacheEntry **node = &gfx_dl_cache.hashmap[hash];
+    
+    if (gfx_dl_cache.pool_pos == DL_CACHE_MAX_ENTRIES) {
+        // Pool is full. Just like the texture cache, drop everything and start over.
+        for (uint32_t i = 0; i < gfx_dl_cache.pool_pos; i++) {
+            gfx_dl_cache_free_entry(&gfx_dl_cache.pool[i]);
+        }
+        memset(gfx_dl_cache.hashmap, 0, sizeof(gfx_dl_cache.hashmap));
+        gfx_dl_cache.pool_pos = 0;
+        node = &gfx_dl_cache.hashmap[hash];
+    }
+    
+    struct DisplayListCacheEntry *entry = &gfx_dl_cache.pool[gfx_dl_cache.pool_pos++];
+    memset(entry, 0, sizeof(*entry));
+    entry->addr = addr;
+    entry->next = *node;
+    *node = entry;
+    return entry;
+}
+
+static bool gfx_dl_cache_translate(struct DisplayListCacheEntry *entry, const Gfx *cmd, uint16_t num_vertices, uint16_t num_tris, const struct DrawState *ds) {
+    gfx_dl_cache_free_entry(entry);
+    
+    float attribs[32];
+    struct LoadedVertex lv;
+    memset(&lv, 0, sizeof(lv));
+    size_t attribs_len = gfx_emit_vertex_attribs(attribs, &lv, &lv, ds);
+    
+    char *mem = malloc(num_vertices * sizeof(struct DisplayListCacheVertex) +
+                       num_tris * 3 * sizeof(uint16_t) +
+                       num_tris * 3 * attribs_len * sizeof(float) + sizeof(float));
+    if (mem == NULL) {
+        return false;
+    }
+    entry->vertices = (struct DisplayListCacheVertex *) mem;
+    entry->attribs = (float *) (mem + num_vertices * sizeof(struct DisplayListCacheVertex));
+    entry->indices = (uint16_t *) (entry->attribs + num_tris * 3 * attribs_len);
+    entry->attribs_len = attribs_len;
+    entry->num_vertices = 0;
+    entry->num_tris = 0;
+    
+    entry->fog_offset = -1;
+    if (ds->use_fog && (rsp.geometry_mode & G_FOG)) {
+        int offset = 0;
+#ifdef USE_UBER_SHADER
+        bool uber = ds->uber;
+#else
+        bool uber = false;
+#endif
+        if (ds->use_texture || uber) {
+#ifdef USE_PACKED_VERTICES
+            offset += 1;
+#else
+            offset += 2;
+#endif
+#ifdef USE_TEXTURE_ATLAS
+            offset += 2 * (uber ? 2 : ds->used_textures[0] + ds->used_textures[1]);
+#endif
+        }
+        entry->fog_offset = offset;
+    }
+    
+    uint16_t slot_to_vertex[MAX_VERTICES];
+    memset(slot_to_vertex, 0xff, sizeof(slot_to_vertex));
+    
+    for (;; cmd++) {
+        uint32_t opcode = cmd->words.w0 >> 24;
+        uint8_t idx[2][3];
+        int num_idx = 0;
+        
+        switch (opcode) {
+            case G_VTX: {
+                size_t n, dest;
+                const Vtx *vertices;
+                gfx_decode_vtx(cmd, &n, &dest, &vertices);
+                for (size_t i = 0; i < n; i++) {
+                    const Vtx_t *v = &vertices[i].v;
+                    struct DisplayListCacheVertex *cv = &entry->vertices[entry->num_vertices];
+                    cv->ob[0] = v->ob[0];
+                    cv->ob[1] = v->ob[1];
+                    cv->ob[2] = v->ob[2];
+                    cv->u = (short)(v->tc[0] * rsp.texture_scaling_factor.s >> 16);
+                    cv->v = (short)(v->tc[1] * rsp.texture_scaling_factor.t >> 16);
+                    cv->color.r = v->cn[0];
+                    cv->color.g = v->cn[1];
+                    cv->color.b = v->cn[2];
+                    cv->color.a = v->cn[3];
+                    cv->slot = dest + i;
+                    slot_to_vertex[dest + i] = entry->num_vertices++;
+                }
+                break;
+            }
+            case (uint8_t)G_TRI1:
+                gfx_decode_tri1(cmd, idx[num_idx++]);
+                break;
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+            case (uint8_t)G_TRI2:
+                idx[num_idx][0] = C0(16, 8) / 2;
+                idx[num_idx][1] = C0(8, 8) / 2;
+                idx[num_idx++][2] = C0(0, 8) / 2;
+                idx[num_idx][0] = C1(16, 8) / 2;
+                idx[num_idx][1] = C1(8, 8) / 2;
+                idx[num_idx++][2] = C1(0, 8) / 2;
+                break;
+#endif
+            case (uint8_t)G_ENDDL:
+                return true;
+        }
+        
+        for (int t = 0; t < num_idx; t++) {
+            struct LoadedVertex tri[3];
+            for (int k = 0; k < 3; k++) {
+                uint16_t vi = idx[t][k] < MAX_VERTICES ? slot_to_vertex[idx[t][k]] : 0xffff;
+                if (vi == 0xffff) {
+                    // Uses vertices loaded by someone else
+                    gfx_dl_cache_free_entry(entry);
+                    return false;
+                }
+                const struct DisplayListCacheVertex *cv = &entry->vertices[vi];
+                tri[k] = lv;
+                tri[k].u = cv->u;
+                tri[k].v = cv->v;
+                tri[k].color = cv->color;
+                entry->indices[entry->num_tris * 3 + k] = vi;
+            }
+            for (int k = 0; k < 3; k++) {
+                gfx_emit_vertex_attribs(&entry->attribs[(entry->num_tris * 3 + k) * attribs_len], &tri[k], &tri[0], ds);
+            }
+            entry->num_tris++;
+        }
+    }
+}
+
+static void gfx_dl_cache_replay(const struct DisplayListCacheEntry *entry, const struct DrawState *ds) {
+    static struct LoadedVertex transformed[DL_CACHE_MAX_VERTICES];
+    bool fog = (rsp.geometry_mode & G_FOG) != 0;
+    gfx_stats.vertices_transformed += entry->num_vertices;
+    gfx_stats.tris_submitted += entry->num_tris;
+    
+    for (int i = 0; i < entry->num_vertices; i++) {
+        const struct DisplayListCacheVertex *cv = &entry->vertices[i];
+        struct LoadedVertex *d = &transformed[i];
+        gfx_transform_vertex(d, cv->ob[0], cv->ob[1], cv->ob[2]);
+        d->u = cv->u;
+        d->v = cv->v;
+        d->color = cv->color;
+        if (fog) {
+            d->color.a = gfx_fog_factor(d->z, d->w, rsp.fog_mul, rsp.fog_offset);
+        }
+    }
+    
+    const uint16_t *indices = entry->indices;
+    const float *attribs = entry->attribs;
+    size_t attribs_len = entry->attribs_len;
+    for (int i = 0; i < entry->num_tris; i++, indices += 3, attribs += 3 * attribs_len) {
+        const struct LoadedVertex *v_arr[3] = {
+            &transformed[indices[0]], &transformed[indices[1]], &transformed[indices[2]]
+        };
+        if (gfx_tri_is_rejected(v_arr[0], v_arr[1], v_arr[2])) {
+            gfx_stats.tris_culled++;
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            gfx_emit_vertex_position(v_arr[k], ds);
+            memcpy(&buf_vbo[buf_vbo_len], &attribs[k * attribs_len], attribs_len * sizeof(float));
+            if (entry->fog_offset >= 0) {
+                gfx_store_fog_factor(&buf_vbo[buf_vbo_len + entry->fog_offset], v_arr[k]->color.a);
+            }
+            buf_vbo_len += attribs_len;
+        }
+        gfx_end_tri();
+    }
+    
+    // Leave the vertex cache the way G_VTX would have
+    for (int i = 0; i < entry->num_vertices; i++) {
+        rsp.loaded_vertices[entry->vertices[i].slot] = transformed[i];
+#ifdef USE_INDEXED_DRAWING
+        gfx_index_invalidate(entry->vertices[i].slot, 1);
+#endif
+    }
+}
+
+// Runs a called display list from the cache. Returns false if it has to be
+// interpreted instead.
+static bool gfx_dl_cache_run(const Gfx *dl) {
+    // Nothing writes to display lists or vertices while a frame is drawn, an
+    // entry checked earlier in the frame is still up to date
+    struct DisplayListCacheEntry *entry = gfx_dl_cache_find(dl);
+    bool checked = entry != NULL && entry->vertices != NULL && entry->checked_frame == gfx_dl_cache.frame;
+    uint32_t hash = 0;
+    uint16_t num_vertices = 0, num_tris = 0;
+    if (checked) {
+        num_vertices = entry->num_vertices;
+        num_tris = entry->num_tris;
+    } else if (!gfx_dl_cache_scan(dl, &hash, &num_vertices, &num_tris)) {
+        return false;
+    }
+    
+    ProfEmitEventStart("gfx_dl_cache");
+    struct DrawState ds;
+    gfx_update_draw_state(&ds, false);
+    if (!gfx_dl_cache_state_is_static(&ds)) {
+        ProfEmitEventEnd("gfx_dl_cache");
+        return false;
+    }
+    
+    struct DisplayListCacheKey key;
+    gfx_dl_cache_make_key(&key, &ds);
+    
+    if (entry == NULL) {
+        entry = gfx_dl_cache_insert(dl);
+    }
+    if (!checked) {
+        if (entry->vertices != NULL && entry->content_hash != hash) {
+            gfx_dl_cache_free_entry(entry);
+        }
+        entry->content_hash = hash;
+        entry->checked_frame = gfx_dl_cache.frame;
+    }
+    if (entry->vertices == NULL || memcmp(&entry->key, &key, sizeof(key)) != 0) {
+        if (!gfx_dl_cache_translate(entry, dl, num_vertices, num_tris, &ds)) {
+            ProfEmitEventEnd("gfx_dl_cache");
+            return false;
+        }
+        entry->key = key;
+    }
+    
+#ifdef USE_STATE_SORTING
+    gfx_batch_select(&ds);
+#endif
+    gfx_dl_cache_replay(entry, &ds);
+    ProfEmitEventEnd("gfx_dl_cache");
+    return true;
+}
+#endif
+
 static void gfx_run_dl(Gfx* cmd) {
     int dummy = 0;
     for (;;) {
@@ -1551,6 +4005,11 @@ static void gfx_run_dl(Gfx* cmd) {
                 break;
             case G_DL:
                 if (C0(16, 1) == 0) {
+#ifdef USE_DL_CACHE
+                    if (gfx_dl_cache_run((const Gfx *)seg_addr(cmd->words.w1))) {
+                        break;
+                    }
+#endif
                     // Push return address
                     gfx_run_dl((Gfx *)seg_addr(cmd->words.w1));
                 } else {
@@ -1572,6 +4031,14 @@ static void gfx_run_dl(Gfx* cmd) {
                 gfx_sp_geometry_mode(cmd->words.w1, 0);
                 break;
 #endif
+#ifdef USE_TRI_BATCHING
+            case (uint8_t)G_TRI1:
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+            case (uint8_t)G_TRI2:
+#endif
+                cmd = gfx_run_tris(cmd);
+                break;
+#else
             case (uint8_t)G_TRI1:
 #ifdef F3DEX_GBI_2
                 gfx_sp_tri1(C0(16, 8) / 2, C0(8, 8) / 2, C0(0, 8) / 2);
@@ -1586,6 +4053,7 @@ static void gfx_run_dl(Gfx* cmd) {
                 gfx_sp_tri1(C0(16, 8) / 2, C0(8, 8) / 2, C0(0, 8) / 2);
                 gfx_sp_tri1(C1(16, 8) / 2, C1(8, 8) / 2, C1(0, 8) / 2);
                 break;
+#endif
 #endif
             case (uint8_t)G_SETOTHERMODE_L:
 #ifdef F3DEX_GBI_2
@@ -1748,48 +4216,168 @@ void gfx_get_dimensions(uint32_t *width, uint32_t *height) {
 void gfx_init(struct GfxWindowManagerAPI *wapi, struct GfxRenderingAPI *rapi, const char *game_name, bool start_in_fullscreen) {
     gfx_wapi = wapi;
     gfx_rapi = rapi;
+#ifdef USE_GL_THREAD
+    if (!gfx_cmdqueue_wrap(&gfx_wapi, &gfx_rapi)) {
+        puts("Warning: The window manager can't share its GL context, rendering on the main thread");
+    }
+#endif
     gfx_wapi->init(game_name, start_in_fullscreen);
     gfx_rapi->init();
 
 #ifdef USE_TEXTURE_ATLAS
-    if (!atlas_create(&atlas, 2048, 1))
+    // Pages are powers of two, and the sampler parameters only have 11 bits for coordinates
+    uint32_t page_size = ATLAS_MIN_PAGE_SIZE;
+    while (page_size * 2 <= configAtlasPageSize && page_size * 2 <= ATLAS_MAX_PAGE_SIZE) {
+        page_size *= 2;
+    }
+    int pages = configAtlasPages < 1 ? 1 : configAtlasPages > ATLAS_MAX_PAGES ? ATLAS_MAX_PAGES : configAtlasPages;
+    
+    // Give up pages first, then resolution, until they fit in the budget
+    uint32_t texel_size = configTexture16Bit ? 2 : 4;
+    bool trimmed = false;
+    while (configAtlasVramBudget != 0 && pages * page_size * page_size * texel_size > configAtlasVramBudget * 1024 * 1024) {
+        if (pages > 1) {
+            pages--;
+        } else if (page_size > ATLAS_MIN_PAGE_SIZE) {
+            page_size /= 2;
+        } else {
+            break;
+        }
+        trimmed = true;
+    }
+    if (trimmed) {
+        printf("Texture atlas trimmed to %d %ux%u page(s) to fit in %u MB\n", pages, page_size, page_size, configAtlasVramBudget);
+    }
+    
+    if (!atlas_create(&atlas, page_size, 1, pages))
         abort();
 
-    gfx_rapi->create_virtual_texture_page(2048);
+    gfx_texture_cache.movable = true;
+    for (int i = 0; i < pages; i++) {
+        gfx_texture_cache.movable &= gfx_rapi->create_virtual_texture_page(i, page_size, configTexture16Bit ? GFX_TEXFMT_RGBA4444 : GFX_TEXFMT_RGBA8888);
+    }
+    
+    if (configAtlasTrace) {
+        FILE *trace = fopen_home(ATLAS_TRACE_FILE, "w");
+        if (trace != NULL) {
+            atlas_set_trace(atlas, trace);
+        }
+    }
+#endif
+
+#ifdef USE_HW_TNL
+    gfx_tnl.supported = gfx_rapi->set_tnl_state != NULL;
+#endif
+#ifdef USE_INDEXED_DRAWING
+    gfx_index.supported = gfx_rapi->draw_indexed_triangles != NULL;
+    gfx_index.generation = 1;
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    gfx_colors.supported = gfx_rapi->set_combiner_colors != NULL;
 #endif
     
-    // Used in the 120 star TAS
-    static uint32_t precomp_shaders[] = {
-        0x01200200,
-        0x00000045,
+    gfx_texture_cache.pool_size = configTextureCacheSize;
+    if (gfx_texture_cache.pool_size < TEXTURE_CACHE_MIN_SIZE) {
+        gfx_texture_cache.pool_size = TEXTURE_CACHE_MIN_SIZE;
+    }
+    gfx_texture_cache.pool = calloc(gfx_texture_cache.pool_size, sizeof(struct TextureHashmapNode));
+    if (gfx_texture_cache.pool == NULL)
+        abort();
+    
+    if (configTextureDiskCacheSize != 0) {
+        uint32_t mb = configTextureDiskCacheSize < 1024 ? configTextureDiskCacheSize : 1024;
+        gfx_texture_cache.disk_cache = texture_disk_cache_open("texture_cache.bin", mb << 20);
+    }
+    
+    // Combiners used in the 120 star TAS, as combine mode and SHADER_OPT_* bits.
+    // Shader ids depend on the build options, so they're generated from these.
+    static uint32_t precomp_combiners[] = {
+        0x01800800,
+        0x01a00800,
+        0x00000141,
+        0x00000101,
+        0x000000c1,
+        0x00000800,
+        0x01a00200,
+        0x01800200,
         0x00000200,
-        0x01200a00,
-        0x00000a00,
-        0x01a00045,
-        0x00000551,
-        0x01045045,
-        0x05a00a00,
-        0x01200045,
-        0x05045045,
-        0x01045a00,
-        0x01a00a00,
-        0x0000038d,
-        0x01081081,
-        0x0120038d,
-        0x03200045,
-        0x03200a00,
-        0x01a00a6f,
-        0x01141045,
-        0x07a00a00,
+        0x01200101,
+        0x00000863,
+        0x01141141,
+        0x01101101,
+        0x01141101,
+        0x010c10c1,
         0x05200200,
-        0x03200200,
-        0x09200200,
-        0x0920038d,
-        0x09200045
+        0x01800101,
+        0x01a00101,
+        0x05141141,
+        0x05101101,
+        0x05141101,
+        0x050c10c1,
+        0x01141200,
+        0x01200200,
+        0x000009a1,
+        0x01144144,
+        0x018009a1,
+        0x01a009a1,
+        0x03800101,
+        0x03a00101,
+        0x03a00200,
+        0x03800200,
+        0x0120a3ca,
+        0x01045101,
+        0x07200200,
+        0x05800800,
+        0x05a00800,
+        0x03800800,
+        0x03a00800,
+        0x09800800,
+        0x09a00800,
+        0x098009a1,
+        0x09a009a1,
+        0x09800101,
+        0x09a00101
     };
-    for (size_t i = 0; i < sizeof(precomp_shaders) / sizeof(uint32_t); i++) {
-        gfx_lookup_or_create_shader_program(precomp_shaders[i]);
+    for (size_t i = 0; i < sizeof(precomp_combiners) / sizeof(uint32_t); i++) {
+        struct ColorCombiner comb;
+        gfx_generate_cc(&comb, precomp_combiners[i]);
+    }
+    
+    // Only entries that still build a shader of their own are kept, the file
+    // is rewritten without the invalid, repeated or already covered ones
+    FILE *warmup = fopen_home(SHADER_WARMUP_FILE, "r");
+    if (warmup != NULL) {
+        uint32_t kept[GFX_MAX_SHADER_PROGRAMS];
+        uint32_t num_kept = 0, num_read = 0;
+        unsigned int cc_id;
+        while (fscanf(warmup, "%x", &cc_id) == 1) {
+            num_read++;
+            if (!gfx_shader_warmup_is_valid(cc_id) || gfx_shader_warmup.programs >= GFX_MAX_SHADER_PROGRAMS) {
+                continue;
+            }
+            uint32_t programs = gfx_shader_warmup.programs;
+            struct ColorCombiner comb;
+            gfx_generate_cc(&comb, cc_id);
+            if (gfx_shader_warmup.programs != programs) {
+                kept[num_kept++] = cc_id;
+            }
+        }
+        fclose(warmup);
+        
+        if (num_kept != num_read) {
+            warmup = fopen_home(SHADER_WARMUP_FILE, "w");
+            if (warmup != NULL) {
+                for (uint32_t i = 0; i < num_kept; i++) {
+                    fprintf(warmup, "%08x\n", kept[i]);
+                }
+                fclose(warmup);
+            }
+        }
     }
+    printf("Prepared %u shaders in %lu ms\n", gfx_shader_warmup.compiles, gfx_shader_warmup.compile_time / 1000);
+    gfx_shader_warmup.compiles = 0;
+    gfx_shader_warmup.compile_time = 0;
+    gfx_shader_warmup.recording = true;
 }
 
 struct GfxRenderingAPI *gfx_get_current_rendering_api(void) {
@@ -1807,6 +4395,42 @@ void gfx_start_frame(void) {
     gfx_rapi->signal_start(gfx_current_dimensions.width, gfx_current_dimensions.height);
 }
 
+static void gfx_stats_end_frame(void) {
+#ifdef USE_PROFILER
+    static char *flush_names[GFX_FLUSH_CAUSES] = {
+        "flushes_shader",
+        "flushes_texture",
+        "flushes_depth",
+        "flushes_viewport",
+        "flushes_scissor",
+        "flushes_alpha",
+        "flushes_buffer_full",
+        "flushes_colors",
+        "flushes_tnl",
+        "flushes_batch",
+        "flushes_frame_end"
+    };
+    ProfEmitCounter("tris_submitted", gfx_stats.tris_submitted);
+    ProfEmitCounter("tris_culled", gfx_stats.tris_culled);
+    ProfEmitCounter("tris_drawn", gfx_stats.tris_drawn);
+    ProfEmitCounter("draw_calls_batched", gfx_stats.draw_calls);
+    for (int i = 0; i < GFX_FLUSH_CAUSES; i++) {
+        ProfEmitCounter(flush_names[i], gfx_stats.flushes[i]);
+    }
+    ProfEmitCounter("texture_cache_hits", gfx_stats.texture_cache_hits);
+    ProfEmitCounter("texture_cache_misses", gfx_stats.texture_cache_misses);
+    ProfEmitCounter("texture_upload_bytes", gfx_stats.texture_upload_bytes);
+    ProfEmitCounter("shader_switches", gfx_stats.shader_switches);
+    ProfEmitCounter("vertices_transformed", gfx_stats.vertices_transformed);
+#endif
+    gfx_stats_last = gfx_stats;
+    memset(&gfx_stats, 0, sizeof(gfx_stats));
+}
+
+void gfx_get_stats(struct GfxStats *stats) {
+    *stats = gfx_stats_last;
+}
+
 void gfx_run(Gfx *commands) {
     gfx_sp_reset();
     
@@ -1818,14 +4442,75 @@ void gfx_run(Gfx *commands) {
     }
     dropped_frame = false;
     
+#ifdef USE_DL_TRACE
+    if (configTraceFrames != 0) {
+        uint32_t frame = gfx_trace_frame_count++;
+        if (frame == configTraceStart) {
+            gfx_trace_begin(DL_TRACE_FILE);
+        }
+        if (frame >= configTraceStart && frame - configTraceStart < configTraceFrames) {
+            gfx_trace_capture(commands);
+            if (frame - configTraceStart == configTraceFrames - 1) {
+                gfx_trace_end();
+                printf("Wrote %u frames to %s\n", configTraceFrames, DL_TRACE_FILE);
+            }
+        }
+    }
+#endif
+    
     rendering_state.shader_program = NULL;
     double t0 = gfx_wapi->get_time();
     gfx_rapi->start_frame();
     #ifdef USE_TEXTURE_ATLAS
-    gfx_rapi->bind_virtual_texture_page();
+    for (int i = 0; i < 2; i++) {
+        gfx_rapi->bind_virtual_texture_page(i, 0);
+        rendering_state.atlas_pages[i] = 0;
+    }
     #endif
+#ifdef USE_DL_CACHE
+    gfx_dl_cache.frame++;
+#endif
     gfx_run_dl(commands);
-    gfx_flush();
+#ifdef USE_STATE_SORTING
+    gfx_batch_flush();
+    ProfEmitCounter("batch_draws", gfx_batch.draws);
+    ProfEmitCounter("batch_flushes", gfx_batch.flushes);
+    gfx_batch.draws = gfx_batch.flushes = 0;
+#endif
+    gfx_flush(GFX_FLUSH_FRAME_END);
+#ifdef USE_INDEXED_DRAWING
+    ProfEmitCounter("vertices_shared", gfx_index.shared);
+    gfx_index.shared = 0;
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    ProfEmitCounter("color_uniform_updates", gfx_colors.updates);
+    gfx_colors.updates = 0;
+#endif
+#ifdef USE_TRI_BATCHING
+    ProfEmitCounter("batched_tris", gfx_tri_batch.tris);
+    ProfEmitCounter("batched_tris_culled", gfx_tri_batch.culled);
+    gfx_tri_batch.tris = gfx_tri_batch.culled = 0;
+#endif
+    ProfEmitCounter("shader_compiles", gfx_shader_warmup.compiles);
+    ProfEmitCounter("shader_compile_us", gfx_shader_warmup.compile_time);
+    gfx_shader_warmup.compiles = 0;
+    gfx_shader_warmup.compile_time = 0;
+    
+    gfx_stats.texture_cache_hits = gfx_texture_cache.hits;
+    gfx_stats.texture_cache_misses = gfx_texture_cache.misses;
+    gfx_stats_end_frame();
+    
+    ProfEmitCounter("texture_cache_evictions", gfx_texture_cache.evictions);
+    ProfEmitCounter("texture_cache_dedups", gfx_texture_cache.dedups);
+    ProfEmitCounter("texture_cache_disk_hits", gfx_texture_cache.disk_hits);
+#ifdef USE_TEXTURE_ATLAS
+    ProfEmitCounter("texture_atlas_compactions", gfx_texture_cache.compactions);
+    ProfEmitCounter("texture_atlas_page_binds", gfx_texture_cache.page_binds);
+    gfx_texture_cache.page_binds = 0;
+#endif
+    gfx_texture_cache.hits = gfx_texture_cache.misses = gfx_texture_cache.evictions = gfx_texture_cache.dedups = 0;
+    gfx_texture_cache.disk_hits = gfx_texture_cache.compactions = 0;
+    
     double t1 = gfx_wapi->get_time();
     //printf("Process %f %f\n", t1, t1 - t0);
     gfx_rapi->end_frame();
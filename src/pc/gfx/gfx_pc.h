@@ -1,6 +1,7 @@
 #ifndef GFX_PC_H
 #define GFX_PC_H
 
+#include <stdint.h>
 #include <stdbool.h>
 
 struct GfxRenderingAPI;
@@ -13,6 +14,42 @@ struct GfxDimensions {
 
 extern struct GfxDimensions gfx_current_dimensions;
 
+// Why buffered triangles had to be drawn
+enum GfxFlushCause {
+    GFX_FLUSH_SHADER,
+    GFX_FLUSH_TEXTURE,
+    GFX_FLUSH_DEPTH,
+    GFX_FLUSH_VIEWPORT,
+    GFX_FLUSH_SCISSOR,
+    GFX_FLUSH_ALPHA,
+    GFX_FLUSH_BUFFER_FULL,
+    GFX_FLUSH_COLORS, // combiner colour uniforms
+    GFX_FLUSH_TNL, // hardware transform state
+    GFX_FLUSH_BATCH, // sorted batches being drawn
+    GFX_FLUSH_FRAME_END,
+    GFX_FLUSH_CAUSES
+};
+
+/**
+ * Renderer counters for one frame.
+ * @property tris_culled: Clip rejected or back/front face culled on the CPU.
+ * @property flushes: Draw calls by what forced them.
+ * @property texture_upload_bytes: In the format handed to the backend.
+ * @property vertices_transformed: On the CPU, hardware T&L vertices aren't counted.
+ **/
+struct GfxStats {
+    uint32_t tris_submitted;
+    uint32_t tris_culled;
+    uint32_t tris_drawn;
+    uint32_t draw_calls;
+    uint32_t flushes[GFX_FLUSH_CAUSES];
+    uint32_t texture_cache_hits;
+    uint32_t texture_cache_misses;
+    uint32_t texture_upload_bytes;
+    uint32_t shader_switches;
+    uint32_t vertices_transformed;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,6 +59,7 @@ struct GfxRenderingAPI *gfx_get_current_rendering_api(void);
 void gfx_start_frame(void);
 void gfx_run(Gfx *commands);
 void gfx_end_frame(void);
+void gfx_get_stats(struct GfxStats *stats); // of the last frame gfx_run finished
 
 #ifdef __cplusplus
 }
@@ -7,6 +7,83 @@
 
 struct ShaderProgram;
 
+// Most shader programs a backend has to hold, the startup and warm-up lists
+// included.
+#define GFX_MAX_SHADER_PROGRAMS 128
+// Most triangles gfx_pc hands to a single draw call.
+#define GFX_MAX_BUFFERED_TRIS 2048
+// Most 32-bit words a vertex can take: position and normal with HW TNL,
+// texture coordinates, fog, four RGBA inputs and the uber shader's combiner
+// parameters. The atlas adds the virtual texture parameters of both textures.
+#ifndef USE_TEXTURE_ATLAS
+#define GFX_MAX_FLOATS_PER_VERTEX (7 + 2 + 4 + 4 * 4 + 4)
+#else
+#define GFX_MAX_FLOATS_PER_VERTEX (7 + 2 + 2 * 2 + 4 + 4 * 4 + 4)
+#endif
+
+#ifdef USE_PACKED_VERTICES
+// draw_triangles still receives 32-bit words, but apart from positions and
+// normals they hold packed data:
+//  * texture coordinates: 2 shorts, in 1/GFX_PACKED_UV_SCALE texture widths
+//  * atlas sampler parameters: 4 unsigned shorts per texture,
+//    x, y, width | cms << 12, height | cmt << 12
+//  * fog colour and factor, combiner inputs: 4 normalized unsigned bytes
+//    (with set_combiner_colors the fog is just the factor, in the first one)
+#define GFX_PACKED_UV_SCALE 1024
+#endif
+
+// Storage formats a backend may pack RGBA32 texels into before uploading.
+enum GfxTextureFormat {
+    GFX_TEXFMT_RGBA8888,
+    GFX_TEXFMT_RGBA5551,
+    GFX_TEXFMT_RGBA4444,
+    GFX_TEXFMT_LA88, // luminance taken from the red channel
+    GFX_TEXFMT_L8
+};
+
+#ifdef USE_TEXTURE_ATLAS
+// Virtual texture pages a backend has to hold, all of the same size and format.
+// Also what the texture atlas allocates from, vertices encode the page in two bits.
+#define GFX_MAX_VIRTUAL_TEXTURE_PAGES 4
+
+// Texels moved within a virtual texture page, in pixels.
+struct GfxTextureMove {
+    uint16_t src_x, src_y;
+    uint16_t dst_x, dst_y;
+    uint16_t width, height;
+};
+#endif
+
+#ifdef USE_HW_TNL
+#define GFX_TNL_MAX_LIGHTS 2
+
+enum {
+    GFX_CULL_NONE,
+    GFX_CULL_FRONT,
+    GFX_CULL_BACK,
+    GFX_CULL_BOTH
+};
+
+// What the vertex shaders need to transform, light and fog raw Vtx data.
+struct GfxTnlState {
+    float mp_matrix[4][4]; // with the aspect ratio correction applied
+    float light_dirs[GFX_TNL_MAX_LIGHTS][3]; // model space, pre-divided by 127
+    float light_colors[GFX_TNL_MAX_LIGHTS + 1][3]; // the last one is ambient
+    bool fog;
+    float fog_mul, fog_offset;
+    uint8_t cull_mode;
+};
+#endif
+
+#ifdef USE_COLOR_UNIFORMS
+// Combiner colours that are the same for every vertex of a draw, 0.0 to 1.0.
+struct GfxCombinerColors {
+    float prim[4];
+    float env[4];
+    float fog[3];
+};
+#endif
+
 struct GfxRenderingAPI {
     bool (*z_is_from_0_to_1)(void);
     void (*unload_shader)(struct ShaderProgram *old_prg);
@@ -31,11 +108,31 @@ struct GfxRenderingAPI {
     void (*end_frame)(void);
     void (*finish_render)(void);
 #ifdef USE_TEXTURE_ATLAS
-    void (*bind_virtual_texture_page)(void);
-    void (*create_virtual_texture_page)(uint16_t dimensions);
-    void (*upload_virtual_texture)(const uint8_t *rgba32_buf, int x, int y, int width, int height, int h_mirror, int v_mirror);
+    // Samples the page through the tile's texture unit.
+    void (*bind_virtual_texture_page)(int tile, int page);
+    // Returns whether move_virtual_textures works on the page.
+    bool (*create_virtual_texture_page)(int page, uint16_t dimensions, enum GfxTextureFormat format);
+    // Wrap modes, mirroring included, are applied when sampling.
+    void (*upload_virtual_texture)(int page, const uint8_t *rgba32_buf, int x, int y, int width, int height);
+    // Every move reads the page as it was before any of them is written.
+    void (*move_virtual_textures)(int page, const struct GfxTextureMove *moves, int count);
 #endif
     void (*signal_start)(uint32_t width, uint32_t height);
+#ifdef USE_HW_TNL
+    // NULL means the vertex positions are already in clip space.
+    void (*set_tnl_state)(const struct GfxTnlState *state);
+#endif
+    // Like upload_texture but stored as format. NULL if only RGBA32 is supported.
+    void (*upload_texture_format)(const uint8_t *rgba32_buf, enum GfxTextureFormat format, int width, int height);
+#ifdef USE_INDEXED_DRAWING
+    // Like draw_triangles, but indices select the vertices of each triangle. Optional.
+    void (*draw_indexed_triangles)(float buf_vbo[], size_t buf_vbo_len, const uint16_t indices[], size_t buf_vbo_num_tris);
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    // Where SHADER_INPUT_PRIM, SHADER_INPUT_ENV and the fog colour come from.
+    // NULL means they are part of the vertices like the other inputs.
+    void (*set_combiner_colors)(const struct GfxCombinerColors *colors);
+#endif
 };
 
 #endif
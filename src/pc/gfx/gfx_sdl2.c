@@ -21,14 +21,16 @@
 #endif
 
 #include "../cheapProfiler.h"
+#include "../configfile.h"
 #include "gfx_window_manager_api.h"
 #include "gfx_screen_config.h"
+#include "gfx_pacer.h"
 
 #define GFX_API_NAME "SDL2 - OpenGL"
 
 static SDL_Window *wnd;
+static SDL_GLContext ctx;
 static int inverted_scancode_table[512];
-static int vsync_enabled = 0;
 static unsigned int window_width = DESIRED_SCREEN_WIDTH;
 static unsigned int window_height = DESIRED_SCREEN_HEIGHT;
 static bool fullscreen_state;
@@ -37,11 +39,8 @@ static bool (*on_key_down_callback)(int scancode);
 static bool (*on_key_up_callback)(int scancode);
 static void (*on_all_keys_up_callback)(void);
 
-#define S_IN_NS (1e+9)
-#define MS_IN_NS (1e+6)
-static const double TARGET_FRAMETIME = (double)S_IN_NS / 31.5f; //1.5 frames of headroom
-static const double SLEEP_FRAMETIME = MS_IN_NS * 5.0;
-static struct timespec prev_frame = {};
+// The game logic runs at 30 Hz
+#define GAME_FRAME_RATE 30
 
 const SDL_Scancode windows_scancode_table[] =
 { 
@@ -117,51 +116,13 @@ static void set_fullscreen(bool on, bool call_callback) {
     }
 }
 
-int test_vsync(void) {
-    // Even if SDL_GL_SetSwapInterval succeeds, it doesn't mean that VSync actually works.
-    // A 60 Hz monitor should have a swap interval of 16.67 milliseconds.
-    // Try to detect the length of a vsync by swapping buffers some times.
-    // Since the graphics card may enqueue a fixed number of frames,
-    // first send in four dummy frames to hopefully fill the queue.
-    // This method will fail if the refresh rate is changed, which, in
-    // combination with that we can't control the queue size (i.e. lag)
-    // is a reason this generic SDL2 backend should only be used as last resort.
-    Uint32 start;
-    Uint32 end;
-
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    start = SDL_GetTicks();
+static void gfx_sdl_swap_black(void) {
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
     SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    SDL_GL_SwapWindow(wnd);
-    end = SDL_GetTicks();
-
-    float average = 4.0 * 1000.0 / (end - start);
-
-    vsync_enabled = 1;
-    if (average > 27 && average < 33) {
-        SDL_GL_SetSwapInterval(1);
-    } else if (average > 57 && average < 63) {
-        SDL_GL_SetSwapInterval(2);
-    } else if (average > 86 && average < 94) {
-        SDL_GL_SetSwapInterval(3);
-    } else if (average > 115 && average < 125) {
-        SDL_GL_SetSwapInterval(4);
-    } else {
-        vsync_enabled = 0;
-    }
 }
 
 static void gfx_sdl_init(const char *game_name, bool start_in_fullscreen) {
-    clock_gettime(CLOCK_MONOTONIC, &prev_frame);
     SDL_Init(SDL_INIT_VIDEO);
 
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
@@ -180,14 +141,24 @@ static void gfx_sdl_init(const char *game_name, bool start_in_fullscreen) {
         set_fullscreen(true, false);
     }
 
-    SDL_GL_CreateContext(wnd);
+    ctx = SDL_GL_CreateContext(wnd);
+
+    SDL_DisplayMode mode;
+    int refresh_rate = 0;
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(wnd), &mode) == 0) {
+        refresh_rate = mode.refresh_rate;
+    }
 
-    SDL_GL_SetSwapInterval(1);
-    //test_vsync();
-    // Don't stage this
-    vsync_enabled = 0;
-    if (!vsync_enabled)
-        puts("Warning: VSync is not enabled or not working. Falling back to timer for synchronization");
+    if (configFrameLimit) {
+        SDL_GL_SetSwapInterval(1);
+        gfx_pacer_init(gfx_sdl_swap_black, SDL_GL_SetSwapInterval, refresh_rate, GAME_FRAME_RATE);
+        if (!gfx_pacer_has_vsync())
+            puts("Warning: VSync is not enabled or not working. Falling back to timer for synchronization");
+    } else {
+        // Nothing to wait for, the trace replay wants every frame as soon as possible
+        SDL_GL_SetSwapInterval(0);
+        gfx_pacer_init(NULL, NULL, refresh_rate, GAME_FRAME_RATE);
+    }
 
     for (size_t i = 0; i < sizeof(windows_scancode_table) / sizeof(SDL_Scancode); i++) {
         inverted_scancode_table[windows_scancode_table[i]] = i;
@@ -283,65 +254,17 @@ static bool gfx_sdl_start_frame(void) {
     return true;
 }
 
-
-// Returns difference between two timespec structures in nanoseconds
-static double diff_timespec(struct timespec *t1, struct timespec *t2) 
-{
-    struct timespec td;
-    td.tv_nsec = t2->tv_nsec - t1->tv_nsec;
-    td.tv_sec  = t2->tv_sec - t1->tv_sec;
-
-    if (td.tv_sec > 0 && td.tv_nsec < 0) {         
-        td.tv_nsec += S_IN_NS;         
-        td.tv_sec--;
-    }     
-    else if (td.tv_sec < 0 && td.tv_nsec > 0) {         
-        td.tv_nsec -= S_IN_NS;         
-        td.tv_sec++;     
-    }
-
-    return td.tv_nsec + td.tv_sec * S_IN_NS;
-}
-
-static void sync_framerate_with_timer(void) {
-    static struct timespec cur_time;
-
-    do {
-        clock_gettime(CLOCK_MONOTONIC, &cur_time);
-        double frametime = diff_timespec(&prev_frame, &cur_time);
-        double wait = TARGET_FRAMETIME - frametime;
-        if (wait <= 0) {
-            break;
-        } else if (wait >= SLEEP_FRAMETIME) {
-            SDL_Delay(5);
-        }
-    } while(1);
-
-    prev_frame.tv_nsec = cur_time.tv_nsec;
-    prev_frame.tv_sec = cur_time.tv_sec;
-
-#if 0
-    // Number of milliseconds a frame should take (30 fps)
-    const Uint32 FRAME_TIME = 1000 / 30;
-    static Uint32 last_time;
-    Uint32 elapsed = SDL_GetTicks() - last_time;
-
-    if (elapsed < FRAME_TIME)
-        SDL_Delay(FRAME_TIME - elapsed);
-    last_time += FRAME_TIME;
-#endif
-}
-
 static void gfx_sdl_swap_buffers_begin(void) {
     ProfEmitEventStart("idle_time");
-    if (!vsync_enabled) {
-        sync_framerate_with_timer();
+    if (configFrameLimit) {
+        gfx_pacer_wait();
     }
     ProfEmitEventEnd("idle_time");
 
     ProfEmitEventStart("SDL_GL_SwapWindow");
     SDL_GL_SwapWindow(wnd);
     ProfEmitEventEnd("SDL_GL_SwapWindow");
+    gfx_pacer_presented();
 }
 
 static void gfx_sdl_swap_buffers_end(void) {
@@ -351,6 +274,10 @@ static double gfx_sdl_get_time(void) {
     return 0.0;
 }
 
+static void gfx_sdl_make_context_current(bool current) {
+    SDL_GL_MakeCurrent(wnd, current ? ctx : NULL);
+}
+
 struct GfxWindowManagerAPI gfx_sdl = {
     gfx_sdl_init,
     gfx_sdl_set_keyboard_callbacks,
@@ -362,7 +289,8 @@ struct GfxWindowManagerAPI gfx_sdl = {
     gfx_sdl_start_frame,
     gfx_sdl_swap_buffers_begin,
     gfx_sdl_swap_buffers_end,
-    gfx_sdl_get_time
+    gfx_sdl_get_time,
+    gfx_sdl_make_context_current
 };
 
 #endif
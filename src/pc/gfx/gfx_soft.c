@@ -0,0 +1,1099 @@
+#ifdef ENABLE_SOFT
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "gfx_cc.h"
+#include "gfx_rendering_api.h"
+#include "gfx_soft.h"
+#include "../cheapProfiler.h"
+#include "../configfile.h"
+#include "../fsutils.h"
+
+#ifdef USE_TEXTURE_ATLAS
+#error "The software renderer samples whole textures, build it without USE_TEXTURE_ATLAS"
+#endif
+
+// Tiles are square, each one gets rasterized by a single thread
+#define SOFT_TILE_SIZE 32
+#define SOFT_MAX_THREADS 16
+// Triangles and render states binned before the tiles have to be rasterized
+#define SOFT_MAX_TRIS 16384
+#define SOFT_MAX_STATES 4096
+// Texture coordinates, fog and four inputs
+#define SOFT_MAX_VARYINGS (2 + 4 + 4 * 4)
+// Smallest depth difference glPolygonOffset units are counted in
+#define SOFT_DEPTH_UNIT (1.0f / (1 << 24))
+
+struct ShaderProgram {
+    uint32_t shader_id;
+    struct CCFeatures cc;
+    bool has_texcoord;
+    uint8_t var_fog, var_inputs; // where they start in SoftVertex.var
+    uint8_t num_varyings;
+};
+
+struct SoftTexture {
+    uint8_t *texels; // RGBA32
+    uint16_t width, height;
+    bool linear_filter;
+    uint8_t cms, cmt;
+    uint32_t used_until; // binned triangles sample it until flush number used_until - 1 is done
+};
+
+// What a texture looked like when a draw used it.
+struct SoftSampler {
+    const uint8_t *texels;
+    int width, height;
+    bool linear_filter;
+    uint8_t cms, cmt;
+};
+
+struct SoftState {
+    const struct ShaderProgram *prg;
+    struct SoftSampler samplers[2];
+    bool depth_test, depth_mask, use_alpha;
+    uint32_t frame; // for the noise
+};
+
+struct SoftVertex {
+    float pos[4];
+    float var[SOFT_MAX_VARYINGS];
+    float combiner[3];
+};
+
+/**
+ * A triangle ready to be rasterized. Edges and attributes are planes,
+ * a * dx + b * dy + c around the first vertex. Varyings are divided by w.
+ * @property x0, y0, x1, y1: Pixels it may cover, ends excluded.
+ * @property top_left: Edges that own the pixels exactly on them.
+ * @property c: Combiner selectors, from the vertices for the uber program.
+ **/
+struct SoftTri {
+    uint16_t state;
+    uint8_t top_left;
+    uint8_t c[2][4];
+    bool opt_alpha, opt_texture_edge;
+    int16_t x0, y0, x1, y1;
+    float ox, oy;
+    float edge[3][3];
+    float z[3], inv_w[3];
+    float var[SOFT_MAX_VARYINGS][3];
+};
+
+struct SoftBin {
+    uint32_t *tris;
+    uint32_t count, capacity;
+};
+
+static struct ShaderProgram shader_program_pool[GFX_MAX_SHADER_PROGRAMS];
+static uint8_t shader_program_pool_size;
+
+static struct {
+    // Framebuffer, the first row is the bottom one like in OpenGL
+    uint8_t *color; // RGBA32
+    float *depth;
+    int width, height;
+    int tiles_x, tiles_y;
+    struct SoftBin *bins;
+
+    struct SoftTexture *textures;
+    uint32_t num_textures, textures_capacity;
+    uint32_t bound_textures[2];
+    int active_tile;
+
+    const struct ShaderProgram *prg;
+    bool depth_test, depth_mask, zmode_decal, use_alpha;
+    int viewport[4], scissor[4]; // x, y, width, height
+    bool state_dirty;
+
+    struct SoftState *states;
+    struct SoftTri *tris;
+    uint32_t num_states, num_tris;
+    uint32_t flushes; // tiles rasterized so far
+    uint32_t frame;
+    bool drawn; // a frame has been finished
+
+    // This frame's statistics
+    uint32_t tris_setup, tris_clipped, fragments, flushes_this_frame;
+    unsigned long raster_us;
+} soft;
+
+static struct {
+    pthread_t threads[SOFT_MAX_THREADS];
+    int num_threads; // workers, the flushing thread helps them
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond, done_cond;
+    uint32_t generation; // bumped for every flush
+    int busy; // workers still rasterizing this generation
+    int next_tile;
+} soft_pool;
+
+static unsigned long soft_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline float soft_clamp01(float v) {
+    return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+}
+
+static inline int soft_wrap(int i, int size, uint8_t cm) {
+    if (cm & G_TX_CLAMP) {
+        return i < 0 ? 0 : (i >= size ? size - 1 : i);
+    }
+    if (cm & G_TX_MIRROR) {
+        int period = size * 2;
+        i %= period;
+        if (i < 0) i += period;
+        return i >= size ? period - 1 - i : i;
+    }
+    i %= size;
+    return i < 0 ? i + size : i;
+}
+
+// Same as GL_NEAREST and GL_LINEAR with the wrap modes of gfx_cm_to_opengl.
+static void soft_sample(const struct SoftSampler *s, float u, float v, float out[4]) {
+    float fu = u * s->width, fv = v * s->height;
+    // Keep far away coordinates within int, they wrap the same
+    if (!(fabsf(fu) < (1 << 24))) fu = 0.0f;
+    if (!(fabsf(fv) < (1 << 24))) fv = 0.0f;
+
+    if (!s->linear_filter) {
+        int x = soft_wrap((int)floorf(fu), s->width, s->cms);
+        int y = soft_wrap((int)floorf(fv), s->height, s->cmt);
+        const uint8_t *t = &s->texels[(y * s->width + x) * 4];
+        for (int i = 0; i < 4; i++) {
+            out[i] = t[i] * (1.0f / 255.0f);
+        }
+        return;
+    }
+
+    fu -= 0.5f;
+    fv -= 0.5f;
+    float iu = floorf(fu), iv = floorf(fv);
+    float au = fu - iu, av = fv - iv;
+    int x0 = soft_wrap((int)iu, s->width, s->cms), x1 = soft_wrap((int)iu + 1, s->width, s->cms);
+    int y0 = soft_wrap((int)iv, s->height, s->cmt), y1 = soft_wrap((int)iv + 1, s->height, s->cmt);
+    const uint8_t *t00 = &s->texels[(y0 * s->width + x0) * 4], *t10 = &s->texels[(y0 * s->width + x1) * 4];
+    const uint8_t *t01 = &s->texels[(y1 * s->width + x0) * 4], *t11 = &s->texels[(y1 * s->width + x1) * 4];
+    for (int i = 0; i < 4; i++) {
+        float top = t00[i] + (t10[i] - t00[i]) * au;
+        float bottom = t01[i] + (t11[i] - t01[i]) * au;
+        out[i] = (top + (bottom - top) * av) * (1.0f / 255.0f);
+    }
+}
+
+// Stands in for the random() of the desktop GL noise, 0 or 1.
+static inline float soft_noise(int x, int y, uint32_t frame) {
+    uint32_t h = (uint32_t)x * 0x8da6b343U ^ (uint32_t)y * 0xd8163841U ^ frame * 0xcb1ab31fU;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return (float)(h >> 31);
+}
+
+/**
+ * Runs the colour combiner for one pixel, like the fragment shaders of
+ * gfx_opengl. Every formula it picks is a special case of (a - b) * c + d.
+ * @returns false if the pixel gets discarded.
+ **/
+static bool soft_shade(const struct SoftState *st, const struct SoftTri *tri, const float *var, int x, int y, float out[4]) {
+    static const float zero[4];
+    const struct ShaderProgram *prg = st->prg;
+    const struct CCFeatures *cc = &prg->cc;
+    const float *items[8];
+    float texels[3][4];
+
+    items[SHADER_0] = zero;
+    for (int i = 0; i < cc->num_inputs; i++) {
+        items[SHADER_INPUT_1 + i] = &var[prg->var_inputs + i * 4];
+    }
+    if (cc->used_textures[0]) {
+        soft_sample(&st->samplers[0], var[0], var[1], texels[0]);
+        texels[1][0] = texels[1][1] = texels[1][2] = texels[1][3] = texels[0][3];
+        items[SHADER_TEXEL0] = texels[0];
+        items[SHADER_TEXEL0A] = texels[1];
+    }
+    if (cc->used_textures[1]) {
+        soft_sample(&st->samplers[1], var[0], var[1], texels[2]);
+        items[SHADER_TEXEL1] = texels[2];
+    }
+
+    const uint8_t (*c)[4] = tri->c;
+    bool opt_alpha = tri->opt_alpha, opt_texture_edge = tri->opt_texture_edge;
+    for (int i = 0; i < 3; i++) {
+        out[i] = (items[c[0][0]][i] - items[c[0][1]][i]) * items[c[0][2]][i] + items[c[0][3]][i];
+    }
+    if (opt_alpha) {
+        // Texel 0 alpha is the same thing as texel 0 for the alpha
+        out[3] = (items[c[1][0]][3] - items[c[1][1]][3]) * items[c[1][2]][3] + items[c[1][3]][3];
+    } else {
+        out[3] = 1.0f;
+    }
+
+    if (opt_texture_edge && opt_alpha) {
+        if (out[3] > 0.3f) {
+            out[3] = 1.0f;
+        } else {
+            return false;
+        }
+    }
+    if (cc->opt_fog) {
+        const float *fog = &var[prg->var_fog];
+        for (int i = 0; i < 3; i++) {
+            out[i] += (fog[i] - out[i]) * fog[3];
+        }
+    }
+#ifndef USE_GLES2
+    if (opt_alpha && cc->opt_noise) {
+        float scale = 240.0f / soft.height;
+        out[3] *= soft_noise((int)(x * scale), (int)(y * scale), st->frame);
+    }
+#endif
+    return true;
+}
+
+static void soft_raster_tile(int tile, uint32_t *fragments) {
+    struct SoftBin *bin = &soft.bins[tile];
+    int tx0 = (tile % soft.tiles_x) * SOFT_TILE_SIZE, ty0 = (tile / soft.tiles_x) * SOFT_TILE_SIZE;
+    int tx1 = tx0 + SOFT_TILE_SIZE, ty1 = ty0 + SOFT_TILE_SIZE;
+
+    for (uint32_t n = 0; n < bin->count; n++) {
+        const struct SoftTri *tri = &soft.tris[bin->tris[n]];
+        const struct SoftState *st = &soft.states[tri->state];
+        int num_varyings = st->prg->num_varyings;
+        int x0 = tri->x0 > tx0 ? tri->x0 : tx0, x1 = tri->x1 < tx1 ? tri->x1 : tx1;
+        int y0 = tri->y0 > ty0 ? tri->y0 : ty0, y1 = tri->y1 < ty1 ? tri->y1 : ty1;
+
+        for (int y = y0; y < y1; y++) {
+            float dy = y + 0.5f - tri->oy;
+            for (int x = x0; x < x1; x++) {
+                float dx = x + 0.5f - tri->ox;
+                bool inside = true;
+                for (int e = 0; e < 3; e++) {
+                    float d = tri->edge[e][0] * dx + tri->edge[e][1] * dy + tri->edge[e][2];
+                    inside = inside && (d > 0.0f || (d == 0.0f && (tri->top_left & (1 << e))));
+                }
+                if (!inside) {
+                    continue;
+                }
+
+                size_t pixel = (size_t)y * soft.width + x;
+                float depth = tri->z[0] * dx + tri->z[1] * dy + tri->z[2];
+                if (depth > 1.0f) {
+                    continue; // beyond the far plane
+                }
+                if (depth < 0.0f) {
+                    depth = 0.0f;
+                }
+                if (st->depth_test && depth > soft.depth[pixel]) {
+                    continue;
+                }
+
+                float w = 1.0f / (tri->inv_w[0] * dx + tri->inv_w[1] * dy + tri->inv_w[2]);
+                float var[SOFT_MAX_VARYINGS];
+                for (int i = 0; i < num_varyings; i++) {
+                    var[i] = (tri->var[i][0] * dx + tri->var[i][1] * dy + tri->var[i][2]) * w;
+                }
+                float color[4];
+                if (!soft_shade(st, tri, var, x, y, color)) {
+                    continue;
+                }
+                (*fragments)++;
+
+                if (st->depth_test && st->depth_mask) {
+                    soft.depth[pixel] = depth;
+                }
+                uint8_t *dst = &soft.color[pixel * 4];
+                if (st->use_alpha) {
+                    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA)
+                    float a = soft_clamp01(color[3]);
+                    for (int i = 0; i < 4; i++) {
+                        float blended = soft_clamp01(color[i]) * a + dst[i] * (1.0f / 255.0f) * (1.0f - a);
+                        dst[i] = (uint8_t)(blended * 255.0f + 0.5f);
+                    }
+                } else {
+                    for (int i = 0; i < 4; i++) {
+                        dst[i] = (uint8_t)(soft_clamp01(color[i]) * 255.0f + 0.5f);
+                    }
+                }
+            }
+        }
+    }
+    bin->count = 0;
+}
+
+// Takes tiles until there are none left.
+static void soft_raster_tiles(void) {
+    uint32_t fragments = 0;
+    int num_tiles = soft.tiles_x * soft.tiles_y;
+    int tile;
+    while ((tile = __sync_fetch_and_add(&soft_pool.next_tile, 1)) < num_tiles) {
+        soft_raster_tile(tile, &fragments);
+    }
+    __sync_fetch_and_add(&soft.fragments, fragments);
+}
+
+static void *soft_worker(void *arg) {
+    uint32_t seen = 0;
+
+    pthread_mutex_lock(&soft_pool.mutex);
+    for (;;) {
+        while (soft_pool.generation == seen) {
+            pthread_cond_wait(&soft_pool.start_cond, &soft_pool.mutex);
+        }
+        seen = soft_pool.generation;
+        pthread_mutex_unlock(&soft_pool.mutex);
+
+        soft_raster_tiles();
+
+        pthread_mutex_lock(&soft_pool.mutex);
+        if (--soft_pool.busy == 0) {
+            pthread_cond_signal(&soft_pool.done_cond);
+        }
+    }
+    return NULL;
+}
+
+// Rasterizes everything binned so far and starts over.
+static void soft_flush(void) {
+    if (soft.num_tris == 0) {
+        soft.num_states = 0;
+        return;
+    }
+    unsigned long t0 = soft_get_time();
+
+    pthread_mutex_lock(&soft_pool.mutex);
+    soft_pool.next_tile = 0;
+    soft_pool.busy = soft_pool.num_threads;
+    soft_pool.generation++;
+    pthread_cond_broadcast(&soft_pool.start_cond);
+    pthread_mutex_unlock(&soft_pool.mutex);
+
+    soft_raster_tiles();
+
+    pthread_mutex_lock(&soft_pool.mutex);
+    while (soft_pool.busy > 0) {
+        pthread_cond_wait(&soft_pool.done_cond, &soft_pool.mutex);
+    }
+    pthread_mutex_unlock(&soft_pool.mutex);
+
+    soft.num_tris = 0;
+    soft.num_states = 0;
+    soft.state_dirty = true;
+    soft.flushes++;
+    soft.flushes_this_frame++;
+    soft.raster_us += soft_get_time() - t0;
+}
+
+static void soft_bin_append(struct SoftBin *bin, uint32_t tri) {
+    if (bin->count == bin->capacity) {
+        bin->capacity = bin->capacity ? bin->capacity * 2 : 64;
+        bin->tris = realloc(bin->tris, bin->capacity * sizeof(uint32_t));
+        if (bin->tris == NULL)
+            abort();
+    }
+    bin->tris[bin->count++] = tri;
+}
+
+static void soft_resize(int width, int height) {
+    if (soft.bins == NULL) {
+        // Like a new GL context, the viewport and scissor box cover the window
+        soft.viewport[2] = soft.scissor[2] = width;
+        soft.viewport[3] = soft.scissor[3] = height;
+    }
+    soft_flush();
+    for (int i = 0; i < soft.tiles_x * soft.tiles_y; i++) {
+        free(soft.bins[i].tris);
+    }
+    free(soft.bins);
+    free(soft.color);
+    free(soft.depth);
+
+    soft.width = width;
+    soft.height = height;
+    soft.tiles_x = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    soft.tiles_y = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    soft.bins = calloc(soft.tiles_x * soft.tiles_y, sizeof(struct SoftBin));
+    soft.color = calloc((size_t)width * height, 4);
+    soft.depth = calloc((size_t)width * height, sizeof(float));
+    if (soft.bins == NULL || soft.color == NULL || soft.depth == NULL)
+        abort();
+    soft.drawn = false;
+}
+
+static void soft_snapshot_sampler(struct SoftSampler *sampler, uint32_t texture_id) {
+    struct SoftTexture *tex = &soft.textures[texture_id];
+
+    tex->used_until = soft.flushes + 1;
+    sampler->texels = tex->texels;
+    sampler->width = tex->width;
+    sampler->height = tex->height;
+    sampler->linear_filter = tex->linear_filter;
+    sampler->cms = tex->cms;
+    sampler->cmt = tex->cmt;
+}
+
+// Adds a state for the upcoming triangles if something changed since the last one.
+static void soft_update_state(void) {
+    if (!soft.state_dirty && soft.num_states > 0) {
+        return;
+    }
+    if (soft.num_states == SOFT_MAX_STATES) {
+        soft_flush();
+    }
+    struct SoftState *st = &soft.states[soft.num_states++];
+    st->prg = soft.prg;
+    for (int i = 0; i < 2; i++) {
+        if (soft.prg->cc.used_textures[i] && soft.textures[soft.bound_textures[i]].texels != NULL) {
+            soft_snapshot_sampler(&st->samplers[i], soft.bound_textures[i]);
+        } else {
+            // Nothing uploaded yet, sample an opaque black texel
+            static const uint8_t black[4] = {0, 0, 0, 255};
+            memset(&st->samplers[i], 0, sizeof(st->samplers[i]));
+            st->samplers[i].texels = black;
+            st->samplers[i].width = st->samplers[i].height = 1;
+        }
+    }
+    st->depth_test = soft.depth_test;
+    st->depth_mask = soft.depth_mask;
+    st->use_alpha = soft.use_alpha;
+    st->frame = soft.frame;
+    soft.state_dirty = false;
+}
+
+static const float *soft_fetch_color(const float *src, float *dst, int components) {
+#ifdef USE_PACKED_VERTICES
+    const uint8_t *bytes = (const uint8_t *)src;
+    for (int i = 0; i < components; i++) {
+        dst[i] = bytes[i] * (1.0f / 255.0f);
+    }
+    return src + 1;
+#else
+    memcpy(dst, src, components * sizeof(float));
+    return src + components;
+#endif
+}
+
+// Reads a vertex laid out the way gfx_emit_vertex_attribs writes it.
+static const float *soft_fetch_vertex(const struct ShaderProgram *prg, const float *src, struct SoftVertex *v) {
+    const struct CCFeatures *cc = &prg->cc;
+
+    memcpy(v->pos, src, sizeof(v->pos));
+    src += 4;
+    if (prg->has_texcoord) {
+#ifdef USE_PACKED_VERTICES
+        int16_t st[2];
+        memcpy(st, src++, sizeof(st));
+        v->var[0] = st[0] * (1.0f / GFX_PACKED_UV_SCALE);
+        v->var[1] = st[1] * (1.0f / GFX_PACKED_UV_SCALE);
+#else
+        v->var[0] = *src++;
+        v->var[1] = *src++;
+#endif
+    }
+    if (cc->opt_fog) {
+        src = soft_fetch_color(src, &v->var[prg->var_fog], 4);
+    }
+    for (int i = 0; i < cc->num_inputs; i++) {
+        float *input = &v->var[prg->var_inputs + i * 4];
+        src = soft_fetch_color(src, input, cc->opt_alpha ? 4 : 3);
+        if (!cc->opt_alpha) {
+            input[3] = 1.0f;
+        }
+    }
+    if (cc->opt_uber) {
+#ifdef USE_PACKED_VERTICES
+        uint16_t words[4];
+        memcpy(words, src, sizeof(words));
+        src += 2;
+        for (int i = 0; i < 3; i++) {
+            v->combiner[i] = words[i];
+        }
+#else
+        memcpy(v->combiner, src, sizeof(v->combiner));
+        src += 4;
+#endif
+    }
+    return src;
+}
+
+static void soft_lerp_vertex(const struct SoftVertex *a, const struct SoftVertex *b, float t, int num_varyings, struct SoftVertex *out) {
+    for (int i = 0; i < 4; i++) {
+        out->pos[i] = a->pos[i] + (b->pos[i] - a->pos[i]) * t;
+    }
+    for (int i = 0; i < num_varyings; i++) {
+        out->var[i] = a->var[i] + (b->var[i] - a->var[i]) * t;
+    }
+    memcpy(out->combiner, a->combiner, sizeof(out->combiner));
+}
+
+/**
+ * Clips a triangle against the near plane, z >= -w. The other planes are
+ * taken care of by limiting the pixels to the viewport.
+ * @returns the number of vertices in out, 0 or 3 to 4.
+ **/
+static int soft_clip_near(const struct SoftVertex *in, int num_varyings, struct SoftVertex out[4]) {
+    int n = 0;
+    for (int i = 0; i < 3; i++) {
+        const struct SoftVertex *a = &in[i], *b = &in[(i + 1) % 3];
+        float da = a->pos[2] + a->pos[3], db = b->pos[2] + b->pos[3];
+        if (da >= 0.0f) {
+            out[n++] = *a;
+        }
+        if ((da >= 0.0f) != (db >= 0.0f)) {
+            soft_lerp_vertex(a, b, da / (da - db), num_varyings, &out[n++]);
+        }
+    }
+    return n;
+}
+
+// Fits a plane through the values at the three vertices, see SoftTri.
+static inline void soft_plane(float out[3], float a0, float a1, float a2, const float dx[2], const float dy[2], float inv_area) {
+    out[0] = ((a1 - a0) * dy[1] - (a2 - a0) * dy[0]) * inv_area;
+    out[1] = ((a2 - a0) * dx[0] - (a1 - a0) * dx[1]) * inv_area;
+    out[2] = a0;
+}
+
+static void soft_setup_triangle(const struct SoftVertex *v0, const struct SoftVertex *v1, const struct SoftVertex *v2) {
+    const struct SoftVertex *v[3] = {v0, v1, v2};
+    float sx[3], sy[3], sz[3], inv_w[3];
+
+    for (int i = 0; i < 3; i++) {
+        inv_w[i] = 1.0f / v[i]->pos[3];
+        sx[i] = soft.viewport[0] + (v[i]->pos[0] * inv_w[i] + 1.0f) * 0.5f * soft.viewport[2];
+        sy[i] = soft.viewport[1] + (v[i]->pos[1] * inv_w[i] + 1.0f) * 0.5f * soft.viewport[3];
+        sz[i] = (v[i]->pos[2] * inv_w[i] + 1.0f) * 0.5f;
+    }
+    float dx[2] = {sx[1] - sx[0], sx[2] - sx[0]};
+    float dy[2] = {sy[1] - sy[0], sy[2] - sy[0]};
+    float area = dx[0] * dy[1] - dx[1] * dy[0];
+    if (!(fabsf(area) > 0.0f) || !isfinite(area)) {
+        return; // degenerate, or w was 0
+    }
+
+    // The viewport stands in for the clipping planes other than near
+    int x0 = soft.scissor[0] > soft.viewport[0] ? soft.scissor[0] : soft.viewport[0];
+    int y0 = soft.scissor[1] > soft.viewport[1] ? soft.scissor[1] : soft.viewport[1];
+    int x1 = soft.scissor[0] + soft.scissor[2], vx1 = soft.viewport[0] + soft.viewport[2];
+    int y1 = soft.scissor[1] + soft.scissor[3], vy1 = soft.viewport[1] + soft.viewport[3];
+    x1 = x1 < vx1 ? x1 : vx1;
+    y1 = y1 < vy1 ? y1 : vy1;
+    x0 = x0 > 0 ? x0 : 0;
+    y0 = y0 > 0 ? y0 : 0;
+    x1 = x1 < soft.width ? x1 : soft.width;
+    y1 = y1 < soft.height ? y1 : soft.height;
+
+    float min_x = fminf(sx[0], fminf(sx[1], sx[2])), max_x = fmaxf(sx[0], fmaxf(sx[1], sx[2]));
+    float min_y = fminf(sy[0], fminf(sy[1], sy[2])), max_y = fmaxf(sy[0], fmaxf(sy[1], sy[2]));
+    if (min_x > x0) x0 = (int)floorf(min_x);
+    if (min_y > y0) y0 = (int)floorf(min_y);
+    if (max_x < x1) x1 = (int)ceilf(max_x);
+    if (max_y < y1) y1 = (int)ceilf(max_y);
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+
+    if (soft.num_tris == SOFT_MAX_TRIS) {
+        soft_flush();
+    }
+    soft_update_state();
+    uint32_t index = soft.num_tris++;
+    struct SoftTri *tri = &soft.tris[index];
+    tri->state = soft.num_states - 1;
+    tri->x0 = x0;
+    tri->y0 = y0;
+    tri->x1 = x1;
+    tri->y1 = y1;
+    tri->ox = sx[0];
+    tri->oy = sy[0];
+
+    // Edge e is across from vertex e and positive on the inside
+    float sign = area > 0.0f ? 1.0f : -1.0f;
+    tri->top_left = 0;
+    for (int e = 0; e < 3; e++) {
+        int j = (e + 1) % 3, k = (e + 2) % 3;
+        float a = (sy[j] - sy[k]) * sign, b = (sx[k] - sx[j]) * sign;
+        tri->edge[e][0] = a;
+        tri->edge[e][1] = b;
+        tri->edge[e][2] = ((sx[k] - sx[j]) * (sy[0] - sy[j]) - (sy[k] - sy[j]) * (sx[0] - sx[j])) * sign;
+        if (a > 0.0f || (a == 0.0f && b > 0.0f)) {
+            tri->top_left |= 1 << e;
+        }
+    }
+
+    float inv_area = 1.0f / area;
+    soft_plane(tri->z, sz[0], sz[1], sz[2], dx, dy, inv_area);
+    if (soft.zmode_decal) {
+        // glPolygonOffset(-2, -2)
+        tri->z[2] -= 2.0f * fmaxf(fabsf(tri->z[0]), fabsf(tri->z[1])) + 2.0f * SOFT_DEPTH_UNIT;
+    }
+    soft_plane(tri->inv_w, inv_w[0], inv_w[1], inv_w[2], dx, dy, inv_area);
+    for (int i = 0; i < soft.prg->num_varyings; i++) {
+        soft_plane(tri->var[i], v0->var[i] * inv_w[0], v1->var[i] * inv_w[1], v2->var[i] * inv_w[2], dx, dy, inv_area);
+    }
+    if (soft.prg->cc.opt_uber) {
+        // Selectors and options, see append_uber_combiner
+        uint32_t rgb = (uint32_t)(v0->combiner[0] + 0.5f);
+        uint32_t alpha = (uint32_t)(v0->combiner[1] + 0.5f);
+        uint32_t options = (uint32_t)(v0->combiner[2] + 0.5f);
+        for (int i = 0; i < 4; i++) {
+            tri->c[0][i] = (rgb >> (i * 3)) & 7;
+            tri->c[1][i] = (alpha >> (i * 3)) & 7;
+        }
+        tri->opt_alpha = options & 1;
+        tri->opt_texture_edge = (options & 2) != 0;
+    } else {
+        memcpy(tri->c, soft.prg->cc.c, sizeof(tri->c));
+        tri->opt_alpha = soft.prg->cc.opt_alpha;
+        tri->opt_texture_edge = soft.prg->cc.opt_texture_edge;
+    }
+
+    for (int ty = y0 / SOFT_TILE_SIZE; ty <= (y1 - 1) / SOFT_TILE_SIZE; ty++) {
+        for (int tx = x0 / SOFT_TILE_SIZE; tx <= (x1 - 1) / SOFT_TILE_SIZE; tx++) {
+            soft_bin_append(&soft.bins[ty * soft.tiles_x + tx], index);
+        }
+    }
+    soft.tris_setup++;
+}
+
+static bool gfx_soft_z_is_from_0_to_1(void) {
+    return false;
+}
+
+static void gfx_soft_unload_shader(struct ShaderProgram *old_prg) {
+}
+
+static void gfx_soft_load_shader(struct ShaderProgram *new_prg) {
+    soft.prg = new_prg;
+    soft.state_dirty = true;
+}
+
+static struct ShaderProgram *gfx_soft_create_and_load_new_shader(uint32_t shader_id) {
+    if (shader_program_pool_size >= GFX_MAX_SHADER_PROGRAMS) {
+        fprintf(stderr, "Out of shader programs, %08x is one too many\n", shader_id);
+        abort();
+    }
+    struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
+    uint8_t n = 0;
+
+    prg->shader_id = shader_id;
+    gfx_cc_get_features(shader_id, &prg->cc);
+    prg->has_texcoord = prg->cc.used_textures[0] || prg->cc.used_textures[1];
+    if (prg->has_texcoord) {
+        n += 2;
+    }
+    prg->var_fog = n;
+    if (prg->cc.opt_fog) {
+        n += 4;
+    }
+    prg->var_inputs = n;
+    n += prg->cc.num_inputs * 4;
+    prg->num_varyings = n;
+
+    gfx_soft_load_shader(prg);
+    return prg;
+}
+
+static struct ShaderProgram *gfx_soft_lookup_shader(uint32_t shader_id) {
+    for (size_t i = 0; i < shader_program_pool_size; i++) {
+        if (shader_program_pool[i].shader_id == shader_id) {
+            return &shader_program_pool[i];
+        }
+    }
+    return NULL;
+}
+
+static void gfx_soft_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    *num_inputs = prg->cc.num_inputs;
+    used_textures[0] = prg->cc.used_textures[0];
+    used_textures[1] = prg->cc.used_textures[1];
+}
+
+static uint32_t gfx_soft_new_texture(void) {
+    if (soft.num_textures == soft.textures_capacity) {
+        soft.textures_capacity = soft.textures_capacity ? soft.textures_capacity * 2 : 256;
+        soft.textures = realloc(soft.textures, soft.textures_capacity * sizeof(struct SoftTexture));
+        if (soft.textures == NULL)
+            abort();
+    }
+    memset(&soft.textures[soft.num_textures], 0, sizeof(struct SoftTexture));
+    return soft.num_textures++;
+}
+
+static void gfx_soft_select_texture(int tile, uint32_t texture_id) {
+    soft.bound_textures[tile] = texture_id;
+    soft.active_tile = tile;
+    soft.state_dirty = true;
+}
+
+// Stores texels as RGBA32 with the precision format would have kept.
+static void gfx_soft_upload_texture_format(const uint8_t *rgba32_buf, enum GfxTextureFormat format, int width, int height) {
+    struct SoftTexture *tex = &soft.textures[soft.bound_textures[soft.active_tile]];
+
+    if (tex->used_until == soft.flushes + 1) {
+        soft_flush(); // binned triangles still sample the old texels
+    }
+    if (tex->texels == NULL || tex->width * tex->height != width * height) {
+        free(tex->texels);
+        tex->texels = malloc((size_t)width * height * 4);
+        if (tex->texels == NULL)
+            abort();
+    }
+    tex->width = width;
+    tex->height = height;
+
+    uint8_t *dst = tex->texels;
+    const uint8_t *src = rgba32_buf;
+    for (int i = 0; i < width * height; i++, src += 4, dst += 4) {
+        switch (format) {
+            case GFX_TEXFMT_RGBA5551:
+                for (int j = 0; j < 3; j++) {
+                    dst[j] = (src[j] * 31 + 127) / 255 * 255 / 31;
+                }
+                dst[3] = src[3] >> 7 ? 255 : 0;
+                break;
+            case GFX_TEXFMT_RGBA4444:
+                for (int j = 0; j < 4; j++) {
+                    dst[j] = (src[j] * 15 + 127) / 255 * 17;
+                }
+                break;
+            case GFX_TEXFMT_LA88:
+                dst[0] = dst[1] = dst[2] = src[0];
+                dst[3] = src[3];
+                break;
+            case GFX_TEXFMT_L8:
+                dst[0] = dst[1] = dst[2] = src[0];
+                dst[3] = 255;
+                break;
+            default:
+                memcpy(dst, src, 4);
+                break;
+        }
+    }
+    soft.state_dirty = true;
+}
+
+static void gfx_soft_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
+    gfx_soft_upload_texture_format(rgba32_buf, GFX_TEXFMT_RGBA8888, width, height);
+}
+
+static void gfx_soft_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
+    struct SoftTexture *tex = &soft.textures[soft.bound_textures[tile]];
+
+    soft.active_tile = tile;
+    tex->linear_filter = linear_filter;
+    tex->cms = cms;
+    tex->cmt = cmt;
+    soft.state_dirty = true;
+}
+
+static void gfx_soft_set_depth_test(bool depth_test) {
+    soft.depth_test = depth_test;
+    soft.state_dirty = true;
+}
+
+static void gfx_soft_set_depth_mask(bool z_upd) {
+    soft.depth_mask = z_upd;
+    soft.state_dirty = true;
+}
+
+static void gfx_soft_set_zmode_decal(bool zmode_decal) {
+    soft.zmode_decal = zmode_decal;
+}
+
+static void gfx_soft_set_viewport(int x, int y, int width, int height) {
+    soft.viewport[0] = x;
+    soft.viewport[1] = y;
+    soft.viewport[2] = width;
+    soft.viewport[3] = height;
+}
+
+static void gfx_soft_set_scissor(int x, int y, int width, int height) {
+    soft.scissor[0] = x;
+    soft.scissor[1] = y;
+    soft.scissor[2] = width;
+    soft.scissor[3] = height;
+}
+
+static void gfx_soft_set_use_alpha(bool use_alpha) {
+    soft.use_alpha = use_alpha;
+    soft.state_dirty = true;
+}
+
+static void gfx_soft_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
+    const struct ShaderProgram *prg = soft.prg;
+    const float *src = buf_vbo;
+
+    for (size_t t = 0; t < buf_vbo_num_tris; t++) {
+        struct SoftVertex v[3], clipped[4];
+        for (int i = 0; i < 3; i++) {
+            src = soft_fetch_vertex(prg, src, &v[i]);
+        }
+        if (v[0].pos[2] >= -v[0].pos[3] && v[1].pos[2] >= -v[1].pos[3] && v[2].pos[2] >= -v[2].pos[3]) {
+            soft_setup_triangle(&v[0], &v[1], &v[2]);
+            continue;
+        }
+        int n = soft_clip_near(v, prg->num_varyings, clipped);
+        for (int i = 2; i < n; i++) {
+            soft_setup_triangle(&clipped[0], &clipped[i - 1], &clipped[i]);
+        }
+        soft.tris_clipped++;
+    }
+}
+
+static void gfx_soft_init(void) {
+    int threads = configSoftThreads;
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) threads = 1;
+    if (threads > SOFT_MAX_THREADS) threads = SOFT_MAX_THREADS;
+
+    soft.states = malloc(SOFT_MAX_STATES * sizeof(struct SoftState));
+    soft.tris = malloc(SOFT_MAX_TRIS * sizeof(struct SoftTri));
+    if (soft.states == NULL || soft.tris == NULL)
+        abort();
+    // Texture 0 stays empty for the tiles nothing was selected for
+    gfx_soft_new_texture();
+
+    pthread_mutex_init(&soft_pool.mutex, NULL);
+    pthread_cond_init(&soft_pool.start_cond, NULL);
+    pthread_cond_init(&soft_pool.done_cond, NULL);
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&soft_pool.threads[i], NULL, soft_worker, NULL) != 0) {
+            fprintf(stderr, "Unable to start the rasterizer threads, using %d\n", i + 1);
+            break;
+        }
+        soft_pool.num_threads++;
+    }
+}
+
+static void gfx_soft_on_resize(void) {
+}
+
+static void gfx_soft_start_frame(void) {
+    soft.frame++;
+    // Same as the glClear of gfx_opengl
+    for (size_t i = 0; i < (size_t)soft.width * soft.height; i++) {
+        soft.color[i * 4 + 0] = 0;
+        soft.color[i * 4 + 1] = 0;
+        soft.color[i * 4 + 2] = 0;
+        soft.color[i * 4 + 3] = 255;
+        soft.depth[i] = 1.0f;
+    }
+    soft.state_dirty = true;
+}
+
+static bool soft_write_ppm(FILE *file) {
+    uint8_t *row = malloc(soft.width * 3);
+    if (row == NULL)
+        return false;
+
+    fprintf(file, "P6\n%d %d\n255\n", soft.width, soft.height);
+    for (int y = soft.height - 1; y >= 0; y--) {
+        const uint8_t *src = &soft.color[(size_t)y * soft.width * 4];
+        for (int x = 0; x < soft.width; x++) {
+            memcpy(&row[x * 3], &src[x * 4], 3);
+        }
+        fwrite(row, 1, soft.width * 3, file);
+    }
+    free(row);
+    return !ferror(file);
+}
+
+static uint32_t soft_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static inline void soft_put_be32(uint8_t *dst, uint32_t v) {
+    dst[0] = v >> 24;
+    dst[1] = v >> 16;
+    dst[2] = v >> 8;
+    dst[3] = v;
+}
+
+static void soft_write_png_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t len) {
+    uint8_t header[8];
+    uint8_t crc[4];
+
+    soft_put_be32(header, len);
+    memcpy(&header[4], type, 4);
+    soft_put_be32(crc, soft_crc32(soft_crc32(0, &header[4], 4), data, len));
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(data, 1, len, file);
+    fwrite(crc, 1, sizeof(crc), file);
+}
+
+// RGB with stored (uncompressed) deflate blocks, so there's no need for zlib.
+static bool soft_write_png(FILE *file) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    size_t stride = 1 + soft.width * 3;
+    size_t raw_len = stride * soft.height;
+    size_t num_blocks = (raw_len + 0xffff - 1) / 0xffff;
+    size_t zlib_len = 2 + raw_len + num_blocks * 5 + 4;
+    uint8_t *raw = malloc(raw_len);
+    uint8_t *zlib = malloc(zlib_len);
+    if (raw == NULL || zlib == NULL) {
+        free(raw);
+        free(zlib);
+        return false;
+    }
+
+    for (int y = 0; y < soft.height; y++) {
+        uint8_t *dst = &raw[y * stride];
+        const uint8_t *src = &soft.color[(size_t)(soft.height - 1 - y) * soft.width * 4];
+        *dst++ = 0; // no filter
+        for (int x = 0; x < soft.width; x++, dst += 3, src += 4) {
+            memcpy(dst, src, 3);
+        }
+    }
+
+    uint8_t *z = zlib;
+    uint32_t a = 1, b = 0;
+    *z++ = 0x78;
+    *z++ = 0x01;
+    for (size_t pos = 0; pos < raw_len; pos += 0xffff) {
+        uint32_t len = raw_len - pos < 0xffff ? raw_len - pos : 0xffff;
+        *z++ = pos + len == raw_len; // last block
+        *z++ = len;
+        *z++ = len >> 8;
+        *z++ = ~len;
+        *z++ = ~len >> 8;
+        memcpy(z, &raw[pos], len);
+        z += len;
+    }
+    for (size_t i = 0; i < raw_len; i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    soft_put_be32(z, b << 16 | a);
+
+    uint8_t ihdr[13];
+    soft_put_be32(&ihdr[0], soft.width);
+    soft_put_be32(&ihdr[4], soft.height);
+    ihdr[8] = 8; // bits per channel
+    ihdr[9] = 2; // RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // deflate, adaptive filtering, no interlacing
+
+    fwrite(signature, 1, sizeof(signature), file);
+    soft_write_png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+    soft_write_png_chunk(file, "IDAT", zlib, zlib_len);
+    soft_write_png_chunk(file, "IEND", NULL, 0);
+    free(raw);
+    free(zlib);
+    return !ferror(file);
+}
+
+bool gfx_soft_save_frame(const char *filename) {
+    if (!soft.drawn) {
+        return false;
+    }
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    size_t len = strlen(filename);
+    bool ok = len >= 4 && strcmp(filename + len - 4, ".ppm") == 0 ? soft_write_ppm(file) : soft_write_png(file);
+    return fclose(file) == 0 && ok;
+}
+
+static void gfx_soft_end_frame(void) {
+    soft_flush();
+    soft.drawn = true;
+
+    if (configSoftDumpInterval != 0 && soft.frame % configSoftDumpInterval == 0) {
+        char name[32];
+        sprintf(name, "soft_%06u.png", soft.frame);
+        FILE *file = fopen_home(name, "wb");
+        if (file == NULL || !soft_write_png(file)) {
+            fprintf(stderr, "Unable to write %s\n", name);
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+
+    ProfEmitCounter("soft_tris", soft.tris_setup);
+    ProfEmitCounter("soft_tris_clipped", soft.tris_clipped);
+    ProfEmitCounter("soft_fragments", soft.fragments);
+    ProfEmitCounter("soft_flushes", soft.flushes_this_frame);
+    ProfEmitCounter("soft_raster_us", soft.raster_us);
+    soft.tris_setup = soft.tris_clipped = soft.fragments = soft.flushes_this_frame = 0;
+    soft.raster_us = 0;
+}
+
+static void gfx_soft_finish_render(void) {
+}
+
+static void gfx_soft_signal_start(uint32_t width, uint32_t height) {
+    if ((int)width != soft.width || (int)height != soft.height) {
+        soft_resize(width, height);
+    }
+}
+
+struct GfxRenderingAPI gfx_soft_api = {
+    gfx_soft_z_is_from_0_to_1,
+    gfx_soft_unload_shader,
+    gfx_soft_load_shader,
+    gfx_soft_create_and_load_new_shader,
+    gfx_soft_lookup_shader,
+    gfx_soft_shader_get_info,
+    gfx_soft_new_texture,
+    gfx_soft_select_texture,
+    gfx_soft_upload_texture,
+    gfx_soft_set_sampler_parameters,
+    gfx_soft_set_depth_test,
+    gfx_soft_set_depth_mask,
+    gfx_soft_set_zmode_decal,
+    gfx_soft_set_viewport,
+    gfx_soft_set_scissor,
+    gfx_soft_set_use_alpha,
+    gfx_soft_draw_triangles,
+    gfx_soft_init,
+    gfx_soft_on_resize,
+    gfx_soft_start_frame,
+    gfx_soft_end_frame,
+    gfx_soft_finish_render,
+    gfx_soft_signal_start,
+#ifdef USE_HW_TNL
+    NULL, // transformed by gfx_pc
+#endif
+    gfx_soft_upload_texture_format,
+#ifdef USE_INDEXED_DRAWING
+    NULL,
+#endif
+#ifdef USE_COLOR_UNIFORMS
+    NULL,
+#endif
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef GFX_SOFT_H
+#define GFX_SOFT_H
+
+#include <stdbool.h>
+
+#include "gfx_rendering_api.h"
+
+extern struct GfxRenderingAPI gfx_soft_api;
+
+/**
+ * Writes the last finished frame.
+ * @arg filename: Saved as a binary PPM if it ends in .ppm, PNG otherwise.
+ * @returns false if the file couldn't be written or nothing was drawn yet.
+ **/
+extern bool gfx_soft_save_frame(const char *filename);
+
+#endif
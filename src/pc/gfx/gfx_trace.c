@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gfx_trace.h"
+#include "../fsutils.h"
+
+#define GFX_TRACE_MAGIC 0x52544c44 // "DLTR"
+#define GFX_TRACE_VERSION 1
+
+// Traces only replay on a build that decodes commands the same way
+#if defined(F3DEX_GBI_2E)
+#define GFX_TRACE_GBI 4
+#elif defined(F3DEX_GBI_2)
+#define GFX_TRACE_GBI 3
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+#define GFX_TRACE_GBI 2
+#else
+#define GFX_TRACE_GBI 1
+#endif
+#ifdef GBI_FLOATS
+#define GFX_TRACE_FLAGS 1
+#else
+#define GFX_TRACE_FLAGS 0
+#endif
+
+enum GfxTraceKind {
+    TRACE_KIND_DATA,
+    TRACE_KIND_DL
+};
+
+enum GfxTraceRecordType {
+    TRACE_RECORD_BLOCK = 1,
+    TRACE_RECORD_FRAME
+};
+
+/**
+ * @property gfx_size: sizeof(Gfx) on the capturing machine, needed to find
+ * commands inside display list blocks since those are stored widened.
+ **/
+struct GfxTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t gbi;
+    uint32_t flags;
+    uint32_t gfx_size;
+    uint32_t vtx_size;
+};
+
+/**
+ * Followed by the block contents. Display lists are stored as a w0, w1 pair
+ * of 64 bit words per command so traces survive a change of pointer size.
+ * @property length: Bytes for data, commands for display lists.
+ **/
+struct GfxTraceBlockRecord {
+    uint32_t type;
+    uint32_t id;
+    uint32_t kind;
+    uint32_t length;
+    uint64_t addr;
+};
+
+/**
+ * Followed by the ids of every block the frame references.
+ **/
+struct GfxTraceFrameRecord {
+    uint32_t type;
+    uint32_t num_blocks;
+    uint64_t root;
+};
+
+#define C0(pos, width) ((cmd->words.w0 >> (pos)) & ((1U << width) - 1))
+#define C1(pos, width) ((cmd->words.w1 >> (pos)) & ((1U << width) - 1))
+
+struct GfxTraceRange {
+    uintptr_t addr, end;
+    uint32_t kind;
+};
+
+/**
+ * Open addressing with linear probing, a slot is free when size is zero.
+ **/
+struct GfxTraceWritten {
+    uint64_t hash;
+    uintptr_t addr;
+    uint32_t size;
+    uint32_t id;
+};
+
+static struct {
+    FILE *file;
+    struct GfxTraceRange *ranges;
+    size_t num_ranges, max_ranges;
+    uint32_t *frame_ids;
+    size_t max_frame_ids;
+    struct GfxTraceWritten *written;
+    uint32_t written_mask, num_written;
+    const uint8_t *texture_addr;
+    uint32_t texture_siz;
+} trace_out;
+
+struct GfxTraceBlock {
+    uint64_t addr, end;
+    uint32_t kind, length;
+    void *data;
+    Gfx *native;
+};
+
+struct GfxTraceFrame {
+    uint64_t root;
+    uint32_t num_blocks;
+    uint32_t *blocks; // sorted by address
+};
+
+struct GfxTrace {
+    uint32_t gfx_size;
+    struct GfxTraceBlock *blocks;
+    uint32_t num_blocks;
+    struct GfxTraceFrame *frames;
+    uint32_t num_frames;
+};
+
+static uint64_t gfx_trace_hash(const void *data, size_t len) {
+    // FNV-1a
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool gfx_trace_begin(const char *filename) {
+    trace_out.file = fopen_home(filename, "wb");
+    if (trace_out.file == NULL) {
+        fprintf(stderr, "Unable to create display list trace '%s'\n", filename);
+        return false;
+    }
+
+    struct GfxTraceHeader header = {
+        GFX_TRACE_MAGIC, GFX_TRACE_VERSION, GFX_TRACE_GBI, GFX_TRACE_FLAGS, sizeof(Gfx), sizeof(Vtx)
+    };
+    fwrite(&header, sizeof(header), 1, trace_out.file);
+
+    trace_out.written_mask = 1023;
+    trace_out.num_written = 0;
+    free(trace_out.written);
+    trace_out.written = calloc(trace_out.written_mask + 1, sizeof(struct GfxTraceWritten));
+    if (trace_out.written == NULL) {
+        abort();
+    }
+    return true;
+}
+
+void gfx_trace_end(void) {
+    if (trace_out.file != NULL) {
+        fclose(trace_out.file);
+        trace_out.file = NULL;
+    }
+}
+
+static void gfx_trace_add(const void *addr, size_t size, uint32_t kind) {
+    if (addr == NULL || size == 0) {
+        return;
+    }
+    if (trace_out.num_ranges == trace_out.max_ranges) {
+        trace_out.max_ranges = trace_out.max_ranges == 0 ? 4096 : trace_out.max_ranges * 2;
+        trace_out.ranges = realloc(trace_out.ranges, trace_out.max_ranges * sizeof(struct GfxTraceRange));
+        if (trace_out.ranges == NULL) {
+            abort();
+        }
+    }
+    struct GfxTraceRange *range = &trace_out.ranges[trace_out.num_ranges++];
+    range->addr = (uintptr_t) addr;
+    range->end = (uintptr_t) addr + size;
+    range->kind = kind;
+}
+
+static uint32_t gfx_trace_texel_shift(uint32_t siz) {
+    switch (siz) {
+        case G_IM_SIZ_16b:
+            return 1;
+        case G_IM_SIZ_32b:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// Walks the display lists like gfx_run_dl, noting every range it would read
+static void gfx_trace_walk(const Gfx *cmd) {
+    const Gfx *start = cmd;
+    for (;; cmd++) {
+        uint32_t opcode = cmd->words.w0 >> 24;
+
+        switch (opcode) {
+            case G_MTX:
+                gfx_trace_add((const void *) cmd->words.w1, sizeof(Mtx), TRACE_KIND_DATA);
+                break;
+            case G_MOVEMEM:
+#ifdef F3DEX_GBI_2
+                if (C0(0, 8) == G_MV_VIEWPORT) {
+                    gfx_trace_add((const void *) cmd->words.w1, sizeof(Vp), TRACE_KIND_DATA);
+                } else if (C0(0, 8) == G_MV_LIGHT && C0(8, 8) * 8 >= 48) {
+                    gfx_trace_add((const void *) cmd->words.w1, sizeof(Light_t), TRACE_KIND_DATA);
+                }
+#else
+                if (C0(16, 8) == G_MV_VIEWPORT) {
+                    gfx_trace_add((const void *) cmd->words.w1, sizeof(Vp), TRACE_KIND_DATA);
+                } else if (C0(16, 8) >= G_MV_L0 && C0(16, 8) <= G_MV_L2) {
+                    gfx_trace_add((const void *) cmd->words.w1, sizeof(Light_t), TRACE_KIND_DATA);
+                }
+#endif
+                break;
+            case G_VTX:
+#ifdef F3DEX_GBI_2
+                gfx_trace_add((const void *) cmd->words.w1, C0(12, 8) * sizeof(Vtx), TRACE_KIND_DATA);
+#elif defined(F3DEX_GBI) || defined(F3DLP_GBI)
+                gfx_trace_add((const void *) cmd->words.w1, C0(10, 6) * sizeof(Vtx), TRACE_KIND_DATA);
+#else
+                gfx_trace_add((const void *) cmd->words.w1, C0(0, 16) / sizeof(Vtx) * sizeof(Vtx), TRACE_KIND_DATA);
+#endif
+                break;
+            case G_DL:
+                if (C0(16, 1) == 0) {
+                    gfx_trace_walk((const Gfx *) cmd->words.w1);
+                } else {
+                    gfx_trace_add(start, (cmd + 1 - start) * sizeof(Gfx), TRACE_KIND_DL);
+                    start = (const Gfx *) cmd->words.w1;
+                    cmd = start - 1; // increase after break
+                }
+                break;
+            case (uint8_t)G_ENDDL:
+                gfx_trace_add(start, (cmd + 1 - start) * sizeof(Gfx), TRACE_KIND_DL);
+                return;
+            case G_SETTIMG:
+                trace_out.texture_addr = (const uint8_t *) cmd->words.w1;
+                trace_out.texture_siz = C0(19, 2);
+                break;
+            case G_LOADBLOCK:
+                if (C1(24, 3) != 1) {
+                    gfx_trace_add(trace_out.texture_addr, (C1(12, 12) + 1) << gfx_trace_texel_shift(trace_out.texture_siz), TRACE_KIND_DATA);
+                }
+                break;
+            case G_LOADTILE:
+                if (C1(24, 3) != 1) {
+                    uint32_t texels = ((C1(12, 12) >> G_TEXTURE_IMAGE_FRAC) + 1) * ((C1(0, 12) >> G_TEXTURE_IMAGE_FRAC) + 1);
+                    gfx_trace_add(trace_out.texture_addr, texels << gfx_trace_texel_shift(trace_out.texture_siz), TRACE_KIND_DATA);
+                }
+                break;
+            case G_LOADTLUT:
+                gfx_trace_add(trace_out.texture_addr, (C1(14, 10) + 1) * sizeof(uint16_t), TRACE_KIND_DATA);
+                break;
+        }
+    }
+}
+
+static int gfx_trace_range_cmp(const void *a, const void *b) {
+    const struct GfxTraceRange *ra = a, *rb = b;
+    if (ra->kind != rb->kind) {
+        return ra->kind < rb->kind ? -1 : 1;
+    }
+    if (ra->addr != rb->addr) {
+        return ra->addr < rb->addr ? -1 : 1;
+    }
+    return 0;
+}
+
+static struct GfxTraceWritten *gfx_trace_find_written(uint64_t hash, uintptr_t addr, uint32_t size) {
+    uint32_t i = (uint32_t)(hash ^ (hash >> 32)) & trace_out.written_mask;
+    for (;; i = (i + 1) & trace_out.written_mask) {
+        struct GfxTraceWritten *w = &trace_out.written[i];
+        if (w->size == 0 || (w->hash == hash && w->addr == addr && w->size == size)) {
+            return w;
+        }
+    }
+}
+
+static void gfx_trace_grow_written(void) {
+    struct GfxTraceWritten *old = trace_out.written;
+    uint32_t old_count = trace_out.written_mask + 1;
+
+    trace_out.written_mask = old_count * 2 - 1;
+    trace_out.written = calloc(old_count * 2, sizeof(struct GfxTraceWritten));
+    if (trace_out.written == NULL) {
+        abort();
+    }
+    for (uint32_t i = 0; i < old_count; i++) {
+        if (old[i].size != 0) {
+            *gfx_trace_find_written(old[i].hash, old[i].addr, old[i].size) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Returns the id of a block, writing it out first if no earlier frame had it
+static uint32_t gfx_trace_write_block(const struct GfxTraceRange *range) {
+    uint32_t size = range->end - range->addr;
+    uint64_t hash = gfx_trace_hash((const void *) range->addr, size) ^ range->kind;
+
+    struct GfxTraceWritten *w = gfx_trace_find_written(hash, range->addr, size);
+    if (w->size != 0) {
+        return w->id;
+    }
+
+    w->hash = hash;
+    w->addr = range->addr;
+    w->size = size;
+    w->id = trace_out.num_written++;
+
+    struct GfxTraceBlockRecord record = {
+        TRACE_RECORD_BLOCK, w->id, range->kind, size, range->addr
+    };
+    if (range->kind == TRACE_KIND_DL) {
+        const Gfx *cmd = (const Gfx *) range->addr;
+        record.length = size / sizeof(Gfx);
+        fwrite(&record, sizeof(record), 1, trace_out.file);
+        for (uint32_t i = 0; i < record.length; i++) {
+            uint64_t words[2] = { cmd[i].words.w0, cmd[i].words.w1 };
+            fwrite(words, sizeof(words), 1, trace_out.file);
+        }
+    } else {
+        fwrite(&record, sizeof(record), 1, trace_out.file);
+        fwrite((const void *) range->addr, size, 1, trace_out.file);
+    }
+
+    uint32_t id = w->id;
+    if (trace_out.num_written * 2 > trace_out.written_mask) {
+        gfx_trace_grow_written();
+    }
+    return id;
+}
+
+void gfx_trace_capture(const Gfx *commands) {
+    if (trace_out.file == NULL) {
+        return;
+    }
+
+    trace_out.num_ranges = 0;
+    trace_out.texture_addr = NULL;
+    gfx_trace_walk(commands);
+
+    // Merge overlapping ranges so every pointer lands inside exactly one block
+    qsort(trace_out.ranges, trace_out.num_ranges, sizeof(struct GfxTraceRange), gfx_trace_range_cmp);
+    size_t num_merged = 0;
+    for (size_t i = 0; i < trace_out.num_ranges; i++) {
+        struct GfxTraceRange *range = &trace_out.ranges[i];
+        struct GfxTraceRange *last = num_merged != 0 ? &trace_out.ranges[num_merged - 1] : NULL;
+        if (last != NULL && last->kind == range->kind && range->addr <= last->end) {
+            if (range->end > last->end) {
+                last->end = range->end;
+            }
+        } else {
+            trace_out.ranges[num_merged++] = *range;
+        }
+    }
+
+    if (num_merged > trace_out.max_frame_ids) {
+        trace_out.max_frame_ids = num_merged;
+        trace_out.frame_ids = realloc(trace_out.frame_ids, num_merged * sizeof(uint32_t));
+        if (trace_out.frame_ids == NULL) {
+            abort();
+        }
+    }
+    for (size_t i = 0; i < num_merged; i++) {
+        trace_out.frame_ids[i] = gfx_trace_write_block(&trace_out.ranges[i]);
+    }
+
+    struct GfxTraceFrameRecord record = {
+        TRACE_RECORD_FRAME, num_merged, (uintptr_t) commands
+    };
+    fwrite(&record, sizeof(record), 1, trace_out.file);
+    fwrite(trace_out.frame_ids, sizeof(uint32_t), num_merged, trace_out.file);
+}
+
+static struct GfxTrace *gfx_trace_load_failed(FILE *file, struct GfxTrace *trace, const char *filename) {
+    fprintf(stderr, "Display list trace '%s' is corrupt or was captured by another build\n", filename);
+    fclose(file);
+    gfx_trace_free(trace);
+    return NULL;
+}
+
+static struct GfxTrace *gfx_trace_sort_trace;
+
+static int gfx_trace_block_cmp(const void *a, const void *b) {
+    uint64_t addr_a = gfx_trace_sort_trace->blocks[*(const uint32_t *) a].addr;
+    uint64_t addr_b = gfx_trace_sort_trace->blocks[*(const uint32_t *) b].addr;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+struct GfxTrace *gfx_trace_load(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open display list trace '%s'\n", filename);
+        return NULL;
+    }
+
+    struct GfxTrace *trace = calloc(1, sizeof(struct GfxTrace));
+    if (trace == NULL) {
+        abort();
+    }
+
+    struct GfxTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != GFX_TRACE_MAGIC ||
+        header.version != GFX_TRACE_VERSION ||
+        header.gbi != GFX_TRACE_GBI ||
+        header.flags != GFX_TRACE_FLAGS ||
+        header.vtx_size != sizeof(Vtx) ||
+        header.gfx_size == 0) {
+        return gfx_trace_load_failed(file, trace, filename);
+    }
+    trace->gfx_size = header.gfx_size;
+
+    uint32_t max_blocks = 0, max_frames = 0;
+    uint32_t type;
+    while (fread(&type, sizeof(type), 1, file) == 1) {
+        if (type == TRACE_RECORD_BLOCK) {
+            struct GfxTraceBlockRecord record;
+            record.type = type;
+            if (fread(&record.id, sizeof(record) - sizeof(type), 1, file) != 1 || record.id != trace->num_blocks) {
+                return gfx_trace_load_failed(file, trace, filename);
+            }
+            if (trace->num_blocks == max_blocks) {
+                max_blocks = max_blocks == 0 ? 1024 : max_blocks * 2;
+                trace->blocks = realloc(trace->blocks, max_blocks * sizeof(struct GfxTraceBlock));
+                if (trace->blocks == NULL) {
+                    abort();
+                }
+            }
+
+            struct GfxTraceBlock *block = &trace->blocks[trace->num_blocks++];
+            size_t bytes = record.kind == TRACE_KIND_DL ? record.length * 2 * sizeof(uint64_t) : record.length;
+            block->addr = record.addr;
+            block->end = record.addr + (record.kind == TRACE_KIND_DL ? (uint64_t) record.length * header.gfx_size : record.length);
+            block->kind = record.kind;
+            block->length = record.length;
+            block->data = malloc(bytes);
+            block->native = record.kind == TRACE_KIND_DL ? malloc(record.length * sizeof(Gfx)) : NULL;
+            if (block->data == NULL || (record.kind == TRACE_KIND_DL && block->native == NULL)) {
+                abort();
+            }
+            if (fread(block->data, 1, bytes, file) != bytes) {
+                return gfx_trace_load_failed(file, trace, filename);
+            }
+        } else if (type == TRACE_RECORD_FRAME) {
+            struct GfxTraceFrameRecord record;
+            if (fread(&record.num_blocks, sizeof(record) - sizeof(type), 1, file) != 1) {
+                return gfx_trace_load_failed(file, trace, filename);
+            }
+            if (trace->num_frames == max_frames) {
+                max_frames = max_frames == 0 ? 256 : max_frames * 2;
+                trace->frames = realloc(trace->frames, max_frames * sizeof(struct GfxTraceFrame));
+                if (trace->frames == NULL) {
+                    abort();
+                }
+            }
+
+            struct GfxTraceFrame *frame = &trace->frames[trace->num_frames++];
+            frame->root = record.root;
+            frame->num_blocks = record.num_blocks;
+            frame->blocks = malloc(record.num_blocks * sizeof(uint32_t));
+            if (frame->blocks == NULL && record.num_blocks != 0) {
+                abort();
+            }
+            if (fread(frame->blocks, sizeof(uint32_t), record.num_blocks, file) != record.num_blocks) {
+                return gfx_trace_load_failed(file, trace, filename);
+            }
+            for (uint32_t i = 0; i < record.num_blocks; i++) {
+                if (frame->blocks[i] >= trace->num_blocks) {
+                    return gfx_trace_load_failed(file, trace, filename);
+                }
+            }
+            gfx_trace_sort_trace = trace;
+            qsort(frame->blocks, frame->num_blocks, sizeof(uint32_t), gfx_trace_block_cmp);
+        } else {
+            return gfx_trace_load_failed(file, trace, filename);
+        }
+    }
+
+    fclose(file);
+    return trace;
+}
+
+uint32_t gfx_trace_num_frames(const struct GfxTrace *trace) {
+    return trace->num_frames;
+}
+
+// Maps an address from the capture to the loaded copy, unknown addresses were
+// never dereferenced by the renderer and are passed through
+static uintptr_t gfx_trace_relocate(const struct GfxTrace *trace, const struct GfxTraceFrame *frame, uint64_t addr) {
+    uint32_t lo = 0, hi = frame->num_blocks;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (trace->blocks[frame->blocks[mid]].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Data and display list blocks are merged separately and may overlap, so
+    // the block before the closest one can still contain the address
+    for (uint32_t i = lo; i > 0 && lo - i < 2; i--) {
+        const struct GfxTraceBlock *block = &trace->blocks[frame->blocks[i - 1]];
+        if (addr >= block->end) {
+            continue;
+        }
+        if (block->kind == TRACE_KIND_DL) {
+            return (uintptr_t)(block->native + (addr - block->addr) / trace->gfx_size);
+        }
+        return (uintptr_t)((uint8_t *) block->data + (addr - block->addr));
+    }
+    return (uintptr_t) addr;
+}
+
+Gfx *gfx_trace_frame(struct GfxTrace *trace, uint32_t frame_index) {
+    const struct GfxTraceFrame *frame = &trace->frames[frame_index];
+
+    for (uint32_t i = 0; i < frame->num_blocks; i++) {
+        struct GfxTraceBlock *block = &trace->blocks[frame->blocks[i]];
+        if (block->kind != TRACE_KIND_DL) {
+            continue;
+        }
+
+        const uint64_t *words = block->data;
+        for (uint32_t j = 0; j < block->length; j++) {
+            Gfx *cmd = &block->native[j];
+            cmd->words.w0 = words[j * 2];
+            cmd->words.w1 = words[j * 2 + 1];
+
+            switch (cmd->words.w0 >> 24) {
+                case G_MTX:
+                case G_MOVEMEM:
+                case G_VTX:
+                case G_DL:
+                case G_SETTIMG:
+                    cmd->words.w1 = gfx_trace_relocate(trace, frame, words[j * 2 + 1]);
+                    break;
+            }
+        }
+    }
+
+    return (Gfx *) gfx_trace_relocate(trace, frame, frame->root);
+}
+
+void gfx_trace_free(struct GfxTrace *trace) {
+    if (trace == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < trace->num_blocks; i++) {
+        free(trace->blocks[i].data);
+        free(trace->blocks[i].native);
+    }
+    for (uint32_t i = 0; i < trace->num_frames; i++) {
+        free(trace->frames[i].blocks);
+    }
+    free(trace->blocks);
+    free(trace->frames);
+    free(trace);
+}
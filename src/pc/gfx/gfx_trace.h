@@ -0,0 +1,53 @@
+#ifndef GFX_TRACE_H
+#define GFX_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+struct GfxTrace;
+
+/**
+ * Starts writing every frame passed to gfx_trace_capture to a trace file.
+ * @arg filename: File name relative to the user directory.
+ * @returns false if the file couldn't be created.
+ **/
+extern bool gfx_trace_begin(const char *filename);
+
+/**
+ * Appends a frame: the display list tree reachable from commands, along with
+ * the vertices, matrices, lights, viewports and texture data it loads. Blocks
+ * with the same contents and address as an earlier frame are only written once.
+ **/
+extern void gfx_trace_capture(const Gfx *commands);
+
+/**
+ * Flushes and closes the trace file, further captures are ignored.
+ **/
+extern void gfx_trace_end(void);
+
+/**
+ * Loads a whole trace into memory so it can be replayed without touching the disk.
+ * @arg filename: Path of the trace, not relative to the user directory.
+ * @returns NULL if the file is missing, truncated or was captured with another GBI.
+ **/
+extern struct GfxTrace *gfx_trace_load(const char *filename);
+
+/**
+ * @returns the number of frames in the trace.
+ **/
+extern uint32_t gfx_trace_num_frames(const struct GfxTrace *trace);
+
+/**
+ * Rebuilds a frame's display lists with their pointers moved to the loaded copies.
+ * @returns the root display list to hand to gfx_run, valid until the next call.
+ **/
+extern Gfx *gfx_trace_frame(struct GfxTrace *trace, uint32_t frame);
+
+extern void gfx_trace_free(struct GfxTrace *trace);
+
+#endif
@@ -16,6 +16,8 @@ struct GfxWindowManagerAPI {
     void (*swap_buffers_begin)(void);
     void (*swap_buffers_end)(void);
     double (*get_time)(void); // For debug
+    // Binds the GL context to the calling thread, or releases it. Optional.
+    void (*make_context_current)(bool current);
 };
 
 #endif
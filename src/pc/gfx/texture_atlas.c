@@ -2,148 +2,417 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "texture_atlas.h"
 
-#define ATLAS_MIN_RESERVED_HOLES 32
+#define ATLAS_MIN_RESERVED_RECTS 32
 #define ATLAS_MIN_RESERVED_VTEXES 32
 
+// Free rectangles are binned by floor(log2(height)), 2^15 covers any page size.
+#define ATLAS_BINS 16
+// Buckets for looking up free rectangles by their corners, power of two.
+#define ATLAS_CORNER_BUCKETS 256
+
+#define ATLAS_NONE -1
+
 // Trivial Rectangle, containing either free space or a virtual texture.
 typedef struct Rect {
     uint16_t left, up;
     uint16_t right, down;
 } Rect;
 
+/**
+ * A piece of free space, linked into its height bin and into the corner
+ * buckets of its top-left and bottom-right corners.
+ * @property bin_prev, bin_next: Neighbours in the bin, next unused slot when unused.
+ * @property tl_next: Next rectangle in the top-left corner bucket.
+ * @property br_next: Next rectangle in the bottom-right corner bucket.
+ **/
+typedef struct FreeRect {
+    Rect rect;
+    int bin;
+    int bin_prev, bin_next;
+    int tl_next, br_next;
+} FreeRect;
+
+/**
+ * Free space of a page, kept by a guillotine packer. Free rectangles never
+ * overlap, and freed space is merged back with neighbours sharing a full edge.
+ **/
+typedef struct FreeSpace {
+    FreeRect *rects;
+    int rect_reserved;
+    int rect_unused; // Head of the unused slot list.
+
+    int bins[ATLAS_BINS];
+    int tl_buckets[ATLAS_CORNER_BUCKETS];
+    int br_buckets[ATLAS_CORNER_BUCKETS];
+
+    uint32_t area; // Sum of the free rectangle areas.
+} FreeSpace;
+
 /**
  * Contains virtual texture metadata. Actual texel is an implementation detail
  * of the library user.
  * @property rect: Rectangle containing the virtual texture and padding.
- * @property id: Unique identifier for the virtual texture.
- * @property invalidated: Tags virtual texture for deletion upon next upload.
+ * @property generation: Bumped every time the slot is reused, part of the id.
+ * @property used: Whether the slot belongs to a virtual texture.
+ * @property allocated: Whether rect holds space in a page.
+ * @property page: Page holding the space, when allocated.
+ * @property next_unused: Next unused slot, when unused.
  **/
 typedef struct VirtualTexture {
         Rect rect;
-        uint32_t id;
-        int invalidated;
+        uint16_t generation;
+        uint8_t used, allocated;
+        uint8_t page;
+        int next_unused;
 } VirtualTexture;
 
-typedef struct Atlas {
-    /**
-     * Holes describe areas in the atlas that are empty. A hole can overlap
-     * other holes, but not fully contain another.
-     **/
-    Rect *holes;
-    uint16_t hole_count; // Currently created holes.
-    uint16_t hole_reserved; 
-    int holes_invalidated; // Whether the hole structure was invalidated.
-
+struct Atlas {
+    FreeSpace spaces[ATLAS_MAX_PAGES];
+    int page_allocated[ATLAS_MAX_PAGES]; // Virtual textures holding space in each page.
+    int page_count;
 
     /**
-     * Virtual Textures meta-data. Describes how and where texel data is pinned 
-     * to the altas page.
+     * Virtual Textures meta-data. Describes how and where texel data is pinned
+     * to the altas pages. Ids are the slot index plus one in the lower 16 bits
+     * and the slot generation in the upper ones, so stale ids don't resolve.
      **/
     VirtualTexture *vtexes;
-    uint16_t vtex_count;
-    uint16_t vtex_last_id;
-    uint16_t vtex_reserved;
+    int vtex_count; // Slots handed out so far, used or not.
+    int vtex_reserved;
+    int vtex_unused; // Head of the unused slot list.
+    int vtex_allocated; // Virtual textures holding space in any page.
+
+    AtlasMove *moves; // Result of the last compaction.
+    int move_reserved;
+
+    FILE *trace; // Allocation log for tools/atlas_bench, or NULL.
 
     uint16_t padding; // Padding to be added to the borders of every virtual texture.
-    uint16_t dimensions; // Atlas page dimensions.
-} Atlas;
+    uint16_t dimensions; // Dimensions of every atlas page.
+};
 
-static inline int rect_width(Rect *rect)
+static inline int rect_width(const Rect *rect)
 {
     int val = rect->right - rect->left;
     return val < 0 ? 0 : val;
 }
 
-static inline int rect_height(Rect *rect)
+static inline int rect_height(const Rect *rect)
 {
     int val = rect->down - rect->up;
     return val < 0 ? 0 : val;
 }
 
-static inline int rect_area(Rect *rect)
+static inline int rect_area(const Rect *rect)
 {
     return rect_width(rect) * rect_height(rect);
 }
 
+static inline int atlas_bin(int height)
+{
+    int bin = 0;
+    while (height > 1 && bin < ATLAS_BINS - 1) {
+        height >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+static inline int atlas_corner_bucket(uint16_t x, uint16_t y)
+{
+    return ((x * 31) ^ (y * 7919)) & (ATLAS_CORNER_BUCKETS - 1);
+}
+
 /**
- * Private, look-up the index for a given virtual texture id.
- * @arg atlas: Pointer to atlas structure.
- * @arg id: Unique virtual texture identifier.
- * @returns: Index of the texture atlas slot, otherwise -1.
+ * Private, reserves more free rectangle slots.
+ * @arg space: Pointer to the free space.
+ * @arg reserved: Number of slots to be reserved.
+ * @return: 1 on success, 0 otherwise.
  **/
-static int atlas_lookup_vtex_id(Atlas *atlas, uint32_t id)
+static int free_reserve_rects(FreeSpace *space, int reserved)
 {
-    int i;
-    for (i = 0; i < atlas->vtex_count; i++) {
-        if (atlas->vtexes[i].id == id)
-            break;
+    FreeRect *rects = (FreeRect*)realloc(space->rects, sizeof(rects[0]) * reserved);
+    if (!rects)
+        return 0;
+
+    // Chain the new slots into the unused list.
+    for (int i = reserved - 1; i >= space->rect_reserved; i--) {
+        rects[i].bin_next = space->rect_unused;
+        space->rect_unused = i;
     }
 
-    if (i == atlas->vtex_count)
-        return -1;
+    space->rects = rects;
+    space->rect_reserved = reserved;
+    return 1;
+}
+
+/**
+ * Private, empties the free space, every slot goes back to the unused list.
+ * @arg space: Pointer to the free space.
+ **/
+static void free_clear(FreeSpace *space)
+{
+    space->rect_unused = ATLAS_NONE;
+    for (int i = space->rect_reserved - 1; i >= 0; i--) {
+        space->rects[i].bin_next = space->rect_unused;
+        space->rect_unused = i;
+    }
+
+    for (int i = 0; i < ATLAS_BINS; i++)
+        space->bins[i] = ATLAS_NONE;
+    for (int i = 0; i < ATLAS_CORNER_BUCKETS; i++)
+        space->tl_buckets[i] = space->br_buckets[i] = ATLAS_NONE;
+
+    space->area = 0;
+}
+
+/**
+ * Private, links a free rectangle as is, without merging it.
+ * @arg space: Pointer to the free space.
+ * @arg rect: Free rectangle, must not overlap any other.
+ * @return: 1 on success, 0 otherwise.
+ **/
+static int free_link(FreeSpace *space, const Rect *rect)
+{
+    if (space->rect_unused == ATLAS_NONE) {
+        if (!free_reserve_rects(space, space->rect_reserved * 2))
+            return 0;
+    }
+
+    int index = space->rect_unused;
+    FreeRect *fr = &space->rects[index];
+    space->rect_unused = fr->bin_next;
+
+    fr->rect = *rect;
+    fr->bin = atlas_bin(rect_height(rect));
+    fr->bin_prev = ATLAS_NONE;
+    fr->bin_next = space->bins[fr->bin];
+    if (fr->bin_next != ATLAS_NONE)
+        space->rects[fr->bin_next].bin_prev = index;
+    space->bins[fr->bin] = index;
+
+    int *tl = &space->tl_buckets[atlas_corner_bucket(rect->left, rect->up)];
+    fr->tl_next = *tl;
+    *tl = index;
+
+    int *br = &space->br_buckets[atlas_corner_bucket(rect->right, rect->down)];
+    fr->br_next = *br;
+    *br = index;
+
+    space->area += rect_area(rect);
+    return 1;
+}
+
+/**
+ * Private, removes a free rectangle from the bins and corner buckets.
+ * @arg space: Pointer to the free space.
+ * @arg index: Slot of the free rectangle.
+ **/
+static void free_unlink(FreeSpace *space, int index)
+{
+    FreeRect *fr = &space->rects[index];
+
+    if (fr->bin_prev != ATLAS_NONE)
+        space->rects[fr->bin_prev].bin_next = fr->bin_next;
+    else
+        space->bins[fr->bin] = fr->bin_next;
+    if (fr->bin_next != ATLAS_NONE)
+        space->rects[fr->bin_next].bin_prev = fr->bin_prev;
+
+    int *tl = &space->tl_buckets[atlas_corner_bucket(fr->rect.left, fr->rect.up)];
+    while (*tl != index)
+        tl = &space->rects[*tl].tl_next;
+    *tl = fr->tl_next;
+
+    int *br = &space->br_buckets[atlas_corner_bucket(fr->rect.right, fr->rect.down)];
+    while (*br != index)
+        br = &space->rects[*br].br_next;
+    *br = fr->br_next;
+
+    space->area -= rect_area(&fr->rect);
+    fr->bin_next = space->rect_unused;
+    space->rect_unused = index;
+}
+
+/**
+ * Private, look-up the free rectangle with a given top-left corner.
+ * @return: Slot of the free rectangle, otherwise ATLAS_NONE.
+ **/
+static int free_lookup_tl(FreeSpace *space, uint16_t left, uint16_t up)
+{
+    int i = space->tl_buckets[atlas_corner_bucket(left, up)];
+    while (i != ATLAS_NONE && (space->rects[i].rect.left != left || space->rects[i].rect.up != up))
+        i = space->rects[i].tl_next;
     return i;
 }
 
 /**
- * Private, look-up the smallest possible rectangle where the texture fits.
- * @arg atlas: Pointer to atlas structure.
+ * Private, look-up the free rectangle with a given bottom-right corner.
+ * @return: Slot of the free rectangle, otherwise ATLAS_NONE.
+ **/
+static int free_lookup_br(FreeSpace *space, uint16_t right, uint16_t down)
+{
+    int i = space->br_buckets[atlas_corner_bucket(right, down)];
+    while (i != ATLAS_NONE && (space->rects[i].rect.right != right || space->rects[i].rect.down != down))
+        i = space->rects[i].br_next;
+    return i;
+}
+
+/**
+ * Private, gives space back, merging it with every neighbour that shares a
+ * full edge with it.
+ * @arg space: Pointer to the free space.
+ * @arg rect: Rectangle being freed.
+ * @return: 1 on success, 0 otherwise.
+ **/
+static int free_insert(FreeSpace *space, Rect rect)
+{
+    for (;;) {
+        int n;
+        // Right neighbour, same rows.
+        if ((n = free_lookup_tl(space, rect.right, rect.up)) != ATLAS_NONE &&
+            space->rects[n].rect.down == rect.down) {
+            rect.right = space->rects[n].rect.right;
+        // Left neighbour, same rows.
+        } else if ((n = free_lookup_br(space, rect.left, rect.down)) != ATLAS_NONE &&
+                   space->rects[n].rect.up == rect.up) {
+            rect.left = space->rects[n].rect.left;
+        // Neighbour below, same columns.
+        } else if ((n = free_lookup_tl(space, rect.left, rect.down)) != ATLAS_NONE &&
+                   space->rects[n].rect.right == rect.right) {
+            rect.down = space->rects[n].rect.down;
+        // Neighbour above, same columns.
+        } else if ((n = free_lookup_br(space, rect.right, rect.up)) != ATLAS_NONE &&
+                   space->rects[n].rect.left == rect.left) {
+            rect.up = space->rects[n].rect.up;
+        } else {
+            break;
+        }
+        free_unlink(space, n);
+    }
+
+    return free_link(space, &rect);
+}
+
+/**
+ * Private, look-up the free rectangle that fits the texture with the least
+ * space left over on its shorter side, in the lowest height bin that has one.
+ * @arg space: Pointer to the free space.
  * @arg w: Texture width.
  * @arg h: Texture height.
- * @returns: Pointer to the hole Rect if successful, otherwise NULL.
+ * @returns: Slot of the free rectangle if successful, otherwise ATLAS_NONE.
  **/
-static Rect *atlas_lookup_bestfit(Atlas *atlas, int w, int h)
+static int free_lookup_bestfit(FreeSpace *space, int w, int h)
 {
-    Rect *last_best = NULL;
-    uint32_t last_best_area = UINT32_MAX;
-    for (int i = 0; i < atlas->hole_count; i++) {
-        Rect *hole = &atlas->holes[i];
-        if (rect_width(hole) < w || rect_height(hole) < h)
-            continue;
+    for (int bin = atlas_bin(h); bin < ATLAS_BINS; bin++) {
+        int best = ATLAS_NONE;
+        int best_short = INT32_MAX, best_long = INT32_MAX;
+
+        for (int i = space->bins[bin]; i != ATLAS_NONE; i = space->rects[i].bin_next) {
+            const Rect *rect = &space->rects[i].rect;
+            int left_w = rect_width(rect) - w;
+            int left_h = rect_height(rect) - h;
+            if (left_w < 0 || left_h < 0)
+                continue;
 
-        uint32_t area = rect_area(hole);
-        if (area < last_best_area) {
-            last_best = hole;
-            last_best_area = area;
+            int left_short = left_w < left_h ? left_w : left_h;
+            int left_long = left_w < left_h ? left_h : left_w;
+            if (left_short < best_short || (left_short == best_short && left_long < best_long)) {
+                best = i;
+                best_short = left_short;
+                best_long = left_long;
+            }
         }
+
+        if (best != ATLAS_NONE)
+            return best;
     }
 
-    return last_best;
+    return ATLAS_NONE;
 }
 
 /**
- * Private, copy Rect b into a.
- * @arg a: Rect to be overwriten.
- * @arg b: Rect to be copied from, left intact.
+ * Private, carves a w by h rectangle out of the free space. The rest of the
+ * chosen free rectangle is cut in two along its shorter leftover axis.
+ * @arg space: Pointer to the free space.
+ * @arg w: Width, padding included.
+ * @arg h: Height, padding included.
+ * @arg out: Pointer to retrieve the placed rectangle.
+ * @return: 1 on success, 0 otherwise.
  **/
-static void rect_copy(Rect *a, const Rect *b)
+static int free_place(FreeSpace *space, int w, int h, Rect *out)
 {
-    if (a == b)
-        return;
+    int index = free_lookup_bestfit(space, w, h);
+    if (index == ATLAS_NONE)
+        return 0;
 
-    a->left = b->left;
-    a->up = b->up;
-    a->right = b->right;
-    a->down = b->down;
+    Rect hole = space->rects[index].rect;
+    free_unlink(space, index);
+
+    Rect placed = { hole.left, hole.up, hole.left + w, hole.up + h };
+    Rect right, below;
+    if (rect_width(&hole) - w < rect_height(&hole) - h) {
+        right = (Rect) { placed.right, hole.up,     hole.right,  placed.down };
+        below = (Rect) { hole.left,    placed.down, hole.right,  hole.down   };
+    } else {
+        right = (Rect) { placed.right, hole.up,     hole.right,  hole.down   };
+        below = (Rect) { hole.left,    placed.down, placed.right, hole.down  };
+    }
+
+    if ((rect_area(&right) && !free_insert(space, right)) ||
+        (rect_area(&below) && !free_insert(space, below)))
+        return 0;
+
+    *out = placed;
+    return 1;
 }
 
 /**
- * Private, reserves more atlas holes array space.
- * @arg atlas: Pointer to atlas structure.
- * @arg reserved: Number of holes to be reserved.
+ * Private, resets the free space to one rectangle covering the whole page.
+ * @arg space: Pointer to the free space.
+ * @arg dimensions: Page width and height.
+ * @return: 1 on success, 0 otherwise.
+ **/
+static int free_reset(FreeSpace *space, uint16_t dimensions)
+{
+    Rect whole = {0, 0, dimensions, dimensions};
+    free_clear(space);
+    return free_link(space, &whole);
+}
+
+/**
+ * Private, creates free space covering the whole page.
  * @return: 1 on success, 0 otherwise.
  **/
-static int atlas_reserve_holes(Atlas *atlas, int reserved)
+static int free_create(FreeSpace *space, uint16_t dimensions)
 {
-    Rect *holes = (Rect*)realloc(atlas->holes, sizeof(holes[0]) * reserved);
-    if (!holes)
+    memset(space, 0, sizeof(*space));
+    space->rect_unused = ATLAS_NONE;
+    if (!free_reserve_rects(space, ATLAS_MIN_RESERVED_RECTS))
         return 0;
-    
-    atlas->holes = holes;
-    atlas->hole_reserved = reserved;
-    return 1;
+    return free_reset(space, dimensions);
+}
+
+/**
+ * Private, look-up the virtual texture for a given id.
+ * @arg atlas: Pointer to atlas structure.
+ * @arg id: Unique virtual texture identifier.
+ * @returns: Pointer to the virtual texture, otherwise NULL.
+ **/
+static VirtualTexture *atlas_lookup_vtex_id(Atlas *atlas, uint32_t id)
+{
+    int slot = (int)(id & 0xFFFF) - 1;
+    if (slot < 0 || slot >= atlas->vtex_count)
+        return NULL;
+
+    VirtualTexture *vt = &atlas->vtexes[slot];
+    if (!vt->used || vt->generation != (id >> 16))
+        return NULL;
+    return vt;
 }
 
 /**
@@ -157,21 +426,31 @@ static int atlas_reserve_vtexes(Atlas *atlas, int reserved)
     VirtualTexture *vtexes = (VirtualTexture*)realloc(atlas->vtexes, sizeof(vtexes[0]) * reserved);
     if (!vtexes)
         return 0;
-    
+
     atlas->vtexes = vtexes;
     atlas->vtex_reserved = reserved;
     return 1;
 }
 
 /**
- * Private, resets hole count to 1 and resets first hole.
+ * Private, gives the space held by a virtual texture back to its page.
  * @arg atlas: Pointer to atlas structure.
+ * @arg vt: Virtual texture, might not hold any space.
+ * @return: 1 on success, 0 otherwise.
  **/
-static void atlas_reset_holes(Atlas *atlas)
+static int atlas_release_space(Atlas *atlas, VirtualTexture *vt)
 {
-    Rect first = {0, 0, atlas->dimensions, atlas->dimensions};
-    rect_copy(&atlas->holes[0], &first);
-    atlas->hole_count = 1;
+    if (!vt->allocated)
+        return 1;
+
+    vt->allocated = 0;
+    atlas->vtex_allocated--;
+
+    // An empty page is always a single free rectangle, whatever merges were missed.
+    FreeSpace *space = &atlas->spaces[vt->page];
+    if (--atlas->page_allocated[vt->page] == 0)
+        return free_reset(space, atlas->dimensions);
+    return free_insert(space, vt->rect);
 }
 
 /**
@@ -179,26 +458,31 @@ static void atlas_reset_holes(Atlas *atlas)
  * @arg atlas_ptr: Double pointer to atlas structure, undefined on failure.
  * @arg dimensions: Defines atlas width and height dimenions.
  * @arg padding: Defines padding added to all sides of a virtual texture.
+ * @arg pages: Number of pages, from 1 to ATLAS_MAX_PAGES.
  * @return: 1 on success, 0 otherwise.
  **/
-int atlas_create(Atlas **atlas_dptr, uint16_t dimensions, uint16_t padding)
+int atlas_create(Atlas **atlas_dptr, uint16_t dimensions, uint16_t padding, int pages)
 {
+    if (pages < 1 || pages > ATLAS_MAX_PAGES)
+        goto err_allocate;
+
     Atlas *atlas = (Atlas*)calloc(1, sizeof(*atlas));
     if (!atlas)
         goto err_allocate;
 
     // Attempt to reserve space for the necessary meta-data structures.
-    if (!atlas_reserve_holes(atlas, ATLAS_MIN_RESERVED_HOLES) || 
-        !atlas_reserve_vtexes(atlas, ATLAS_MIN_RESERVED_VTEXES))
+    atlas->page_count = pages;
+    for (int i = 0; i < pages; i++) {
+        if (!free_create(&atlas->spaces[i], dimensions))
+            goto err_reserve;
+    }
+    if (!atlas_reserve_vtexes(atlas, ATLAS_MIN_RESERVED_VTEXES))
         goto err_reserve;
 
-    atlas->vtex_last_id = 1;
+    atlas->vtex_unused = ATLAS_NONE;
     atlas->dimensions = dimensions;
     atlas->padding = padding;
 
-    // Initializes first hole
-    atlas_reset_holes(atlas);
-
     *atlas_dptr = atlas;
     return 1;
 err_reserve:
@@ -213,11 +497,17 @@ err_allocate:
  */
 void atlas_destroy(Atlas *atlas)
 {
-    if (atlas->holes)
-        free(atlas->holes);
+    for (int i = 0; i < atlas->page_count; i++) {
+        if (atlas->spaces[i].rects)
+            free(atlas->spaces[i].rects);
+    }
     if (atlas->vtexes)
         free(atlas->vtexes);
-        
+    if (atlas->moves)
+        free(atlas->moves);
+    if (atlas->trace)
+        fclose(atlas->trace);
+
     free(atlas);
 }
 
@@ -229,213 +519,245 @@ void atlas_destroy(Atlas *atlas)
  **/
 int atlas_gen_texture(Atlas *atlas, uint32_t *id_ptr)
 {
-    // If we don't have enough virtual texture slots reserved, attempt to double
-    // the number of reserved slots.
-    if (atlas->vtex_count >= atlas->vtex_reserved) {
-        if (!atlas_reserve_vtexes(atlas, atlas->vtex_reserved * 2)) {
+    int slot;
+    if (atlas->vtex_unused != ATLAS_NONE) {
+        // Reuse a slot given back by atlas_destroy_vtex.
+        slot = atlas->vtex_unused;
+        atlas->vtex_unused = atlas->vtexes[slot].next_unused;
+    } else {
+        // Ids only have 16 bits for the slot.
+        if (atlas->vtex_count == 0xFFFF)
             return 0;
+
+        // If we don't have enough virtual texture slots reserved, attempt to double
+        // the number of reserved slots.
+        if (atlas->vtex_count >= atlas->vtex_reserved) {
+            if (!atlas_reserve_vtexes(atlas, atlas->vtex_reserved * 2)) {
+                return 0;
+            }
         }
+
+        slot = atlas->vtex_count++;
+        atlas->vtexes[slot].generation = 0;
     }
 
-    // Acquire an unique ID and a reusable virtual texture slot.
-    VirtualTexture *vt = &atlas->vtexes[atlas->vtex_count++];
-    vt->id = atlas->vtex_last_id++;
-    vt->invalidated = 0;
+    VirtualTexture *vt = &atlas->vtexes[slot];
+    vt->used = 1;
+    vt->allocated = 0;
     vt->rect.left = vt->rect.up = vt->rect.right = vt->rect.down = 0;
 
-    *id_ptr = vt->id;
+    *id_ptr = ((uint32_t)vt->generation << 16) | (slot + 1);
     return 1;
 }
 
 /**
- * Private, checks if two rects have any overlap.
- * @param a: Pointer to first Rect.
- * @param b: Pointer to second Rect.
- * @returns: 1 if overlaps, 0 otherwise.
+ * Destroys a virtual texture, its space and slot can be reused right away.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @arg id: Unique virtual texture identifier.
+ * @return: 1 on success, 0 otherwise.
  **/
-static int rect_overlaps(Rect *a, Rect *b)
+int atlas_destroy_vtex(Atlas *atlas, uint32_t id)
 {
-    return ((a->right > b->left) && (a->left < b->right)) &&
-           ((a->up    < b->down) && (a->down > b->up   ));
-}
+    VirtualTexture *vt = atlas_lookup_vtex_id(atlas, id);
+    if (!vt)
+        return 0;
 
-/**
- * Private, checks if a is completely contained within b.
- * @param a: Pointer to first Rect.
- * @param b: Pointer to second Rect.
- * @returns: 1 if overlaps, 0 otherwise.
- **/
-static int rect_contained(Rect *a, Rect *b)
-{
-    return ((a->left >= b->left) && (a->right <= b->right)) && 
-           ((a->up   >= b->up  ) && (a->down  <= b->down ));
+    if (atlas->trace && vt->allocated)
+        fprintf(atlas->trace, "free %u\n", id);
+
+    int ret = atlas_release_space(atlas, vt);
+
+    int slot = vt - atlas->vtexes;
+    vt->used = 0;
+    vt->generation++;
+    vt->next_unused = atlas->vtex_unused;
+    atlas->vtex_unused = slot;
+
+    return ret;
 }
 
 /**
- * Private, splits all atlas holes overlapped by the rectangle.
- * @param atlas: Pointer to private Atlas structure.
- * @param x: Left rectangle coordinate.
- * @param y: Top rectangle coordinate.
- * @param w: Rectangle width.
- * @param h: Rectangle height.
- * @return: 1 on success, 0 otherwise. Failure means structure is left in an invalid state.
+ * Allocates space for the virtual texture, giving back any space it held.
+ * Pages are tried in order, so the first ones fill up before the others
+ * get used and textures drawn together tend to share a page.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @arg id: Unique virtual texture identifier.
+ * @arg w: Virtual texture width.
+ * @arg h: Virtual texture height.
+ * @return: 1 on success, 0 otherwise.
  **/
-static int atlas_split_holes(Atlas *atlas, Rect *cut)
+int atlas_allocate_vtex_space(Atlas *atlas, uint32_t id, uint16_t w, uint16_t h)
 {
-    for (int i = 0; i < atlas->hole_count; i++) {
-        Rect *hole = &atlas->holes[i];
-        if (!rect_overlaps(cut, hole))
-            continue;
-
-        // New Rect splits to be considered for emplacing
-        Rect new_holes[4] = {
-            /* Up    */ {hole->left, hole->up,  hole->right, cut->up   },
-            /* Down  */ {hole->left, cut->down, hole->right, hole->down},
-            /* Left  */ {hole->left, hole->up,  cut->left,   hole->down},
-            /* Right */ {cut->right, hole->up,  hole->right, hole->down},
-        };
-
-        // Deallocate current hole
-        rect_copy(&atlas->holes[i], &atlas->holes[--atlas->hole_count]);
-
-        for (int j = 0; j < 4; j++) {
-            // Skip zero area holes.
-            if (rect_area(&new_holes[j]) == 0)
-                continue;
+    VirtualTexture *vt = atlas_lookup_vtex_id(atlas, id);
 
-            // If we don't have enough hole slots, reserve more.
-            if (atlas->hole_count == atlas->hole_reserved) {
-                if (!atlas_reserve_holes(atlas, atlas->hole_reserved * 2))
-                    return 0;
-            }
+    // If id not found, bail out
+    if (!vt)
+        return 0;
 
-            // Emplace the new hole.
-            rect_copy(&atlas->holes[atlas->hole_count++], &new_holes[j]);
-        }
+    if (vt->allocated) {
+        if (atlas->trace)
+            fprintf(atlas->trace, "free %u\n", id);
+        if (!atlas_release_space(atlas, vt))
+            return 0;
+    }
 
-        // For every (j, k) pair of Rects: 
-        //      if j fully contained in k, remove j
-        // else if k fully contained in j, remove k
-        for (int j = 0; j < atlas->hole_count; j++) {
-            for (int k = j + 1; k < atlas->hole_count; k++) {
-                if (rect_contained(&atlas->holes[k], &atlas->holes[j])) {
-                    // Move last Hole index into k and drop k
-                    rect_copy(&atlas->holes[k], &atlas->holes[--atlas->hole_count]);
-
-                    // Since we moved the last Hole into k, we need to recheck the
-                    // k index instead of advancing into k+1
-                    k--;
-                } else if (rect_contained(&atlas->holes[j], &atlas->holes[k])) {
-                    // Move last Hole index into j and drop j
-                    rect_copy(&atlas->holes[j], &atlas->holes[--atlas->hole_count]);
-
-                    // Since we moved into j, we will need to reset k now
-                    k = j + 1;
-                }
-            }
-        }
+    // Add padding.
+    int padded_w = w + atlas->padding * 2;
+    int padded_h = h + atlas->padding * 2;
 
-        // Retry current hole index.
-        i--;
+    int page = 0;
+    while (!free_place(&atlas->spaces[page], padded_w, padded_h, &vt->rect)) {
+        if (++page == atlas->page_count)
+            return 0;
     }
 
+    vt->allocated = 1;
+    vt->page = page;
+    atlas->vtex_allocated++;
+    atlas->page_allocated[page]++;
+
+    if (atlas->trace)
+        fprintf(atlas->trace, "alloc %u %u %u\n", id, w, h);
     return 1;
 }
 
+// Sort key for atlas_compact.
+typedef struct CompactItem {
+    uint16_t height, width;
+    int slot;
+} CompactItem;
+
 /**
- * Marks a virtual texture for future reclaiming. This happens the next time a
- * texture gets uploaded.
- * @arg atlas: Pointer to private Atlas structure.
- * @arg id: Unique virtual texture identifier.
- * @return: 1 on success, 0 otherwise.
+ * Private, orders virtual textures tallest first, then widest first.
  **/
-int atlas_destroy_vtex(Atlas *atlas, uint32_t id)
+static int atlas_compare_items(const void *a, const void *b)
 {
-    int index;
-    if ((index = atlas_lookup_vtex_id(atlas, id)) == -1)
-        return 0;
-
-    atlas->vtexes[index].invalidated = 1;
-    atlas->holes_invalidated = 1;
-
-    return 1;
+    const CompactItem *ia = (const CompactItem *)a;
+    const CompactItem *ib = (const CompactItem *)b;
+
+    if (ia->height != ib->height)
+        return ib->height - ia->height;
+    if (ia->width != ib->width)
+        return ib->width - ia->width;
+    return ia->slot - ib->slot;
 }
 
 /**
- * Allocates space for the virtual texture.
+ * Packs every virtual texture holding space in a page again from scratch,
+ * tallest first, so the free space ends up in a few large rectangles. The page
+ * is only changed if everything fits, textures never move to another page.
  * @arg atlas: Pointer to private Atlas structure.
- * @arg id: Unique virtual texture identifier.
- * @arg w: Virtual texture width.
- * @arg h: Virtual texture height.
+ * @arg page: Page to be compacted.
+ * @arg moves: Pointer to retrieve the textures that moved, valid until the next
+ *             compaction. They have to be applied as if all of them read the
+ *             page before any is written, rectangles include the padding.
+ * @arg move_count: Pointer to retrieve the number of moves.
  * @return: 1 on success, 0 otherwise.
  **/
-int atlas_allocate_vtex_space(Atlas *atlas, uint32_t id, uint16_t w, uint16_t h)
+int atlas_compact(Atlas *atlas, int page, const AtlasMove **moves, int *move_count)
 {
-    // If a texture has been deleted, we'll regenerate the holes before
-    // trying to allocate space for a new one.
-    // TODO:: Benchmark impact of this
-    if (atlas->holes_invalidated) {
-        atlas->holes_invalidated = 0;
-        atlas_reset_holes(atlas);
-
-        // Delete all invalidated textures
-        for (int i = 0; i < atlas->vtex_count; i++) {
-            VirtualTexture *vt = &atlas->vtexes[i];
-            
-            if (!vt->invalidated) {
-                // Ignore textures that haven't had space allocated for them
-                if (rect_area(&vt->rect) == 0)
-                    continue;
-
-                // If virtual texture isn't invalidated, let's reallocate space for it
-                atlas_split_holes(atlas, &vt->rect);
-            } else {
-                // Otherwise, swap current virtual texture for the last entry
-                VirtualTexture *last = &atlas->vtexes[atlas->vtex_count - 1];
-                rect_copy(&vt->rect, &last->rect);
-                vt->id = last->id;
-                vt->invalidated = last->invalidated;
-
-                // Remove last virtual texture and retry current index
-                atlas->vtex_count--;
-                i--;
-            } 
-        }
-    }
+    if (page < 0 || page >= atlas->page_count)
+        return 0;
 
-    // Add padding.
-    w += atlas->padding * 2;
-    h += atlas->padding * 2;
+    CompactItem *items = (CompactItem*)malloc(sizeof(items[0]) * (atlas->page_allocated[page] + 1));
+    if (!items)
+        return 0;
 
-    // Look-up virtual texture id
-    VirtualTexture *vt = NULL;
+    int count = 0;
     for (int i = 0; i < atlas->vtex_count; i++) {
-        if (atlas->vtexes[i].id == id) {
-            vt = &atlas->vtexes[i];
-            break;
-        }
+        VirtualTexture *vt = &atlas->vtexes[i];
+        if (!vt->used || !vt->allocated || vt->page != page)
+            continue;
+        items[count].height = rect_height(&vt->rect);
+        items[count].width = rect_width(&vt->rect);
+        items[count].slot = i;
+        count++;
+    }
+    qsort(items, count, sizeof(items[0]), atlas_compare_items);
+
+    if (atlas->move_reserved < count) {
+        AtlasMove *reserved = (AtlasMove*)realloc(atlas->moves, sizeof(reserved[0]) * count);
+        if (!reserved)
+            goto err;
+        atlas->moves = reserved;
+        atlas->move_reserved = count;
     }
 
-    // If id not found, bail out
-    if (!vt)
-        return 0;
+    // Lay everything out on a blank page first.
+    FreeSpace plan;
+    if (!free_create(&plan, atlas->dimensions))
+        goto err;
 
-    // Do a best-fit lookup
-    Rect *best_fit = atlas_lookup_bestfit(atlas, w, h);
-    if (!best_fit)
-        return 0;
+    Rect *placed = (Rect*)malloc(sizeof(placed[0]) * (count + 1));
+    if (!placed)
+        goto err_plan;
 
-    // Split holes as necessary
-    Rect vtex = {
-        /* left, up    */ best_fit->left,     best_fit->up, 
-        /* right, down */ best_fit->left + w, best_fit->up + h
-    };
+    for (int i = 0; i < count; i++) {
+        if (!free_place(&plan, items[i].width, items[i].height, &placed[i]))
+            goto err_placed;
+    }
 
-    rect_copy(&vt->rect, &vtex);
-    if (!atlas_split_holes(atlas, &vtex))
-        return 0;
+    int moved = 0;
+    for (int i = 0; i < count; i++) {
+        VirtualTexture *vt = &atlas->vtexes[items[i].slot];
+        if (vt->rect.left == placed[i].left && vt->rect.up == placed[i].up)
+            continue;
 
+        AtlasMove *move = &atlas->moves[moved++];
+        move->id = ((uint32_t)vt->generation << 16) | (items[i].slot + 1);
+        move->src_x = vt->rect.left;
+        move->src_y = vt->rect.up;
+        move->dst_x = placed[i].left;
+        move->dst_y = placed[i].up;
+        move->width = items[i].width;
+        move->height = items[i].height;
+        vt->rect = placed[i];
+    }
+
+    free(atlas->spaces[page].rects);
+    atlas->spaces[page] = plan;
+    free(placed);
+    free(items);
+
+    if (atlas->trace)
+        fprintf(atlas->trace, "compact %d\n", page);
+
+    *moves = atlas->moves;
+    *move_count = moved;
     return 1;
+err_placed:
+    free(placed);
+err_plan:
+    free(plan.rects);
+err:
+    free(items);
+    return 0;
+}
+
+/**
+ * Tells whether an allocation that just failed is worth an atlas_compact: it
+ * would fit in the free area of a page, and at least a quarter of that page is
+ * free, just not in one piece. Evicting is cheaper than moving texels around
+ * otherwise.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @arg w: Virtual texture width.
+ * @arg h: Virtual texture height.
+ * @arg page_ptr: Pointer to retrieve the page with the most free area.
+ * @return: 1 if the page should be compacted, 0 otherwise.
+ **/
+int atlas_wants_compaction(Atlas *atlas, uint16_t w, uint16_t h, int *page_ptr)
+{
+    int best = 0;
+    for (int i = 1; i < atlas->page_count; i++) {
+        if (atlas->spaces[i].area > atlas->spaces[best].area)
+            best = i;
+    }
+
+    uint32_t needed = (uint32_t)(w + atlas->padding * 2) * (h + atlas->padding * 2);
+    uint32_t page = (uint32_t)atlas->dimensions * atlas->dimensions;
+    uint32_t area = atlas->spaces[best].area;
+    *page_ptr = best;
+    return area >= needed && area >= page / 4;
 }
 
 /**
@@ -444,15 +766,15 @@ int atlas_allocate_vtex_space(Atlas *atlas, uint32_t id, uint16_t w, uint16_t h)
  * @arg atlas: Pointer to private Atlas structure.
  * @arg id: Unique virtual texture identifier.
  * @arg uvst: Pointer to retrieve (u, v) and (s, t) normalized coordinates.
- * @return: 1 if virtual texture id is valid, 0 otherwise.
+ * @return: 1 if virtual texture id is valid and has space, 0 otherwise.
  **/
 int atlas_get_vtex_uvst_coords(Atlas *atlas, uint32_t id, int padding, float *uvst)
 {
-    int index;
-    if ((index = atlas_lookup_vtex_id(atlas, id)) == -1)
+    VirtualTexture *vtex = atlas_lookup_vtex_id(atlas, id);
+    if (!vtex || !vtex->allocated)
         return 0;
 
-    Rect *vt = &atlas->vtexes[index].rect;
+    Rect *vt = &vtex->rect;
     uvst[0] = (float)(vt->left ) / atlas->dimensions;
     uvst[1] = (float)(vt->up   ) / atlas->dimensions;
     uvst[2] = (float)(vt->right) / atlas->dimensions;
@@ -460,10 +782,10 @@ int atlas_get_vtex_uvst_coords(Atlas *atlas, uint32_t id, int padding, float *uv
 
     if (!padding) {
         float atlas_norm_padding = (float)atlas->padding / atlas->dimensions;
-        uvst[0] += atlas->padding / atlas_norm_padding;
-        uvst[1] += atlas->padding / atlas_norm_padding;
-        uvst[2] -= atlas->padding / atlas_norm_padding;
-        uvst[3] -= atlas->padding / atlas_norm_padding;
+        uvst[0] += atlas_norm_padding;
+        uvst[1] += atlas_norm_padding;
+        uvst[2] -= atlas_norm_padding;
+        uvst[3] -= atlas_norm_padding;
     }
 
     return 1;
@@ -475,15 +797,15 @@ int atlas_get_vtex_uvst_coords(Atlas *atlas, uint32_t id, int padding, float *uv
  * @arg atlas: Pointer to private Atlas structure.
  * @arg id: Unique virtual texture identifier.
  * @arg uvst: Pointer to retrieve (x, y) and (w, h) coordinates.
- * @return: 1 if virtual texture id is valid, 0 otherwise.
+ * @return: 1 if virtual texture id is valid and has space, 0 otherwise.
  **/
 int atlas_get_vtex_xywh_coords(Atlas *atlas, uint32_t id, int padding, uint16_t *xywh)
 {
-    int index;
-    if ((index = atlas_lookup_vtex_id(atlas, id)) == -1)
+    VirtualTexture *vtex = atlas_lookup_vtex_id(atlas, id);
+    if (!vtex || !vtex->allocated)
         return 0;
 
-    Rect *vt = &atlas->vtexes[index].rect;
+    Rect *vt = &vtex->rect;
     xywh[0] =  vt->left;
     xywh[1] =  vt->up;
     xywh[2] = (vt->right - vt->left);
@@ -499,10 +821,63 @@ int atlas_get_vtex_xywh_coords(Atlas *atlas, uint32_t id, int padding, uint16_t
     return 1;
 }
 
+/**
+ * Retrieves the page holding a virtual texture's space.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @arg id: Unique virtual texture identifier.
+ * @return: Page index if virtual texture id is valid and has space, -1 otherwise.
+ **/
+int atlas_get_vtex_page(Atlas *atlas, uint32_t id)
+{
+    VirtualTexture *vtex = atlas_lookup_vtex_id(atlas, id);
+    if (!vtex || !vtex->allocated)
+        return ATLAS_NONE;
+    return vtex->page;
+}
+
+/**
+ * Retrieves the free area, which might be split into pieces too small to use.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @returns: Free texels in all pages.
+ **/
+uint32_t atlas_get_free_area(Atlas *atlas)
+{
+    uint32_t area = 0;
+    for (int i = 0; i < atlas->page_count; i++)
+        area += atlas->spaces[i].area;
+    return area;
+}
+
+/**
+ * Logs every allocation, free and compaction from now on, in the format
+ * tools/atlas_bench replays.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @arg trace: File to write to, NULL to stop logging. The atlas closes it
+ * when it's replaced or the atlas is destroyed.
+ **/
+void atlas_set_trace(Atlas *atlas, FILE *trace)
+{
+    if (atlas->trace)
+        fclose(atlas->trace);
+    atlas->trace = trace;
+    if (trace)
+        fprintf(trace, "atlas %u %u %d\n", atlas->dimensions, atlas->padding, atlas->page_count);
+}
+
+/**
+ * Retrieves atlas page count.
+ * @arg atlas: Pointer to private Atlas structure.
+ * @returns: Number of pages.
+ **/
+int atlas_get_page_count(Atlas *atlas)
+{
+    return atlas->page_count;
+}
+
 /**
  * Retrieves atlas dimensions.
  * @arg atlas: Pointer to private Atlas structure.
- * @returns: Atlas dimensions.
+ * @returns: Atlas page dimensions.
  **/
 uint16_t atlas_get_dimensions(Atlas *atlas)
 {
@@ -518,4 +893,4 @@ uint16_t atlas_get_padding(Atlas *atlas)
 {
     return atlas->padding;
 }
-#endif /* USE_TEXTURE_ATLAS */
\ No newline at end of file
+#endif /* USE_TEXTURE_ATLAS */
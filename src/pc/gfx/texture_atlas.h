@@ -1,21 +1,41 @@
 #ifndef __TEXTURE_ATLAS_H__
 #define __TEXTURE_ATLAS_H__
 
+#include <stdio.h>
 #include <stdint.h>
 
+#include "gfx_rendering_api.h"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
     typedef struct Atlas Atlas;
 
-    extern int atlas_create(Atlas **atlas_dptr, uint16_t dimensions, uint16_t padding);
+    // Pages a single atlas can have, each one backed by a virtual texture page.
+    #define ATLAS_MAX_PAGES GFX_MAX_VIRTUAL_TEXTURE_PAGES
+
+    // A virtual texture moved by atlas_compact, rectangles include the padding.
+    typedef struct AtlasMove {
+        uint32_t id;
+        uint16_t src_x, src_y;
+        uint16_t dst_x, dst_y;
+        uint16_t width, height;
+    } AtlasMove;
+
+    extern int atlas_create(Atlas **atlas_dptr, uint16_t dimensions, uint16_t padding, int pages);
     extern void atlas_destroy(Atlas *atlas);
     extern int atlas_gen_texture(Atlas *atlas, uint32_t *id_ptr);
     extern int atlas_destroy_vtex(Atlas *atlas, uint32_t id);
     extern int atlas_allocate_vtex_space(Atlas *atlas, uint32_t id, uint16_t w, uint16_t h);
     extern int atlas_get_vtex_uvst_coords(Atlas *atlas, uint32_t id, int padding, float *uvst);
     extern int atlas_get_vtex_xywh_coords(Atlas *atlas, uint32_t id, int padding, uint16_t *xywh);
+    extern int atlas_get_vtex_page(Atlas *atlas, uint32_t id);
+    extern int atlas_compact(Atlas *atlas, int page, const AtlasMove **moves, int *move_count);
+    extern int atlas_wants_compaction(Atlas *atlas, uint16_t w, uint16_t h, int *page_ptr);
+    extern uint32_t atlas_get_free_area(Atlas *atlas);
+    extern void atlas_set_trace(Atlas *atlas, FILE *trace);
+    extern int atlas_get_page_count(Atlas *atlas);
     extern uint16_t atlas_get_dimensions(Atlas *atlas);
     extern uint16_t atlas_get_padding(Atlas *atlas);
 #ifdef __cplusplus
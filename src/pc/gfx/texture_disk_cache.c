@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "texture_disk_cache.h"
+#include "../fsutils.h"
+
+#define TEXTURE_DISK_CACHE_MAGIC 0x58543634 // "46TX"
+// Bump whenever the output of any import_texture_* decoder changes
+#define TEXTURE_DISK_CACHE_VERSION 2
+#define TEXTURE_DISK_CACHE_MIN_ENTRIES 256
+
+struct TextureDiskCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t entry_count; // power of two
+    uint32_t data_size;
+    uint32_t data_used;
+};
+
+/**
+ * Index slot, open addressing with linear probing.
+ * @property width: Written last, a slot is in use when it's non-zero.
+ * @property offset: Start of the texels relative to the data area.
+ **/
+struct TextureDiskCacheEntry {
+    struct TextureDiskCacheKey key;
+    uint16_t width, height;
+    uint32_t offset;
+};
+
+static struct {
+    struct TextureDiskCacheHeader *header;
+    struct TextureDiskCacheEntry *entries;
+    uint8_t *data;
+    int full_reported;
+} tdc;
+
+#ifndef _WIN32
+static void texture_disk_cache_reset(uint32_t entry_count, uint32_t size) {
+    memset(tdc.entries, 0, entry_count * sizeof(struct TextureDiskCacheEntry));
+    tdc.header->magic = TEXTURE_DISK_CACHE_MAGIC;
+    tdc.header->version = TEXTURE_DISK_CACHE_VERSION;
+    tdc.header->entry_size = sizeof(struct TextureDiskCacheEntry);
+    tdc.header->entry_count = entry_count;
+    tdc.header->data_size = size;
+    tdc.header->data_used = 0;
+}
+
+bool texture_disk_cache_open(const char *filename, uint32_t size) {
+    // Assume textures average 32x32, that's plenty for what sm64 loads
+    uint32_t entry_count = TEXTURE_DISK_CACHE_MIN_ENTRIES;
+    while (entry_count < size / (32 * 32 * 4)) {
+        entry_count <<= 1;
+    }
+    size_t total = sizeof(struct TextureDiskCacheHeader) + entry_count * sizeof(struct TextureDiskCacheEntry) + size;
+
+    FILE *file = fopen_home(filename, "r+b");
+    if (file == NULL) {
+        file = fopen_home(filename, "w+b");
+    }
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open texture cache '%s'\n", filename);
+        return false;
+    }
+
+    int fd = fileno(file);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size != total) {
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, total) != 0) {
+            fprintf(stderr, "Unable to resize texture cache '%s'\n", filename);
+            fclose(file);
+            return false;
+        }
+    }
+
+    void *map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    fclose(file); // the mapping keeps the file alive
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map texture cache '%s'\n", filename);
+        return false;
+    }
+
+    tdc.header = map;
+    tdc.entries = (struct TextureDiskCacheEntry *)(tdc.header + 1);
+    tdc.data = (uint8_t *)(tdc.entries + entry_count);
+
+    if (tdc.header->magic != TEXTURE_DISK_CACHE_MAGIC ||
+        tdc.header->version != TEXTURE_DISK_CACHE_VERSION ||
+        tdc.header->entry_size != sizeof(struct TextureDiskCacheEntry) ||
+        tdc.header->entry_count != entry_count ||
+        tdc.header->data_size != size ||
+        tdc.header->data_used > size) {
+        texture_disk_cache_reset(entry_count, size);
+    }
+
+    return true;
+}
+
+static struct TextureDiskCacheEntry *texture_disk_cache_find(const struct TextureDiskCacheKey *key) {
+    uint32_t mask = tdc.header->entry_count - 1;
+    uint32_t i = (key->hash[0] ^ key->hash[1]) & mask;
+    for (uint32_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+        struct TextureDiskCacheEntry *entry = &tdc.entries[i];
+        if (entry->width == 0 || memcmp(&entry->key, key, sizeof(*key)) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const uint8_t *texture_disk_cache_lookup(const struct TextureDiskCacheKey *key, uint16_t *width, uint16_t *height) {
+    if (tdc.header == NULL) {
+        return NULL;
+    }
+
+    struct TextureDiskCacheEntry *entry = texture_disk_cache_find(key);
+    if (entry == NULL || entry->width == 0) {
+        return NULL;
+    }
+
+    // Guard against an entry left half written by a crash
+    if ((uint64_t)entry->offset + (uint64_t)entry->width * entry->height * 4 > tdc.header->data_used) {
+        return NULL;
+    }
+
+    *width = entry->width;
+    *height = entry->height;
+    return tdc.data + entry->offset;
+}
+
+void texture_disk_cache_store(const struct TextureDiskCacheKey *key, const uint8_t *rgba32_buf, uint16_t width, uint16_t height) {
+    if (tdc.header == NULL || width == 0 || height == 0) {
+        return;
+    }
+
+    struct TextureDiskCacheEntry *entry = texture_disk_cache_find(key);
+    uint32_t bytes = (uint32_t)width * height * 4;
+    if (entry != NULL && entry->width != 0) {
+        return; // already cached
+    }
+    if (entry == NULL || tdc.header->data_size - tdc.header->data_used < bytes) {
+        if (!tdc.full_reported) {
+            fprintf(stderr, "Texture cache is full, new textures won't be cached\n");
+            tdc.full_reported = 1;
+        }
+        return;
+    }
+
+    uint32_t offset = tdc.header->data_used;
+    memcpy(tdc.data + offset, rgba32_buf, bytes);
+    tdc.header->data_used = offset + bytes;
+
+    entry->key = *key;
+    entry->height = height;
+    entry->offset = offset;
+    entry->width = width;
+}
+#else
+bool texture_disk_cache_open(const char *filename, uint32_t size) {
+    (void)filename;
+    (void)size;
+    return false;
+}
+
+const uint8_t *texture_disk_cache_lookup(const struct TextureDiskCacheKey *key, uint16_t *width, uint16_t *height) {
+    (void)key;
+    (void)width;
+    (void)height;
+    return NULL;
+}
+
+void texture_disk_cache_store(const struct TextureDiskCacheKey *key, const uint8_t *rgba32_buf, uint16_t width, uint16_t height) {
+    (void)key;
+    (void)rgba32_buf;
+    (void)width;
+    (void)height;
+}
+#endif
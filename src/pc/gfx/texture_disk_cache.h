@@ -0,0 +1,40 @@
+#ifndef __TEXTURE_DISK_CACHE_H__
+#define __TEXTURE_DISK_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Identifies a decoded texture. Keyed on the texel contents rather than the
+ * source address, since addresses change between builds and runs.
+ * @property check: Second hash of the texels and palette, computed differently
+ * from hash. A collision would show the wrong texture on every later run.
+ **/
+struct TextureDiskCacheKey {
+    uint32_t hash[2];
+    uint32_t size_bytes;
+    uint16_t line_size_bytes;
+    uint8_t fmt, siz;
+    uint32_t check;
+};
+
+/**
+ * Maps the cache file, creating or resetting it when it is missing, was
+ * written by a different version or doesn't match the requested size.
+ * @arg filename: File name relative to the user directory.
+ * @arg size: Bytes available for texel data.
+ * @returns whether the cache is usable.
+ **/
+extern bool texture_disk_cache_open(const char *filename, uint32_t size);
+
+/**
+ * @returns a pointer to the RGBA32 texels inside the mapping, or NULL on a miss.
+ **/
+extern const uint8_t *texture_disk_cache_lookup(const struct TextureDiskCacheKey *key, uint16_t *width, uint16_t *height);
+
+/**
+ * Appends a decoded texture. Silently does nothing once the file is full.
+ **/
+extern void texture_disk_cache_store(const struct TextureDiskCacheKey *key, const uint8_t *rgba32_buf, uint16_t width, uint16_t height);
+
+#endif /* __TEXTURE_DISK_CACHE_H__ */
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 
 #ifdef TARGET_WEB
@@ -8,6 +9,7 @@
 #include "sm64.h"
 
 #include "game/memory.h"
+#include "buffers/buffers.h"
 #include "audio/external.h"
 
 #include "gfx/gfx_pc.h"
@@ -18,6 +20,7 @@
 #include "gfx/gfx_glx.h"
 #include "gfx/gfx_sdl.h"
 #include "gfx/gfx_dummy.h"
+#include "gfx/gfx_soft.h"
 
 #include "audio/audio_api.h"
 #include "audio/audio_wasapi.h"
@@ -52,6 +55,9 @@ extern void gfx_run(Gfx *commands);
 extern void thread5_game_loop(void *arg);
 extern void create_next_audio_buffer(s16 *samples, u32 num_samples);
 void game_loop_one_iteration(void);
+#ifdef USE_RENDER_THREAD
+static void render_thread_queue(int pool, Gfx *commands);
+#endif
 
 void dispatch_audio_sptask(UNUSED struct SPTask *spTask) {
 }
@@ -66,7 +72,11 @@ void send_display_list(struct SPTask *spTask) {
     if (!inited) {
         return;
     }
+#ifdef USE_RENDER_THREAD
+    render_thread_queue(gGfxPool - gGfxPools, (Gfx *)spTask->task.t.data_ptr);
+#else
     gfx_run((Gfx *)spTask->task.t.data_ptr);
+#endif
 }
 
 #ifdef VERSION_EU
@@ -126,6 +136,101 @@ int sdl_snd_dispatch_fn(void *ptr)
     return 0;
 }
 
+#ifdef USE_RENDER_THREAD
+/**
+ * The game logic runs on its own thread and builds frame N+1 while the main
+ * thread, which owns the GL context, interprets and submits frame N.
+ * Each frame's display list, matrices and vertices live in its gGfxPools
+ * entry, so a pool changes hands with the frame and is only rebuilt once the
+ * render thread is done with it.
+ * @property frames: Display lists handed over, oldest first at head.
+ * @property busy: Frames queued or being drawn out of each pool.
+ **/
+static struct {
+    SDL_Thread *thread;
+    SDL_threadID thread_id;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    struct {
+        Gfx *commands;
+        int pool;
+    } frames[GFX_NUM_POOLS];
+    int head, queued, in_flight;
+    int busy[GFX_NUM_POOLS];
+} render_thread;
+
+static void render_thread_queue(int pool, Gfx *commands) {
+    SDL_LockMutex(render_thread.mutex);
+    int slot = (render_thread.head + render_thread.queued) % GFX_NUM_POOLS;
+    render_thread.frames[slot].commands = commands;
+    render_thread.frames[slot].pool = pool;
+    render_thread.queued++;
+    render_thread.in_flight++;
+    render_thread.busy[pool]++;
+    SDL_CondBroadcast(render_thread.cond);
+    SDL_UnlockMutex(render_thread.mutex);
+}
+
+// Called from the game thread before freeing anything a queued frame may still read
+void render_thread_sync(void) {
+    if (render_thread.thread == NULL || SDL_ThreadID() != render_thread.thread_id) {
+        return;
+    }
+
+    SDL_LockMutex(render_thread.mutex);
+    while (render_thread.in_flight > 0) {
+        SDL_CondWait(render_thread.cond, render_thread.mutex);
+    }
+    SDL_UnlockMutex(render_thread.mutex);
+}
+
+static int game_thread_fn(UNUSED void *arg) {
+    render_thread.thread_id = SDL_ThreadID();
+
+    while (true) {
+        // Wait until the pool this frame builds into has been drawn
+        SDL_LockMutex(render_thread.mutex);
+        while (render_thread.in_flight >= GFX_NUM_POOLS || render_thread.busy[gGlobalTimer % GFX_NUM_POOLS] > 0) {
+            SDL_CondWait(render_thread.cond, render_thread.mutex);
+        }
+        SDL_UnlockMutex(render_thread.mutex);
+
+        SDL_LockMutex(snd_mutex);
+            game_loop_one_iteration();
+        SDL_UnlockMutex(snd_mutex);
+        snd_thread_status = 0;
+
+        display_and_vsync();
+    }
+
+    return 0;
+}
+
+void produce_one_frame(void) {
+    SDL_LockMutex(render_thread.mutex);
+    while (render_thread.queued == 0) {
+        SDL_CondWait(render_thread.cond, render_thread.mutex);
+    }
+    Gfx *commands = render_thread.frames[render_thread.head].commands;
+    int pool = render_thread.frames[render_thread.head].pool;
+    render_thread.head = (render_thread.head + 1) % GFX_NUM_POOLS;
+    render_thread.queued--;
+    SDL_UnlockMutex(render_thread.mutex);
+
+    ProfEmitEventStart("frame");
+    gfx_start_frame();
+    gfx_run(commands);
+    gfx_end_frame();
+    ProfEmitEventEnd("frame");
+    ProfSampleFrame();
+
+    SDL_LockMutex(render_thread.mutex);
+    render_thread.busy[pool]--;
+    render_thread.in_flight--;
+    SDL_CondBroadcast(render_thread.cond);
+    SDL_UnlockMutex(render_thread.mutex);
+}
+#else
 void produce_one_frame(void) {
     ProfEmitEventStart("frame");
     gfx_start_frame();
@@ -157,6 +262,7 @@ void produce_one_frame(void) {
     ProfEmitEventEnd("frame");
     ProfSampleFrame();
 }
+#endif
 
 #ifdef TARGET_WEB
 static void em_main_loop(void) {
@@ -202,7 +308,10 @@ static void on_fullscreen_changed(bool is_now_fullscreen) {
 void main_func(void) {
 #ifdef USE_SYSTEM_MALLOC
     main_pool_init();
-    gGfxAllocOnlyPool = alloc_only_pool_init();
+    for (int i = 0; i < GFX_NUM_POOLS; i++) {
+        gGfxAllocOnlyPools[i] = alloc_only_pool_init();
+    }
+    gGfxAllocOnlyPool = gGfxAllocOnlyPools[0];
 #else
     static u64 pool[0x165000/8 / 4 * sizeof(void *)];
     main_pool_init(pool, pool + sizeof(pool) / sizeof(pool[0]));
@@ -230,6 +339,9 @@ void main_func(void) {
     #else
         wm_api = &gfx_sdl;
     #endif
+#elif defined(ENABLE_SOFT)
+    rendering_api = &gfx_soft_api;
+    wm_api = &gfx_dummy_wm_api;
 #elif defined(ENABLE_GFX_DUMMY)
     rendering_api = &gfx_dummy_renderer_api;
     wm_api = &gfx_dummy_wm_api;
@@ -279,6 +391,15 @@ void main_func(void) {
     inited = 1;
 #else
     inited = 1;
+#ifdef USE_RENDER_THREAD
+    render_thread.mutex = SDL_CreateMutex();
+    render_thread.cond = SDL_CreateCond();
+    render_thread.thread = SDL_CreateThread(game_thread_fn, "th_game", NULL);
+    if (render_thread.thread == NULL) {
+        fprintf(stderr, "Unable to start the game thread: %s\n", SDL_GetError());
+        abort();
+    }
+#endif
     while (1) {
         wm_api->main_loop(produce_one_frame);
     }
@@ -0,0 +1,196 @@
+// gfx_replay.c - plays a display list trace back through the renderer as fast as possible
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "../gfx/gfx_pc.h"
+#include "../gfx/gfx_opengl.h"
+#include "../gfx/gfx_direct3d11.h"
+#include "../gfx/gfx_direct3d12.h"
+#include "../gfx/gfx_dxgi.h"
+#include "../gfx/gfx_glx.h"
+#include "../gfx/gfx_sdl.h"
+#include "../gfx/gfx_dummy.h"
+#include "../gfx/gfx_soft.h"
+#include "../gfx/gfx_trace.h"
+
+#include "../configfile.h"
+#include "../cheapProfiler.h"
+
+// Same settings as the game, so the renderer is configured the same way
+#define CONFIG_FILE "sm64config.txt"
+
+// Largest difference in any channel that still counts as the same pixel, so
+// references survive compilers that contract or reorder float math
+#define GOLDEN_TOLERANCE 2
+
+static double get_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+#ifdef ENABLE_SOFT
+// Binary PPMs as gfx_soft_save_frame writes them, returns the RGB24 pixels
+static uint8_t *load_ppm(const char *filename, int *width, int *height) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open '%s'\n", filename);
+        return NULL;
+    }
+    uint8_t *pixels = NULL;
+    int maxval;
+    if (fscanf(file, "P6 %d %d %d", width, height, &maxval) == 3 && fgetc(file) != EOF &&
+        *width > 0 && *height > 0 && maxval == 255) {
+        size_t size = (size_t)*width * *height * 3;
+        pixels = malloc(size);
+        if (pixels != NULL && fread(pixels, 1, size, file) != size) {
+            free(pixels);
+            pixels = NULL;
+        }
+    }
+    if (pixels == NULL) {
+        fprintf(stderr, "'%s' isn't a binary PPM\n", filename);
+    }
+    fclose(file);
+    return pixels;
+}
+
+// Compares the frame the replay left behind against a golden image, returns
+// whether they match within GOLDEN_TOLERANCE
+static bool compare_frame(const char *frame, const char *reference) {
+    int width, height, ref_width, ref_height;
+    uint8_t *pixels = load_ppm(frame, &width, &height);
+    uint8_t *ref_pixels = load_ppm(reference, &ref_width, &ref_height);
+    bool ok = false;
+
+    if (pixels != NULL && ref_pixels != NULL) {
+        if (width != ref_width || height != ref_height) {
+            fprintf(stderr, "'%s' is %dx%d, '%s' is %dx%d\n", frame, width, height, reference, ref_width, ref_height);
+        } else {
+            uint32_t differing = 0;
+            int worst = 0;
+            for (size_t i = 0; i < (size_t)width * height; i++) {
+                int diff = 0;
+                for (int c = 0; c < 3; c++) {
+                    int d = abs(pixels[i * 3 + c] - ref_pixels[i * 3 + c]);
+                    diff = d > diff ? d : diff;
+                }
+                differing += diff > GOLDEN_TOLERANCE;
+                worst = diff > worst ? diff : worst;
+            }
+            printf("%s: %u of %d pixels differ from %s, by up to %d\n", frame, differing, width * height, reference, worst);
+            ok = differing == 0;
+        }
+    }
+    free(pixels);
+    free(ref_pixels);
+    return ok;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+#ifdef ENABLE_SOFT
+        fprintf(stderr, "Usage: %s <trace> [passes] [frame.ppm [reference.ppm]]\n", argv[0]);
+#else
+        fprintf(stderr, "Usage: %s <trace> [passes]\n", argv[0]);
+#endif
+        return 1;
+    }
+    unsigned int passes = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+
+    struct GfxTrace *trace = gfx_trace_load(argv[1]);
+    if (trace == NULL) {
+        return 1;
+    }
+    uint32_t num_frames = gfx_trace_num_frames(trace);
+    if (num_frames == 0) {
+        fprintf(stderr, "'%s' has no frames\n", argv[1]);
+        return 1;
+    }
+
+    configfile_load(CONFIG_FILE);
+    configFrameLimit = false;
+    configTraceFrames = 0;
+
+    struct GfxRenderingAPI *rendering_api;
+    struct GfxWindowManagerAPI *wm_api;
+#if defined(ENABLE_DX12)
+    rendering_api = &gfx_direct3d12_api;
+    wm_api = &gfx_dxgi_api;
+#elif defined(ENABLE_DX11)
+    rendering_api = &gfx_direct3d11_api;
+    wm_api = &gfx_dxgi_api;
+#elif defined(ENABLE_OPENGL)
+    rendering_api = &gfx_opengl_api;
+    #if (defined(__linux__) || defined(__BSD__)) && !defined(TARGET_OD)
+        wm_api = &gfx_glx;
+    #else
+        wm_api = &gfx_sdl;
+    #endif
+#elif defined(ENABLE_SOFT)
+    rendering_api = &gfx_soft_api;
+    wm_api = &gfx_dummy_wm_api;
+#elif defined(ENABLE_GFX_DUMMY)
+    rendering_api = &gfx_dummy_renderer_api;
+    wm_api = &gfx_dummy_wm_api;
+#endif
+
+    gfx_init(wm_api, rendering_api, "Super Mario 64 PC-Port - Trace Replay", false);
+
+    for (unsigned int pass = 0; pass < passes; pass++) {
+        double total = 0.0, best = 1e9, worst = 0.0;
+        uint64_t draw_calls = 0, shader_switches = 0, tris_drawn = 0;
+
+        for (uint32_t i = 0; i < num_frames; i++) {
+            Gfx *commands = gfx_trace_frame(trace, i);
+
+            double t0 = get_time_ms();
+            ProfEmitEventStart("frame");
+            gfx_start_frame();
+            gfx_run(commands);
+            gfx_end_frame();
+            ProfEmitEventEnd("frame");
+            double t1 = get_time_ms();
+            ProfSampleFrame();
+
+            struct GfxStats stats;
+            gfx_get_stats(&stats);
+            draw_calls += stats.draw_calls;
+            shader_switches += stats.shader_switches;
+            tris_drawn += stats.tris_drawn;
+
+            total += t1 - t0;
+            best = t1 - t0 < best ? t1 - t0 : best;
+            worst = t1 - t0 > worst ? t1 - t0 : worst;
+        }
+
+        printf("Pass %u: %u frames in %.1f ms, %.3f ms average, %.3f best, %.3f worst, %.1f fps\n",
+               pass + 1, num_frames, total, total / num_frames, best, worst, num_frames * 1000.0 / total);
+        // Per frame, to compare builds with different batching options on the same trace
+        printf("        %.1f draw calls, %.1f shader switches, %.1f triangles drawn\n",
+               (double)draw_calls / num_frames, (double)shader_switches / num_frames, (double)tris_drawn / num_frames);
+    }
+
+    gfx_trace_free(trace);
+
+#ifdef ENABLE_SOFT
+    // The last frame of the trace, checked against a reference when given one
+    if (argc > 3) {
+        if (!gfx_soft_save_frame(argv[3])) {
+            fprintf(stderr, "Unable to write '%s'\n", argv[3]);
+            return 1;
+        }
+        if (argc > 4 && !compare_frame(argv[3], argv[4])) {
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,410 @@
+// atlas_bench.c - replays texture atlas allocation traces and times the packer
+//
+// Traces come from the game with atlas_trace enabled in sm64config.txt, or are
+// made up on the spot with -g. Allocations that don't fit (on fewer or smaller
+// pages than the trace was recorded with, or always with -g) are handled like
+// the texture cache does: compact once if atlas_wants_compaction says so,
+// otherwise drop the oldest texture and try again.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "texture_atlas.h"
+
+#define NONE -1
+
+enum OpType {
+    OP_ALLOC,
+    OP_FREE,
+    OP_COMPACT
+};
+
+typedef struct Op {
+    int type;
+    int tex; // dense texture index
+    uint16_t w, h; // page to compact for OP_COMPACT
+} Op;
+
+typedef struct Trace {
+    Op *ops;
+    int op_count;
+    int op_reserved;
+    int tex_count;
+    uint16_t dimensions, padding;
+    int pages;
+} Trace;
+
+// Per texture state while replaying
+typedef struct Tex {
+    uint32_t id;
+    int live;
+    int lru_prev, lru_next;
+} Tex;
+
+typedef struct Stats {
+    long allocs, failed, frees, evictions, compactions, moves;
+    uint64_t moved_texels;
+    uint32_t peak_used;
+    double seconds;
+} Stats;
+
+static Tex *texes;
+static int lru_head = NONE, lru_tail = NONE;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-d dimensions] [-p pages] [-n passes] [-g count [-s seed]] [trace]\n"
+            "  -d  page width and height, defaults to the trace's\n"
+            "  -p  number of pages, defaults to the trace's\n"
+            "  -n  times the whole trace is replayed\n"
+            "  -g  replay count made up allocations and frees instead of a trace\n"
+            "  -s  seed for -g\n",
+            name);
+}
+
+static void trace_push(Trace *trace, int type, int tex, int w, int h)
+{
+    if (trace->op_count == trace->op_reserved) {
+        trace->op_reserved = trace->op_reserved ? trace->op_reserved * 2 : 1024;
+        trace->ops = realloc(trace->ops, sizeof(trace->ops[0]) * trace->op_reserved);
+        if (!trace->ops) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    Op *op = &trace->ops[trace->op_count++];
+    op->type = type;
+    op->tex = tex;
+    op->w = w;
+    op->h = h;
+}
+
+// Maps the ids in a trace to dense indices, ids are never reused while live
+typedef struct IdMap {
+    uint32_t *keys;
+    int *values;
+    uint32_t mask;
+    int count;
+} IdMap;
+
+static int *idmap_slot(IdMap *map, uint32_t key)
+{
+    uint32_t i = (key * 2654435761u) & map->mask;
+    while (map->values[i] != NONE && map->keys[i] != key)
+        i = (i + 1) & map->mask;
+    map->keys[i] = key;
+    return &map->values[i];
+}
+
+static void idmap_grow(IdMap *map)
+{
+    IdMap grown;
+    grown.mask = map->mask ? map->mask * 2 + 1 : 1023;
+    grown.count = map->count;
+    grown.keys = malloc(sizeof(grown.keys[0]) * (grown.mask + 1));
+    grown.values = malloc(sizeof(grown.values[0]) * (grown.mask + 1));
+    if (!grown.keys || !grown.values) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i <= grown.mask; i++)
+        grown.values[i] = NONE;
+    for (uint32_t i = 0; map->mask && i <= map->mask; i++) {
+        if (map->values[i] != NONE)
+            *idmap_slot(&grown, map->keys[i]) = map->values[i];
+    }
+    free(map->keys);
+    free(map->values);
+    *map = grown;
+}
+
+static int trace_load(Trace *trace, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open '%s'\n", filename);
+        return 0;
+    }
+
+    IdMap map = { NULL, NULL, 0, 0 };
+    idmap_grow(&map);
+
+    char line[128];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        unsigned int id, w, h, dimensions, padding, page;
+        int pages = 1;
+        line_no++;
+
+        if (sscanf(line, "atlas %u %u %d", &dimensions, &padding, &pages) >= 2) {
+            // Only the first atlas counts, later ones come from restarts
+            if (!trace->dimensions) {
+                trace->dimensions = dimensions;
+                trace->padding = padding;
+                trace->pages = pages;
+            }
+        } else if (sscanf(line, "alloc %u %u %u", &id, &w, &h) == 3) {
+            if ((uint32_t)map.count * 2 > map.mask)
+                idmap_grow(&map);
+            int *tex = idmap_slot(&map, id);
+            if (*tex == NONE) {
+                *tex = trace->tex_count++;
+                map.count++;
+            }
+            trace_push(trace, OP_ALLOC, *tex, w, h);
+        } else if (sscanf(line, "free %u", &id) == 1) {
+            int *tex = idmap_slot(&map, id);
+            if (*tex != NONE)
+                trace_push(trace, OP_FREE, *tex, 0, 0);
+        } else if (strncmp(line, "compact", 7) == 0) {
+            // Traces from single page atlases don't name the page
+            if (sscanf(line, "compact %u", &page) != 1)
+                page = 0;
+            trace_push(trace, OP_COMPACT, NONE, page, 0);
+        } else {
+            fprintf(stderr, "%s:%d: unknown operation\n", filename, line_no);
+        }
+    }
+
+    free(map.keys);
+    free(map.values);
+    fclose(file);
+    return 1;
+}
+
+// Made up trace with texture sizes and churn like the game's: mostly small
+// power of two textures, some of them doubled for mirroring, and enough of
+// them to overflow the page now and then.
+static void trace_generate(Trace *trace, int count, unsigned int seed)
+{
+    static const uint16_t sizes[] = { 8, 16, 16, 32, 32, 32, 32, 64, 64 };
+    int *live = malloc(sizeof(live[0]) * count);
+    int live_count = 0;
+    uint32_t state = seed * 2654435761u + 1;
+
+    if (!live) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        state = state * 1664525u + 1013904223u;
+        uint32_t r = state >> 8;
+
+        if (live_count == 0 || r % 100 < 70) {
+            int w = sizes[(r >> 8) % (sizeof(sizes) / sizeof(sizes[0]))];
+            int h = sizes[(r >> 12) % (sizeof(sizes) / sizeof(sizes[0]))];
+            w *= ((r >> 16) & 7) == 0 ? 2 : 1;
+            h *= ((r >> 19) & 7) == 0 ? 2 : 1;
+            live[live_count++] = trace->tex_count;
+            trace_push(trace, OP_ALLOC, trace->tex_count++, w, h);
+        } else {
+            int victim = (r >> 8) % live_count;
+            trace_push(trace, OP_FREE, live[victim], 0, 0);
+            live[victim] = live[--live_count];
+        }
+    }
+
+    free(live);
+}
+
+static void lru_unlink(int tex)
+{
+    if (texes[tex].lru_prev != NONE)
+        texes[texes[tex].lru_prev].lru_next = texes[tex].lru_next;
+    else
+        lru_head = texes[tex].lru_next;
+    if (texes[tex].lru_next != NONE)
+        texes[texes[tex].lru_next].lru_prev = texes[tex].lru_prev;
+    else
+        lru_tail = texes[tex].lru_prev;
+}
+
+static void lru_push(int tex)
+{
+    texes[tex].lru_prev = NONE;
+    texes[tex].lru_next = lru_head;
+    if (lru_head != NONE)
+        texes[lru_head].lru_prev = tex;
+    else
+        lru_tail = tex;
+    lru_head = tex;
+}
+
+static void release(Atlas *atlas, int tex)
+{
+    atlas_destroy_vtex(atlas, texes[tex].id);
+    texes[tex].live = 0;
+    lru_unlink(tex);
+}
+
+static void compact(Atlas *atlas, int page, Stats *stats)
+{
+    const AtlasMove *moves;
+    int move_count;
+    if (!atlas_compact(atlas, page, &moves, &move_count))
+        return;
+
+    stats->compactions++;
+    stats->moves += move_count;
+    for (int i = 0; i < move_count; i++)
+        stats->moved_texels += moves[i].width * moves[i].height;
+}
+
+static void replay(const Trace *trace, uint16_t dimensions, int pages, Stats *stats)
+{
+    Atlas *atlas;
+    if (!atlas_create(&atlas, dimensions, trace->padding, pages)) {
+        fprintf(stderr, "Can't create %d %u pixel pages\n", pages, dimensions);
+        exit(1);
+    }
+    uint32_t atlas_area = (uint32_t)dimensions * dimensions * pages;
+
+    for (int i = 0; i < trace->tex_count; i++)
+        texes[i].live = 0;
+    lru_head = lru_tail = NONE;
+
+    clock_t start = clock();
+    for (int i = 0; i < trace->op_count; i++) {
+        const Op *op = &trace->ops[i];
+        Tex *tex = op->tex != NONE ? &texes[op->tex] : NULL;
+
+        switch (op->type) {
+            case OP_ALLOC: {
+                if (!tex->live) {
+                    if (!atlas_gen_texture(atlas, &tex->id)) {
+                        fprintf(stderr, "Out of virtual texture slots\n");
+                        exit(1);
+                    }
+                    tex->live = 1;
+                } else {
+                    lru_unlink(op->tex);
+                }
+                lru_push(op->tex);
+                stats->allocs++;
+
+                int compacted = 0, page;
+                while (!atlas_allocate_vtex_space(atlas, tex->id, op->w, op->h)) {
+                    if (!compacted && atlas_wants_compaction(atlas, op->w, op->h, &page)) {
+                        compacted = 1;
+                        compact(atlas, page, stats);
+                        continue;
+                    }
+                    // Never evict the texture being allocated
+                    if (lru_tail == NONE || lru_tail == op->tex) {
+                        stats->failed++;
+                        release(atlas, op->tex);
+                        break;
+                    }
+                    release(atlas, lru_tail);
+                    stats->evictions++;
+                }
+
+                uint32_t used = atlas_area - atlas_get_free_area(atlas);
+                if (used > stats->peak_used)
+                    stats->peak_used = used;
+                break;
+            }
+            case OP_FREE:
+                if (tex->live) {
+                    release(atlas, op->tex);
+                    stats->frees++;
+                }
+                break;
+            case OP_COMPACT:
+                // Pages beyond the ones replayed have nothing to compact
+                if (op->w < pages)
+                    compact(atlas, op->w, stats);
+                break;
+        }
+    }
+    stats->seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    atlas_destroy(atlas);
+}
+
+int main(int argc, char *argv[])
+{
+    Trace trace;
+    memset(&trace, 0, sizeof(trace));
+    const char *filename = NULL;
+    unsigned int dimensions = 0, pages = 0, passes = 1, generate = 0, seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0' && i + 1 < argc) {
+            unsigned int value = strtoul(argv[++i], NULL, 0);
+            switch (argv[i - 1][1]) {
+                case 'd': dimensions = value; break;
+                case 'p': pages = value; break;
+                case 'n': passes = value; break;
+                case 'g': generate = value; break;
+                case 's': seed = value; break;
+                default: usage(argv[0]); return 1;
+            }
+        } else if (!filename && argv[i][0] != '-') {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (generate) {
+        trace.dimensions = 1024;
+        trace.padding = 1;
+        trace.pages = 1;
+        trace_generate(&trace, generate, seed);
+    } else if (filename) {
+        if (!trace_load(&trace, filename))
+            return 1;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!dimensions)
+        dimensions = trace.dimensions ? trace.dimensions : 2048;
+    if (dimensions > 32768) {
+        fprintf(stderr, "Pages are at most 32768 pixels wide\n");
+        return 1;
+    }
+    if (!pages)
+        pages = trace.pages ? trace.pages : 1;
+    if (pages > ATLAS_MAX_PAGES) {
+        fprintf(stderr, "Atlases have at most %d pages\n", ATLAS_MAX_PAGES);
+        return 1;
+    }
+
+    texes = calloc(trace.tex_count + 1, sizeof(texes[0]));
+    if (!texes) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%d operations on %d textures, %u %ux%u page(s), padding %u\n",
+           trace.op_count, trace.tex_count, pages, dimensions, dimensions, trace.padding);
+
+    for (unsigned int pass = 0; pass < passes; pass++) {
+        Stats stats;
+        memset(&stats, 0, sizeof(stats));
+        replay(&trace, dimensions, pages, &stats);
+
+        printf("Pass %u: %.2f ms, %.1f ns per operation\n", pass + 1, stats.seconds * 1000.0,
+               trace.op_count ? stats.seconds * 1e9 / trace.op_count : 0.0);
+        if (pass == 0) {
+            printf("  %ld allocations, %ld frees, %ld evictions, %ld failed\n",
+                   stats.allocs, stats.frees, stats.evictions, stats.failed);
+            printf("  %ld compactions moving %ld textures, %llu texels\n",
+                   stats.compactions, stats.moves, (unsigned long long)stats.moved_texels);
+            printf("  peak use %.1f%% of the atlas\n",
+                   stats.peak_used * 100.0 / ((double)dimensions * dimensions * pages));
+        }
+    }
+
+    free(texes);
+    free(trace.ops);
+    return 0;
+}